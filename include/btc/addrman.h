@@ -0,0 +1,95 @@
+/*
+
+ The MIT License (MIT)
+
+ Copyright (c) 2016 libbtc developers
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES
+ OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+
+#ifndef __LIBBTC_ADDRMAN_H__
+#define __LIBBTC_ADDRMAN_H__
+
+#include "btc.h"
+#include "buffer.h"
+#include "cstr.h"
+#include "protocol.h"
+#include "vector.h"
+
+LIBBTC_BEGIN_DECL
+
+/* max amount of known addresses, the least useful ones are evicted */
+static const size_t BTC_ADDRMAN_MAX_ENTRIES = 2500;
+
+/* don't retry an address within this time (seconds) */
+static const uint64_t BTC_ADDRMAN_RETRY_DELAY = 60;
+
+/* addresses not seen for this long (seconds) without a successful connection are dropped */
+static const uint64_t BTC_ADDRMAN_HORIZON = 30 * 24 * 60 * 60;
+
+/* a known peer (peers.dat-style record) */
+typedef struct btc_addrman_entry_ {
+    btc_p2p_address addr; /* addr.time is the last time the address has been seen (relayed or connected) */
+    uint64_t last_try; /* last connection attempt */
+    uint64_t last_success; /* last completed version handshake, 0 if never connected */
+    uint32_t attempts; /* failed attempts since the last success */
+    uint32_t successes;
+    uint64_t score; /* sync score (btc_node_sync_score) of the last session, 0 if unknown */
+} btc_addrman_entry;
+
+typedef struct btc_addrman_ {
+    vector* entries; /* btc_addrman_entry */
+    void* tree_root; /* entries by ip and port */
+    size_t max_entries;
+    btc_bool dirty; /* changed since loaded or saved */
+} btc_addrman;
+
+LIBBTC_API btc_addrman* btc_addrman_new(void);
+LIBBTC_API void btc_addrman_free(btc_addrman* addrman);
+
+LIBBTC_API btc_addrman_entry* btc_addrman_find(btc_addrman* addrman, const btc_p2p_address* addr);
+
+/* add a relayed (or seeded) address or refresh the last seen time of a known one
+   returns true if the address was new */
+LIBBTC_API btc_bool btc_addrman_add(btc_addrman* addrman, const btc_p2p_address* addr, uint64_t now);
+
+/* record the outcome of a connection attempt (the address is added if unknown) */
+LIBBTC_API void btc_addrman_attempt(btc_addrman* addrman, const btc_p2p_address* addr, uint64_t now);
+LIBBTC_API void btc_addrman_good(btc_addrman* addrman, const btc_p2p_address* addr, uint64_t now);
+LIBBTC_API void btc_addrman_failed(btc_addrman* addrman, const btc_p2p_address* addr);
+
+/* remember the sync score of a finished session */
+LIBBTC_API void btc_addrman_set_score(btc_addrman* addrman, const btc_p2p_address* addr, uint64_t score);
+
+/* select up to count addresses to connect to (references into the addrman, added to addrs_out)
+   previously fast and reliable peers come first, a quarter of the slots is kept for untried addresses */
+LIBBTC_API size_t btc_addrman_select(btc_addrman* addrman, size_t count, uint64_t now, vector* addrs_out);
+
+/* (de)serialize all entries, the records are bound to the network (netmagic) */
+LIBBTC_API void btc_addrman_serialize(const btc_addrman* addrman, const unsigned char netmagic[4], cstring* str_out);
+LIBBTC_API btc_bool btc_addrman_deserialize(btc_addrman* addrman, const unsigned char netmagic[4], struct const_buffer* buf, uint64_t now);
+
+/* load the entries from a file (a missing file is not an error), save replaces the file atomically */
+LIBBTC_API btc_bool btc_addrman_load(btc_addrman* addrman, const unsigned char netmagic[4], const char* filename, uint64_t now);
+LIBBTC_API btc_bool btc_addrman_save(btc_addrman* addrman, const unsigned char netmagic[4], const char* filename);
+
+LIBBTC_END_DECL
+
+#endif // __LIBBTC_ADDRMAN_H__
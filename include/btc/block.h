@@ -35,6 +35,9 @@
 
 LIBBTC_BEGIN_DECL
 
+/* the largest amount of transactions a block can have (4M weight units / 240 for the smallest tx) */
+#define BTC_MAX_BLOCK_TRANSACTIONS 16666
+
 typedef struct btc_block_header_ {
     int32_t version;
     btc_uint256 prev_block;
@@ -51,6 +54,9 @@ LIBBTC_API void btc_block_header_serialize(cstring* s, const btc_block_header* h
 LIBBTC_API void btc_block_header_copy(btc_block_header* dest, const btc_block_header* src);
 LIBBTC_API btc_bool btc_block_header_hash(btc_block_header* header, btc_uint256 hash);
 
+/* merkle root of the txids, computed level by level */
+LIBBTC_API void btc_block_merkle_root(const uint8_t* txids, size_t count, btc_uint256 root_out);
+
 LIBBTC_END_DECL
 
 #endif // __LIBBTC_BLOCK_H__
@@ -37,8 +37,18 @@ typedef struct btc_blockindex {
     btc_uint256 hash;
     btc_block_header header;
     struct btc_blockindex* prev;
+    struct btc_blockindex* skip; /* pointer to an ancestor further back, used for fast ancestor lookups */
 } btc_blockindex;
 
+/* set the skip pointer of a blockindex (requires prev and height to be set)
+   lowest_height is the lowest height still kept in memory (0 for a full chain) */
+LIBBTC_API void btc_blockindex_build_skip(btc_blockindex* pindex, uint32_t lowest_height);
+
+/* get the ancestor at the given height in O(log n) by using the skip pointers,
+   returns NULL if the height is out of range or not reachable (pruned chain)
+   the caller needs to make sure all headers between height and pindex are still in memory */
+LIBBTC_API btc_blockindex* btc_blockindex_get_ancestor(btc_blockindex* pindex, uint32_t height);
+
 LIBBTC_END_DECL
 
 #endif // __LIBBTC_BLOCKCHAIN_H__
@@ -0,0 +1,63 @@
+/*
+
+ The MIT License (MIT)
+
+ Copyright (c) 2016 libbtc developers
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES
+ OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+
+#ifndef __LIBBTC_BLOCKFILTER_H__
+#define __LIBBTC_BLOCKFILTER_H__
+
+#include "btc.h"
+#include "cstr.h"
+#include "vector.h"
+
+LIBBTC_BEGIN_DECL
+
+/* BIP158 basic filter: Golomb-Rice coded set with P=19, M=784931 */
+#define BTC_BLOCKFILTER_TYPE_BASIC 0
+#define BTC_BLOCKFILTER_P 19
+#define BTC_BLOCKFILTER_M 784931
+
+/* SipHash-2-4 with the 128 bit key (k0, k1) */
+LIBBTC_API uint64_t btc_siphash(uint64_t k0, uint64_t k1, const uint8_t* data, size_t len);
+
+/* build a serialized filter (N followed by the coded set) of the elements (vector of cstring*)
+   keyed by the block hash, elements hashing to the same value are stored once */
+LIBBTC_API void btc_blockfilter_build(const btc_uint256 block_hash, const vector* elements, cstring* filter_out);
+
+/* check if a single element is in the filter */
+LIBBTC_API btc_bool btc_blockfilter_match(const btc_uint256 block_hash, const uint8_t* filter, size_t filter_len, const uint8_t* element, size_t element_len);
+
+/* check if any of the elements (vector of cstring*) is in the filter,
+   the elements are hashed and sorted once and the coded set is decoded in a single pass */
+LIBBTC_API btc_bool btc_blockfilter_match_any(const btc_uint256 block_hash, const uint8_t* filter, size_t filter_len, const vector* elements);
+
+/* the filter hash (double sha256 of the serialized filter) */
+LIBBTC_API void btc_blockfilter_hash(const uint8_t* filter, size_t filter_len, btc_uint256 hash_out);
+
+/* the filter header, double sha256 of the filter hash and the previous filter header */
+LIBBTC_API void btc_blockfilter_header(const btc_uint256 filter_hash, const btc_uint256 prev_header, btc_uint256 header_out);
+
+LIBBTC_END_DECL
+
+#endif // __LIBBTC_BLOCKFILTER_H__
@@ -0,0 +1,105 @@
+/*
+
+ The MIT License (MIT)
+
+ Copyright (c) 2016 libbtc developers
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES
+ OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+
+#ifndef __LIBBTC_BLOCKSTORE_H__
+#define __LIBBTC_BLOCKSTORE_H__
+
+#include <stdio.h>
+
+#include "btc.h"
+#include "chainparams.h"
+#include "cstr.h"
+#include "vector.h"
+
+LIBBTC_BEGIN_DECL
+
+/* a new block file is started once the current one reaches this size */
+static const uint64_t BTC_BLOCKSTORE_DEFAULT_FILE_SIZE = 16 * 1024 * 1024;
+
+/* record in a block file: netmagic, height, length of the block, block hash, raw block */
+#define BTC_BLOCKSTORE_RECORD_HDR_SIZE (4 + 4 + 4 + 32)
+
+typedef struct btc_blockstore_entry_
+{
+    btc_uint256 hash;
+    uint32_t height;
+    uint32_t file;
+    uint64_t offset; /* of the raw block */
+    uint32_t len;
+} btc_blockstore_entry;
+
+/* raw blocks in append-only flat files (blk00000.dat, ...)
+   the hash/height index is kept in memory and rebuilt from the record headers when opening the store */
+typedef struct btc_blockstore_
+{
+    const btc_chainparams *chain;
+    cstring *dir;
+    vector *entries; /* btc_blockstore_entry in file order */
+    void *hash_tree; /* binary tree (tsearch) of the entries by hash */
+    void *height_tree; /* binary tree (tsearch) of the entries by height (forks can have several per height) */
+    uint32_t first_file;
+    uint32_t current_file;
+    FILE *current;
+    uint64_t current_size;
+    uint64_t total_bytes; /* size of all block files */
+    uint64_t max_file_size;
+
+    /* retention (0 = keep everything), only whole files are deleted, never the one being written */
+    uint32_t keep_from_height; /* delete files with only blocks below this height */
+    uint64_t max_bytes; /* delete the oldest files while the store is larger */
+
+    /* block file mapped for reading */
+    uint8_t *map;
+    size_t map_len;
+    uint32_t map_file;
+} btc_blockstore;
+
+LIBBTC_API btc_blockstore* btc_blockstore_new(const btc_chainparams *chain);
+LIBBTC_API void btc_blockstore_free(btc_blockstore *store);
+
+/* open the store in the directory (created if missing), a partially written last record is discarded
+   returns false if the directory can not be used or has blocks of a different network */
+LIBBTC_API btc_bool btc_blockstore_open(btc_blockstore *store, const char *dir);
+
+/* append a raw block, returns false if it could not be written or is already stored */
+LIBBTC_API btc_bool btc_blockstore_put(btc_blockstore *store, const btc_uint256 hash, uint32_t height, const uint8_t *block, size_t len);
+
+LIBBTC_API const btc_blockstore_entry* btc_blockstore_find(btc_blockstore *store, const btc_uint256 hash);
+
+/* add the entries of the blocks stored at the height to entries_out (the most recently stored last),
+   returns the amount of entries added, they stay valid until the next put or prune */
+LIBBTC_API size_t btc_blockstore_find_height(btc_blockstore *store, uint32_t height, vector *entries_out);
+
+/* get a raw block (memory mapped), the data stays valid until the next get, put or prune */
+LIBBTC_API btc_bool btc_blockstore_get(btc_blockstore *store, const btc_uint256 hash, const uint8_t **block_out, size_t *len_out);
+
+/* set the retention (0 = unlimited) and delete the block files outside of it */
+LIBBTC_API void btc_blockstore_set_retention(btc_blockstore *store, uint32_t keep_from_height, uint64_t max_bytes);
+LIBBTC_API void btc_blockstore_prune(btc_blockstore *store);
+
+LIBBTC_END_DECL
+
+#endif // __LIBBTC_BLOCKSTORE_H__
@@ -0,0 +1,83 @@
+/*
+
+ The MIT License (MIT)
+
+ Copyright (c) 2016 libbtc developers
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES
+ OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+
+#ifndef __LIBBTC_BLOOM_H__
+#define __LIBBTC_BLOOM_H__
+
+#include "btc.h"
+#include "block.h"
+#include "buffer.h"
+#include "cstr.h"
+
+LIBBTC_BEGIN_DECL
+
+/* BIP37 limits */
+#define BTC_BLOOM_MAX_FILTER_SIZE 36000 /* bytes */
+#define BTC_BLOOM_MAX_HASH_FUNCS 50
+
+/* how the peer updates the filter when an output matches */
+enum btc_bloom_flags {
+    BTC_BLOOM_UPDATE_NONE = 0,
+    BTC_BLOOM_UPDATE_ALL = 1,
+    BTC_BLOOM_UPDATE_P2PUBKEY_ONLY = 2,
+};
+
+typedef struct btc_bloom_filter_ {
+    uint8_t* data;
+    uint32_t size; /* in bytes */
+    uint32_t n_hash_funcs;
+    uint32_t tweak;
+    uint8_t flags;
+} btc_bloom_filter;
+
+/* MurmurHash3 (x86, 32 bit) */
+LIBBTC_API uint32_t btc_murmur3(uint32_t seed, const uint8_t* data, size_t len);
+
+/* create a filter for the expected amount of elements with the given false positive rate (0 < fp_rate < 1) */
+LIBBTC_API btc_bloom_filter* btc_bloom_filter_new(unsigned int n_elements, double fp_rate, uint32_t tweak, uint8_t flags);
+LIBBTC_API void btc_bloom_filter_free(btc_bloom_filter* filter);
+
+LIBBTC_API void btc_bloom_filter_insert(btc_bloom_filter* filter, const uint8_t* data, size_t len);
+LIBBTC_API btc_bool btc_bloom_filter_contains(const btc_bloom_filter* filter, const uint8_t* data, size_t len);
+
+/* serialize the filter as filterload payload */
+LIBBTC_API void btc_bloom_filter_serialize(const btc_bloom_filter* filter, cstring* str_out);
+
+/* build the partial merkle tree (total_tx, hashes and flags as in a merkleblock message)
+   of the txids where matches[i] is set */
+LIBBTC_API void btc_partial_merkle_tree_build(btc_uint256* txids, const btc_bool* matches, uint32_t total_tx, cstring* str_out);
+
+/* verify a partial merkle tree and extract the matched txids (allocated, to be freed with btc_free)
+   the computed merkle root is returned, it still needs to be compared against the block header */
+LIBBTC_API btc_bool btc_partial_merkle_tree_extract(struct const_buffer* buf, btc_uint256 merkle_root_out, btc_uint256** matches_out, size_t* match_count_out);
+
+/* deserialize a merkleblock message, verify its partial merkle tree against the merkle root of the header
+   and extract the matched txids (allocated, to be freed with btc_free) */
+LIBBTC_API btc_bool btc_merkleblock_deser(btc_block_header* header, btc_uint256** matches_out, size_t* match_count_out, struct const_buffer* buf);
+
+LIBBTC_END_DECL
+
+#endif // __LIBBTC_BLOOM_H__
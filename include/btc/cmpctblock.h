@@ -0,0 +1,100 @@
+/*
+
+ The MIT License (MIT)
+
+ Copyright (c) 2016 libbtc developers
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES
+ OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+
+#ifndef __LIBBTC_CMPCTBLOCK_H__
+#define __LIBBTC_CMPCTBLOCK_H__
+
+#include "btc.h"
+#include "block.h"
+#include "buffer.h"
+#include "cstr.h"
+
+LIBBTC_BEGIN_DECL
+
+/* BIP152 compact blocks, version 2 (short ids of the wtxids) */
+#define BTC_CMPCTBLOCK_VERSION 2
+#define BTC_CMPCTBLOCK_SHORTID_LEN 6
+
+/* pool of recently relayed transactions, the oldest ones are replaced once it is full */
+typedef struct btc_cmpct_txpool_entry_ {
+    btc_uint256 txid;
+    btc_uint256 wtxid;
+    cstring* tx; /* serialized (with witness) */
+} btc_cmpct_txpool_entry;
+
+typedef struct btc_cmpct_txpool_ {
+    btc_cmpct_txpool_entry* entries;
+    size_t size;
+    size_t max_size;
+    size_t next; /* slot replaced by the next tx once the pool is full */
+} btc_cmpct_txpool;
+
+LIBBTC_API btc_cmpct_txpool* btc_cmpct_txpool_new(size_t max_size);
+LIBBTC_API void btc_cmpct_txpool_free(btc_cmpct_txpool* pool);
+
+/* add a serialized tx, returns false if it could not be deserialized or is already in the pool */
+LIBBTC_API btc_bool btc_cmpct_txpool_add(btc_cmpct_txpool* pool, const uint8_t* tx, size_t len);
+
+/* check if the pool has the tx with the txid */
+LIBBTC_API btc_bool btc_cmpct_txpool_contains(const btc_cmpct_txpool* pool, const btc_uint256 txid);
+
+/* a compact block being reconstructed */
+typedef struct btc_cmpctblock_ {
+    btc_block_header header;
+    btc_uint256 hash;
+    uint32_t tx_count;
+    cstring** txs; /* in block order, NULL while missing */
+    uint32_t missing_count;
+} btc_cmpctblock;
+
+/* short id of a wtxid with the siphash keys of the block */
+LIBBTC_API uint64_t btc_cmpctblock_shortid(uint64_t k0, uint64_t k1, const btc_uint256 wtxid);
+
+/* siphash keys of the block (sha256 of the header and the nonce) */
+LIBBTC_API void btc_cmpctblock_shortid_keys(const btc_block_header* header, uint64_t nonce, uint64_t* k0, uint64_t* k1);
+
+LIBBTC_API btc_cmpctblock* btc_cmpctblock_new();
+LIBBTC_API void btc_cmpctblock_free(btc_cmpctblock* cb);
+
+/* deserialize a cmpctblock message and fill in the prefilled txs and the txs found in the pool,
+   returns false if the block can not be reconstructed (invalid message or colliding short ids), it then has to be requested in full */
+LIBBTC_API btc_bool btc_cmpctblock_deser(btc_cmpctblock* cb, struct const_buffer* buf, const btc_cmpct_txpool* pool);
+
+/* serialize the getblocktxn request of the missing txs */
+LIBBTC_API void btc_cmpctblock_getblocktxn(const btc_cmpctblock* cb, cstring* str_out);
+
+/* fill in the missing txs from a blocktxn message */
+LIBBTC_API btc_bool btc_cmpctblock_fill(btc_cmpctblock* cb, struct const_buffer* buf);
+
+/* serialize the reconstructed block, returns false if txs are missing or the merkle root does not match */
+LIBBTC_API btc_bool btc_cmpctblock_to_block(const btc_cmpctblock* cb, cstring* block_out);
+
+/* build a cmpctblock message of a serialized block with the coinbase prefilled */
+LIBBTC_API btc_bool btc_cmpctblock_build(const uint8_t* block, size_t len, uint64_t nonce, cstring* str_out);
+
+LIBBTC_END_DECL
+
+#endif // __LIBBTC_CMPCTBLOCK_H__
@@ -39,6 +39,9 @@ LIBBTC_BEGIN_DECL
 
 /* headers database interface, flexible function pointers in
    order to support multiple backends
+   returned blockindex objects are owned by the backend and may be temporary views
+   (the compact backend has no prev/skip pointers and reuses its views after
+   BTC_HEADERS_DB_COMPACT_VIEWS calls), copy what needs to be kept
 */
 typedef struct btc_headers_db_interface_
 {
@@ -51,8 +54,8 @@ typedef struct btc_headers_db_interface_
     /* loads database from filename */
     btc_bool (*load)(void *db, const char *filename);
 
-    /* fill in blocklocator up to the tip */
-    void (*fill_blocklocator_tip)(void* db, vector *blocklocators);
+    /* fill in blocklocator (flat hash array) from the tip, returns the amount of hashes written */
+    size_t (*fill_blocklocator_tip)(void* db, btc_uint256 *locators, size_t max_locators);
 
     /* connect (append) a header */
     btc_blockindex *(*connect_hdr)(void* db, struct const_buffer *buf, btc_bool load_process, btc_bool *connected);
@@ -68,8 +71,22 @@ typedef struct btc_headers_db_interface_
 
     /* set that we are using a checkpoint as basepoint at given height with given hash */
     void (*set_checkpoint_start)(void *db, btc_uint256 hash, uint32_t height);
+
+    /* get the main chain header at the given height, NULL if it is not (or no longer) in memory */
+    btc_blockindex* (*get_by_height)(void *db, uint32_t height);
+
+    /* height of the lowest main chain header in memory (chain bottom) */
+    uint32_t (*lowest_height)(void *db);
+
+    /* connect a header snapshot verified against pinned_hash (or a compiled-in checkpoint if NULL) */
+    btc_bool (*import_snapshot)(void *db, const btc_chainparams* chainparams, const char *filename, const uint8_t *pinned_hash);
 } btc_headers_db_interface;
 
+/* reads a header snapshot and verifies its header sequence from the snapshot base to pinned_hash
+   (or a compiled-in checkpoint if NULL), returns the serialized headers (count * 80 bytes, free with btc_free)
+   or NULL if the snapshot is invalid */
+uint8_t * btc_headers_snapshot_read(const btc_chainparams* chainparams, const char *filename, const uint8_t *pinned_hash, uint32_t *base_height, btc_uint256 base_hash, uint32_t *count);
+
 LIBBTC_END_DECL
 
 #endif // __LIBBTC_HEADERSDB_H__
@@ -0,0 +1,143 @@
+/*
+
+ The MIT License (MIT)
+
+ Copyright (c) 2015 Jonas Schnelli
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES
+ OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+
+#ifndef __LIBBTC_HEADERSDB_COMPACT_H__
+#define __LIBBTC_HEADERSDB_COMPACT_H__
+
+#include "btc.h"
+#include "blockchain.h"
+#include "buffer.h"
+#include "chainparams.h"
+#include "headersdb.h"
+#include "vector.h"
+
+LIBBTC_BEGIN_DECL
+
+/* amount of blockindex views returned before the first one gets overwritten */
+#define BTC_HEADERS_DB_COMPACT_VIEWS 16
+
+/* maximal amount of headers kept on forks (not in the main chain) */
+static const unsigned int BTC_HEADERS_DB_COMPACT_MAX_FORK_HEADERS = 2016;
+
+/* maximal amount of headers that don't connect (yet), the oldest get evicted first */
+static const unsigned int BTC_HEADERS_DB_COMPACT_MAX_ORPHANS = 1000;
+
+/* orphans older than this (in seconds) will be evicted */
+static const int64_t BTC_HEADERS_DB_COMPACT_ORPHAN_EXPIRE = 20 * 60;
+
+/* compact in-memory headers database
+   the main chain is stored as a contiguous array of headers by height plus an
+   open addressing hash index, btc_blockindex objects are views materialized on
+   demand (no prev/skip pointers, valid for the next BTC_HEADERS_DB_COMPACT_VIEWS calls)
+*/
+typedef struct btc_headers_db_compact_
+{
+    btc_block_header *headers; /* headers[i] is at height base_height+1+i */
+    size_t headers_count;
+    size_t headers_alloc;
+
+    uint32_t base_height; /* height of the chain bottom (genesis or checkpoint) */
+    btc_uint256 base_hash;
+    btc_uint256 tip_hash; /* other hashes are the prev_block of the successor */
+
+    uint32_t *hash_index; /* chain position+1 (0 = empty slot), position 0 is the base */
+    size_t hash_index_size;
+    size_t hash_index_used;
+
+    vector *forks; /* headers not (or no longer) in the main chain */
+    vector *orphans; /* headers with an unknown parent, oldest first */
+
+    btc_blockindex tip_view;
+    btc_blockindex views[BTC_HEADERS_DB_COMPACT_VIEWS];
+    unsigned int next_view;
+} btc_headers_db_compact;
+
+btc_headers_db_compact *btc_headers_db_compact_new(const btc_chainparams* chainparams, btc_bool inmem_only);
+void btc_headers_db_compact_free(btc_headers_db_compact *db);
+
+btc_bool btc_headers_db_compact_load(btc_headers_db_compact* db, const char *filename);
+
+/* connects a header
+   headers with an unknown parent are kept in the orphan pool (returned with connected = false)
+   and get connected as soon as the parent arrives */
+btc_blockindex * btc_headers_db_compact_connect_hdr(btc_headers_db_compact* db, struct const_buffer *buf, btc_bool load_process, btc_bool *connected);
+
+size_t btc_headers_db_compact_fill_block_locator(btc_headers_db_compact* db, btc_uint256 *locators, size_t max_locators);
+
+btc_blockindex * btc_headers_db_compact_getchaintip(btc_headers_db_compact* db);
+btc_bool btc_headers_db_compact_disconnect_tip(btc_headers_db_compact* db);
+
+btc_bool btc_headers_db_compact_has_checkpoint_start(btc_headers_db_compact* db);
+void btc_headers_db_compact_set_checkpoint_start(btc_headers_db_compact* db, btc_uint256 hash, uint32_t height);
+
+/* connects a header snapshot on top of the tip (or from the snapshot base on an empty chain),
+   see btc_headers_db_import_snapshot */
+btc_bool btc_headers_db_compact_import_snapshot(btc_headers_db_compact* db, const btc_chainparams* chainparams, const char *filename, const uint8_t *pinned_hash);
+
+/* main chain lookups, return a view or NULL if not found
+   views have no prev/skip pointers (use btc_headers_db_compact_get for ancestors) and are
+   overwritten after BTC_HEADERS_DB_COMPACT_VIEWS calls, the tip view stays valid until the tip changes */
+btc_blockindex * btc_headers_db_compact_find(btc_headers_db_compact* db, btc_uint256 hash);
+btc_blockindex * btc_headers_db_compact_get(btc_headers_db_compact* db, uint32_t height);
+
+/* height of the chain base (genesis or checkpoint) */
+uint32_t btc_headers_db_compact_lowest_height(btc_headers_db_compact* db);
+
+/* returns true if a header with the given hash is in the orphan pool */
+btc_bool btc_headers_db_compact_have_orphan(btc_headers_db_compact* db, btc_uint256 hash);
+
+/* evict orphans added before now - BTC_HEADERS_DB_COMPACT_ORPHAN_EXPIRE */
+void btc_headers_db_compact_expire_orphans(btc_headers_db_compact* db, int64_t now);
+
+/* returns the lowest main chain height with a timestamp >= the given timestamp, -1 if there is none */
+int64_t btc_headers_db_compact_find_height_by_time(btc_headers_db_compact* db, uint32_t timestamp);
+
+/* returns the approximate heap memory used by the database */
+size_t btc_headers_db_compact_mem_usage(btc_headers_db_compact* db);
+
+// interface function pointer bindings
+static const btc_headers_db_interface btc_headers_db_interface_compact = {
+    (void* (*)(const btc_chainparams*, btc_bool))btc_headers_db_compact_new,
+    (void (*)(void *))btc_headers_db_compact_free,
+    (btc_bool (*)(void *, const char *))btc_headers_db_compact_load,
+    (size_t (*)(void* , btc_uint256 *, size_t))btc_headers_db_compact_fill_block_locator,
+    (btc_blockindex *(*)(void* , struct const_buffer *, btc_bool , btc_bool *))btc_headers_db_compact_connect_hdr,
+
+    (btc_blockindex* (*)(void *))btc_headers_db_compact_getchaintip,
+    (btc_bool (*)(void *))btc_headers_db_compact_disconnect_tip,
+
+    (btc_bool (*)(void *))btc_headers_db_compact_has_checkpoint_start,
+    (void (*)(void *, btc_uint256, uint32_t))btc_headers_db_compact_set_checkpoint_start,
+
+    (btc_blockindex* (*)(void *, uint32_t))btc_headers_db_compact_get,
+    (uint32_t (*)(void *))btc_headers_db_compact_lowest_height,
+
+    (btc_bool (*)(void *, const btc_chainparams*, const char *, const uint8_t *))btc_headers_db_compact_import_snapshot
+};
+
+LIBBTC_END_DECL
+
+#endif // __LIBBTC_HEADERSDB_COMPACT_H__
@@ -32,9 +32,31 @@
 #include "buffer.h"
 #include "chainparams.h"
 #include "headersdb.h"
+#include "vector.h"
 
 LIBBTC_BEGIN_DECL
 
+/* default memory budget for the in-memory headers window (~170 headers) */
+static const size_t BTC_HEADERS_DB_DEFAULT_MEM_BUDGET = 32 * 1024;
+
+/* default memory budget for headers that don't connect (yet) */
+static const size_t BTC_HEADERS_DB_DEFAULT_ORPHAN_MEM_BUDGET = 256 * 1024;
+
+/* orphans older than this (in seconds) will be evicted */
+static const int64_t BTC_HEADERS_DB_DEFAULT_ORPHAN_EXPIRE = 20 * 60;
+
+/* orphan pool counters (for monitoring) */
+typedef struct btc_headers_db_orphan_stats_
+{
+    size_t count; /* headers currently in the pool */
+    size_t mem_bytes; /* approximate memory used by the pool */
+    uint64_t added;
+    uint64_t duplicates; /* orphans we already had */
+    uint64_t connected; /* orphans connected once their parent arrived */
+    uint64_t evicted_size; /* evicted because the pool was full */
+    uint64_t evicted_age; /* evicted because they were too old */
+} btc_headers_db_orphan_stats;
+
 /* filebased headers database (including binary tree option for fast access)
 */
 typedef struct btc_headers_db_
@@ -45,7 +67,19 @@ typedef struct btc_headers_db_
     void *tree_root;
     btc_bool use_binary_tree;
 
-    unsigned int max_hdr_in_mem;
+    /* in-memory window of the main chain, ring buffer indexed by height */
+    size_t max_hdr_mem_bytes; /* memory budget in bytes, 0 = keep all headers in memory */
+    unsigned int max_hdr_in_mem; /* amount of headers fitting into the budget (window size) */
+    btc_blockindex **window;
+    vector *fork_headers; /* in-memory headers off the main chain (only kept track of with a window) */
+
+    /* headers with an unknown parent, indexed by the prev hash */
+    void *orphans_by_prev;
+    vector *orphans; /* oldest first */
+    size_t max_orphan_mem_bytes;
+    int64_t orphan_expire;
+    btc_headers_db_orphan_stats orphan_stats;
+
     btc_blockindex genesis;
     btc_blockindex *chaintip;
     btc_blockindex *chainbottom;
@@ -55,12 +89,39 @@ btc_headers_db *btc_headers_db_new(const btc_chainparams* chainparams, btc_bool
 void btc_headers_db_free(btc_headers_db *db);
 
 btc_bool btc_headers_db_load(btc_headers_db* db, const char *filename);
+
+/* set the memory budget (in bytes) for in-memory headers, 0 for unbounded
+   headers falling out of the budget will only be kept on disk */
+void btc_headers_db_set_mem_budget(btc_headers_db* db, size_t max_bytes);
+
+/* set the orphan pool limits (memory in bytes, max age in seconds) */
+void btc_headers_db_set_orphan_limits(btc_headers_db* db, size_t max_bytes, int64_t max_age);
+
+/* evict orphans added before now - max age */
+void btc_headers_db_expire_orphans(btc_headers_db* db, int64_t now);
+
+/* returns true if a header with the given hash is in the orphan pool */
+btc_bool btc_headers_db_have_orphan(btc_headers_db* db, btc_uint256 hash);
+
+/* connects a header, returns the new blockindex (or NULL on a deserialization error)
+   headers with an unknown parent are kept in the orphan pool (returned with connected = false)
+   and get connected as soon as the parent arrives, a returned orphan may be evicted later */
 btc_blockindex * btc_headers_db_connect_hdr(btc_headers_db* db, struct const_buffer *buf, btc_bool load_process, btc_bool *connected);
 
-void btc_headers_db_fill_block_locator(btc_headers_db* db, vector *blocklocators);
+size_t btc_headers_db_fill_block_locator(btc_headers_db* db, btc_uint256 *locators, size_t max_locators);
+
+/* header snapshots
+   export writes the in-memory main chain (chain bottom to tip) to a file, use an unbounded memory budget for a full export
+   import connects a snapshot on top of the current tip (or sets the snapshot base as checkpoint start on an empty chain)
+   after verifying the header sequence and the final hash against pinned_hash (or a compiled-in checkpoint if NULL) */
+btc_bool btc_headers_db_export_snapshot(btc_headers_db* db, const btc_chainparams* chainparams, const char *filename);
+btc_bool btc_headers_db_import_snapshot(btc_headers_db* db, const btc_chainparams* chainparams, const char *filename, const uint8_t *pinned_hash);
 
 btc_blockindex * btc_headersdb_find(btc_headers_db* db, btc_uint256 hash);
+btc_blockindex * btc_headersdb_get_ancestor(btc_headers_db* db, btc_blockindex *pindex, uint32_t height);
 btc_blockindex * btc_headersdb_getchaintip(btc_headers_db* db);
+btc_blockindex * btc_headersdb_get_by_height(btc_headers_db* db, uint32_t height);
+uint32_t btc_headersdb_lowest_height(btc_headers_db* db);
 btc_bool btc_headersdb_disconnect_tip(btc_headers_db* db);
 
 btc_bool btc_headersdb_has_checkpoint_start(btc_headers_db* db);
@@ -72,14 +133,19 @@ static const btc_headers_db_interface btc_headers_db_interface_file = {
     (void* (*)(const btc_chainparams*, btc_bool))btc_headers_db_new,
     (void (*)(void *))btc_headers_db_free,
     (btc_bool (*)(void *, const char *))btc_headers_db_load,
-    (void (*)(void* , vector *))btc_headers_db_fill_block_locator,
+    (size_t (*)(void* , btc_uint256 *, size_t))btc_headers_db_fill_block_locator,
     (btc_blockindex *(*)(void* , struct const_buffer *, btc_bool , btc_bool *))btc_headers_db_connect_hdr,
 
     (btc_blockindex* (*)(void *))btc_headersdb_getchaintip,
     (btc_bool (*)(void *))btc_headersdb_disconnect_tip,
 
     (btc_bool (*)(void *))btc_headersdb_has_checkpoint_start,
-    (void (*)(void *, btc_uint256, uint32_t))btc_headersdb_set_checkpoint_start
+    (void (*)(void *, btc_uint256, uint32_t))btc_headersdb_set_checkpoint_start,
+
+    (btc_blockindex* (*)(void *, uint32_t))btc_headersdb_get_by_height,
+    (uint32_t (*)(void *))btc_headersdb_lowest_height,
+
+    (btc_bool (*)(void *, const btc_chainparams*, const char *, const uint8_t *))btc_headers_db_import_snapshot
 };
 
 #ifdef __cplusplus
@@ -28,6 +28,7 @@
 #define __LIBBTC_NET_H__
 
 #include "btc.h"
+#include "addrman.h"
 #include "buffer.h"
 #include "chainparams.h"
 #include "cstr.h"
@@ -40,6 +41,16 @@ LIBBTC_BEGIN_DECL
 
 static const unsigned int BTC_P2P_MESSAGE_CHUNK_SIZE = 4096;
 
+/* maximal amount of buffered received data per peer (a single larger message can exceed it) */
+static const size_t BTC_P2P_RECV_BUFFER_LIMIT = 4 * 1024 * 1024;
+
+/* outgoing messages up to this size are coalesced into a single write per event loop iteration */
+static const size_t BTC_P2P_COALESCE_MAX_SIZE = 1024;
+
+/* queued outgoing data per peer, producers get paused above the high and resumed below the low water mark */
+static const size_t BTC_P2P_SEND_HIGH_WATER = 1024 * 1024;
+static const size_t BTC_P2P_SEND_LOW_WATER = 256 * 1024;
+
 enum NODE_STATE {
     NODE_CONNECTING = (1 << 0),
     NODE_CONNECTED = (1 << 1),
@@ -52,8 +63,62 @@ enum NODE_STATE {
     NODE_DISCONNECTED_FROM_REMOTE_PEER = (1 << 8),
 };
 
+#define BTC_NODE_STATS_MAX_COMMANDS 32
+#define BTC_NODE_STATS_RTT_BUCKETS 8
+
+/* per command traffic counters */
+typedef struct btc_node_command_stats_ {
+    char command[13];
+    uint64_t msgs_in;
+    uint64_t bytes_in;
+    uint64_t msgs_out;
+    uint64_t bytes_out;
+} btc_node_command_stats;
+
+/* per node instrumentation (since the connection has been established), times in milliseconds */
+typedef struct btc_node_stats_ {
+    int nodeid;
+    uint32_t state;
+    uint64_t time_connected; /* unix time */
+
+    uint64_t msgs_in;
+    uint64_t bytes_in;
+    uint64_t msgs_out;
+    uint64_t bytes_out;
+    btc_node_command_stats commands[BTC_NODE_STATS_MAX_COMMANDS]; /* further commands only count in the totals */
+    unsigned int commands_count;
+
+    /* first headers/block message started to arrive, 0 = not yet */
+    uint64_t first_headers_ms;
+    uint64_t first_block_ms;
+
+    /* ping round trip times, bucket i counts the rtts below 25ms * 2^i, the last bucket all others */
+    uint32_t ping_rtt_hist[BTC_NODE_STATS_RTT_BUCKETS];
+    uint64_t ping_rtt_last_ms;
+
+    /* moving averages of the round trip time and the throughput of requested data (bytes/s), 0 = unknown */
+    uint64_t rtt_avg_ms;
+    uint64_t throughput_avg;
+
+    /* queue depths in bytes */
+    size_t send_queue_bytes;
+    size_t send_queue_max;
+    size_t recv_buffer_bytes; /* received, waiting for the rest of the message */
+    size_t recv_pending_bytes; /* waiting for the checksum verification */
+
+    /* time spent parsing messages in microseconds */
+    uint64_t parse_time_us;
+    uint64_t parse_time_max_us;
+} btc_node_stats;
+
 /* basic group-of-nodes structure */
 struct btc_node_;
+struct btc_node_verify_pool_;
+struct btc_node_group_shards_;
+
+/* handles a message of a type, return false if the node missbehaved (the "post command" callback is skipped) */
+typedef btc_bool (*btc_node_msg_handler)(struct btc_node_* node, btc_p2p_msg_hdr* hdr, struct const_buffer* buf);
+
 typedef struct btc_node_group_ {
     void* ctx; /* flexible context usefull in conjunction with the callbacks */
     struct event_base* event_base;
@@ -61,14 +126,45 @@ typedef struct btc_node_group_ {
     char clientstr[1024];
     int desired_amount_connected_nodes;
     const btc_chainparams* chainparams;
+    btc_bool prefer_headers; /* ask peers to announce new blocks with headers instead of inv (BIP130) */
+
+    /* worker threads verifying message checksums, NULL = verify on the event loop */
+    struct btc_node_verify_pool_* verify_pool;
+
+    /* event bases (and threads) the nodes are spread over, NULL = all nodes on event_base */
+    struct btc_node_group_shards_* shards;
+
+    /* base message logic by message type, run after parse_cmd_cb (on the nodes shard thread)
+       the version, verack, ping and pong handlers are set by btc_node_group_new */
+    btc_node_msg_handler msg_handlers[BTC_MSG_TYPE_COUNT];
+
+    /* periodic dump of the node statistics */
+    struct event* stats_dump_event;
+    char* stats_dump_file;
+
+    /* known peers (learned from addr messages and connection outcomes), NULL = always ask the DNS seeds */
+    btc_addrman* addrman;
+    char* addrman_file;
+    struct event* addrman_save_event;
+
+    /* asynchronous DNS seed lookups on the event base */
+    struct evdns_base* dns_base;
+    vector* dns_seed_queries; /* outstanding lookups */
+    struct event* dns_seed_timeout_event; /* gives up on slow seeds */
+    btc_bool discover_peers; /* peers are discovered (not set by IP), the DNS seeds are asked again once the known peers ran out */
+    uint64_t dns_seed_last_time; /* last lookup (unix time) */
+    struct event* dns_reseed_event;
 
     /* callbacks */
+    /* with shards, log_write_cb and parse_cmd_cb are called on the nodes shard thread (must be thread-safe),
+       the other callbacks on the thread running btc_node_group_event_loop (in the order the node passed them) */
     int (*log_write_cb)(const char* format, ...); /* log callback, default=printf */
     btc_bool (*parse_cmd_cb)(struct btc_node_* node, btc_p2p_msg_hdr* hdr, struct const_buffer* buf);
     void (*postcmd_cb)(struct btc_node_* node, btc_p2p_msg_hdr* hdr, struct const_buffer* buf);
     void (*node_connection_state_changed_cb)(struct btc_node_* node);
     btc_bool (*should_connect_to_more_nodes_cb)(struct btc_node_* node);
     void (*handshake_done_cb)(struct btc_node_* node);
+    void (*send_queue_cb)(struct btc_node_* node, btc_bool paused); /* send queue crossed the high (paused) or low water mark */
     btc_bool (*periodic_timer_cb)(struct btc_node_* node, uint64_t* time); // return false will cancle the internal logic
 } btc_node_group;
 
@@ -85,16 +181,24 @@ typedef struct btc_node_ {
     struct sockaddr addr;
     struct bufferevent* event_bev;
     struct event* timer_event;
+    struct event* flush_event; /* writes the coalesced messages once per loop iteration */
+    cstring* send_batch; /* coalesced small messages */
+    btc_bool send_paused; /* send queue above the high water mark */
     btc_node_group* nodegroup;
     int nodeid;
     uint64_t lastping;
+    uint64_t ping_nonce; /* outstanding ping */
+    uint64_t ping_sent_ms;
+    uint64_t request_sent_ms; /* outstanding request (see btc_node_request_sent) */
     uint64_t time_started_con;
     uint64_t time_last_request;
     btc_uint256 last_requested_inv;
 
-    cstring* recvBuffer;
+    size_t recv_pending_bytes; /* received messages waiting for the checksum verification */
+    btc_bool recv_paused; /* stopped taking messages off the input buffer */
     uint64_t nonce;
     uint64_t services;
+    int32_t version; /* protocol version of the peer */
     uint32_t state;
     int missbehavescore;
     btc_bool version_handshake;
@@ -102,6 +206,8 @@ typedef struct btc_node_ {
     unsigned int bestknownheight;
 
     uint32_t hints; /* can be use for user defined state */
+
+    btc_node_stats stats; /* updated by the thread running the node, use btc_node_group_get_stats */
 } btc_node;
 
 LIBBTC_API int net_write_log_printf(const char* format, ...);
@@ -123,6 +229,20 @@ LIBBTC_API void btc_node_disconnect(btc_node* node);
 /* mark a node missbehave and disconnect */
 LIBBTC_API btc_bool btc_node_missbehave(btc_node* node);
 
+/* send a ping, the pong updates the round trip time */
+LIBBTC_API void btc_node_send_ping(btc_node* node);
+
+/* response time measurement of requests (like getheaders or getdata) */
+LIBBTC_API void btc_node_request_sent(btc_node* node);
+LIBBTC_API void btc_node_response_received(btc_node* node, size_t bytes);
+LIBBTC_API void btc_node_record_response(btc_node* node, size_t bytes, uint64_t elapsed_ms);
+
+/* true if the outstanding request takes much longer than expected from the nodes measurements */
+LIBBTC_API btc_bool btc_node_response_overdue(btc_node* node);
+
+/* expected performance of the node for sync requests, higher is better (unmeasured nodes get a default) */
+LIBBTC_API uint64_t btc_node_sync_score(btc_node* node);
+
 /* =================================== */
 /* NODE GROUPS */
 /* =================================== */
@@ -131,18 +251,50 @@ LIBBTC_API btc_bool btc_node_missbehave(btc_node* node);
 LIBBTC_API btc_node_group* btc_node_group_new(const btc_chainparams* chainparams);
 LIBBTC_API void btc_node_group_free(btc_node_group* group);
 
-/* disconnect all peers */
+/* verify message checksums with the given amount of worker threads (0 = on the event loop)
+   must be called before connecting to nodes, messages are still processed in order on the event loop */
+LIBBTC_API btc_bool btc_node_group_set_verify_threads(btc_node_group* group, unsigned int threads);
+
+/* spread the nodes over the given amount of event bases, each running on its own thread
+   must be called right after creating the group (replaces the groups event_base)
+   the connections, message framing and the internal protocol logic run on the shards,
+   the application callbacks are handed over to the thread running btc_node_group_event_loop
+   (periodic_timer_cb can't cancel the internal timer logic, should_connect_to_more_nodes_cb isn't called) */
+LIBBTC_API btc_bool btc_node_group_set_shards(btc_node_group* group, unsigned int shards);
+
+/* disconnect all peers, stop the periodic timers and save the known peers (stops the event loop if the group is sharded) */
 LIBBTC_API void btc_node_group_shutdown(btc_node_group* group);
 
+/* copy the statistics of up to max nodes to stats_out, returns the amount of nodes in the group */
+LIBBTC_API size_t btc_node_group_get_stats(btc_node_group* group, btc_node_stats* stats_out, size_t max);
+
+/* write the node statistics as text file (replaced atomically) */
+LIBBTC_API btc_bool btc_node_group_dump_stats(btc_node_group* group, const char* filename);
+
+/* dump the node statistics every interval_s seconds from the event loop (NULL filename = stop)
+   the dump timer keeps the event loop running */
+LIBBTC_API btc_bool btc_node_group_set_stats_dump(btc_node_group* group, const char* filename, unsigned int interval_s);
+
+/* keep an address manager stored in filename (loaded now, saved every interval_s seconds if changed
+   and when the group gets freed), peers are then taken from it instead of the DNS seeds (NULL filename = stop) */
+LIBBTC_API btc_bool btc_node_group_set_addrman_file(btc_node_group* group, const char* filename, unsigned int interval_s);
+
+/* save the address manager now (including the sync scores of the connected nodes) */
+LIBBTC_API btc_bool btc_node_group_save_addrman(btc_node_group* group);
+
 /* add a node to a node group */
 LIBBTC_API void btc_node_group_add_node(btc_node_group* group, btc_node* node);
 
-/* start node groups event loop */
+/* start node groups event loop
+   with shards, it runs until the group gets shut down or the event_base loop exits */
 LIBBTC_API void btc_node_group_event_loop(btc_node_group* group);
 
 /* connect to more nodex */
 LIBBTC_API btc_bool btc_node_group_connect_next_nodes(btc_node_group* group);
 
+/* get the best scoring connected node (handshake done) that knows a chain higher than the given height */
+LIBBTC_API btc_node* btc_node_group_best_sync_node(btc_node_group* group, unsigned int height, btc_node* exclude);
+
 /* get the amount of connected nodes */
 LIBBTC_API int btc_node_group_amount_of_connected_nodes(btc_node_group* group, enum NODE_STATE state);
 
@@ -152,6 +304,17 @@ LIBBTC_API void btc_node_send_version(btc_node* node);
 /* send arbitrary data to node */
 LIBBTC_API void btc_node_send(btc_node* node, cstring* data);
 
+/* send data to node, takes the ownership of data (no copy for messages larger than BTC_P2P_COALESCE_MAX_SIZE) */
+LIBBTC_API void btc_node_send_owned(btc_node* node, cstring* data);
+
+/* frame and send a message without copying the payload: the header is written to the output and the
+   payload parts are referenced until they have been sent (messages up to BTC_P2P_COALESCE_MAX_SIZE are coalesced)
+   takes the ownership of the parts, checksum: known payload checksum (like of a relayed message) or NULL */
+LIBBTC_API void btc_node_send_message(btc_node* node, const char* command, cstring** parts, size_t parts_count, const unsigned char* checksum);
+
+/* write the queued messages to the socket immediately (if called on the nodes thread) */
+LIBBTC_API void btc_node_flush(btc_node* node);
+
 LIBBTC_API int btc_node_parse_message(btc_node* node, btc_p2p_msg_hdr* hdr, struct const_buffer* buf);
 LIBBTC_API void btc_node_connection_state_changed(btc_node* node);
 
@@ -159,7 +322,18 @@ LIBBTC_API void btc_node_connection_state_changed(btc_node* node);
 /* DNS */
 /* =================================== */
 
+/* add the given comma separated ips, without ips the best known peers of the address manager
+   or the peers of the DNS seeds (if there is no address manager or it doesn't know usable peers) */
 LIBBTC_API btc_bool btc_node_group_add_peers_by_ip_or_seed(btc_node_group *group, const char *ips);
+
+/* resolve all DNS seeds of the chain in parallel on the groups event base (returns the amount of lookups started)
+   the peers of each answer are added and connected once the event loop runs, without waiting for the other seeds */
+LIBBTC_API unsigned int btc_node_group_resolve_seeds(btc_node_group* group);
+
+/* resolve the seeds with the given nameserver ("ip[:port]") instead of the systems (resolv.conf) */
+LIBBTC_API btc_bool btc_node_group_set_dns_nameserver(btc_node_group* group, const char* ip_port);
+
+/* blocking lookup of a single seed */
 LIBBTC_API int btc_get_peers_from_dns(const char* seed, vector* ips_out, int port, int family);
 
 LIBBTC_END_DECL
@@ -29,7 +29,11 @@
 
 #include "btc.h"
 #include "blockchain.h"
+#include "blockstore.h"
+#include "bloom.h"
+#include "cmpctblock.h"
 #include "headersdb.h"
+#include "scriptmatch.h"
 #include "tx.h"
 
 LIBBTC_BEGIN_DECL
@@ -39,6 +43,36 @@ enum SPV_CLIENT_STATE {
     SPV_FULLBLOCK_SYNC_FLAG	    = (1 << 1),
 };
 
+/* latency of a stage of the block processing pipeline (microseconds) */
+typedef struct btc_spv_pipeline_stage_
+{
+    uint64_t count;
+    uint64_t total_us;
+    uint64_t max_us;
+} btc_spv_pipeline_stage;
+
+typedef struct btc_spv_pipeline_stats_
+{
+    uint64_t blocks;
+    uint64_t txs;
+    btc_spv_pipeline_stage queued; /* waiting for a parser worker */
+    btc_spv_pipeline_stage parse; /* deserializing the transactions */
+    btc_spv_pipeline_stage reorder; /* parsed, waiting for the previous blocks and the event loop */
+    btc_spv_pipeline_stage callback; /* sync_transaction calls */
+    size_t pending; /* blocks in the pipeline */
+    size_t pending_max;
+    uint64_t backpressure; /* block requests held back because the pipeline was full */
+} btc_spv_pipeline_stats;
+
+/* wallet (or other watcher) in the registry of the client, the transactions paying to its scripts are passed to its callback */
+typedef struct btc_spv_watcher_
+{
+    void (*sync_transaction)(void *ctx, btc_tx *tx, unsigned int pos, btc_blockindex *blockindex);
+    void *ctx;
+    vector *keys; /* btc_script_match_key, to remove them from the index */
+    uint64_t last_tx_seq; /* the callback is called once per transaction */
+} btc_spv_watcher;
+
 typedef struct btc_spv_client_
 {
     btc_node_group *nodegroup;
@@ -49,6 +83,45 @@ typedef struct btc_spv_client_
     int stateflags;
     uint64_t last_statecheck_time;
     btc_bool called_sync_completed;
+    btc_bool headers_pipelining; /* request the next headers before connecting a full headers message (default true) */
+
+    /* parallel block download */
+    vector *block_queue; /* announced blocks in chain order, the head of the queue (the window) is fetched from multiple peers */
+    btc_bool block_queue_more; /* the last block inv was full, more blocks can be requested */
+    uint64_t block_download_timeout_ms; /* reassign a block request to a different peer after this time */
+    struct event *block_download_timer;
+    struct btc_spv_block_pipeline_ *block_pipeline; /* parses the downloaded blocks */
+
+    /* optional local copy of the downloaded blocks, rescans are served from it */
+    btc_blockstore *block_store;
+    btc_bool rescanning;
+    uint32_t rescan_next_height; /* next block to read from the store */
+    uint32_t rescan_end_height;
+    btc_uint256 rescan_prev_hash; /* last block of the rescan, links the stored blocks below the headers in memory */
+    btc_bool rescan_have_prev;
+
+    /* compact block filters (BIP157/158) */
+    btc_bool use_compact_filters; /* check the filters of the blocks to scan and only download matching blocks (the filter headers are cross-checked with a second filter peer if connected) */
+    vector *watched_scripts; /* scripts (cstring) to look for in the filters */
+    struct btc_spv_filter_sync_ *filter_sync;
+
+    /* bloom filtered merkle blocks (BIP37) */
+    btc_bool use_bloom_filter; /* download merkle blocks and the matched transactions instead of full blocks */
+    vector *watched_outpoints; /* serialized outpoints (cstring) to add to the bloom filter */
+    double bloom_fp_rate; /* false positive rate of the bloom filter (default 0.0001) */
+    btc_bloom_filter *bloom_filter; /* filter loaded on the peers */
+    btc_bool bloom_filter_dirty; /* watched items have been added, the filter needs to be loaded again */
+
+    /* registry of watchers sharing one index of the watched scripts, each block is parsed and matched once */
+    vector *watchers;
+    btc_script_matcher *watch_index; /* owners are the watchers */
+    vector *watch_matches; /* watchers of the current output */
+    uint64_t watch_tx_seq;
+
+    /* compact blocks (BIP152) */
+    btc_bool use_compact_blocks; /* let peers announce new blocks as compact blocks, relayed txs are kept in the pool */
+    btc_cmpct_txpool *tx_pool; /* recently relayed txs to reconstruct compact blocks from */
+    vector *cmpct_blocks; /* compact blocks waiting for their missing txs */
 
     void *headers_db_ctx; /* flexible headers db context */
     const btc_headers_db_interface *headers_db; /* headers db interface */
@@ -65,11 +138,15 @@ typedef struct btc_spv_client_
 
     /* callback when the header message has been processed */
     /* return false will abort further logic (like continue loading headers, etc.) */
+    /* with headers_pipelining, the next headers may already have been requested */
     btc_bool (*header_message_processed)(struct btc_spv_client_ *client, btc_node *node, btc_blockindex *newtip);
 
     /* callback, executed on each transaction (when getting a block, merkle-block txns or inv txns) */
     void (*sync_transaction)(void *ctx, btc_tx *tx, unsigned int pos, btc_blockindex *blockindex);
     void *sync_transaction_ctx;
+
+    /* callback when all blocks of a rescan have been passed to the transaction callbacks */
+    void (*rescan_completed)(struct btc_spv_client_ *client);
 } btc_spv_client;
 
 
@@ -79,15 +156,63 @@ LIBBTC_API void btc_spv_client_free(btc_spv_client *client);
 /* load the eventually existing headers db */
 LIBBTC_API btc_bool btc_spv_client_load(btc_spv_client *client, const char *file_path);
 
+/* import a header snapshot on top of the loaded headers
+   the final snapshot hash is verified against a compiled-in checkpoint */
+LIBBTC_API btc_bool btc_spv_client_import_snapshot(btc_spv_client *client, const char *file_path);
+
+/* add a script (like a scriptPubKey of a wallet address) to look for in the compact block filters
+   the data pushes of the script (like the hash160) are added to the bloom filter */
+LIBBTC_API void btc_spv_client_watch_script(btc_spv_client *client, const uint8_t *script, size_t script_len);
+
+/* add an outpoint (like an unspent output of the wallet) to the bloom filter to find the spending transaction */
+LIBBTC_API void btc_spv_client_watch_outpoint(btc_spv_client *client, const btc_uint256 txid, uint32_t n);
+
+/* register a watcher, the callback is called on the event loop thread for each transaction paying to one of its scripts */
+LIBBTC_API btc_spv_watcher* btc_spv_client_add_watcher(btc_spv_client *client, void (*sync_transaction)(void *ctx, btc_tx *tx, unsigned int pos, btc_blockindex *blockindex), void *ctx);
+
+/* unregister a watcher and remove its scripts from the index (they stay in the filters until the next restart) */
+LIBBTC_API void btc_spv_client_remove_watcher(btc_spv_client *client, btc_spv_watcher *watcher);
+
+/* add a scriptPubKey to a watcher (and to the filters of the client), returns false if the watcher already watches it */
+LIBBTC_API btc_bool btc_spv_watcher_watch_script(btc_spv_client *client, btc_spv_watcher *watcher, const uint8_t *script, size_t script_len);
+
+/* add the P2PKH, P2WPKH and P2PK outputs of a pubkey hash to a watcher */
+LIBBTC_API btc_bool btc_spv_watcher_watch_keyhash(btc_spv_client *client, btc_spv_watcher *watcher, const btc_uint160 hash160);
+
+/* keep the downloaded blocks in a block store in the directory (full blocks only, not with use_bloom_filter)
+   the retention can be set with btc_blockstore_set_retention on client->block_store */
+LIBBTC_API btc_bool btc_spv_client_open_block_store(btc_spv_client *client, const char *dir);
+
+/* pass the blocks from the height up to the current tip to the transaction callbacks again (like after adding a wallet)
+   blocks are read from the block store and parsed by the block workers, the blocks after the first one
+   missing in the store are downloaded, returns false if there is no store or blocks are being downloaded
+   below the headers in memory, the stored blocks are looked up by height and must connect to each other */
+LIBBTC_API btc_bool btc_spv_client_rescan(btc_spv_client *client, uint32_t from_height);
+
+/* parse the transactions of downloaded blocks on worker threads (0 = on the event loop)
+   the sync_transaction callbacks stay on the event loop thread and are called in chain order,
+   blocks waiting in the pipeline count against the download window (max_pending, 0 = the whole window)
+   call before the run loop */
+LIBBTC_API btc_bool btc_spv_client_set_block_workers(btc_spv_client *client, unsigned int threads, unsigned int max_pending);
+
+LIBBTC_API void btc_spv_client_get_pipeline_stats(btc_spv_client *client, btc_spv_pipeline_stats *stats);
+
 /* discover peers or set peers by IP(s) (CSV) */
 LIBBTC_API void btc_spv_client_discover_peers(btc_spv_client *client, const char *ips);
 
 /* start the spv client main run loop */
 LIBBTC_API void btc_spv_client_runloop(btc_spv_client *client);
 
-/* try to request headers from a single node in the nodegroup */
+/* try to request headers from a single node in the nodegroup (the best scoring one) */
 LIBBTC_API btc_bool btc_net_spv_request_headers(btc_spv_client *client);
 
+/* get the node used for the header sync, NULL if there is none */
+LIBBTC_API btc_node *btc_net_spv_headers_sync_node(btc_spv_client *client);
+
+/* request the queued blocks within the download window from the connected peers (fastest first)
+   and reassign requests that have timed out */
+LIBBTC_API void btc_net_spv_schedule_blocks(btc_spv_client *client);
+
 LIBBTC_END_DECL
 
 #endif // __LIBBTC_NETSPV_H__
@@ -52,6 +52,8 @@ static btc_uint256 NULLHASH = {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0
 
 enum service_bits {
     BTC_NODE_NETWORK = (1 << 0),
+    BTC_NODE_BLOOM = (1 << 2),
+    BTC_NODE_COMPACT_FILTERS = (1 << 6),
 };
 
 static const char* BTC_MSG_VERSION = "version";
@@ -65,6 +67,71 @@ static const char* BTC_MSG_GETBLOCKS = "getblocks";
 static const char* BTC_MSG_BLOCK = "block";
 static const char* BTC_MSG_INV = "inv";
 static const char* BTC_MSG_TX = "tx";
+static const char* BTC_MSG_GETCFILTERS = "getcfilters";
+static const char* BTC_MSG_CFILTER = "cfilter";
+static const char* BTC_MSG_GETCFHEADERS = "getcfheaders";
+static const char* BTC_MSG_CFHEADERS = "cfheaders";
+static const char* BTC_MSG_FILTERLOAD = "filterload";
+static const char* BTC_MSG_MERKLEBLOCK = "merkleblock";
+static const char* BTC_MSG_SENDCMPCT = "sendcmpct";
+static const char* BTC_MSG_CMPCTBLOCK = "cmpctblock";
+static const char* BTC_MSG_GETBLOCKTXN = "getblocktxn";
+static const char* BTC_MSG_BLOCKTXN = "blocktxn";
+static const char* BTC_MSG_SENDHEADERS = "sendheaders";
+static const char* BTC_MSG_ADDR = "addr";
+static const char* BTC_MSG_GETADDR = "getaddr";
+static const char* BTC_MSG_NOTFOUND = "notfound";
+static const char* BTC_MSG_REJECT = "reject";
+static const char* BTC_MSG_MEMPOOL = "mempool";
+static const char* BTC_MSG_FEEFILTER = "feefilter";
+static const char* BTC_MSG_FILTERADD = "filteradd";
+static const char* BTC_MSG_FILTERCLEAR = "filterclear";
+static const char* BTC_MSG_GETCFCHECKPT = "getcfcheckpt";
+static const char* BTC_MSG_CFCHECKPT = "cfcheckpt";
+static const char* BTC_MSG_WTXIDRELAY = "wtxidrelay";
+static const char* BTC_MSG_SENDADDRV2 = "sendaddrv2";
+static const char* BTC_MSG_ADDRV2 = "addrv2";
+
+/* interned message commands, set in btc_p2p_msg_hdr when deserializing the header */
+enum btc_p2p_msg_type {
+    BTC_MSG_TYPE_UNKNOWN = 0,
+    BTC_MSG_TYPE_VERSION,
+    BTC_MSG_TYPE_VERACK,
+    BTC_MSG_TYPE_PING,
+    BTC_MSG_TYPE_PONG,
+    BTC_MSG_TYPE_GETDATA,
+    BTC_MSG_TYPE_GETHEADERS,
+    BTC_MSG_TYPE_HEADERS,
+    BTC_MSG_TYPE_GETBLOCKS,
+    BTC_MSG_TYPE_BLOCK,
+    BTC_MSG_TYPE_INV,
+    BTC_MSG_TYPE_TX,
+    BTC_MSG_TYPE_GETCFILTERS,
+    BTC_MSG_TYPE_CFILTER,
+    BTC_MSG_TYPE_GETCFHEADERS,
+    BTC_MSG_TYPE_CFHEADERS,
+    BTC_MSG_TYPE_FILTERLOAD,
+    BTC_MSG_TYPE_MERKLEBLOCK,
+    BTC_MSG_TYPE_SENDCMPCT,
+    BTC_MSG_TYPE_CMPCTBLOCK,
+    BTC_MSG_TYPE_GETBLOCKTXN,
+    BTC_MSG_TYPE_BLOCKTXN,
+    BTC_MSG_TYPE_SENDHEADERS,
+    BTC_MSG_TYPE_ADDR,
+    BTC_MSG_TYPE_GETADDR,
+    BTC_MSG_TYPE_NOTFOUND,
+    BTC_MSG_TYPE_REJECT,
+    BTC_MSG_TYPE_MEMPOOL,
+    BTC_MSG_TYPE_FEEFILTER,
+    BTC_MSG_TYPE_FILTERADD,
+    BTC_MSG_TYPE_FILTERCLEAR,
+    BTC_MSG_TYPE_GETCFCHECKPT,
+    BTC_MSG_TYPE_CFCHECKPT,
+    BTC_MSG_TYPE_WTXIDRELAY,
+    BTC_MSG_TYPE_SENDADDRV2,
+    BTC_MSG_TYPE_ADDRV2,
+    BTC_MSG_TYPE_COUNT
+};
 
 enum BTC_INV_TYPE {
     BTC_INV_TYPE_ERROR = 0,
@@ -75,11 +142,17 @@ enum BTC_INV_TYPE {
 };
 
 static const unsigned int MAX_HEADERS_RESULTS = 2000;
+static const unsigned int MAX_LOCATOR_SZ = 101;
+static const unsigned int MAX_GETCFILTERS_SIZE = 1000;
+static const unsigned int MAX_GETCFHEADERS_SIZE = 2000;
+static const unsigned int MAX_ADDR_TO_SEND = 1000;
 static const int BTC_PROTOCOL_VERSION = 70014;
+static const int BTC_SENDHEADERS_VERSION = 70012;
 
 typedef struct btc_p2p_msg_hdr_ {
     unsigned char netmagic[4];
-    char command[12];
+    char command[13]; /* zero terminated, the wire format has 12 bytes */
+    enum btc_p2p_msg_type type; /* the interned command, BTC_MSG_TYPE_UNKNOWN for commands we don't know */
     uint32_t data_len;
     unsigned char hash[4];
 } btc_p2p_msg_hdr;
@@ -183,6 +256,16 @@ LIBBTC_API void btc_p2paddr_to_addr(btc_p2p_address* p2p_addr, struct sockaddr*
 /* deserialize the p2p message header from a buffer */
 LIBBTC_API void btc_p2p_deser_msghdr(btc_p2p_msg_hdr* hdr, struct const_buffer* buf);
 
+/* look up the message type of a (zero terminated) command, BTC_MSG_TYPE_UNKNOWN if the command is unknown */
+LIBBTC_API enum btc_p2p_msg_type btc_p2p_msg_type_from_command(const char* command);
+
+/* get the command of a message type, NULL for BTC_MSG_TYPE_UNKNOWN */
+LIBBTC_API const char* btc_p2p_msg_type_command(enum btc_p2p_msg_type type);
+
+/* write the 24 byte header of a message with a payload made of parts (referenced, not copied)
+   the checksum is hashed over the parts unless given (like the checksum of a just received message) */
+LIBBTC_API void btc_p2p_message_header(const unsigned char netmagic[4], const char* command, const struct const_buffer* parts, size_t parts_count, const unsigned char* checksum, unsigned char hdr_out[24]);
+
 /* btc_p2p_message_new does malloc a cstring, needs cleanup afterwards! */
 LIBBTC_API cstring* btc_p2p_message_new(const unsigned char netmagic[4], const char* command, const void* data, uint32_t data_len);
 
@@ -197,6 +280,20 @@ LIBBTC_API void btc_p2p_msg_getheaders(vector* blocklocators, btc_uint256 hashst
 /* directly deserialize a getheaders message to blocklocators, hashstop */
 LIBBTC_API btc_bool btc_p2p_deser_msg_getheaders(vector* blocklocators, btc_uint256 hashstop, struct const_buffer* buf);
 
+
+/* =================================== */
+/* COMPACT BLOCK FILTER MESSAGES (BIP157) */
+/* =================================== */
+
+/* creates a getcfilters message (getcfheaders uses the same layout) */
+LIBBTC_API void btc_p2p_msg_getcfilters(uint8_t filter_type, uint32_t start_height, const btc_uint256 stop_hash, cstring* str_out);
+
+/* deserialize a cfilter message, the filter references the buffer */
+LIBBTC_API btc_bool btc_p2p_deser_msg_cfilter(uint8_t* filter_type, btc_uint256 block_hash, struct const_buffer* filter, struct const_buffer* buf);
+
+/* deserialize the fixed part of a cfheaders message, the buffer is left at the <count> filter hashes */
+LIBBTC_API btc_bool btc_p2p_deser_msg_cfheaders(uint8_t* filter_type, btc_uint256 stop_hash, btc_uint256 prev_header, uint32_t* count, struct const_buffer* buf);
+
 LIBBTC_END_DECL
 
 #endif // __LIBBTC_PROTOCOL_H__
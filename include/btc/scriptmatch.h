@@ -0,0 +1,98 @@
+/*
+
+ The MIT License (MIT)
+
+ Copyright (c) 2016 libbtc developers
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES
+ OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+
+#ifndef __LIBBTC_SCRIPTMATCH_H__
+#define __LIBBTC_SCRIPTMATCH_H__
+
+#include "btc.h"
+#include "tx.h"
+#include "vector.h"
+
+LIBBTC_BEGIN_DECL
+
+/* what a watched script is matched by (taken from the raw script bytes, without parsing the ops) */
+enum btc_script_match_type {
+    BTC_SCRIPT_MATCH_KEYHASH = 1, /* hash160 of a pubkey: P2PKH, P2WPKH and P2PK outputs */
+    BTC_SCRIPT_MATCH_SCRIPTHASH, /* P2SH */
+    BTC_SCRIPT_MATCH_WITNESS_PROGRAM, /* other witness programs (P2WSH, P2TR, ...) */
+    BTC_SCRIPT_MATCH_SCRIPT, /* sha256 of any other script */
+};
+
+#define BTC_SCRIPT_MATCH_KEY_LEN 35
+
+/* type, witness version, length and the hash or witness program (zero padded) */
+typedef struct btc_script_match_key_ {
+    uint8_t data[BTC_SCRIPT_MATCH_KEY_LEN];
+} btc_script_match_key;
+
+typedef struct btc_script_match_slot_ {
+    uint64_t hash; /* 0 for an empty slot */
+    btc_script_match_key key;
+    void* owner; /* the same key can be watched by different owners */
+} btc_script_match_slot;
+
+/* set of watched scripts (open addressing) with a bit array in front to reject most scripts without touching the table */
+typedef struct btc_script_matcher_ {
+    btc_script_match_slot* slots;
+    size_t capacity; /* power of two */
+    size_t count;
+    size_t removed; /* since the prefilter was built (removed keys leave their bits set) */
+    uint64_t* prefilter;
+    size_t prefilter_bits; /* power of two */
+    uint64_t k0, k1; /* random siphash keys */
+} btc_script_matcher;
+
+/* get the match key of a script */
+LIBBTC_API void btc_script_match_key_from_script(const uint8_t* script, size_t len, btc_script_match_key* key_out);
+LIBBTC_API void btc_script_match_key_from_keyhash(const btc_uint160 hash160, btc_script_match_key* key_out);
+
+/* create a matcher sized for the expected amount of watched scripts (it grows when needed) */
+LIBBTC_API btc_script_matcher* btc_script_matcher_new(size_t expected);
+LIBBTC_API void btc_script_matcher_free(btc_script_matcher* matcher);
+
+/* watch a scriptPubKey, returns false if it was already watched */
+LIBBTC_API btc_bool btc_script_matcher_add_script(btc_script_matcher* matcher, const uint8_t* script, size_t len);
+
+/* watch the outputs paying to a pubkey hash (P2PKH, P2WPKH and P2PK), returns false if it was already watched */
+LIBBTC_API btc_bool btc_script_matcher_add_keyhash(btc_script_matcher* matcher, const btc_uint160 hash160);
+
+/* watch a key for an owner, returns false if the owner already watches it */
+LIBBTC_API btc_bool btc_script_matcher_add_key(btc_script_matcher* matcher, const btc_script_match_key* key, void* owner);
+
+/* stop watching a key for an owner, returns false if the owner did not watch it */
+LIBBTC_API btc_bool btc_script_matcher_remove_key(btc_script_matcher* matcher, const btc_script_match_key* key, void* owner);
+
+LIBBTC_API btc_bool btc_script_matcher_match_script(const btc_script_matcher* matcher, const uint8_t* script, size_t len);
+
+/* add the owners watching the script to owners_out, returns the amount of owners found */
+LIBBTC_API size_t btc_script_matcher_find_owners(const btc_script_matcher* matcher, const uint8_t* script, size_t len, vector* owners_out);
+
+/* check if any output of the transaction pays to a watched script */
+LIBBTC_API btc_bool btc_script_matcher_match_tx(const btc_script_matcher* matcher, const btc_tx* tx);
+
+LIBBTC_END_DECL
+
+#endif // __LIBBTC_SCRIPTMATCH_H__
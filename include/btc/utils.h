@@ -66,8 +66,9 @@ static inline void btc_btree_tdestroy(void *root, void (*freekey)(void *))
 
     if (r == 0)
         return;
-    btc_btree_tdestroy(r->left, freekey);
-    btc_btree_tdestroy(r->right, freekey);
+    /* glibc stores the node color in the lowest bit of the child pointers */
+    btc_btree_tdestroy((void*)((uintptr_t)r->left & ~(uintptr_t)1), freekey);
+    btc_btree_tdestroy((void*)((uintptr_t)r->right & ~(uintptr_t)1), freekey);
 
     if (freekey) freekey(r->key);
     btc_free(r);
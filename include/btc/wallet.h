@@ -31,6 +31,7 @@
 #include "blockchain.h"
 #include "bip32.h"
 #include "buffer.h"
+#include "scriptmatch.h"
 #include "tx.h"
 
 LIBBTC_BEGIN_DECL
@@ -47,6 +48,9 @@ typedef struct btc_wallet {
     /* use binary trees for in-memory mapping for wtxs, keys */
     void* wtxes_rbtree;
     void* hdkeys_rbtree;
+
+    /* output scripts of the keys, to detect the wallet transactions without parsing the scripts */
+    btc_script_matcher* matcher;
 } btc_wallet;
 
 typedef struct btc_wtx_ {
@@ -0,0 +1,388 @@
+/*
+
+ The MIT License (MIT)
+
+ Copyright (c) 2016 libbtc developers
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES
+ OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+
+#include <search.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <btc/addrman.h>
+
+#include <btc/hash.h>
+#include <btc/serialize.h>
+#include <btc/utils.h>
+
+static const uint32_t BTC_ADDRMAN_FILE_VERSION = 1;
+
+/* upper bound of a serialized entry (for sanity checks while loading) */
+#define BTC_ADDRMAN_ENTRY_SIZE (8 + 16 + 2 + 4 + 8 + 8 + 4 + 4 + 8)
+
+static int btc_addrman_compare(const void* l, const void* r)
+{
+    const btc_addrman_entry* le = l;
+    const btc_addrman_entry* re = r;
+    int cmp = memcmp(le->addr.ip, re->addr.ip, sizeof(le->addr.ip));
+    if (cmp != 0)
+        return cmp;
+    return (int)le->addr.port - (int)re->addr.port;
+}
+
+btc_addrman* btc_addrman_new(void)
+{
+    btc_addrman* addrman = btc_calloc(1, sizeof(*addrman));
+    addrman->entries = vector_new(64, btc_free);
+    addrman->tree_root = NULL;
+    addrman->max_entries = BTC_ADDRMAN_MAX_ENTRIES;
+    addrman->dirty = false;
+    return addrman;
+}
+
+void btc_addrman_free(btc_addrman* addrman)
+{
+    if (!addrman)
+        return;
+    /* the entries are owned by the vector */
+    btc_btree_tdestroy(addrman->tree_root, NULL);
+    vector_free(addrman->entries, true);
+    btc_free(addrman);
+}
+
+btc_addrman_entry* btc_addrman_find(btc_addrman* addrman, const btc_p2p_address* addr)
+{
+    btc_addrman_entry key;
+    memcpy(&key.addr, addr, sizeof(key.addr));
+    void* found = tfind(&key, &addrman->tree_root, btc_addrman_compare);
+    return (found ? *(btc_addrman_entry**)found : NULL);
+}
+
+/* addresses not worth keeping (or trying) anymore */
+static btc_bool btc_addrman_is_terrible(const btc_addrman_entry* entry, uint64_t now)
+{
+    /* relayed with a time in the future */
+    if (entry->addr.time > now + 10 * 60)
+        return true;
+
+    /* not seen for too long */
+    if (entry->addr.time == 0 || entry->addr.time + BTC_ADDRMAN_HORIZON < now)
+        return true;
+
+    /* never connected after a couple of tries */
+    if (entry->last_success == 0 && entry->attempts >= 3)
+        return true;
+
+    /* failed repeatedly since a connection a week ago */
+    if (entry->last_success + 7 * 24 * 60 * 60 < now && entry->attempts >= 10)
+        return true;
+
+    return false;
+}
+
+static void btc_addrman_remove_idx(btc_addrman* addrman, size_t idx)
+{
+    btc_addrman_entry* entry = vector_idx(addrman->entries, idx);
+    tdelete(entry, &addrman->tree_root, btc_addrman_compare);
+    vector_remove_idx(addrman->entries, idx);
+    addrman->dirty = true;
+}
+
+/* make room for a new entry: drop a terrible entry, else the oldest never connected one, else the oldest */
+static void btc_addrman_evict(btc_addrman* addrman, uint64_t now)
+{
+    size_t worst = 0;
+    int worst_class = -1;
+    for (size_t i = 0; i < addrman->entries->len; i++) {
+        btc_addrman_entry* entry = vector_idx(addrman->entries, i);
+        int entry_class = (btc_addrman_is_terrible(entry, now) ? 2 : (entry->last_success == 0 ? 1 : 0));
+        btc_addrman_entry* current = (worst_class >= 0 ? vector_idx(addrman->entries, worst) : NULL);
+        if (entry_class > worst_class || (entry_class == worst_class && entry->addr.time < current->addr.time)) {
+            worst = i;
+            worst_class = entry_class;
+        }
+    }
+    if (worst_class >= 0)
+        btc_addrman_remove_idx(addrman, worst);
+}
+
+static btc_addrman_entry* btc_addrman_insert(btc_addrman* addrman, const btc_p2p_address* addr, uint64_t now)
+{
+    if (addrman->max_entries == 0)
+        return NULL;
+    while (addrman->entries->len >= addrman->max_entries)
+        btc_addrman_evict(addrman, now);
+
+    btc_addrman_entry* entry = btc_calloc(1, sizeof(*entry));
+    memcpy(&entry->addr, addr, sizeof(entry->addr));
+    vector_add(addrman->entries, entry);
+    tsearch(entry, &addrman->tree_root, btc_addrman_compare);
+    addrman->dirty = true;
+    return entry;
+}
+
+btc_bool btc_addrman_add(btc_addrman* addrman, const btc_p2p_address* addr, uint64_t now)
+{
+    /* nodes only support IPv4 connections, unroutable addresses are of no use */
+    static const uint8_t ipv4_prefix[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+    if (memcmp(addr->ip, ipv4_prefix, sizeof(ipv4_prefix)) != 0 || addr->port == 0 ||
+        (addr->ip[12] == 0 && addr->ip[13] == 0 && addr->ip[14] == 0 && addr->ip[15] == 0))
+        return false;
+
+    btc_addrman_entry* entry = btc_addrman_find(addrman, addr);
+    if (entry) {
+        if (addr->time > entry->addr.time && addr->time <= now + 10 * 60) {
+            entry->addr.time = addr->time;
+            addrman->dirty = true;
+        }
+        entry->addr.services |= addr->services;
+        return false;
+    }
+
+    /* a relayed time in the future (or none) is clamped */
+    btc_p2p_address relayed = *addr;
+    if (relayed.time == 0 || relayed.time > now + 10 * 60)
+        relayed.time = (uint32_t)now;
+    if (relayed.time + BTC_ADDRMAN_HORIZON < now)
+        return false;
+    return (btc_addrman_insert(addrman, &relayed, now) != NULL);
+}
+
+static btc_addrman_entry* btc_addrman_find_or_add(btc_addrman* addrman, const btc_p2p_address* addr, uint64_t now)
+{
+    btc_addrman_entry* entry = btc_addrman_find(addrman, addr);
+    if (!entry && btc_addrman_add(addrman, addr, now))
+        entry = btc_addrman_find(addrman, addr);
+    return entry;
+}
+
+void btc_addrman_attempt(btc_addrman* addrman, const btc_p2p_address* addr, uint64_t now)
+{
+    btc_addrman_entry* entry = btc_addrman_find_or_add(addrman, addr, now);
+    if (!entry)
+        return;
+    entry->last_try = now;
+    addrman->dirty = true;
+}
+
+void btc_addrman_good(btc_addrman* addrman, const btc_p2p_address* addr, uint64_t now)
+{
+    btc_addrman_entry* entry = btc_addrman_find_or_add(addrman, addr, now);
+    if (!entry)
+        return;
+    entry->addr.time = (uint32_t)now;
+    entry->last_success = now;
+    entry->attempts = 0;
+    entry->successes++;
+    addrman->dirty = true;
+}
+
+void btc_addrman_failed(btc_addrman* addrman, const btc_p2p_address* addr)
+{
+    btc_addrman_entry* entry = btc_addrman_find(addrman, addr);
+    if (!entry)
+        return;
+    entry->attempts++;
+    addrman->dirty = true;
+}
+
+void btc_addrman_set_score(btc_addrman* addrman, const btc_p2p_address* addr, uint64_t score)
+{
+    btc_addrman_entry* entry = btc_addrman_find(addrman, addr);
+    if (!entry || entry->score == score)
+        return;
+    entry->score = score;
+    addrman->dirty = true;
+}
+
+/* fastest (discounted by failed attempts) first, then the most recently connected */
+static int btc_addrman_compare_known(const void* l, const void* r)
+{
+    const btc_addrman_entry* le = *(btc_addrman_entry* const*)l;
+    const btc_addrman_entry* re = *(btc_addrman_entry* const*)r;
+    uint64_t lrank = le->score / (le->attempts + 1);
+    uint64_t rrank = re->score / (re->attempts + 1);
+    if (lrank != rrank)
+        return (lrank > rrank ? -1 : 1);
+    if (le->last_success != re->last_success)
+        return (le->last_success > re->last_success ? -1 : 1);
+    return 0;
+}
+
+/* fewest failed attempts first, then the most recently seen */
+static int btc_addrman_compare_untried(const void* l, const void* r)
+{
+    const btc_addrman_entry* le = *(btc_addrman_entry* const*)l;
+    const btc_addrman_entry* re = *(btc_addrman_entry* const*)r;
+    if (le->attempts != re->attempts)
+        return (le->attempts < re->attempts ? -1 : 1);
+    if (le->addr.time != re->addr.time)
+        return (le->addr.time > re->addr.time ? -1 : 1);
+    return 0;
+}
+
+size_t btc_addrman_select(btc_addrman* addrman, size_t count, uint64_t now, vector* addrs_out)
+{
+    size_t len = addrman->entries->len;
+    btc_addrman_entry** known = btc_calloc(len + 1, sizeof(*known));
+    btc_addrman_entry** untried = btc_calloc(len + 1, sizeof(*untried));
+    size_t known_count = 0, untried_count = 0;
+    for (size_t i = 0; i < len; i++) {
+        btc_addrman_entry* entry = vector_idx(addrman->entries, i);
+        if (btc_addrman_is_terrible(entry, now) || (entry->last_try && now - entry->last_try < BTC_ADDRMAN_RETRY_DELAY))
+            continue;
+        if (entry->last_success)
+            known[known_count++] = entry;
+        else
+            untried[untried_count++] = entry;
+    }
+    qsort(known, known_count, sizeof(*known), btc_addrman_compare_known);
+    qsort(untried, untried_count, sizeof(*untried), btc_addrman_compare_untried);
+
+    /* keep a share for untried addresses to keep learning about new peers */
+    size_t untried_slots = count / 4;
+    if (untried_slots > untried_count)
+        untried_slots = untried_count;
+    size_t known_take = (count - untried_slots < known_count ? count - untried_slots : known_count);
+    size_t untried_take = (count - known_take < untried_count ? count - known_take : untried_count);
+
+    for (size_t i = 0; i < known_take; i++)
+        vector_add(addrs_out, &known[i]->addr);
+    for (size_t i = 0; i < untried_take; i++)
+        vector_add(addrs_out, &untried[i]->addr);
+
+    btc_free(known);
+    btc_free(untried);
+    return known_take + untried_take;
+}
+
+void btc_addrman_serialize(const btc_addrman* addrman, const unsigned char netmagic[4], cstring* str_out)
+{
+    size_t start = str_out->len;
+    ser_bytes(str_out, netmagic, 4);
+    ser_u32(str_out, BTC_ADDRMAN_FILE_VERSION);
+    ser_varlen(str_out, (uint32_t)addrman->entries->len);
+    for (size_t i = 0; i < addrman->entries->len; i++) {
+        const btc_addrman_entry* entry = vector_idx(addrman->entries, i);
+        ser_u64(str_out, entry->addr.services);
+        ser_bytes(str_out, entry->addr.ip, 16);
+        ser_u16(str_out, entry->addr.port);
+        ser_u32(str_out, entry->addr.time);
+        ser_u64(str_out, entry->last_try);
+        ser_u64(str_out, entry->last_success);
+        ser_u32(str_out, entry->attempts);
+        ser_u32(str_out, entry->successes);
+        ser_u64(str_out, entry->score);
+    }
+
+    /* detects truncated or corrupted files */
+    btc_uint256 checksum;
+    btc_hash((const unsigned char*)str_out->str + start, str_out->len - start, checksum);
+    ser_bytes(str_out, checksum, 4);
+}
+
+btc_bool btc_addrman_deserialize(btc_addrman* addrman, const unsigned char netmagic[4], struct const_buffer* buf, uint64_t now)
+{
+    if (buf->len < 4 + 4 + 1 + 4)
+        return false;
+    btc_uint256 checksum;
+    btc_hash(buf->p, buf->len - 4, checksum);
+    if (memcmp(checksum, (const uint8_t*)buf->p + buf->len - 4, 4) != 0)
+        return false;
+    struct const_buffer records = {buf->p, buf->len - 4};
+
+    unsigned char file_netmagic[4];
+    uint32_t version = 0;
+    uint32_t count = 0;
+    if (!deser_bytes(file_netmagic, &records, 4) || memcmp(file_netmagic, netmagic, 4) != 0 ||
+        !deser_u32(&version, &records) || version > BTC_ADDRMAN_FILE_VERSION ||
+        !deser_varlen(&count, &records) || (uint64_t)count * BTC_ADDRMAN_ENTRY_SIZE > records.len)
+        return false;
+
+    for (uint32_t i = 0; i < count; i++) {
+        btc_addrman_entry record;
+        memset(&record, 0, sizeof(record));
+        if (!deser_u64(&record.addr.services, &records) ||
+            !deser_bytes(record.addr.ip, &records, 16) ||
+            !deser_u16(&record.addr.port, &records) ||
+            !deser_u32(&record.addr.time, &records) ||
+            !deser_u64(&record.last_try, &records) ||
+            !deser_u64(&record.last_success, &records) ||
+            !deser_u32(&record.attempts, &records) ||
+            !deser_u32(&record.successes, &records) ||
+            !deser_u64(&record.score, &records))
+            return false;
+
+        /* stale records are dropped while loading */
+        if (btc_addrman_is_terrible(&record, now) || btc_addrman_find(addrman, &record.addr))
+            continue;
+        btc_addrman_entry* entry = btc_addrman_insert(addrman, &record.addr, now);
+        if (entry)
+            memcpy(entry, &record, sizeof(record));
+    }
+    return true;
+}
+
+btc_bool btc_addrman_load(btc_addrman* addrman, const unsigned char netmagic[4], const char* filename, uint64_t now)
+{
+    FILE* file = fopen(filename, "rb");
+    if (!file)
+        return true;
+
+    btc_bool ret = false;
+    long size = 0;
+    if (fseek(file, 0, SEEK_END) == 0 && (size = ftell(file)) > 0 && fseek(file, 0, SEEK_SET) == 0 &&
+        (size_t)size <= 16 + addrman->max_entries * 2 * BTC_ADDRMAN_ENTRY_SIZE) {
+        uint8_t* data = btc_malloc((size_t)size);
+        if (fread(data, (size_t)size, 1, file) == 1) {
+            struct const_buffer buf = {data, (size_t)size};
+            ret = btc_addrman_deserialize(addrman, netmagic, &buf, now);
+        }
+        btc_free(data);
+    }
+    fclose(file);
+    addrman->dirty = false;
+    return ret;
+}
+
+btc_bool btc_addrman_save(btc_addrman* addrman, const unsigned char netmagic[4], const char* filename)
+{
+    cstring* data = cstr_new_sz(16 + addrman->entries->len * BTC_ADDRMAN_ENTRY_SIZE);
+    btc_addrman_serialize(addrman, netmagic, data);
+
+    /* write to a temporary file and replace the file at once */
+    size_t tmplen = strlen(filename) + 5;
+    char* tmpfile = btc_malloc(tmplen);
+    snprintf(tmpfile, tmplen, "%s.tmp", filename);
+    btc_bool ret = false;
+    FILE* file = fopen(tmpfile, "wb");
+    if (file) {
+        ret = (fwrite(data->str, data->len, 1, file) == 1);
+        ret = (fclose(file) == 0 && ret && rename(tmpfile, filename) == 0);
+    }
+    if (ret)
+        addrman->dirty = false;
+    btc_free(tmpfile);
+    cstr_free(data, true);
+    return ret;
+}
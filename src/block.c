@@ -108,3 +108,27 @@ btc_bool btc_block_header_hash(btc_block_header* header, btc_uint256 hash)
     btc_bool ret = true;
     return ret;
 }
+
+void btc_block_merkle_root(const uint8_t* txids, size_t count, btc_uint256 root_out)
+{
+    if (count == 0) {
+        memset(root_out, 0, sizeof(btc_uint256));
+        return;
+    }
+
+    /* each level is hashed in place, the last hash of an odd level is paired with itself */
+    uint8_t* level = btc_malloc(count * 32);
+    memcpy(level, txids, count * 32);
+    uint8_t pair[64];
+    while (count > 1) {
+        for (size_t i = 0; i < count; i += 2) {
+            memcpy(pair, level + i * 32, 32);
+            memcpy(pair + 32, level + (i + 1 < count ? i + 1 : i) * 32, 32);
+            sha256_Raw(pair, sizeof(pair), level + (i / 2) * 32);
+            sha256_Raw(level + (i / 2) * 32, SHA256_DIGEST_LENGTH, level + (i / 2) * 32);
+        }
+        count = (count + 1) / 2;
+    }
+    memcpy(root_out, level, sizeof(btc_uint256));
+    btc_free(level);
+}
@@ -0,0 +1,85 @@
+/*
+
+ The MIT License (MIT)
+
+ Copyright (c) 2016 Libbtc Developers
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES
+ OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+
+#include <btc/blockchain.h>
+
+/* turn the lowest '1' bit in the binary representation of a number into a '0' */
+static inline uint32_t invert_lowest_one(uint32_t n)
+{
+    return n & (n - 1);
+}
+
+/* compute what height to jump back to with the skip pointer
+   (same distribution as Bitcoin Core's CBlockIndex::pskip) */
+static inline uint32_t get_skip_height(uint32_t height)
+{
+    if (height < 2)
+        return 0;
+
+    /* determine which height to jump back to. Any number strictly lower than height is acceptable,
+       but the following expression seems to perform well in simulations (max 110 steps to go back
+       up to 2**18 blocks) */
+    return (height & 1) ? invert_lowest_one(invert_lowest_one(height - 1)) + 1 : invert_lowest_one(height);
+}
+
+void btc_blockindex_build_skip(btc_blockindex* pindex, uint32_t lowest_height)
+{
+    if (!pindex)
+        return;
+
+    pindex->skip = NULL;
+    uint32_t skip_height = get_skip_height(pindex->height);
+    if (pindex->prev && skip_height >= lowest_height)
+        pindex->skip = btc_blockindex_get_ancestor(pindex->prev, skip_height);
+}
+
+btc_blockindex* btc_blockindex_get_ancestor(btc_blockindex* pindex, uint32_t height)
+{
+    if (!pindex || height > pindex->height)
+        return NULL;
+
+    btc_blockindex* walk = pindex;
+    uint32_t height_walk = pindex->height;
+    while (height_walk > height) {
+        uint32_t height_skip = get_skip_height(height_walk);
+        uint32_t height_skip_prev = get_skip_height(height_walk - 1);
+        if (walk->skip != NULL &&
+            (height_skip == height ||
+             (height_skip > height && !(height_skip_prev + 2 < height_skip && height_skip_prev >= height)))) {
+            /* only follow the skip pointer if prev->skip isn't better than skip->prev */
+            walk = walk->skip;
+            height_walk = height_skip;
+        } else {
+            if (!walk->prev) {
+                /* reached the bottom of the in-memory chain (checkpoint start or pruned) */
+                return NULL;
+            }
+            walk = walk->prev;
+            height_walk--;
+        }
+    }
+    return walk;
+}
@@ -0,0 +1,272 @@
+/*
+
+ The MIT License (MIT)
+
+ Copyright (c) 2016 libbtc developers
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES
+ OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <btc/blockfilter.h>
+
+#include <btc/hash.h>
+#include <btc/serialize.h>
+
+#define SIPROUND                                            \
+    do {                                                    \
+        v0 += v1; v1 = ROTL64(v1, 13); v1 ^= v0; v0 = ROTL64(v0, 32); \
+        v2 += v3; v3 = ROTL64(v3, 16); v3 ^= v2;            \
+        v0 += v3; v3 = ROTL64(v3, 21); v3 ^= v0;            \
+        v2 += v1; v1 = ROTL64(v1, 17); v1 ^= v2; v2 = ROTL64(v2, 32); \
+    } while (0)
+
+#define ROTL64(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+static uint64_t read_le64(const uint8_t* p)
+{
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; i--)
+        v = (v << 8) | p[i];
+    return v;
+}
+
+uint64_t btc_siphash(uint64_t k0, uint64_t k1, const uint8_t* data, size_t len)
+{
+    uint64_t v0 = 0x736f6d6570736575ULL ^ k0;
+    uint64_t v1 = 0x646f72616e646f6dULL ^ k1;
+    uint64_t v2 = 0x6c7967656e657261ULL ^ k0;
+    uint64_t v3 = 0x7465646279746573ULL ^ k1;
+
+    size_t blocks = len / 8;
+    for (size_t i = 0; i < blocks; i++) {
+        uint64_t m = read_le64(data + i * 8);
+        v3 ^= m;
+        SIPROUND;
+        SIPROUND;
+        v0 ^= m;
+    }
+
+    /* last block with the length in the top byte */
+    uint64_t b = ((uint64_t)len) << 56;
+    const uint8_t* tail = data + blocks * 8;
+    for (size_t i = 0; i < (len & 7); i++)
+        b |= ((uint64_t)tail[i]) << (8 * i);
+    v3 ^= b;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= b;
+
+    v2 ^= 0xff;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+/* the high 64 bits of a 64x64 bit multiplication */
+static uint64_t mul_high64(uint64_t a, uint64_t b)
+{
+    uint64_t a_lo = (uint32_t)a, a_hi = a >> 32;
+    uint64_t b_lo = (uint32_t)b, b_hi = b >> 32;
+    uint64_t lo_lo = a_lo * b_lo;
+    uint64_t hi_lo = a_hi * b_lo;
+    uint64_t lo_hi = a_lo * b_hi;
+    uint64_t hi_hi = a_hi * b_hi;
+    uint64_t cross = (lo_lo >> 32) + (uint32_t)hi_lo + lo_hi;
+    return hi_hi + (hi_lo >> 32) + (cross >> 32);
+}
+
+/* map an element uniformly to [0, range) */
+static uint64_t blockfilter_hash_to_range(const btc_uint256 block_hash, uint64_t range, const uint8_t* element, size_t element_len)
+{
+    /* the key are the first 16 bytes of the block hash */
+    uint64_t hash = btc_siphash(read_le64(block_hash), read_le64(block_hash + 8), element, element_len);
+    return mul_high64(hash, range);
+}
+
+static int blockfilter_cmp_u64(const void* a, const void* b)
+{
+    uint64_t va = *(const uint64_t*)a, vb = *(const uint64_t*)b;
+    return (va > vb) - (va < vb);
+}
+
+/* sorted and deduplicated hashed values of the elements, returns the amount of values */
+static size_t blockfilter_hashed_set(const btc_uint256 block_hash, uint64_t range, const vector* elements, uint64_t* values)
+{
+    size_t count = 0;
+    for (size_t i = 0; i < elements->len; i++) {
+        const cstring* element = vector_idx(elements, i);
+        values[count++] = blockfilter_hash_to_range(block_hash, range, (const uint8_t*)element->str, element->len);
+    }
+    qsort(values, count, sizeof(uint64_t), blockfilter_cmp_u64);
+
+    size_t unique = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (unique == 0 || values[unique - 1] != values[i])
+            values[unique++] = values[i];
+    }
+    return unique;
+}
+
+/* msb first bit stream */
+typedef struct blockfilter_bitreader_ {
+    const uint8_t* p;
+    size_t len;
+    size_t pos; /* in bits */
+} blockfilter_bitreader;
+
+static btc_bool blockfilter_read_bit(blockfilter_bitreader* reader, uint64_t* bit)
+{
+    if (reader->pos >= reader->len * 8)
+        return false;
+    *bit = (reader->p[reader->pos / 8] >> (7 - (reader->pos % 8))) & 1;
+    reader->pos++;
+    return true;
+}
+
+static btc_bool blockfilter_golomb_decode(blockfilter_bitreader* reader, uint64_t* delta)
+{
+    /* unary coded quotient */
+    uint64_t quotient = 0, bit;
+    for (;;) {
+        if (!blockfilter_read_bit(reader, &bit))
+            return false;
+        if (!bit)
+            break;
+        quotient++;
+    }
+
+    /* P bit remainder */
+    if (reader->pos + BTC_BLOCKFILTER_P > reader->len * 8)
+        return false;
+    uint64_t remainder = 0;
+    for (unsigned int i = 0; i < BTC_BLOCKFILTER_P; i++) {
+        blockfilter_read_bit(reader, &bit);
+        remainder = (remainder << 1) | bit;
+    }
+    *delta = (quotient << BTC_BLOCKFILTER_P) | remainder;
+    return true;
+}
+
+static void blockfilter_write_bits(cstring* s, uint8_t* acc, unsigned int* acc_bits, uint64_t value, unsigned int bits)
+{
+    while (bits > 0) {
+        bits--;
+        *acc = (uint8_t)((*acc << 1) | ((value >> bits) & 1));
+        if (++(*acc_bits) == 8) {
+            cstr_append_buf(s, acc, 1);
+            *acc = 0;
+            *acc_bits = 0;
+        }
+    }
+}
+
+void btc_blockfilter_build(const btc_uint256 block_hash, const vector* elements, cstring* filter_out)
+{
+    uint64_t* values = btc_malloc((elements->len + 1) * sizeof(uint64_t));
+    /* N is needed for the range, duplicates are removed afterwards */
+    size_t count = blockfilter_hashed_set(block_hash, (uint64_t)elements->len * BTC_BLOCKFILTER_M, elements, values);
+    if (count != elements->len)
+        count = blockfilter_hashed_set(block_hash, (uint64_t)count * BTC_BLOCKFILTER_M, elements, values);
+
+    ser_varlen(filter_out, (uint32_t)count);
+
+    uint8_t acc = 0;
+    unsigned int acc_bits = 0;
+    uint64_t last = 0;
+    for (size_t i = 0; i < count; i++) {
+        uint64_t delta = values[i] - last;
+        last = values[i];
+
+        /* quotient as unary (ones terminated by a zero), then the P bit remainder */
+        for (uint64_t q = delta >> BTC_BLOCKFILTER_P; q > 0; q--)
+            blockfilter_write_bits(filter_out, &acc, &acc_bits, 1, 1);
+        blockfilter_write_bits(filter_out, &acc, &acc_bits, 0, 1);
+        blockfilter_write_bits(filter_out, &acc, &acc_bits, delta, BTC_BLOCKFILTER_P);
+    }
+    if (acc_bits > 0) {
+        acc = (uint8_t)(acc << (8 - acc_bits));
+        cstr_append_buf(filter_out, &acc, 1);
+    }
+    btc_free(values);
+}
+
+/* intersect the sorted values with the coded set */
+static btc_bool blockfilter_match_sorted(const uint8_t* filter, size_t filter_len, uint32_t n, const uint64_t* values, size_t count, size_t offset)
+{
+    blockfilter_bitreader reader = {filter + offset, filter_len - offset, 0};
+    uint64_t value = 0;
+    size_t pos = 0;
+    for (uint32_t i = 0; i < n && pos < count; i++) {
+        uint64_t delta;
+        if (!blockfilter_golomb_decode(&reader, &delta))
+            return false;
+        value += delta;
+
+        /* skip the query values below the current set value */
+        while (pos < count && values[pos] < value)
+            pos++;
+        if (pos < count && values[pos] == value)
+            return true;
+    }
+    return false;
+}
+
+btc_bool btc_blockfilter_match_any(const btc_uint256 block_hash, const uint8_t* filter, size_t filter_len, const vector* elements)
+{
+    struct const_buffer buf = {filter, filter_len};
+    uint32_t n;
+    if (!deser_varlen(&n, &buf) || n == 0 || elements->len == 0)
+        return false;
+
+    uint64_t* values = btc_malloc(elements->len * sizeof(uint64_t));
+    size_t count = blockfilter_hashed_set(block_hash, (uint64_t)n * BTC_BLOCKFILTER_M, elements, values);
+    btc_bool match = blockfilter_match_sorted(filter, filter_len, n, values, count, filter_len - buf.len);
+    btc_free(values);
+    return match;
+}
+
+btc_bool btc_blockfilter_match(const btc_uint256 block_hash, const uint8_t* filter, size_t filter_len, const uint8_t* element, size_t element_len)
+{
+    struct const_buffer buf = {filter, filter_len};
+    uint32_t n;
+    if (!deser_varlen(&n, &buf) || n == 0)
+        return false;
+
+    uint64_t value = blockfilter_hash_to_range(block_hash, (uint64_t)n * BTC_BLOCKFILTER_M, element, element_len);
+    return blockfilter_match_sorted(filter, filter_len, n, &value, 1, filter_len - buf.len);
+}
+
+void btc_blockfilter_hash(const uint8_t* filter, size_t filter_len, btc_uint256 hash_out)
+{
+    btc_hash(filter, filter_len, hash_out);
+}
+
+void btc_blockfilter_header(const btc_uint256 filter_hash, const btc_uint256 prev_header, btc_uint256 header_out)
+{
+    uint8_t data[BTC_HASH_LENGTH * 2];
+    memcpy(data, filter_hash, BTC_HASH_LENGTH);
+    memcpy(data + BTC_HASH_LENGTH, prev_header, BTC_HASH_LENGTH);
+    btc_hash(data, sizeof(data), header_out);
+}
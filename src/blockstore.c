@@ -0,0 +1,433 @@
+/*
+
+ The MIT License (MIT)
+
+ Copyright (c) 2016 libbtc developers
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES
+ OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+
+#include <btc/blockstore.h>
+
+#include <btc/cstr.h>
+#include <btc/serialize.h>
+#include <btc/utils.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <search.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifndef WIN32
+#include <sys/mman.h>
+#endif
+
+static int btc_blockstore_entry_compare(const void *l, const void *r)
+{
+    const btc_blockstore_entry *el = l;
+    const btc_blockstore_entry *er = r;
+    return memcmp(el->hash, er->hash, sizeof(btc_uint256));
+}
+
+/* all entries at a height */
+typedef struct btc_blockstore_height_bucket_
+{
+    uint32_t height;
+    vector *entries;
+} btc_blockstore_height_bucket;
+
+static int btc_blockstore_height_bucket_compare(const void *l, const void *r)
+{
+    const btc_blockstore_height_bucket *bl = l;
+    const btc_blockstore_height_bucket *br = r;
+    return (bl->height < br->height ? -1 : (bl->height > br->height ? 1 : 0));
+}
+
+static void btc_blockstore_height_bucket_free(void *obj)
+{
+    btc_blockstore_height_bucket *bucket = obj;
+    vector_free(bucket->entries, true);
+    btc_free(bucket);
+}
+
+static btc_blockstore_height_bucket* btc_blockstore_height_bucket_find(btc_blockstore *store, uint32_t height)
+{
+    btc_blockstore_height_bucket search;
+    search.height = height;
+    void *node = tfind(&search, &store->height_tree, btc_blockstore_height_bucket_compare);
+    return (node ? *(btc_blockstore_height_bucket **)node : NULL);
+}
+
+static void btc_blockstore_file_path(const btc_blockstore *store, uint32_t file, cstring *path_out)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "/blk%05u.dat", file);
+    cstr_resize(path_out, 0);
+    cstr_append_buf(path_out, store->dir->str, store->dir->len);
+    cstr_append_buf(path_out, name, strlen(name));
+}
+
+btc_blockstore* btc_blockstore_new(const btc_chainparams *chain)
+{
+    btc_blockstore *store = btc_calloc(1, sizeof(*store));
+    store->chain = chain;
+    store->entries = vector_new(1024, btc_free);
+    store->hash_tree = NULL;
+    store->height_tree = NULL;
+    store->max_file_size = BTC_BLOCKSTORE_DEFAULT_FILE_SIZE;
+    return store;
+}
+
+static void btc_blockstore_unmap(btc_blockstore *store)
+{
+    if (!store->map)
+        return;
+#ifdef WIN32
+    btc_free(store->map);
+#else
+    munmap(store->map, store->map_len);
+#endif
+    store->map = NULL;
+    store->map_len = 0;
+}
+
+void btc_blockstore_free(btc_blockstore *store)
+{
+    if (!store)
+        return;
+
+    btc_blockstore_unmap(store);
+    if (store->current)
+        fclose(store->current);
+    /* the entries are owned by the vector */
+    btc_btree_tdestroy(store->hash_tree, NULL);
+    btc_btree_tdestroy(store->height_tree, btc_blockstore_height_bucket_free);
+    vector_free(store->entries, true);
+    if (store->dir)
+        cstr_free(store->dir, true);
+    btc_free(store);
+}
+
+static void btc_blockstore_add_entry(btc_blockstore *store, const btc_uint256 hash, uint32_t height, uint32_t file, uint64_t offset, uint32_t len)
+{
+    btc_blockstore_entry *entry = btc_calloc(1, sizeof(*entry));
+    memcpy(entry->hash, hash, sizeof(btc_uint256));
+    entry->height = height;
+    entry->file = file;
+    entry->offset = offset;
+    entry->len = len;
+    vector_add(store->entries, entry);
+    tsearch(entry, &store->hash_tree, btc_blockstore_entry_compare);
+
+    btc_blockstore_height_bucket *bucket = btc_blockstore_height_bucket_find(store, height);
+    if (!bucket) {
+        bucket = btc_calloc(1, sizeof(*bucket));
+        bucket->height = height;
+        bucket->entries = vector_new(1, NULL);
+        tsearch(bucket, &store->height_tree, btc_blockstore_height_bucket_compare);
+    }
+    vector_add(bucket->entries, entry);
+}
+
+static void btc_blockstore_remove_entry(btc_blockstore *store, btc_blockstore_entry *entry)
+{
+    tdelete(entry, &store->hash_tree, btc_blockstore_entry_compare);
+
+    btc_blockstore_height_bucket *bucket = btc_blockstore_height_bucket_find(store, entry->height);
+    if (!bucket)
+        return;
+    vector_remove(bucket->entries, entry);
+    if (bucket->entries->len == 0) {
+        tdelete(bucket, &store->height_tree, btc_blockstore_height_bucket_compare);
+        btc_blockstore_height_bucket_free(bucket);
+    }
+}
+
+/* index the records of a block file and get the size of its complete records (a torn write ends the scan),
+   returns false if the file belongs to a different network */
+static btc_bool btc_blockstore_scan_file(btc_blockstore *store, uint32_t file, const char *path, uint64_t *size_out)
+{
+    *size_out = 0;
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        return true;
+
+    fseek(f, 0, SEEK_END);
+    uint64_t file_size = (uint64_t)ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    uint64_t offset = 0;
+    uint8_t hdr[BTC_BLOCKSTORE_RECORD_HDR_SIZE];
+    while (offset + BTC_BLOCKSTORE_RECORD_HDR_SIZE <= file_size)
+    {
+        if (fseek(f, (long)offset, SEEK_SET) != 0 || fread(hdr, sizeof(hdr), 1, f) != 1)
+            break;
+        struct const_buffer buf = {hdr, sizeof(hdr)};
+        uint8_t magic[4];
+        uint32_t height, len;
+        btc_uint256 hash;
+        if (!deser_bytes(magic, &buf, 4))
+            break;
+        if (memcmp(magic, store->chain->netmagic, 4) != 0) {
+            if (offset > 0)
+                break;
+            fclose(f);
+            return false;
+        }
+        if (!deser_u32(&height, &buf) || !deser_u32(&len, &buf) || !deser_u256(hash, &buf))
+            break;
+        if (offset + BTC_BLOCKSTORE_RECORD_HDR_SIZE + len > file_size)
+            break;
+        btc_blockstore_add_entry(store, hash, height, file, offset + BTC_BLOCKSTORE_RECORD_HDR_SIZE, len);
+        offset += BTC_BLOCKSTORE_RECORD_HDR_SIZE + len;
+    }
+    fclose(f);
+    *size_out = offset;
+    return true;
+}
+
+btc_bool btc_blockstore_open(btc_blockstore *store, const char *dir)
+{
+#ifdef WIN32
+    if (mkdir(dir) != 0 && errno != EEXIST)
+#else
+    if (mkdir(dir, 0700) != 0 && errno != EEXIST)
+#endif
+        return false;
+
+    /* the block files are numbered without gaps (pruning deletes the oldest ones) */
+    DIR *d = opendir(dir);
+    if (!d)
+        return false;
+    btc_bool found = false;
+    uint32_t first = 0, last = 0;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL)
+    {
+        unsigned int n;
+        char tail;
+        if (strlen(de->d_name) != 12 || sscanf(de->d_name, "blk%5u.da%c", &n, &tail) != 2 || tail != 't')
+            continue;
+        if (!found || n < first)
+            first = n;
+        if (!found || n > last)
+            last = n;
+        found = true;
+    }
+    closedir(d);
+
+    store->dir = cstr_new(dir);
+    store->first_file = first;
+    store->current_file = last;
+    cstring *path = cstr_new_sz(strlen(dir) + 16);
+    for (uint32_t file = first; found && file <= last; file++)
+    {
+        btc_blockstore_file_path(store, file, path);
+        uint64_t size;
+        if (!btc_blockstore_scan_file(store, file, path->str, &size))
+        {
+            cstr_free(path, true);
+            return false;
+        }
+        store->total_bytes += size;
+        if (file == last)
+        {
+            /* discard a record that has not been written completely */
+            struct stat st;
+            if (stat(path->str, &st) == 0 && (uint64_t)st.st_size > size && truncate(path->str, (off_t)size) != 0)
+            {
+                cstr_free(path, true);
+                return false;
+            }
+            store->current_size = size;
+        }
+    }
+
+    btc_blockstore_file_path(store, store->current_file, path);
+    store->current = fopen(path->str, "ab");
+    cstr_free(path, true);
+    return (store->current != NULL);
+}
+
+const btc_blockstore_entry* btc_blockstore_find(btc_blockstore *store, const btc_uint256 hash)
+{
+    btc_blockstore_entry search;
+    memcpy(search.hash, hash, sizeof(btc_uint256));
+    void *node = tfind(&search, &store->hash_tree, btc_blockstore_entry_compare);
+    return (node ? *(btc_blockstore_entry **)node : NULL);
+}
+
+size_t btc_blockstore_find_height(btc_blockstore *store, uint32_t height, vector *entries_out)
+{
+    btc_blockstore_height_bucket *bucket = btc_blockstore_height_bucket_find(store, height);
+    if (!bucket)
+        return 0;
+    for (size_t i = 0; i < bucket->entries->len; i++)
+        vector_add(entries_out, vector_idx(bucket->entries, i));
+    return bucket->entries->len;
+}
+
+btc_bool btc_blockstore_put(btc_blockstore *store, const btc_uint256 hash, uint32_t height, const uint8_t *block, size_t len)
+{
+    if (!store->current || btc_blockstore_find(store, hash))
+        return false;
+
+    if (store->current_size > 0 && store->current_size + BTC_BLOCKSTORE_RECORD_HDR_SIZE + len > store->max_file_size)
+    {
+        /* start the next block file */
+        cstring *path = cstr_new_sz(store->dir->len + 16);
+        btc_blockstore_file_path(store, store->current_file + 1, path);
+        FILE *next = fopen(path->str, "ab");
+        cstr_free(path, true);
+        if (!next)
+            return false;
+        fclose(store->current);
+        store->current = next;
+        store->current_file++;
+        store->current_size = 0;
+    }
+
+    cstring *record = cstr_new_sz(BTC_BLOCKSTORE_RECORD_HDR_SIZE);
+    ser_bytes(record, store->chain->netmagic, 4);
+    ser_u32(record, height);
+    ser_u32(record, (uint32_t)len);
+    ser_u256(record, hash);
+    btc_bool ok = (fwrite(record->str, record->len, 1, store->current) == 1 && fwrite(block, len, 1, store->current) == 1);
+    cstr_free(record, true);
+    /* readers map the file */
+    if (fflush(store->current) != 0 || !ok)
+        return false;
+
+    btc_blockstore_add_entry(store, hash, height, store->current_file, store->current_size + BTC_BLOCKSTORE_RECORD_HDR_SIZE, (uint32_t)len);
+    store->current_size += BTC_BLOCKSTORE_RECORD_HDR_SIZE + len;
+    store->total_bytes += BTC_BLOCKSTORE_RECORD_HDR_SIZE + len;
+    btc_blockstore_prune(store);
+    return true;
+}
+
+static btc_bool btc_blockstore_map(btc_blockstore *store, uint32_t file)
+{
+    btc_blockstore_unmap(store);
+    cstring *path = cstr_new_sz(store->dir->len + 16);
+    btc_blockstore_file_path(store, file, path);
+#ifdef WIN32
+    FILE *f = fopen(path->str, "rb");
+    cstr_free(path, true);
+    if (!f)
+        return false;
+    fseek(f, 0, SEEK_END);
+    size_t size = (size_t)ftell(f);
+    fseek(f, 0, SEEK_SET);
+    store->map = btc_malloc(size > 0 ? size : 1);
+    if (size > 0 && fread(store->map, size, 1, f) != 1) {
+        fclose(f);
+        btc_blockstore_unmap(store);
+        return false;
+    }
+    fclose(f);
+#else
+    int fd = open(path->str, O_RDONLY);
+    cstr_free(path, true);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return false;
+    }
+    size_t size = (size_t)st.st_size;
+    void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return false;
+    store->map = map;
+#endif
+    store->map_len = size;
+    store->map_file = file;
+    return true;
+}
+
+btc_bool btc_blockstore_get(btc_blockstore *store, const btc_uint256 hash, const uint8_t **block_out, size_t *len_out)
+{
+    const btc_blockstore_entry *entry = btc_blockstore_find(store, hash);
+    if (!entry)
+        return false;
+
+    /* the file being written grows, map it again to see the appended blocks */
+    if (!store->map || store->map_file != entry->file || entry->offset + entry->len > store->map_len) {
+        if (!btc_blockstore_map(store, entry->file) || entry->offset + entry->len > store->map_len)
+            return false;
+    }
+    *block_out = store->map + entry->offset;
+    *len_out = entry->len;
+    return true;
+}
+
+void btc_blockstore_set_retention(btc_blockstore *store, uint32_t keep_from_height, uint64_t max_bytes)
+{
+    store->keep_from_height = keep_from_height;
+    store->max_bytes = max_bytes;
+    btc_blockstore_prune(store);
+}
+
+void btc_blockstore_prune(btc_blockstore *store)
+{
+    cstring *path = NULL;
+    while (store->first_file < store->current_file)
+    {
+        /* the entries of the oldest file are at the front */
+        size_t count = 0;
+        uint64_t bytes = 0;
+        btc_bool below_height = true;
+        while (count < store->entries->len)
+        {
+            btc_blockstore_entry *entry = vector_idx(store->entries, count);
+            if (entry->file != store->first_file)
+                break;
+            if (entry->height >= store->keep_from_height)
+                below_height = false;
+            bytes += BTC_BLOCKSTORE_RECORD_HDR_SIZE + entry->len;
+            count++;
+        }
+        btc_bool expired = (store->keep_from_height > 0 && below_height);
+        btc_bool over_budget = (store->max_bytes > 0 && store->total_bytes > store->max_bytes);
+        if (!expired && !over_budget)
+            break;
+
+        for (size_t i = 0; i < count; i++)
+            btc_blockstore_remove_entry(store, vector_idx(store->entries, i));
+        vector_remove_range(store->entries, 0, count);
+        if (store->map && store->map_file == store->first_file)
+            btc_blockstore_unmap(store);
+
+        if (!path)
+            path = cstr_new_sz(store->dir->len + 16);
+        btc_blockstore_file_path(store, store->first_file, path);
+        remove(path->str);
+        store->total_bytes -= bytes;
+        store->first_file++;
+    }
+    if (path)
+        cstr_free(path, true);
+}
@@ -0,0 +1,374 @@
+/*
+
+ The MIT License (MIT)
+
+ Copyright (c) 2016 libbtc developers
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES
+ OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <btc/bloom.h>
+
+#include <btc/hash.h>
+#include <btc/serialize.h>
+
+static const double LN2SQUARED = 0.4804530139182014246671025263266649717305529515945455;
+static const double LN2 = 0.6931471805599453094172321214581765680755001343602552;
+
+#define ROTL32(x, r) (uint32_t)(((x) << (r)) | ((x) >> (32 - (r))))
+
+uint32_t btc_murmur3(uint32_t seed, const uint8_t* data, size_t len)
+{
+    const uint32_t c1 = 0xcc9e2d51;
+    const uint32_t c2 = 0x1b873593;
+    uint32_t h1 = seed;
+    size_t nblocks = len / 4;
+
+    for (size_t i = 0; i < nblocks; i++) {
+        const uint8_t* p = data + i * 4;
+        uint32_t k1 = (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+        k1 *= c1;
+        k1 = ROTL32(k1, 15);
+        k1 *= c2;
+        h1 ^= k1;
+        h1 = ROTL32(h1, 13);
+        h1 = h1 * 5 + 0xe6546b64;
+    }
+
+    const uint8_t* tail = data + nblocks * 4;
+    uint32_t k1 = 0;
+    switch (len & 3) {
+    case 3:
+        k1 ^= (uint32_t)tail[2] << 16;
+    /* fall through */
+    case 2:
+        k1 ^= (uint32_t)tail[1] << 8;
+    /* fall through */
+    case 1:
+        k1 ^= tail[0];
+        k1 *= c1;
+        k1 = ROTL32(k1, 15);
+        k1 *= c2;
+        h1 ^= k1;
+    }
+
+    h1 ^= (uint32_t)len;
+    h1 ^= h1 >> 16;
+    h1 *= 0x85ebca6b;
+    h1 ^= h1 >> 13;
+    h1 *= 0xc2b2ae35;
+    h1 ^= h1 >> 16;
+    return h1;
+}
+
+/* natural logarithm for the filter sizing (0 < x), avoids linking libm */
+static double btc_bloom_ln(double x)
+{
+    int exp2 = 0;
+    while (x > 1.5) {
+        x /= 2;
+        exp2++;
+    }
+    while (x < 0.75) {
+        x *= 2;
+        exp2--;
+    }
+    /* ln(x) = 2 * atanh((x - 1) / (x + 1)) */
+    double y = (x - 1) / (x + 1);
+    double y2 = y * y;
+    double term = y;
+    double sum = 0;
+    for (int i = 1; i < 64; i += 2) {
+        sum += term / i;
+        term *= y2;
+    }
+    return 2 * sum + exp2 * LN2;
+}
+
+btc_bloom_filter* btc_bloom_filter_new(unsigned int n_elements, double fp_rate, uint32_t tweak, uint8_t flags)
+{
+    btc_bloom_filter* filter = btc_calloc(1, sizeof(*filter));
+    if (n_elements == 0)
+        n_elements = 1;
+
+    /* the ideal size for a bloom filter with a given number of elements and false positive rate is:
+       - n_elements * ln(fp_rate) / ln(2)^2, and the ideal number of hash functions is size / n_elements * ln(2) */
+    double bits = -1.0 / LN2SQUARED * n_elements * btc_bloom_ln(fp_rate);
+    if (bits > BTC_BLOOM_MAX_FILTER_SIZE * 8)
+        bits = BTC_BLOOM_MAX_FILTER_SIZE * 8;
+    filter->size = (uint32_t)bits / 8;
+    if (filter->size == 0)
+        filter->size = 1;
+
+    double hash_funcs = filter->size * 8 / (double)n_elements * LN2;
+    if (hash_funcs > BTC_BLOOM_MAX_HASH_FUNCS)
+        hash_funcs = BTC_BLOOM_MAX_HASH_FUNCS;
+    filter->n_hash_funcs = (uint32_t)hash_funcs;
+    if (filter->n_hash_funcs == 0)
+        filter->n_hash_funcs = 1;
+
+    filter->data = btc_calloc(1, filter->size);
+    filter->tweak = tweak;
+    filter->flags = flags;
+    return filter;
+}
+
+void btc_bloom_filter_free(btc_bloom_filter* filter)
+{
+    if (!filter)
+        return;
+    btc_free(filter->data);
+    btc_free(filter);
+}
+
+static uint32_t btc_bloom_filter_bit(const btc_bloom_filter* filter, uint32_t n, const uint8_t* data, size_t len)
+{
+    /* 0xFBA4C795 chosen as it guarantees a reasonable bit difference between n values */
+    return btc_murmur3(n * 0xFBA4C795 + filter->tweak, data, len) % (filter->size * 8);
+}
+
+void btc_bloom_filter_insert(btc_bloom_filter* filter, const uint8_t* data, size_t len)
+{
+    for (uint32_t i = 0; i < filter->n_hash_funcs; i++) {
+        uint32_t bit = btc_bloom_filter_bit(filter, i, data, len);
+        filter->data[bit >> 3] |= (uint8_t)(1 << (7 & bit));
+    }
+}
+
+btc_bool btc_bloom_filter_contains(const btc_bloom_filter* filter, const uint8_t* data, size_t len)
+{
+    for (uint32_t i = 0; i < filter->n_hash_funcs; i++) {
+        uint32_t bit = btc_bloom_filter_bit(filter, i, data, len);
+        if (!(filter->data[bit >> 3] & (1 << (7 & bit))))
+            return false;
+    }
+    return true;
+}
+
+void btc_bloom_filter_serialize(const btc_bloom_filter* filter, cstring* str_out)
+{
+    ser_varlen(str_out, filter->size);
+    ser_bytes(str_out, filter->data, filter->size);
+    ser_u32(str_out, filter->n_hash_funcs);
+    ser_u32(str_out, filter->tweak);
+    ser_bytes(str_out, &filter->flags, 1);
+}
+
+/* partial merkle tree (BIP37)
+   the tree is traversed depth-first, a flag bit per visited node tells if it is a parent of a match,
+   the hashes of the subtrees without matches (and of the matched leafs) are included */
+
+static uint32_t btc_pmt_width(uint32_t total_tx, int height)
+{
+    return (uint32_t)(((uint64_t)total_tx + (((uint64_t)1) << height) - 1) >> height);
+}
+
+static int btc_pmt_height(uint32_t total_tx)
+{
+    int height = 0;
+    while (btc_pmt_width(total_tx, height) > 1)
+        height++;
+    return height;
+}
+
+/* inner node: double sha256 of the concatenated children, hashed from a single buffer */
+static void btc_pmt_hash_node(const uint8_t* left, const uint8_t* right, btc_uint256 hash_out)
+{
+    uint8_t node[64];
+    memcpy(node, left, 32);
+    memcpy(node + 32, right, 32);
+    btc_hash(node, sizeof(node), hash_out);
+}
+
+static void btc_pmt_calc_hash(btc_uint256* txids, uint32_t total_tx, int height, uint32_t pos, btc_uint256 hash_out)
+{
+    if (height == 0) {
+        memcpy(hash_out, txids[pos], sizeof(btc_uint256));
+        return;
+    }
+    btc_uint256 left, right;
+    btc_pmt_calc_hash(txids, total_tx, height - 1, pos * 2, left);
+    if (pos * 2 + 1 < btc_pmt_width(total_tx, height - 1))
+        btc_pmt_calc_hash(txids, total_tx, height - 1, pos * 2 + 1, right);
+    else
+        memcpy(right, left, sizeof(btc_uint256));
+    btc_pmt_hash_node(left, right, hash_out);
+}
+
+typedef struct btc_pmt_build_ {
+    btc_uint256* txids;
+    const btc_bool* matches;
+    uint32_t total_tx;
+    cstring* hashes;
+    uint32_t hash_count;
+    cstring* flags;
+    uint32_t bits;
+} btc_pmt_build;
+
+static void btc_pmt_build_traverse(btc_pmt_build* b, int height, uint32_t pos)
+{
+    /* is this node the parent of at least one matched txid */
+    btc_bool parent_of_match = false;
+    uint64_t end = ((uint64_t)pos + 1) << height;
+    for (uint64_t p = (uint64_t)pos << height; p < end && p < b->total_tx; p++)
+        parent_of_match |= b->matches[p];
+
+    if (b->bits % 8 == 0)
+        cstr_append_c(b->flags, 0);
+    if (parent_of_match)
+        b->flags->str[b->flags->len - 1] |= (char)(1 << (b->bits % 8));
+    b->bits++;
+
+    if (height == 0 || !parent_of_match) {
+        btc_uint256 hash;
+        btc_pmt_calc_hash(b->txids, b->total_tx, height, pos, hash);
+        ser_u256(b->hashes, hash);
+        b->hash_count++;
+    } else {
+        btc_pmt_build_traverse(b, height - 1, pos * 2);
+        if (pos * 2 + 1 < btc_pmt_width(b->total_tx, height - 1))
+            btc_pmt_build_traverse(b, height - 1, pos * 2 + 1);
+    }
+}
+
+void btc_partial_merkle_tree_build(btc_uint256* txids, const btc_bool* matches, uint32_t total_tx, cstring* str_out)
+{
+    btc_pmt_build b;
+    b.txids = txids;
+    b.matches = matches;
+    b.total_tx = total_tx;
+    b.hashes = cstr_new_sz(64);
+    b.hash_count = 0;
+    b.flags = cstr_new_sz(8);
+    b.bits = 0;
+    if (total_tx > 0)
+        btc_pmt_build_traverse(&b, btc_pmt_height(total_tx), 0);
+
+    ser_u32(str_out, total_tx);
+    ser_varlen(str_out, b.hash_count);
+    cstr_append_buf(str_out, b.hashes->str, b.hashes->len);
+    ser_varlen(str_out, (uint32_t)b.flags->len);
+    cstr_append_buf(str_out, b.flags->str, b.flags->len);
+    cstr_free(b.hashes, true);
+    cstr_free(b.flags, true);
+}
+
+typedef struct btc_pmt_extract_ {
+    uint32_t total_tx;
+    const uint8_t* hashes; /* points into the message */
+    uint32_t hash_count;
+    uint32_t hashes_used;
+    const uint8_t* flags;
+    uint32_t bit_count;
+    uint32_t bits_used;
+    btc_uint256* matches;
+    size_t match_count;
+} btc_pmt_extract;
+
+static btc_bool btc_pmt_extract_traverse(btc_pmt_extract* e, int height, uint32_t pos, btc_uint256 hash_out)
+{
+    if (e->bits_used >= e->bit_count)
+        return false;
+    btc_bool parent_of_match = (e->flags[e->bits_used / 8] >> (e->bits_used % 8)) & 1;
+    e->bits_used++;
+
+    if (height == 0 || !parent_of_match) {
+        /* leaf or a subtree without matches, use the included hash */
+        if (e->hashes_used >= e->hash_count)
+            return false;
+        memcpy(hash_out, e->hashes + (size_t)e->hashes_used * 32, sizeof(btc_uint256));
+        e->hashes_used++;
+        if (height == 0 && parent_of_match)
+            memcpy(e->matches[e->match_count++], hash_out, sizeof(btc_uint256));
+        return true;
+    }
+
+    btc_uint256 left, right;
+    if (!btc_pmt_extract_traverse(e, height - 1, pos * 2, left))
+        return false;
+    if (pos * 2 + 1 < btc_pmt_width(e->total_tx, height - 1)) {
+        if (!btc_pmt_extract_traverse(e, height - 1, pos * 2 + 1, right))
+            return false;
+        /* the subtrees cover different txids and can never be identical (CVE-2012-2459) */
+        if (memcmp(left, right, sizeof(btc_uint256)) == 0)
+            return false;
+    } else {
+        memcpy(right, left, sizeof(btc_uint256));
+    }
+    btc_pmt_hash_node(left, right, hash_out);
+    return true;
+}
+
+btc_bool btc_partial_merkle_tree_extract(struct const_buffer* buf, btc_uint256 merkle_root_out, btc_uint256** matches_out, size_t* match_count_out)
+{
+    btc_pmt_extract e;
+    memset(&e, 0, sizeof(e));
+    *matches_out = NULL;
+    *match_count_out = 0;
+
+    uint32_t flag_bytes;
+    if (!deser_u32(&e.total_tx, buf) || !deser_varlen(&e.hash_count, buf))
+        return false;
+    if (e.total_tx == 0 || e.total_tx > BTC_MAX_BLOCK_TRANSACTIONS || e.hash_count > e.total_tx || buf->len < (size_t)e.hash_count * 32)
+        return false;
+    e.hashes = buf->p;
+    deser_skip(buf, (size_t)e.hash_count * 32);
+    if (!deser_varlen(&flag_bytes, buf) || buf->len < flag_bytes)
+        return false;
+    e.flags = buf->p;
+    e.bit_count = flag_bytes * 8;
+    deser_skip(buf, flag_bytes);
+    /* there must be at least one bit per included hash */
+    if (e.bit_count < e.hash_count)
+        return false;
+
+    e.matches = btc_malloc((e.hash_count > 0 ? e.hash_count : 1) * sizeof(btc_uint256));
+    if (!btc_pmt_extract_traverse(&e, btc_pmt_height(e.total_tx), 0, merkle_root_out) ||
+        (e.bits_used + 7) / 8 != flag_bytes || e.hashes_used != e.hash_count) {
+        /* invalid tree or not all hashes and flag bytes consumed */
+        btc_free(e.matches);
+        return false;
+    }
+
+    *matches_out = e.matches;
+    *match_count_out = e.match_count;
+    return true;
+}
+
+btc_bool btc_merkleblock_deser(btc_block_header* header, btc_uint256** matches_out, size_t* match_count_out, struct const_buffer* buf)
+{
+    btc_uint256 merkle_root;
+    *matches_out = NULL;
+    *match_count_out = 0;
+    if (!btc_block_header_deserialize(header, buf))
+        return false;
+    if (!btc_partial_merkle_tree_extract(buf, merkle_root, matches_out, match_count_out))
+        return false;
+    if (memcmp(merkle_root, header->merkle_root, sizeof(btc_uint256)) != 0) {
+        btc_free(*matches_out);
+        *matches_out = NULL;
+        *match_count_out = 0;
+        return false;
+    }
+    return true;
+}
@@ -37,7 +37,7 @@ const btc_chainparams btc_chainparams_main = {
     {0xf9, 0xbe, 0xb4, 0xd9},
     {0x6f, 0xe2, 0x8c, 0x0a, 0xb6, 0xf1, 0xb3, 0x72, 0xc1, 0xa6, 0xa2, 0x46, 0xae, 0x63, 0xf7, 0x4f, 0x93, 0x1e, 0x83, 0x65, 0xe1, 0x5a, 0x08, 0x9c, 0x68, 0xd6, 0x19, 0x00, 0x00, 0x00, 0x00, 0x00},
     8333,
-    {{"seed.bitcoin.jonasschnelli.ch"}, 0},
+    {{"seed.bitcoin.jonasschnelli.ch"}, {"seed.bitcoin.sipa.be"}, {"dnsseed.bluematt.me"}, {"dnsseed.bitcoin.dashjr.org"}, {"seed.bitcoinstats.com"}, {"seed.btc.petertodd.org"}, {0}},
 };
 const btc_chainparams btc_chainparams_test = {
     "testnet3",
@@ -50,7 +50,7 @@ const btc_chainparams btc_chainparams_test = {
     {0x0b, 0x11, 0x09, 0x07},
     {0x43, 0x49, 0x7f, 0xd7, 0xf8, 0x26, 0x95, 0x71, 0x08, 0xf4, 0xa3, 0x0f, 0xd9, 0xce, 0xc3, 0xae, 0xba, 0x79, 0x97, 0x20, 0x84, 0xe9, 0x0e, 0xad, 0x01, 0xea, 0x33, 0x09, 0x00, 0x00, 0x00, 0x00},
     18333,
-    {{"testnet-seed.bitcoin.jonasschnelli.ch"}, 0},
+    {{"testnet-seed.bitcoin.jonasschnelli.ch"}, {"seed.tbtc.petertodd.org"}, {"testnet-seed.bluematt.me"}, {0}},
 };
 const btc_chainparams btc_chainparams_regtest = {
     "regtest",
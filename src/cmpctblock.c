@@ -0,0 +1,337 @@
+/*
+
+ The MIT License (MIT)
+
+ Copyright (c) 2016 libbtc developers
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES
+ OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <btc/cmpctblock.h>
+
+#include <btc/blockfilter.h>
+#include <btc/hash.h>
+#include <btc/serialize.h>
+#include <btc/sha2.h>
+#include <btc/tx.h>
+
+/* length, txid and wtxid of a serialized tx */
+static btc_bool btc_cmpct_tx_parse(const uint8_t* data, size_t len, size_t* consumed, btc_uint256 txid, btc_uint256 wtxid)
+{
+    btc_tx* tx = btc_tx_new();
+    *consumed = 0;
+    btc_bool valid = btc_tx_deserialize(data, len, tx, consumed, true);
+    if (valid) {
+        if (txid)
+            btc_tx_hash(tx, txid);
+        /* the tx is relayed with its witness, the wtxid is the hash of the serialization */
+        if (wtxid)
+            btc_hash(data, *consumed, wtxid);
+    }
+    btc_tx_free(tx);
+    return valid;
+}
+
+btc_cmpct_txpool* btc_cmpct_txpool_new(size_t max_size)
+{
+    btc_cmpct_txpool* pool = btc_calloc(1, sizeof(*pool));
+    pool->entries = btc_calloc(max_size, sizeof(btc_cmpct_txpool_entry));
+    pool->max_size = max_size;
+    return pool;
+}
+
+void btc_cmpct_txpool_free(btc_cmpct_txpool* pool)
+{
+    if (!pool)
+        return;
+    for (size_t i = 0; i < pool->size; i++)
+        cstr_free(pool->entries[i].tx, true);
+    btc_free(pool->entries);
+    btc_free(pool);
+}
+
+btc_bool btc_cmpct_txpool_add(btc_cmpct_txpool* pool, const uint8_t* tx, size_t len)
+{
+    btc_uint256 txid, wtxid;
+    size_t consumed;
+    if (pool->max_size == 0 || !btc_cmpct_tx_parse(tx, len, &consumed, txid, wtxid))
+        return false;
+    for (size_t i = 0; i < pool->size; i++) {
+        if (btc_hash_equal(pool->entries[i].wtxid, wtxid))
+            return false;
+    }
+
+    btc_cmpct_txpool_entry* entry;
+    if (pool->size < pool->max_size) {
+        entry = &pool->entries[pool->size++];
+    } else {
+        entry = &pool->entries[pool->next];
+        pool->next = (pool->next + 1) % pool->max_size;
+        cstr_free(entry->tx, true);
+    }
+    memcpy(entry->txid, txid, sizeof(btc_uint256));
+    memcpy(entry->wtxid, wtxid, sizeof(btc_uint256));
+    entry->tx = cstr_new_buf(tx, consumed);
+    return true;
+}
+
+btc_bool btc_cmpct_txpool_contains(const btc_cmpct_txpool* pool, const btc_uint256 txid)
+{
+    for (size_t i = 0; i < pool->size; i++) {
+        if (memcmp(pool->entries[i].txid, txid, sizeof(btc_uint256)) == 0)
+            return true;
+    }
+    return false;
+}
+
+static uint64_t read_le64(const uint8_t* p)
+{
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; i--)
+        v = (v << 8) | p[i];
+    return v;
+}
+
+uint64_t btc_cmpctblock_shortid(uint64_t k0, uint64_t k1, const btc_uint256 wtxid)
+{
+    return btc_siphash(k0, k1, wtxid, sizeof(btc_uint256)) & 0xffffffffffffULL;
+}
+
+void btc_cmpctblock_shortid_keys(const btc_block_header* header, uint64_t nonce, uint64_t* k0, uint64_t* k1)
+{
+    cstring* s = cstr_new_sz(88);
+    btc_block_header_serialize(s, header);
+    ser_u64(s, nonce);
+    uint8_t hash[SHA256_DIGEST_LENGTH];
+    sha256_Raw((const uint8_t*)s->str, s->len, hash);
+    cstr_free(s, true);
+    *k0 = read_le64(hash);
+    *k1 = read_le64(hash + 8);
+}
+
+btc_cmpctblock* btc_cmpctblock_new()
+{
+    return btc_calloc(1, sizeof(btc_cmpctblock));
+}
+
+void btc_cmpctblock_free(btc_cmpctblock* cb)
+{
+    if (!cb)
+        return;
+    for (uint32_t i = 0; i < cb->tx_count; i++) {
+        if (cb->txs[i])
+            cstr_free(cb->txs[i], true);
+    }
+    btc_free(cb->txs);
+    btc_free(cb);
+}
+
+typedef struct btc_cmpct_slot_ {
+    uint64_t shortid;
+    uint32_t pos;
+    btc_bool conflict; /* more than one pool tx has the short id */
+} btc_cmpct_slot;
+
+static int btc_cmpct_slot_cmp(const void* a, const void* b)
+{
+    uint64_t ia = ((const btc_cmpct_slot*)a)->shortid;
+    uint64_t ib = ((const btc_cmpct_slot*)b)->shortid;
+    return (ia > ib) - (ia < ib);
+}
+
+btc_bool btc_cmpctblock_deser(btc_cmpctblock* cb, struct const_buffer* buf, const btc_cmpct_txpool* pool)
+{
+    uint64_t nonce;
+    uint32_t shortid_count, prefilled_count;
+    if (cb->txs || !btc_block_header_deserialize(&cb->header, buf) || !deser_u64(&nonce, buf) || !deser_varlen(&shortid_count, buf))
+        return false;
+    if (shortid_count > BTC_MAX_BLOCK_TRANSACTIONS || buf->len < (size_t)shortid_count * BTC_CMPCTBLOCK_SHORTID_LEN)
+        return false;
+    const uint8_t* shortids = buf->p;
+    deser_skip(buf, (size_t)shortid_count * BTC_CMPCTBLOCK_SHORTID_LEN);
+    if (!deser_varlen(&prefilled_count, buf) || prefilled_count > BTC_MAX_BLOCK_TRANSACTIONS - shortid_count || shortid_count + prefilled_count == 0)
+        return false;
+
+    btc_block_header_hash(&cb->header, cb->hash);
+    cb->tx_count = shortid_count + prefilled_count;
+    cb->txs = btc_calloc(cb->tx_count, sizeof(cstring*));
+
+    /* prefilled txs with differentially encoded positions */
+    int64_t last = -1;
+    for (uint32_t i = 0; i < prefilled_count; i++) {
+        uint32_t diff;
+        size_t consumed;
+        if (!deser_varlen(&diff, buf))
+            return false;
+        int64_t pos = last + 1 + diff;
+        if (pos >= cb->tx_count || !btc_cmpct_tx_parse(buf->p, buf->len, &consumed, NULL, NULL))
+            return false;
+        cb->txs[pos] = cstr_new_buf(buf->p, consumed);
+        deser_skip(buf, consumed);
+        last = pos;
+    }
+
+    /* the short ids take the remaining positions in order, sorted for the lookup of the pool txs */
+    btc_cmpct_slot* slots = btc_malloc((shortid_count > 0 ? shortid_count : 1) * sizeof(btc_cmpct_slot));
+    uint32_t pos = 0;
+    for (uint32_t i = 0; i < shortid_count; i++) {
+        while (cb->txs[pos])
+            pos++;
+        uint8_t id[8] = {0};
+        memcpy(id, shortids + (size_t)i * BTC_CMPCTBLOCK_SHORTID_LEN, BTC_CMPCTBLOCK_SHORTID_LEN);
+        slots[i].shortid = read_le64(id);
+        slots[i].pos = pos++;
+        slots[i].conflict = false;
+    }
+    qsort(slots, shortid_count, sizeof(btc_cmpct_slot), btc_cmpct_slot_cmp);
+    for (uint32_t i = 1; i < shortid_count; i++) {
+        if (slots[i].shortid == slots[i - 1].shortid) {
+            /* the short ids of the block collide, needs the full block */
+            btc_free(slots);
+            return false;
+        }
+    }
+
+    uint64_t k0, k1;
+    btc_cmpctblock_shortid_keys(&cb->header, nonce, &k0, &k1);
+    for (size_t i = 0; pool && i < pool->size && shortid_count > 0; i++) {
+        btc_cmpct_slot key;
+        key.shortid = btc_cmpctblock_shortid(k0, k1, pool->entries[i].wtxid);
+        btc_cmpct_slot* slot = bsearch(&key, slots, shortid_count, sizeof(btc_cmpct_slot), btc_cmpct_slot_cmp);
+        if (!slot || slot->conflict)
+            continue;
+        if (cb->txs[slot->pos]) {
+            /* two pool txs share the short id, request it */
+            cstr_free(cb->txs[slot->pos], true);
+            cb->txs[slot->pos] = NULL;
+            slot->conflict = true;
+            continue;
+        }
+        cb->txs[slot->pos] = cstr_new_cstr(pool->entries[i].tx);
+    }
+    btc_free(slots);
+
+    cb->missing_count = 0;
+    for (uint32_t i = 0; i < cb->tx_count; i++) {
+        if (!cb->txs[i])
+            cb->missing_count++;
+    }
+    return true;
+}
+
+void btc_cmpctblock_getblocktxn(const btc_cmpctblock* cb, cstring* str_out)
+{
+    ser_u256(str_out, cb->hash);
+    ser_varlen(str_out, cb->missing_count);
+    int64_t last = -1;
+    for (uint32_t i = 0; i < cb->tx_count; i++) {
+        if (cb->txs[i])
+            continue;
+        ser_varlen(str_out, (uint32_t)(i - (last + 1)));
+        last = i;
+    }
+}
+
+btc_bool btc_cmpctblock_fill(btc_cmpctblock* cb, struct const_buffer* buf)
+{
+    btc_uint256 hash;
+    uint32_t count;
+    if (!deser_u256(hash, buf) || !btc_hash_equal(hash, cb->hash) || !deser_varlen(&count, buf) || count != cb->missing_count)
+        return false;
+
+    /* the txs come in the order of the request */
+    for (uint32_t i = 0; i < cb->tx_count && cb->missing_count > 0; i++) {
+        if (cb->txs[i])
+            continue;
+        size_t consumed;
+        if (!btc_cmpct_tx_parse(buf->p, buf->len, &consumed, NULL, NULL))
+            return false;
+        cb->txs[i] = cstr_new_buf(buf->p, consumed);
+        deser_skip(buf, consumed);
+        cb->missing_count--;
+    }
+    return true;
+}
+
+btc_bool btc_cmpctblock_to_block(const btc_cmpctblock* cb, cstring* block_out)
+{
+    if (cb->missing_count > 0 || !cb->txs)
+        return false;
+
+    /* a tx matched by a colliding short id would change the merkle root */
+    uint8_t* txids = btc_malloc((size_t)cb->tx_count * 32);
+    for (uint32_t i = 0; i < cb->tx_count; i++) {
+        size_t consumed;
+        if (!btc_cmpct_tx_parse((const uint8_t*)cb->txs[i]->str, cb->txs[i]->len, &consumed, txids + (size_t)i * 32, NULL)) {
+            btc_free(txids);
+            return false;
+        }
+    }
+    btc_uint256 merkle_root;
+    btc_block_merkle_root(txids, cb->tx_count, merkle_root);
+    btc_free(txids);
+    if (memcmp(merkle_root, cb->header.merkle_root, sizeof(btc_uint256)) != 0)
+        return false;
+
+    btc_block_header_serialize(block_out, &cb->header);
+    ser_varlen(block_out, cb->tx_count);
+    for (uint32_t i = 0; i < cb->tx_count; i++)
+        cstr_append_buf(block_out, cb->txs[i]->str, cb->txs[i]->len);
+    return true;
+}
+
+btc_bool btc_cmpctblock_build(const uint8_t* block, size_t len, uint64_t nonce, cstring* str_out)
+{
+    struct const_buffer buf = {block, len};
+    btc_block_header header;
+    uint32_t tx_count;
+    size_t consumed;
+    if (!btc_block_header_deserialize(&header, &buf) || !deser_varlen(&tx_count, &buf) || tx_count == 0)
+        return false;
+
+    uint64_t k0, k1;
+    btc_cmpctblock_shortid_keys(&header, nonce, &k0, &k1);
+    btc_block_header_serialize(str_out, &header);
+    ser_u64(str_out, nonce);
+    ser_varlen(str_out, tx_count - 1);
+
+    /* the coinbase is prefilled, the other txs are sent as short ids */
+    const uint8_t* coinbase = buf.p;
+    if (!btc_cmpct_tx_parse(buf.p, buf.len, &consumed, NULL, NULL))
+        return false;
+    size_t coinbase_len = consumed;
+    deser_skip(&buf, consumed);
+    for (uint32_t i = 1; i < tx_count; i++) {
+        btc_uint256 wtxid;
+        if (!btc_cmpct_tx_parse(buf.p, buf.len, &consumed, NULL, wtxid))
+            return false;
+        deser_skip(&buf, consumed);
+        uint64_t shortid = btc_cmpctblock_shortid(k0, k1, wtxid);
+        for (int j = 0; j < BTC_CMPCTBLOCK_SHORTID_LEN; j++)
+            cstr_append_c(str_out, (char)((shortid >> (8 * j)) & 0xff));
+    }
+    ser_varlen(str_out, 1);
+    ser_varlen(str_out, 0);
+    cstr_append_buf(str_out, coinbase, coinbase_len);
+    return true;
+}
@@ -0,0 +1,552 @@
+/*
+
+ The MIT License (MIT)
+
+ Copyright (c) 2017 Jonas Schnelli
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES
+ OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ OTHER DEALINGS IN THE SOFTWARE.
+ 
+*/
+
+#include <btc/headersdb_compact.h>
+#include <btc/block.h>
+#include <btc/serialize.h>
+#include <btc/utils.h>
+
+#include <assert.h>
+#include <time.h>
+
+/* a header that is not part of the main chain */
+typedef struct btc_headers_db_compact_fork_ {
+    btc_block_header header;
+    btc_uint256 hash;
+    uint32_t height;
+} btc_headers_db_compact_fork;
+
+/* a header with an unknown parent */
+typedef struct btc_headers_db_compact_orphan_ {
+    btc_block_header header;
+    btc_uint256 hash;
+    int64_t time_added;
+} btc_headers_db_compact_orphan;
+
+static const size_t BTC_HEADERS_DB_COMPACT_MIN_ALLOC = 2016;
+
+/* amount of headers on top of the base */
+static inline size_t btc_headers_db_compact_tip_pos(btc_headers_db_compact* db)
+{
+    return db->headers_count;
+}
+
+/* get the hash at a given main chain position (0 = base) */
+static inline const uint8_t* btc_headers_db_compact_hash_at(btc_headers_db_compact* db, size_t pos)
+{
+    if (pos == db->headers_count)
+        return db->tip_hash;
+    /* the hash of a header is the prev_block of its successor */
+    return db->headers[pos].prev_block;
+}
+
+static inline size_t btc_headers_db_compact_slot(btc_headers_db_compact* db, const uint8_t* hash)
+{
+    /* block hashes are uniformly distributed, use the first 8 bytes */
+    uint64_t h;
+    memcpy(&h, hash, sizeof(h));
+    return (size_t)(h & (db->hash_index_size - 1));
+}
+
+/* returns the chain position of a hash, -1 if not in the main chain */
+static int64_t btc_headers_db_compact_index_find(btc_headers_db_compact* db, const uint8_t* hash)
+{
+    size_t slot = btc_headers_db_compact_slot(db, hash);
+    while (db->hash_index[slot] != 0) {
+        size_t pos = db->hash_index[slot] - 1;
+        if (memcmp(btc_headers_db_compact_hash_at(db, pos), hash, BTC_HASH_LENGTH) == 0)
+            return (int64_t)pos;
+        slot = (slot + 1) & (db->hash_index_size - 1);
+    }
+    return -1;
+}
+
+static void btc_headers_db_compact_index_insert(btc_headers_db_compact* db, const uint8_t* hash, size_t pos);
+
+/* re-index the positions below the one being inserted (which may already be the tip) */
+static void btc_headers_db_compact_index_grow(btc_headers_db_compact* db, size_t insert_pos)
+{
+    btc_free(db->hash_index);
+    db->hash_index_size *= 2;
+    db->hash_index = btc_calloc(db->hash_index_size, sizeof(uint32_t));
+    db->hash_index_used = 0;
+    for (size_t pos = 0; pos < insert_pos; pos++) {
+        btc_headers_db_compact_index_insert(db, btc_headers_db_compact_hash_at(db, pos), pos);
+    }
+}
+
+static void btc_headers_db_compact_index_insert(btc_headers_db_compact* db, const uint8_t* hash, size_t pos)
+{
+    /* keep the load factor below 75% */
+    if ((db->hash_index_used + 1) * 4 > db->hash_index_size * 3) {
+        btc_headers_db_compact_index_grow(db, pos);
+    }
+    size_t slot = btc_headers_db_compact_slot(db, hash);
+    while (db->hash_index[slot] != 0)
+        slot = (slot + 1) & (db->hash_index_size - 1);
+    db->hash_index[slot] = (uint32_t)pos + 1;
+    db->hash_index_used++;
+}
+
+/* remove an entry, backward shift deletion (no tombstones) */
+static void btc_headers_db_compact_index_remove(btc_headers_db_compact* db, const uint8_t* hash)
+{
+    size_t mask = db->hash_index_size - 1;
+    size_t slot = btc_headers_db_compact_slot(db, hash);
+    while (db->hash_index[slot] != 0) {
+        size_t pos = db->hash_index[slot] - 1;
+        if (memcmp(btc_headers_db_compact_hash_at(db, pos), hash, BTC_HASH_LENGTH) == 0)
+            break;
+        slot = (slot + 1) & mask;
+    }
+    if (db->hash_index[slot] == 0)
+        return;
+
+    db->hash_index[slot] = 0;
+    db->hash_index_used--;
+    size_t next = (slot + 1) & mask;
+    while (db->hash_index[next] != 0) {
+        size_t ideal = btc_headers_db_compact_slot(db, btc_headers_db_compact_hash_at(db, db->hash_index[next] - 1));
+        /* move the entry into the hole if its probe sequence passes the hole */
+        if (((next - ideal) & mask) >= ((next - slot) & mask)) {
+            db->hash_index[slot] = db->hash_index[next];
+            db->hash_index[next] = 0;
+            slot = next;
+        }
+        next = (next + 1) & mask;
+    }
+}
+
+static btc_blockindex* btc_headers_db_compact_view(btc_headers_db_compact* db, btc_blockindex* view, size_t pos)
+{
+    memset(view, 0, sizeof(*view));
+    view->height = db->base_height + pos;
+    memcpy(view->hash, btc_headers_db_compact_hash_at(db, pos), BTC_HASH_LENGTH);
+    if (pos > 0)
+        btc_block_header_copy(&view->header, &db->headers[pos - 1]);
+    return view;
+}
+
+static btc_blockindex* btc_headers_db_compact_next_view(btc_headers_db_compact* db)
+{
+    btc_blockindex* view = &db->views[db->next_view];
+    db->next_view = (db->next_view + 1) % BTC_HEADERS_DB_COMPACT_VIEWS;
+    return view;
+}
+
+static void btc_headers_db_compact_update_tip_view(btc_headers_db_compact* db)
+{
+    btc_headers_db_compact_view(db, &db->tip_view, btc_headers_db_compact_tip_pos(db));
+}
+
+/* reset the chain to a single base entry (genesis or checkpoint) */
+static void btc_headers_db_compact_reset(btc_headers_db_compact* db, const uint8_t* hash, uint32_t height)
+{
+    db->headers_count = 0;
+    db->base_height = height;
+    memcpy(db->base_hash, hash, BTC_HASH_LENGTH);
+    memcpy(db->tip_hash, hash, BTC_HASH_LENGTH);
+    memset(db->hash_index, 0, db->hash_index_size * sizeof(uint32_t));
+    db->hash_index_used = 0;
+    btc_headers_db_compact_index_insert(db, hash, 0);
+    vector_resize(db->forks, 0);
+    btc_headers_db_compact_update_tip_view(db);
+}
+
+static void btc_headers_db_compact_append(btc_headers_db_compact* db, const btc_block_header* header, const uint8_t* hash)
+{
+    if (db->headers_count == db->headers_alloc) {
+        /* grow by 12.5% to limit the slack on large chains */
+        size_t new_alloc = db->headers_alloc + BTC_MAX(db->headers_alloc / 8, BTC_HEADERS_DB_COMPACT_MIN_ALLOC);
+        db->headers = btc_realloc(db->headers, new_alloc * sizeof(btc_block_header));
+        db->headers_alloc = new_alloc;
+    }
+    btc_block_header_copy(&db->headers[db->headers_count], header);
+    db->headers_count++;
+    memcpy(db->tip_hash, hash, BTC_HASH_LENGTH);
+    btc_headers_db_compact_index_insert(db, hash, db->headers_count);
+}
+
+/* remove the tip from the main chain, optionally keep it as fork header */
+static void btc_headers_db_compact_pop(btc_headers_db_compact* db, btc_bool keep_as_fork)
+{
+    size_t tip_pos = btc_headers_db_compact_tip_pos(db);
+    if (keep_as_fork) {
+        btc_headers_db_compact_fork* fork = btc_calloc(1, sizeof(*fork));
+        btc_block_header_copy(&fork->header, &db->headers[tip_pos - 1]);
+        memcpy(fork->hash, db->tip_hash, BTC_HASH_LENGTH);
+        fork->height = db->base_height + tip_pos;
+        vector_add(db->forks, fork);
+    }
+    btc_headers_db_compact_index_remove(db, db->tip_hash);
+    memcpy(db->tip_hash, db->headers[tip_pos - 1].prev_block, BTC_HASH_LENGTH);
+    db->headers_count--;
+}
+
+static btc_headers_db_compact_fork* btc_headers_db_compact_find_fork(btc_headers_db_compact* db, const uint8_t* hash)
+{
+    for (size_t i = db->forks->len; i > 0; i--) {
+        btc_headers_db_compact_fork* fork = vector_idx(db->forks, i - 1);
+        if (memcmp(fork->hash, hash, BTC_HASH_LENGTH) == 0)
+            return fork;
+    }
+    return NULL;
+}
+
+/* switch the main chain to the fork ending with the given header */
+static void btc_headers_db_compact_reorg(btc_headers_db_compact* db, btc_headers_db_compact_fork* forktip)
+{
+    /* collect the fork branch down to the main chain */
+    vector* branch = vector_new(8, NULL);
+    btc_headers_db_compact_fork* walk = forktip;
+    int64_t fork_pos = -1;
+    while (walk) {
+        vector_add(branch, walk);
+        fork_pos = btc_headers_db_compact_index_find(db, walk->header.prev_block);
+        if (fork_pos >= 0)
+            break;
+        walk = btc_headers_db_compact_find_fork(db, walk->header.prev_block);
+    }
+    if (fork_pos < 0) {
+        vector_free(branch, true);
+        return;
+    }
+
+    /* detach the old main chain headers and keep them as fork headers */
+    while (btc_headers_db_compact_tip_pos(db) > (size_t)fork_pos) {
+        btc_headers_db_compact_pop(db, true);
+    }
+
+    /* connect the branch */
+    for (size_t i = branch->len; i > 0; i--) {
+        btc_headers_db_compact_fork* fork = vector_idx(branch, i - 1);
+        btc_headers_db_compact_append(db, &fork->header, fork->hash);
+        vector_remove(db->forks, fork); /* frees the fork entry */
+    }
+    vector_free(branch, true);
+}
+
+btc_headers_db_compact* btc_headers_db_compact_new(const btc_chainparams* chainparams, btc_bool inmem_only)
+{
+    (void)inmem_only;
+    btc_headers_db_compact* db;
+    db = btc_calloc(1, sizeof(*db));
+
+    db->hash_index_size = 4096;
+    db->hash_index = btc_calloc(db->hash_index_size, sizeof(uint32_t));
+    db->forks = vector_new(8, btc_free);
+    db->orphans = vector_new(16, NULL);
+    btc_headers_db_compact_reset(db, chainparams->genesisblockhash, 0);
+    return db;
+}
+
+void btc_headers_db_compact_free(btc_headers_db_compact* db)
+{
+    if (!db)
+        return;
+
+    btc_free(db->headers);
+    btc_free(db->hash_index);
+    vector_free(db->forks, true);
+    for (size_t i = 0; i < db->orphans->len; i++)
+        btc_free(vector_idx(db->orphans, i));
+    vector_free(db->orphans, true);
+    btc_free(db);
+}
+
+btc_bool btc_headers_db_compact_load(btc_headers_db_compact* db, const char* filename)
+{
+    /* in-memory only database */
+    (void)db;
+    (void)filename;
+    return true;
+}
+
+/* connects a header to the main chain or a fork, returns false if the parent is unknown */
+static btc_bool btc_headers_db_compact_link(btc_headers_db_compact* db, const btc_block_header* header, const uint8_t* hash, uint32_t* height)
+{
+    /* try to connect it to the chain tip */
+    if (memcmp(header->prev_block, db->tip_hash, BTC_HASH_LENGTH) == 0) {
+        btc_headers_db_compact_append(db, header, hash);
+        btc_headers_db_compact_update_tip_view(db);
+        *height = db->tip_view.height;
+        return true;
+    }
+
+    /* already known main chain header */
+    int64_t pos = btc_headers_db_compact_index_find(db, hash);
+    if (pos >= 0) {
+        *height = db->base_height + pos;
+        return true;
+    }
+
+    /* check if we know the prevblock (main chain or fork) */
+    pos = btc_headers_db_compact_index_find(db, header->prev_block);
+    btc_headers_db_compact_fork* prev_fork = (pos < 0 ? btc_headers_db_compact_find_fork(db, header->prev_block) : NULL);
+    if (pos < 0 && !prev_fork)
+        return false;
+    *height = (pos >= 0 ? db->base_height + pos : prev_fork->height) + 1;
+
+    if (btc_headers_db_compact_find_fork(db, hash) == NULL) {
+        btc_headers_db_compact_fork* fork = btc_calloc(1, sizeof(*fork));
+        btc_block_header_copy(&fork->header, header);
+        memcpy(fork->hash, hash, BTC_HASH_LENGTH);
+        fork->height = *height;
+        vector_add(db->forks, fork);
+
+        /* the longer chain wins, like in the file based headers db */
+        if (fork->height > db->tip_view.height) {
+            btc_headers_db_compact_reorg(db, fork);
+            btc_headers_db_compact_update_tip_view(db);
+        }
+
+        /* bound the amount of fork headers, drop the oldest */
+        while (db->forks->len > BTC_HEADERS_DB_COMPACT_MAX_FORK_HEADERS)
+            vector_remove_idx(db->forks, 0);
+    }
+    return true;
+}
+
+static void btc_headers_db_compact_add_orphan(btc_headers_db_compact* db, const btc_block_header* header, const uint8_t* hash)
+{
+    if (btc_headers_db_compact_have_orphan(db, (uint8_t*)hash))
+        return;
+
+    int64_t now = time(NULL);
+    btc_headers_db_compact_expire_orphans(db, now);
+
+    /* make room, drop the oldest orphans */
+    while (db->orphans->len >= BTC_HEADERS_DB_COMPACT_MAX_ORPHANS) {
+        btc_free(vector_idx(db->orphans, 0));
+        vector_remove_idx(db->orphans, 0);
+    }
+
+    btc_headers_db_compact_orphan* orphan = btc_calloc(1, sizeof(*orphan));
+    btc_block_header_copy(&orphan->header, header);
+    memcpy(orphan->hash, hash, BTC_HASH_LENGTH);
+    orphan->time_added = now;
+    vector_add(db->orphans, orphan);
+}
+
+/* connect the orphans descending from a connected header */
+static void btc_headers_db_compact_connect_orphans(btc_headers_db_compact* db, const uint8_t* hash)
+{
+    if (db->orphans->len == 0)
+        return;
+
+    vector* linked = vector_new(8, btc_free);
+    const uint8_t* parent = hash;
+    size_t next = 0;
+    while (true) {
+        for (size_t i = 0; i < db->orphans->len;) {
+            btc_headers_db_compact_orphan* orphan = vector_idx(db->orphans, i);
+            if (memcmp(orphan->header.prev_block, parent, BTC_HASH_LENGTH) != 0) {
+                i++;
+                continue;
+            }
+            vector_remove_idx(db->orphans, i);
+            uint32_t height;
+            if (btc_headers_db_compact_link(db, &orphan->header, orphan->hash, &height))
+                vector_add(linked, orphan);
+            else
+                btc_free(orphan);
+        }
+        if (next == linked->len)
+            break;
+        parent = ((btc_headers_db_compact_orphan*)vector_idx(linked, next++))->hash;
+    }
+    vector_free(linked, true);
+}
+
+btc_blockindex* btc_headers_db_compact_connect_hdr(btc_headers_db_compact* db, struct const_buffer* buf, btc_bool load_process, btc_bool* connected)
+{
+    (void)load_process;
+    *connected = false;
+
+    btc_blockindex* view = btc_headers_db_compact_next_view(db);
+    memset(view, 0, sizeof(*view));
+    if (!btc_block_header_deserialize(&view->header, buf))
+        return NULL;
+
+    /* calculate block hash */
+    btc_block_header_hash(&view->header, view->hash);
+
+    if (!btc_headers_db_compact_link(db, &view->header, view->hash, &view->height)) {
+        /* keep it until the parent arrives */
+        btc_headers_db_compact_add_orphan(db, &view->header, view->hash);
+        return view;
+    }
+    btc_headers_db_compact_connect_orphans(db, view->hash);
+    *connected = true;
+    return view;
+}
+
+size_t btc_headers_db_compact_fill_block_locator(btc_headers_db_compact* db, btc_uint256* locators, size_t max_locators)
+{
+    size_t count = 0;
+    size_t step = 1;
+    size_t pos = btc_headers_db_compact_tip_pos(db);
+
+    /* first 10 headers back-to-back, then step back exponentially down to the base */
+    while (count < max_locators) {
+        memcpy(locators[count], btc_headers_db_compact_hash_at(db, pos), BTC_HASH_LENGTH);
+        count++;
+        if (pos == 0)
+            return count;
+        pos = (pos > step ? pos - step : 0);
+        if (count > 10)
+            step *= 2;
+    }
+
+    /* always terminate the locator with the base */
+    if (count > 0)
+        memcpy(locators[count - 1], db->base_hash, BTC_HASH_LENGTH);
+    return count;
+}
+
+btc_blockindex* btc_headers_db_compact_getchaintip(btc_headers_db_compact* db)
+{
+    return &db->tip_view;
+}
+
+btc_bool btc_headers_db_compact_disconnect_tip(btc_headers_db_compact* db)
+{
+    if (btc_headers_db_compact_tip_pos(db) == 0)
+        return false;
+
+    btc_headers_db_compact_pop(db, false);
+    btc_headers_db_compact_update_tip_view(db);
+    return true;
+}
+
+btc_bool btc_headers_db_compact_has_checkpoint_start(btc_headers_db_compact* db)
+{
+    return (db->base_height != 0);
+}
+
+void btc_headers_db_compact_set_checkpoint_start(btc_headers_db_compact* db, btc_uint256 hash, uint32_t height)
+{
+    btc_headers_db_compact_reset(db, hash, height);
+}
+
+btc_bool btc_headers_db_compact_import_snapshot(btc_headers_db_compact* db, const btc_chainparams* chainparams, const char* filename, const uint8_t* pinned_hash)
+{
+    uint32_t base_height, count;
+    btc_uint256 base_hash;
+    uint8_t* headers = btc_headers_snapshot_read(chainparams, filename, pinned_hash, &base_height, base_hash, &count);
+    if (!headers)
+        return false;
+
+    /* the snapshot must extend our chain (or start a new chain from its base) */
+    btc_bool empty_chain = (db->headers_count == 0 && db->base_height == 0);
+    if (!(empty_chain && base_height > 0) &&
+        (base_height != db->tip_view.height || memcmp(base_hash, db->tip_hash, BTC_HASH_LENGTH) != 0)) {
+        btc_free(headers);
+        return false;
+    }
+    if (empty_chain && base_height > 0)
+        btc_headers_db_compact_reset(db, base_hash, base_height);
+
+    /* allocate the chain once */
+    if (db->headers_count + count > db->headers_alloc) {
+        db->headers_alloc = db->headers_count + count;
+        db->headers = btc_realloc(db->headers, db->headers_alloc * sizeof(btc_block_header));
+    }
+    struct const_buffer buf = {headers, (size_t)count * 80};
+    btc_block_header header;
+    btc_uint256 hash;
+    for (uint32_t i = 0; i < count; i++) {
+        btc_block_header_deserialize(&header, &buf);
+        btc_block_header_hash(&header, hash);
+        btc_headers_db_compact_append(db, &header, hash);
+    }
+    btc_headers_db_compact_update_tip_view(db);
+
+    btc_free(headers);
+    return true;
+}
+
+btc_blockindex* btc_headers_db_compact_find(btc_headers_db_compact* db, btc_uint256 hash)
+{
+    int64_t pos = btc_headers_db_compact_index_find(db, hash);
+    if (pos < 0)
+        return NULL;
+    return btc_headers_db_compact_view(db, btc_headers_db_compact_next_view(db), pos);
+}
+
+btc_blockindex* btc_headers_db_compact_get(btc_headers_db_compact* db, uint32_t height)
+{
+    if (height < db->base_height || height - db->base_height > btc_headers_db_compact_tip_pos(db))
+        return NULL;
+    return btc_headers_db_compact_view(db, btc_headers_db_compact_next_view(db), height - db->base_height);
+}
+
+btc_bool btc_headers_db_compact_have_orphan(btc_headers_db_compact* db, btc_uint256 hash)
+{
+    for (size_t i = 0; i < db->orphans->len; i++) {
+        btc_headers_db_compact_orphan* orphan = vector_idx(db->orphans, i);
+        if (memcmp(orphan->hash, hash, BTC_HASH_LENGTH) == 0)
+            return true;
+    }
+    return false;
+}
+
+void btc_headers_db_compact_expire_orphans(btc_headers_db_compact* db, int64_t now)
+{
+    while (db->orphans->len > 0) {
+        btc_headers_db_compact_orphan* orphan = vector_idx(db->orphans, 0);
+        if (orphan->time_added >= now - BTC_HEADERS_DB_COMPACT_ORPHAN_EXPIRE)
+            break;
+        btc_free(orphan);
+        vector_remove_idx(db->orphans, 0);
+    }
+}
+
+uint32_t btc_headers_db_compact_lowest_height(btc_headers_db_compact* db)
+{
+    return db->base_height;
+}
+
+int64_t btc_headers_db_compact_find_height_by_time(btc_headers_db_compact* db, uint32_t timestamp)
+{
+    /* timestamps are not strictly monotonic, do a linear scan over the contiguous headers */
+    for (size_t i = 0; i < db->headers_count; i++) {
+        if (db->headers[i].timestamp >= timestamp)
+            return (int64_t)db->base_height + i + 1;
+    }
+    return -1;
+}
+
+size_t btc_headers_db_compact_mem_usage(btc_headers_db_compact* db)
+{
+    return sizeof(*db) +
+           db->headers_alloc * sizeof(btc_block_header) +
+           db->hash_index_size * sizeof(uint32_t) +
+           db->forks->alloc * sizeof(void*) +
+           db->forks->len * sizeof(btc_headers_db_compact_fork) +
+           db->orphans->alloc * sizeof(void*) +
+           db->orphans->len * sizeof(btc_headers_db_compact_orphan);
+}
@@ -30,12 +30,21 @@
 #include <btc/utils.h>
 
 #include <sys/stat.h>
+#include <unistd.h>
 
 #include <search.h>
+#include <time.h>
 
 static const unsigned char file_hdr_magic[4] = {0xA8, 0xF0, 0x11, 0xC5}; /* header magic */
 static const uint32_t current_version = 1;
 
+static const unsigned char snapshot_hdr_magic[4] = {0xA8, 0xF0, 0x11, 0xC6}; /* snapshot magic */
+static const uint32_t snapshot_version = 1;
+/* magic, version, netmagic, base height, base hash, amount of headers */
+#define BTC_HEADERS_SNAPSHOT_HDR_SIZE (4 + 4 + 4 + 4 + 32 + 4)
+/* amount of headers read/written at once */
+#define BTC_HEADERS_SNAPSHOT_BATCH 2000
+
 int btc_header_compare(const void *l, const void *r)
 {
     const btc_blockindex *lm = l;
@@ -57,27 +66,307 @@ int btc_header_compare(const void *l, const void *r)
     return 0;
 }
 
+/* approximate memory usage of a single in-memory header
+   (blockindex, binary tree node, malloc overhead and window slot) */
+static size_t btc_headers_db_mem_per_header()
+{
+    return sizeof(btc_blockindex) + sizeof(struct btc_btree_node) + 4 * sizeof(void*);
+}
+
+static btc_blockindex ** btc_headers_db_window_slot(btc_headers_db* db, uint32_t height)
+{
+    return &db->window[height % db->max_hdr_in_mem];
+}
+
+/* removes a header from memory (it's still available on disk) */
+static void btc_headers_db_release_hdr(btc_headers_db* db, btc_blockindex *pindex)
+{
+    if (pindex == &db->genesis)
+        return;
+    tdelete(pindex, &db->tree_root, btc_header_compare);
+    btc_free(pindex);
+}
+
+/* reset the window to contain only the chain bottom up to the tip */
+static void btc_headers_db_window_reset(btc_headers_db* db)
+{
+    if (!db->window)
+        return;
+    memset(db->window, 0, db->max_hdr_in_mem * sizeof(btc_blockindex *));
+    btc_blockindex *pindex = db->chaintip;
+    while (pindex && pindex->height >= db->chainbottom->height) {
+        *btc_headers_db_window_slot(db, pindex->height) = pindex;
+        if (pindex == db->chainbottom)
+            break;
+        pindex = pindex->prev;
+    }
+}
+
+static btc_bool btc_headers_db_in_window(btc_headers_db* db, btc_blockindex *pindex)
+{
+    return (pindex->height >= db->chainbottom->height && *btc_headers_db_window_slot(db, pindex->height) == pindex);
+}
+
+/* removes the released headers from memory, together with the headers off the main chain
+   descending from them (their prev pointers would dangle), frees the released vector */
+static void btc_headers_db_release_hdrs(btc_headers_db* db, vector *released)
+{
+    if (db->window) {
+        for (size_t i = 0; i < db->fork_headers->len;) {
+            btc_blockindex *fork = vector_idx(db->fork_headers, i);
+            btc_blockindex *pindex = fork;
+            while (pindex && !btc_headers_db_in_window(db, pindex) && vector_find(released, pindex) == -1)
+                pindex = pindex->prev;
+            if (pindex && !btc_headers_db_in_window(db, pindex)) {
+                vector_remove_idx(db->fork_headers, i);
+                vector_add(released, fork);
+                continue;
+            }
+            i++;
+        }
+    }
+    for (size_t i = 0; i < released->len; i++)
+        btc_headers_db_release_hdr(db, vector_idx(released, i));
+    vector_free(released, true);
+}
+
+/* place a new tip into the window, evict the bottom header if the window is full
+   if the new tip is on a fork, the window is rebuilt along the fork and the headers
+   of the old branch (above the fork point) are released */
+static void btc_headers_db_window_connect_tip(btc_headers_db* db, btc_blockindex *oldtip, btc_blockindex *newtip)
+{
+    if (!db->window)
+        return;
+
+    /* the parent of a connected header is either in the window or a fork header descending from it */
+    btc_blockindex *forkpoint = newtip->prev;
+    while (forkpoint && !btc_headers_db_in_window(db, forkpoint))
+        forkpoint = forkpoint->prev;
+
+    uint32_t bottom_height = db->chainbottom->height;
+    if (newtip->height - bottom_height + 1 > db->max_hdr_in_mem)
+        bottom_height = newtip->height - db->max_hdr_in_mem + 1;
+    btc_blockindex *newbottom = btc_blockindex_get_ancestor(newtip, bottom_height);
+
+    vector *released = vector_new(8, NULL);
+
+    /* the old branch */
+    for (uint32_t h = forkpoint->height + 1; h <= oldtip->height; h++) {
+        btc_blockindex **slot = btc_headers_db_window_slot(db, h);
+        vector_add(released, *slot);
+        *slot = NULL;
+    }
+
+    /* the main chain below the new bottom */
+    for (uint32_t h = db->chainbottom->height; h < bottom_height && h <= forkpoint->height; h++) {
+        btc_blockindex **slot = btc_headers_db_window_slot(db, h);
+        vector_add(released, *slot);
+        *slot = NULL;
+    }
+
+    /* the new branch (only the new tip when extending the tip) */
+    for (btc_blockindex *pindex = newtip; pindex != forkpoint; pindex = pindex->prev) {
+        if (pindex != newtip)
+            vector_remove(db->fork_headers, pindex);
+        if (pindex->height >= bottom_height)
+            *btc_headers_db_window_slot(db, pindex->height) = pindex;
+        else
+            vector_add(released, pindex);
+    }
+
+    newbottom->prev = NULL;
+    db->chainbottom = newbottom;
+    btc_headers_db_release_hdrs(db, released);
+}
+
+/* header with an unknown parent */
+typedef struct btc_headers_db_orphan_ {
+    btc_blockindex *pindex; /* height and prev are unknown */
+    int64_t time_added;
+} btc_headers_db_orphan;
+
+/* all orphans with the same prev hash */
+typedef struct btc_headers_db_orphan_bucket_ {
+    btc_uint256 prev_hash;
+    vector *orphans;
+} btc_headers_db_orphan_bucket;
+
+static int btc_headers_db_orphan_bucket_compare(const void *l, const void *r)
+{
+    return memcmp(l, r, sizeof(btc_uint256));
+}
+
+static void btc_headers_db_orphan_bucket_free(void *obj)
+{
+    btc_headers_db_orphan_bucket *bucket = obj;
+    vector_free(bucket->orphans, true);
+    btc_free(bucket);
+}
+
+static size_t btc_headers_db_orphan_mem()
+{
+    return btc_headers_db_mem_per_header() + sizeof(btc_headers_db_orphan) + 2 * sizeof(void*);
+}
+
+static btc_headers_db_orphan_bucket * btc_headers_db_orphan_bucket_find(btc_headers_db* db, const uint8_t *prev_hash)
+{
+    void *node = tfind(prev_hash, &db->orphans_by_prev, btc_headers_db_orphan_bucket_compare);
+    if (!node)
+        return NULL;
+    return *(btc_headers_db_orphan_bucket **)node;
+}
+
+/* removes an orphan from the prev hash index (not from the age list) */
+static void btc_headers_db_orphan_unindex(btc_headers_db* db, btc_headers_db_orphan *orphan)
+{
+    btc_headers_db_orphan_bucket *bucket = btc_headers_db_orphan_bucket_find(db, orphan->pindex->header.prev_block);
+    if (!bucket)
+        return;
+    vector_remove(bucket->orphans, orphan);
+    if (bucket->orphans->len == 0) {
+        tdelete(bucket, &db->orphans_by_prev, btc_headers_db_orphan_bucket_compare);
+        btc_headers_db_orphan_bucket_free(bucket);
+    }
+}
+
+static void btc_headers_db_orphan_evict_oldest(btc_headers_db* db)
+{
+    btc_headers_db_orphan *orphan = vector_idx(db->orphans, 0);
+    btc_headers_db_orphan_unindex(db, orphan);
+    vector_remove_idx(db->orphans, 0);
+    db->orphan_stats.count--;
+    db->orphan_stats.mem_bytes -= btc_headers_db_orphan_mem();
+    btc_free(orphan->pindex);
+    btc_free(orphan);
+}
+
+/* adds a header with an unknown parent to the pool, returns the pooled blockindex */
+static btc_blockindex * btc_headers_db_add_orphan(btc_headers_db* db, btc_blockindex *blockindex)
+{
+    btc_headers_db_orphan_bucket *bucket = btc_headers_db_orphan_bucket_find(db, blockindex->header.prev_block);
+    if (bucket) {
+        for (size_t i = 0; i < bucket->orphans->len; i++) {
+            btc_headers_db_orphan *orphan = vector_idx(bucket->orphans, i);
+            if (btc_hash_equal(orphan->pindex->hash, blockindex->hash)) {
+                db->orphan_stats.duplicates++;
+                btc_free(blockindex);
+                return orphan->pindex;
+            }
+        }
+    }
+
+    int64_t now = time(NULL);
+    btc_headers_db_expire_orphans(db, now);
+
+    /* make room, drop the oldest orphans */
+    while (db->orphans->len > 0 && db->orphan_stats.mem_bytes + btc_headers_db_orphan_mem() > db->max_orphan_mem_bytes) {
+        btc_headers_db_orphan_evict_oldest(db);
+        db->orphan_stats.evicted_size++;
+    }
+
+    /* eviction may have removed the bucket */
+    bucket = btc_headers_db_orphan_bucket_find(db, blockindex->header.prev_block);
+    if (!bucket) {
+        bucket = btc_calloc(1, sizeof(btc_headers_db_orphan_bucket));
+        memcpy(bucket->prev_hash, blockindex->header.prev_block, sizeof(btc_uint256));
+        bucket->orphans = vector_new(1, NULL);
+        tsearch(bucket, &db->orphans_by_prev, btc_headers_db_orphan_bucket_compare);
+    }
+
+    btc_headers_db_orphan *orphan = btc_calloc(1, sizeof(btc_headers_db_orphan));
+    orphan->pindex = blockindex;
+    orphan->time_added = now;
+    vector_add(bucket->orphans, orphan);
+    vector_add(db->orphans, orphan);
+    db->orphan_stats.count++;
+    db->orphan_stats.mem_bytes += btc_headers_db_orphan_mem();
+    db->orphan_stats.added++;
+    return blockindex;
+}
+
 btc_headers_db* btc_headers_db_new(const btc_chainparams* chainparams, btc_bool inmem_only) {
     btc_headers_db* db;
     db = btc_calloc(1, sizeof(*db));
 
     db->read_write_file = !inmem_only;
     db->use_binary_tree = true;
-    db->max_hdr_in_mem = 144;
 
     db->genesis.height = 0;
     db->genesis.prev = NULL;
     memcpy(db->genesis.hash, chainparams->genesisblockhash, BTC_HASH_LENGTH);
     db->chaintip = &db->genesis;
     db->chainbottom = &db->genesis;
+    db->fork_headers = vector_new(8, NULL);
 
     if (db->use_binary_tree) {
         db->tree_root = 0;
     }
 
+    btc_headers_db_set_mem_budget(db, BTC_HEADERS_DB_DEFAULT_MEM_BUDGET);
+
+    db->orphans = vector_new(16, NULL);
+    btc_headers_db_set_orphan_limits(db, BTC_HEADERS_DB_DEFAULT_ORPHAN_MEM_BUDGET, BTC_HEADERS_DB_DEFAULT_ORPHAN_EXPIRE);
+
     return db;
 }
 
+void btc_headers_db_set_orphan_limits(btc_headers_db* db, size_t max_bytes, int64_t max_age) {
+    db->max_orphan_mem_bytes = max_bytes;
+    db->orphan_expire = max_age;
+    while (db->orphans->len > 0 && db->orphan_stats.mem_bytes > db->max_orphan_mem_bytes) {
+        btc_headers_db_orphan_evict_oldest(db);
+        db->orphan_stats.evicted_size++;
+    }
+}
+
+void btc_headers_db_expire_orphans(btc_headers_db* db, int64_t now) {
+    while (db->orphans->len > 0) {
+        btc_headers_db_orphan *orphan = vector_idx(db->orphans, 0);
+        if (orphan->time_added >= now - db->orphan_expire)
+            break;
+        btc_headers_db_orphan_evict_oldest(db);
+        db->orphan_stats.evicted_age++;
+    }
+}
+
+btc_bool btc_headers_db_have_orphan(btc_headers_db* db, btc_uint256 hash) {
+    for (size_t i = 0; i < db->orphans->len; i++) {
+        btc_headers_db_orphan *orphan = vector_idx(db->orphans, i);
+        if (btc_hash_equal(orphan->pindex->hash, hash))
+            return true;
+    }
+    return false;
+}
+
+void btc_headers_db_set_mem_budget(btc_headers_db* db, size_t max_bytes) {
+    unsigned int max_hdr = max_bytes / btc_headers_db_mem_per_header();
+    if (max_bytes > 0 && max_hdr < 2) {
+        /* the window needs at least the tip and its parent */
+        max_hdr = 2;
+    }
+
+    db->max_hdr_mem_bytes = max_bytes;
+    db->max_hdr_in_mem = max_hdr;
+    btc_free(db->window);
+    db->window = NULL;
+    if (max_hdr == 0)
+        return;
+
+    /* drop headers that no longer fit into the budget */
+    vector *released = vector_new(8, NULL);
+    if (db->chaintip->height - db->chainbottom->height + 1 > max_hdr) {
+        btc_blockindex *newbottom = btc_headersdb_get_ancestor(db, db->chaintip, db->chaintip->height - max_hdr + 1);
+        for (btc_blockindex *pindex = newbottom->prev; pindex; pindex = pindex->prev)
+            vector_add(released, pindex);
+        newbottom->prev = NULL;
+        db->chainbottom = newbottom;
+    }
+
+    db->window = btc_calloc(max_hdr, sizeof(btc_blockindex *));
+    btc_headers_db_window_reset(db);
+    btc_headers_db_release_hdrs(db, released);
+}
+
 void btc_headers_db_free(btc_headers_db* db) {
 
     if (!db)
@@ -94,6 +383,19 @@ void btc_headers_db_free(btc_headers_db* db) {
         db->tree_root = NULL;
     }
 
+    btc_free(db->window);
+    db->window = NULL;
+    vector_free(db->fork_headers, true);
+
+    for (size_t i = 0; i < db->orphans->len; i++) {
+        btc_headers_db_orphan *orphan = vector_idx(db->orphans, i);
+        btc_free(orphan->pindex);
+        btc_free(orphan);
+    }
+    vector_free(db->orphans, true);
+    btc_btree_tdestroy(db->orphans_by_prev, btc_headers_db_orphan_bucket_free);
+    db->orphans_by_prev = NULL;
+
     btc_free(db);
 }
 
@@ -177,6 +479,8 @@ btc_bool btc_headers_db_load(btc_headers_db* db, const char *file_path) {
                     btc_block_header_hash(&chainheader->header, (uint8_t *)&chainheader->hash);
                     chainheader->prev = NULL;
                     db->chaintip = chainheader;
+                    db->chainbottom = chainheader;
+                    btc_headers_db_window_reset(db);
                     firstblock = false;
                 }
                 else {
@@ -207,17 +511,85 @@ btc_bool btc_headers_db_write(btc_headers_db* db, btc_blockindex *blockindex) {
     return (res == 1);
 }
 
+/* links a header to its (known) parent and stores it */
+static void btc_headers_db_link_hdr(btc_headers_db* db, btc_blockindex *blockindex, btc_blockindex *connect_at, btc_bool load_process) {
+    btc_bool on_fork = (connect_at != db->chaintip);
+
+    /* TODO: check claimed PoW */
+    blockindex->prev = connect_at;
+    blockindex->height = connect_at->height+1;
+    btc_blockindex_build_skip(blockindex, db->chainbottom->height);
+
+    /* TODO: check if we should switch to the fork with most work (instead of height) */
+    if (blockindex->height > db->chaintip->height) {
+        if (on_fork) {
+            /* TODO: walk back to the fork point and call reorg callback */
+            printf("Switch to the fork!\n");
+        }
+        btc_blockindex *oldtip = db->chaintip;
+        db->chaintip = blockindex;
+        btc_headers_db_window_connect_tip(db, oldtip, blockindex);
+    }
+    else if (db->window) {
+        vector_add(db->fork_headers, blockindex);
+    }
+    /* store in db */
+    if (!load_process && db->read_write_file)
+    {
+        if (!btc_headers_db_write(db, blockindex)) {
+            fprintf(stderr, "Error writing blockheader to database\n");
+        }
+    }
+    if (db->use_binary_tree) {
+        tsearch(blockindex, &db->tree_root, btc_header_compare);
+    }
+}
+
+/* connects all orphans descending from the given (connected) header */
+static void btc_headers_db_connect_orphans(btc_headers_db* db, btc_blockindex *parent, btc_bool load_process) {
+    if (db->orphans->len == 0)
+        return;
+
+    vector *parents = vector_new(8, NULL);
+    vector_add(parents, parent);
+    while (parents->len > 0) {
+        btc_blockindex *pindex = vector_idx(parents, parents->len - 1);
+        vector_remove_idx(parents, parents->len - 1);
+
+        btc_headers_db_orphan_bucket *bucket = btc_headers_db_orphan_bucket_find(db, pindex->hash);
+        if (!bucket)
+            continue;
+        tdelete(bucket, &db->orphans_by_prev, btc_headers_db_orphan_bucket_compare);
+
+        for (size_t i = 0; i < bucket->orphans->len; i++) {
+            btc_headers_db_orphan *orphan = vector_idx(bucket->orphans, i);
+            vector_remove(db->orphans, orphan);
+            db->orphan_stats.count--;
+            db->orphan_stats.mem_bytes -= btc_headers_db_orphan_mem();
+            db->orphan_stats.connected++;
+
+            btc_headers_db_link_hdr(db, orphan->pindex, pindex, load_process);
+            vector_add(parents, orphan->pindex);
+            btc_free(orphan);
+        }
+        btc_headers_db_orphan_bucket_free(bucket);
+    }
+    vector_free(parents, true);
+}
+
 btc_blockindex * btc_headers_db_connect_hdr(btc_headers_db* db, struct const_buffer *buf, btc_bool load_process, btc_bool *connected) {
     *connected = false;
 
     btc_blockindex *blockindex = btc_calloc(1, sizeof(btc_blockindex));
-    if (!btc_block_header_deserialize(&blockindex->header, buf)) return NULL;
+    if (!btc_block_header_deserialize(&blockindex->header, buf)) {
+        btc_free(blockindex);
+        return NULL;
+    }
 
     /* calculate block hash */
     btc_block_header_hash(&blockindex->header, (uint8_t *)&blockindex->hash);
 
     btc_blockindex *connect_at = NULL;
-    btc_blockindex *fork_from_block = NULL;
     /* try to connect it to the chain tip */
     if (memcmp(blockindex->header.prev_block, db->chaintip->hash, BTC_HASH_LENGTH) == 0)
     {
@@ -225,91 +597,243 @@ btc_blockindex * btc_headers_db_connect_hdr(btc_headers_db* db, struct const_buf
     }
     else {
         // check if we know the prevblock
-        fork_from_block = btc_headersdb_find(db, blockindex->header.prev_block);
-        if (fork_from_block) {
+        connect_at = btc_headersdb_find(db, blockindex->header.prev_block);
+        if (connect_at) {
             /* block found */
             printf("Block found on a fork...\n");
-            connect_at = fork_from_block;
         }
     }
 
     if (connect_at != NULL) {
-        /* TODO: check claimed PoW */
-        blockindex->prev = connect_at;
-        blockindex->height = connect_at->height+1;
-
-        /* TODO: check if we should switch to the fork with most work (instead of height) */
-        if (blockindex->height > db->chaintip->height) {
-            if (fork_from_block) {
-                /* TODO: walk back to the fork point and call reorg callback */
-                printf("Switch to the fork!\n");
-            }
-            db->chaintip = blockindex;
+        btc_headers_db_link_hdr(db, blockindex, connect_at, load_process);
+        *connected = true;
+
+        /* the header may be the parent of orphans */
+        btc_headers_db_connect_orphans(db, blockindex, load_process);
+    }
+    else {
+        char hex[65] = {0};
+        utils_bin_to_hex(blockindex->hash, BTC_HASH_LENGTH, hex);
+        printf("Failed connecting header at height %d (%s), keeping it as orphan\n", db->chaintip->height, hex);
+        blockindex = btc_headers_db_add_orphan(db, blockindex);
+    }
+
+    return blockindex;
+}
+
+btc_bool btc_headers_db_export_snapshot(btc_headers_db* db, const btc_chainparams* chainparams, const char *filename) {
+    uint32_t count = db->chaintip->height - db->chainbottom->height;
+    btc_blockindex **chain = btc_calloc(count + 1, sizeof(btc_blockindex *));
+    btc_blockindex *pindex = db->chaintip;
+    for (uint32_t i = count; i > 0; i--) {
+        if (!pindex) {
+            btc_free(chain);
+            return false;
         }
-        /* store in db */
-        if (!load_process && db->read_write_file)
-        {
-            if (!btc_headers_db_write(db, blockindex)) {
-                fprintf(stderr, "Error writing blockheader to database\n");
-            }
+        chain[i] = pindex;
+        pindex = pindex->prev;
+    }
+
+    FILE *file = fopen(filename, "wb");
+    if (!file) {
+        btc_free(chain);
+        return false;
+    }
+
+    cstring *rec = cstr_new_sz(BTC_HEADERS_SNAPSHOT_HDR_SIZE + BTC_HEADERS_SNAPSHOT_BATCH * 80);
+    ser_bytes(rec, snapshot_hdr_magic, sizeof(snapshot_hdr_magic));
+    ser_u32(rec, snapshot_version);
+    ser_bytes(rec, chainparams->netmagic, sizeof(chainparams->netmagic));
+    ser_u32(rec, db->chainbottom->height);
+    ser_u256(rec, db->chainbottom->hash);
+    ser_u32(rec, count);
+
+    btc_bool res = true;
+    for (uint32_t i = 1; i <= count && res; i++) {
+        btc_block_header_serialize(rec, &chain[i]->header);
+        if (i % BTC_HEADERS_SNAPSHOT_BATCH == 0 || i == count) {
+            res = (fwrite(rec->str, rec->len, 1, file) == 1);
+            cstr_resize(rec, 0);
         }
-        if (db->use_binary_tree) {
-            btc_blockindex *retval = tsearch(blockindex, &db->tree_root, btc_header_compare);
+    }
+    if (count == 0)
+        res = (fwrite(rec->str, rec->len, 1, file) == 1);
+    if (res)
+        btc_file_commit(file);
+
+    cstr_free(rec, true);
+    btc_free(chain);
+    fclose(file);
+    return res;
+}
+
+uint8_t * btc_headers_snapshot_read(const btc_chainparams* chainparams, const char *filename, const uint8_t *pinned_hash, uint32_t *base_height_out, btc_uint256 base_hash_out, uint32_t *count_out) {
+    FILE *file = fopen(filename, "rb");
+    if (!file)
+        return NULL;
+
+    uint8_t hdr[BTC_HEADERS_SNAPSHOT_HDR_SIZE];
+    struct stat st;
+    if (fread(hdr, sizeof(hdr), 1, file) != 1 || fstat(fileno(file), &st) != 0) {
+        fclose(file);
+        return NULL;
+    }
+    struct const_buffer cbuf = {hdr, sizeof(hdr)};
+    uint8_t magic[4];
+    uint8_t netmagic[4];
+    uint32_t version, base_height, count;
+    btc_uint256 base_hash;
+    deser_bytes(magic, &cbuf, sizeof(magic));
+    deser_u32(&version, &cbuf);
+    deser_bytes(netmagic, &cbuf, sizeof(netmagic));
+    deser_u32(&base_height, &cbuf);
+    deser_u256(base_hash, &cbuf);
+    deser_u32(&count, &cbuf);
+    if (memcmp(magic, snapshot_hdr_magic, sizeof(magic)) != 0 || version > snapshot_version ||
+        memcmp(netmagic, chainparams->netmagic, sizeof(netmagic)) != 0 ||
+        (uint64_t)st.st_size != BTC_HEADERS_SNAPSHOT_HDR_SIZE + (uint64_t)count * 80) {
+        fprintf(stderr, "Invalid or unsupported header snapshot\n");
+        fclose(file);
+        return NULL;
+    }
+
+    /* pin the final hash, use a compiled-in checkpoint if no hash is given */
+    btc_uint256 pinned;
+    btc_bool have_pin = false;
+    if (pinned_hash) {
+        memcpy(pinned, pinned_hash, sizeof(pinned));
+        have_pin = true;
+    }
+    else if (chainparams == &btc_chainparams_main) {
+        for (unsigned int i = 0; i < sizeof(btc_mainnet_checkpoint_array) / sizeof(btc_mainnet_checkpoint_array[0]); i++) {
+            if (btc_mainnet_checkpoint_array[i].height == base_height + count) {
+                utils_uint256_sethex((char *)btc_mainnet_checkpoint_array[i].hash, (uint8_t *)pinned);
+                have_pin = true;
+            }
         }
+    }
+    if (!have_pin) {
+        fprintf(stderr, "No checkpoint for header snapshot height %u\n", base_height + count);
+        fclose(file);
+        return NULL;
+    }
 
-        if (db->max_hdr_in_mem > 0) {
-            // de-allocate no longer required headers
-            // keep them only on-disk
-            btc_blockindex *scan_tip = db->chaintip;
-            for(unsigned int i = 0; i<db->max_hdr_in_mem+1;i++)
-            {
-                if (scan_tip->prev)
-                    scan_tip = scan_tip->prev;
-                else {
-                    break;
-                }
+    /* read the headers once, the verified buffer is what gets connected (no PoW checks) */
+    uint8_t *headers = btc_malloc(count > 0 ? (size_t)count * 80 : 1);
+    btc_bool valid = (count == 0 || fread(headers, 80, count, file) == count);
+    fclose(file);
+
+    btc_uint256 hash;
+    btc_block_header header;
+    memcpy(hash, base_hash, sizeof(hash));
+    struct const_buffer hbuf = {headers, (size_t)count * 80};
+    for (uint32_t i = 0; i < count && valid; i++) {
+        valid = btc_block_header_deserialize(&header, &hbuf) && btc_hash_equal(header.prev_block, hash);
+        btc_block_header_hash(&header, hash);
+    }
+    if (!valid || !btc_hash_equal(hash, pinned)) {
+        fprintf(stderr, "Header snapshot verification failed\n");
+        btc_free(headers);
+        return NULL;
+    }
+
+    *base_height_out = base_height;
+    memcpy(base_hash_out, base_hash, sizeof(btc_uint256));
+    *count_out = count;
+    return headers;
+}
 
-                if (scan_tip && i == db->max_hdr_in_mem && scan_tip != &db->genesis) {
-                    if (scan_tip->prev && scan_tip->prev != &db->genesis) {
-                        tdelete(scan_tip->prev, &db->tree_root, btc_header_compare);
-                        btc_free(scan_tip->prev);
+btc_bool btc_headers_db_import_snapshot(btc_headers_db* db, const btc_chainparams* chainparams, const char *filename, const uint8_t *pinned_hash) {
+    uint32_t base_height, count;
+    btc_uint256 base_hash;
+    uint8_t *headers = btc_headers_snapshot_read(chainparams, filename, pinned_hash, &base_height, base_hash, &count);
+    if (!headers)
+        return false;
+
+    /* the snapshot must extend our chain (or start a new chain from its base) */
+    btc_bool empty_chain = (db->chaintip == db->chainbottom && db->chaintip->height == 0);
+    if (!(empty_chain && base_height > 0) &&
+        (base_height != db->chaintip->height || !btc_hash_equal(base_hash, db->chaintip->hash))) {
+        fprintf(stderr, "Header snapshot does not connect to the chain tip\n");
+        btc_free(headers);
+        return false;
+    }
 
-                        scan_tip->prev = NULL;
-                        db->chainbottom = scan_tip;
-                    }
-                }
+    /* write the database records first with a single commit, nothing gets connected if that fails */
+    btc_bool res = true;
+    if (db->read_write_file) {
+        fseek(db->headers_tree_file, 0, SEEK_END);
+        long file_size = ftell(db->headers_tree_file);
+        cstring *rec = cstr_new_sz(BTC_HEADERS_SNAPSHOT_BATCH * (32 + 4 + 80));
+        struct const_buffer hbuf = {headers, (size_t)count * 80};
+        btc_block_header header;
+        btc_uint256 hash;
+        for (uint32_t i = 0; i < count && res; i++) {
+            btc_block_header_deserialize(&header, &hbuf);
+            btc_block_header_hash(&header, hash);
+            ser_u256(rec, hash);
+            ser_u32(rec, base_height + i + 1);
+            btc_block_header_serialize(rec, &header);
+            if ((i + 1) % BTC_HEADERS_SNAPSHOT_BATCH == 0 || i + 1 == count) {
+                res = (fwrite(rec->str, rec->len, 1, db->headers_tree_file) == 1);
+                cstr_resize(rec, 0);
             }
         }
-        *connected = true;
+        cstr_free(rec, true);
+        res = res && (fflush(db->headers_tree_file) == 0);
+        if (!res) {
+            /* drop the partially written records */
+            fprintf(stderr, "Writing the header snapshot to the database failed\n");
+            if (file_size < 0 || ftruncate(fileno(db->headers_tree_file), file_size) != 0)
+                fprintf(stderr, "Could not remove the partially written headers from the database\n");
+            fseek(db->headers_tree_file, 0, SEEK_END);
+            btc_free(headers);
+            return false;
+        }
+        btc_file_commit(db->headers_tree_file);
     }
-    else {
-        //TODO, add to orphans
-        char hex[65] = {0};
-        utils_bin_to_hex(blockindex->hash, BTC_HASH_LENGTH, hex);
-        printf("Failed connecting header at height %d (%s)\n", db->chaintip->height, hex);
+
+    /* bulk connect the verified headers */
+    if (empty_chain && base_height > 0)
+        btc_headersdb_set_checkpoint_start(db, base_hash, base_height);
+    struct const_buffer hbuf = {headers, (size_t)count * 80};
+    for (uint32_t i = 0; i < count; i++) {
+        btc_blockindex *blockindex = btc_calloc(1, sizeof(btc_blockindex));
+        btc_block_header_deserialize(&blockindex->header, &hbuf);
+        btc_block_header_hash(&blockindex->header, (uint8_t *)&blockindex->hash);
+        btc_headers_db_link_hdr(db, blockindex, db->chaintip, true);
     }
 
-    return blockindex;
+    btc_free(headers);
+    return res;
 }
 
-void btc_headers_db_fill_block_locator(btc_headers_db* db, vector *blocklocators)
+size_t btc_headers_db_fill_block_locator(btc_headers_db* db, btc_uint256 *locators, size_t max_locators)
 {
-    btc_blockindex *scan_tip = db->chaintip;
-    if (scan_tip->height > 0)
+    size_t count = 0;
+    uint32_t step = 1;
+    uint32_t bottom_height = db->chainbottom->height;
+    btc_blockindex *pindex = db->chaintip;
+
+    /* first 10 headers back-to-back, then step back exponentially
+       down to the bottom of the chain (genesis or checkpoint) */
+    while (pindex && count < max_locators)
     {
-        for(int i = 0; i<10;i++)
-        {
-            //TODO: try to share memory and avoid heap allocation
-            btc_uint256 *hash = btc_calloc(1, sizeof(btc_uint256));
-            memcpy(hash, scan_tip->hash, sizeof(btc_uint256));
-
-            vector_add(blocklocators, (void *)hash);
-            if (scan_tip->prev)
-                scan_tip = scan_tip->prev;
-            else
-                break;
-        }
+        memcpy(locators[count], pindex->hash, sizeof(btc_uint256));
+        count++;
+        if (pindex->height <= bottom_height)
+            return count;
+
+        uint32_t height = (pindex->height - bottom_height > step) ? pindex->height - step : bottom_height;
+        pindex = btc_headersdb_get_ancestor(db, pindex, height);
+        if (count > 10)
+            step *= 2;
     }
+
+    /* always terminate the locator with the chain bottom */
+    if (count == max_locators && count > 0)
+        memcpy(locators[count-1], db->chainbottom->hash, sizeof(btc_uint256));
+    return count;
 }
 
 btc_blockindex * btc_headersdb_find(btc_headers_db* db, btc_uint256 hash) {
@@ -327,18 +851,36 @@ btc_blockindex * btc_headersdb_find(btc_headers_db* db, btc_uint256 hash) {
     return NULL;
 }
 
+btc_blockindex * btc_headersdb_get_ancestor(btc_headers_db* db, btc_blockindex *pindex, uint32_t height) {
+    /* headers below the chain bottom are not (or no longer) in memory */
+    if (height < db->chainbottom->height)
+        return NULL;
+    return btc_blockindex_get_ancestor(pindex, height);
+}
+
 btc_blockindex * btc_headersdb_getchaintip(btc_headers_db* db) {
     return db->chaintip;
 }
 
+btc_blockindex * btc_headersdb_get_by_height(btc_headers_db* db, uint32_t height) {
+    return btc_headersdb_get_ancestor(db, db->chaintip, height);
+}
+
+uint32_t btc_headersdb_lowest_height(btc_headers_db* db) {
+    return db->chainbottom->height;
+}
+
 btc_bool btc_headersdb_disconnect_tip(btc_headers_db* db) {
     if (db->chaintip->prev)
     {
         btc_blockindex *oldtip = db->chaintip;
         db->chaintip = db->chaintip->prev;
-        /* disconnect/remove the chaintip */
-        tdelete(oldtip, &db->tree_root, btc_header_compare);
-        btc_free(oldtip);
+        if (db->window)
+            *btc_headers_db_window_slot(db, oldtip->height) = NULL;
+        /* disconnect/remove the chaintip (and the forks on top of it) */
+        vector *released = vector_new(1, NULL);
+        vector_add(released, oldtip);
+        btc_headers_db_release_hdrs(db, released);
         return true;
     }
     return false;
@@ -353,4 +895,5 @@ void btc_headersdb_set_checkpoint_start(btc_headers_db* db, btc_uint256 hash, ui
     db->chainbottom->height = height;
     memcpy(db->chainbottom->hash, hash, sizeof(btc_uint256));
     db->chaintip = db->chainbottom;
+    btc_headers_db_window_reset(db);
 }
@@ -2,7 +2,9 @@
 
 #include <event2/buffer.h>
 #include <event2/bufferevent.h>
+#include <event2/dns.h>
 #include <event2/event.h>
+#include <event2/thread.h>
 
 #include <btc/buffer.h>
 #include <btc/chainparams.h>
@@ -23,7 +25,9 @@
 #endif
 
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -31,9 +35,27 @@
 
 #define UNUSED(x) (void)(x)
 
+/* socket errors after which a write can be tried again (the public libevent headers don't export theirs) */
+#ifdef _WIN32
+#define BTC_NET_ERR_RW_RETRIABLE(e) ((e) == WSAEWOULDBLOCK || (e) == WSAEINTR)
+#else
+#define BTC_NET_ERR_RW_RETRIABLE(e) ((e) == EINTR || (e) == EAGAIN || (e) == EWOULDBLOCK)
+#endif
+
 static const int BTC_PERIODICAL_NODE_TIMER_S = 3;
 static const int BTC_PING_INTERVAL_S = 180;
 static const int BTC_CONNECT_TIMEOUT_S = 10;
+static const int BTC_DNS_SEED_TIMEOUT_S = 10;
+static const int BTC_DNS_RESEED_INTERVAL_S = 60;
+
+/* assumed performance of unmeasured nodes */
+static const uint64_t BTC_NODE_DEFAULT_RTT_MS = 500;
+static const uint64_t BTC_NODE_DEFAULT_THROUGHPUT = 100 * 1024;
+/* nodes are compared by the expected time for a full headers message */
+static const uint64_t BTC_NODE_SCORE_RESPONSE_SIZE = 2000 * 81;
+/* responses of at least this size measure the throughput, smaller ones the latency */
+static const size_t BTC_NODE_THROUGHPUT_MIN_SIZE = 16 * 1024;
+static const uint64_t BTC_NODE_MIN_OVERDUE_MS = 5000;
 
 int net_write_log_printf(const char* format, ...)
 {
@@ -51,87 +73,818 @@ int net_write_log_null(const char* format, ...)
     return 1;
 }
 
-void read_cb(struct bufferevent* bev, void* ctx)
+/* received message waiting for (or done with) the checksum verification */
+typedef struct btc_node_verify_job_ {
+    btc_node* node;
+    btc_p2p_msg_hdr hdr;
+    unsigned char* payload;
+    btc_bool valid;
+    btc_bool done;
+    struct btc_node_verify_job_* next_work; /* work queue */
+    struct btc_node_verify_job_* next; /* delivery queue (in receive order) */
+} btc_node_verify_job;
+
+typedef struct btc_node_verify_pool_ {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t* threads;
+    unsigned int threads_count;
+    btc_bool shutdown;
+
+    btc_node_verify_job* work_head;
+    btc_node_verify_job* work_tail;
+    btc_node_verify_job* deliver_head;
+    btc_node_verify_job* deliver_tail;
+
+    /* wakes up the event loop once jobs are done
+       only pending while jobs are in flight (an idle pool doesn't keep the loop running) */
+    evutil_socket_t notify_fds[2];
+    struct event* notify_event;
+    btc_bool notify_pending;
+    btc_node_group* group;
+} btc_node_verify_pool;
+
+void read_cb(struct bufferevent* bev, void* ctx);
+void write_cb(struct bufferevent* ev, void* ctx);
+void event_cb(struct bufferevent* ev, short type, void* ctx);
+static void btc_node_flush_cb(evutil_socket_t fd, short event, void* ctx);
+static int btc_node_parse_message_payload(btc_node* node, btc_p2p_msg_hdr* hdr, struct const_buffer* buf, unsigned char* payload);
+static void btc_node_group_dns_free(btc_node_group* group);
+static void btc_node_group_cancel_seed_queries(btc_node_group* group);
+void node_periodical_timer(int fd, short event, void* ctx);
+
+static btc_bool btc_p2p_checksum_valid(const btc_p2p_msg_hdr* hdr, const unsigned char* payload)
 {
-    struct evbuffer* input = bufferevent_get_input(bev);
-    if (!input)
-        return;
+    btc_uint256 hash;
+    btc_hash(payload, hdr->data_len, hash);
+    return (memcmp(hash, hdr->hash, sizeof(hdr->hash)) == 0);
+}
 
-    size_t length = evbuffer_get_length(input);
+static void* btc_node_verify_worker(void* ctx)
+{
+    btc_node_verify_pool* pool = (btc_node_verify_pool*)ctx;
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        while (!pool->work_head && !pool->shutdown)
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        if (pool->shutdown)
+            break;
+        btc_node_verify_job* job = pool->work_head;
+        pool->work_head = job->next_work;
+        if (!pool->work_head)
+            pool->work_tail = NULL;
+        pthread_mutex_unlock(&pool->lock);
+
+        btc_bool valid = btc_p2p_checksum_valid(&job->hdr, job->payload);
+
+        pthread_mutex_lock(&pool->lock);
+        job->valid = valid;
+        job->done = true;
+        /* the event loop drains all pending notifications at once */
+        char c = 0;
+        if (send(pool->notify_fds[1], &c, 1, 0) < 0) {
+            /* notification pipe is full, the loop will pick up this job anyway */
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
 
-    btc_node* node = (btc_node*)ctx;
+/* completion handler on the event loop, delivers verified messages in receive order */
+static void btc_node_verify_pool_notify_cb(evutil_socket_t fd, short event, void* ctx)
+{
+    UNUSED(event);
+    btc_node_verify_pool* pool = (btc_node_verify_pool*)ctx;
+    char buf[256];
+    while (recv(fd, buf, sizeof(buf), 0) > 0) {
+    }
 
-    if ((node->state & NODE_CONNECTED) != NODE_CONNECTED) {
-        // ignore messages from disconnected peers
+    pthread_mutex_lock(&pool->lock);
+    btc_node_verify_job* done_head = NULL;
+    btc_node_verify_job* done_tail = NULL;
+    while (pool->deliver_head && pool->deliver_head->done) {
+        btc_node_verify_job* job = pool->deliver_head;
+        pool->deliver_head = job->next;
+        job->next = NULL;
+        if (done_tail)
+            done_tail->next = job;
+        else
+            done_head = job;
+        done_tail = job;
+    }
+    if (!pool->deliver_head) {
+        pool->deliver_tail = NULL;
+        event_del(pool->notify_event);
+        pool->notify_pending = false;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    while (done_head) {
+        btc_node_verify_job* job = done_head;
+        btc_node* node = job->node;
+        done_head = job->next;
+
+        node->recv_pending_bytes -= job->hdr.data_len;
+        if ((node->state & NODE_CONNECTED) == NODE_CONNECTED && node->event_bev) {
+            if (!job->valid) {
+                node->nodegroup->log_write_cb("Invalid checksum for command %s from node %d\n", job->hdr.command, node->nodeid);
+                btc_node_missbehave(node);
+            }
+            else {
+                struct const_buffer cmd_data_buf = {job->payload, job->hdr.data_len};
+                btc_node_parse_message(node, &job->hdr, &cmd_data_buf);
+            }
+        }
+        btc_free(job->payload);
+        btc_free(job);
+
+        /* continue reading if we stopped because of too many pending messages */
+        if (node->recv_paused && node->recv_pending_bytes < BTC_P2P_RECV_BUFFER_LIMIT) {
+            node->recv_paused = false;
+            if ((node->state & NODE_CONNECTED) == NODE_CONNECTED && node->event_bev)
+                read_cb(node->event_bev, node);
+        }
+    }
+}
+
+static void btc_node_verify_pool_submit(btc_node_verify_pool* pool, btc_node* node, const btc_p2p_msg_hdr* hdr, struct evbuffer* input)
+{
+    btc_node_verify_job* job = btc_calloc(1, sizeof(*job));
+    job->node = node;
+    memcpy(&job->hdr, hdr, sizeof(*hdr));
+    job->payload = btc_malloc(hdr->data_len > 0 ? hdr->data_len : 1);
+    evbuffer_drain(input, BTC_P2P_HDRSZ);
+    evbuffer_remove(input, job->payload, hdr->data_len);
+    node->recv_pending_bytes += hdr->data_len;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->deliver_tail)
+        pool->deliver_tail->next = job;
+    else
+        pool->deliver_head = job;
+    pool->deliver_tail = job;
+    if (pool->work_tail)
+        pool->work_tail->next_work = job;
+    else
+        pool->work_head = job;
+    pool->work_tail = job;
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    if (!pool->notify_pending) {
+        event_add(pool->notify_event, NULL);
+        pool->notify_pending = true;
+    }
+}
+
+static void btc_node_verify_pool_free(btc_node_verify_pool* pool)
+{
+    if (!pool)
         return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = true;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    for (unsigned int i = 0; i < pool->threads_count; i++)
+        pthread_join(pool->threads[i], NULL);
+
+    btc_node_verify_job* job = pool->deliver_head;
+    while (job) {
+        btc_node_verify_job* next = job->next;
+        btc_free(job->payload);
+        btc_free(job);
+        job = next;
     }
-    // expand the cstring buffer if required
-    cstr_alloc_minsize(node->recvBuffer, node->recvBuffer->len + length);
 
-    // copy direct to cstring, avoid another heap buffer
-    evbuffer_copyout(input, node->recvBuffer->str + node->recvBuffer->len, length);
-    node->recvBuffer->len += length;
+    if (pool->notify_event) {
+        event_del(pool->notify_event);
+        event_free(pool->notify_event);
+    }
+    evutil_closesocket(pool->notify_fds[0]);
+    evutil_closesocket(pool->notify_fds[1]);
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->lock);
+    btc_free(pool->threads);
+    btc_free(pool);
+}
+
+btc_bool btc_node_group_set_verify_threads(btc_node_group* group, unsigned int threads)
+{
+    btc_node_verify_pool_free(group->verify_pool);
+    group->verify_pool = NULL;
+    if (threads == 0)
+        return true;
 
-    // drain the event buffer
-    evbuffer_drain(input, length);
+    /* sharded groups verify the checksums on the shards */
+    if (group->shards)
+        return false;
 
-    struct const_buffer buf = {node->recvBuffer->str, node->recvBuffer->len};
+    btc_node_verify_pool* pool = btc_calloc(1, sizeof(*pool));
+    pool->group = group;
+    if (evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, pool->notify_fds) != 0) {
+        btc_free(pool);
+        return false;
+    }
+    evutil_make_socket_nonblocking(pool->notify_fds[0]);
+    evutil_make_socket_nonblocking(pool->notify_fds[1]);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    pool->notify_event = event_new(group->event_base, pool->notify_fds[0], EV_READ | EV_PERSIST, btc_node_verify_pool_notify_cb, pool);
+
+    pool->threads = btc_calloc(threads, sizeof(pthread_t));
+    for (unsigned int i = 0; i < threads; i++) {
+        if (pthread_create(&pool->threads[i], NULL, btc_node_verify_worker, pool) != 0)
+            break;
+        pool->threads_count++;
+    }
+    group->verify_pool = pool;
+    if (pool->threads_count == 0) {
+        btc_node_verify_pool_free(pool);
+        group->verify_pool = NULL;
+        return false;
+    }
+    return true;
+}
+
+enum btc_node_group_event_type {
+    GROUP_EVENT_MESSAGE,
+    GROUP_EVENT_STATE_CHANGED,
+    GROUP_EVENT_HANDSHAKE_DONE,
+    GROUP_EVENT_TIMER,
+    GROUP_EVENT_SEND_QUEUE,
+};
+
+/* node event handed over from a shard to the thread running the group event loop */
+typedef struct btc_node_group_event_ {
+    struct btc_node_group_event_* next;
+    enum btc_node_group_event_type type;
+    btc_node* node;
     btc_p2p_msg_hdr hdr;
-    char* read_upto = NULL;
+    unsigned char* payload;
+    size_t payload_offset; /* of the message data (the handlers may have consumed a part) */
+    size_t payload_len;
+    uint64_t time; /* timer time or the send queue paused flag */
+} btc_node_group_event;
+
+typedef struct btc_node_group_shards_ {
+    unsigned int count;
+    struct event_base** bases;
+    pthread_t* threads;
+    int running;
+    int shutdown;
+
+    /* guards the node list and the connection state transitions (recursive) */
+    pthread_mutex_t lock;
+
+    /* guards the node statistics, one per shard */
+    pthread_mutex_t* stats_locks;
+
+    /* lock-free multi-producer/single-consumer queue of group events
+       the shards push to head, the group event loop pops from tail */
+    btc_node_group_event* head;
+    btc_node_group_event* tail;
+    btc_node_group_event stub;
+    int notify_pending;
+    struct event* notify_event;
+} btc_node_group_shards;
+
+/* the shard event base the current thread is running */
+static __thread struct event_base* btc_net_current_shard = NULL;
+
+static void btc_node_group_lock(btc_node_group* group)
+{
+    if (group->shards)
+        pthread_mutex_lock(&group->shards->lock);
+}
+
+static void btc_node_group_unlock(btc_node_group* group)
+{
+    if (group->shards)
+        pthread_mutex_unlock(&group->shards->lock);
+}
+
+static void btc_node_group_event_push(btc_node_group_shards* shards, btc_node_group_event* ev)
+{
+    __atomic_store_n(&ev->next, NULL, __ATOMIC_RELAXED);
+    btc_node_group_event* prev = __atomic_exchange_n(&shards->head, ev, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, ev, __ATOMIC_RELEASE);
+}
+
+static btc_node_group_event* btc_node_group_event_pop(btc_node_group_shards* shards)
+{
+    btc_node_group_event* tail = shards->tail;
+    btc_node_group_event* next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (tail == &shards->stub) {
+        if (!next)
+            return NULL;
+        shards->tail = next;
+        tail = next;
+        next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    }
+    if (next) {
+        shards->tail = next;
+        return tail;
+    }
+    if (tail != __atomic_load_n(&shards->head, __ATOMIC_ACQUIRE)) {
+        /* a shard is in the middle of a push, it will notify once the event is linked */
+        return NULL;
+    }
+    btc_node_group_event_push(shards, &shards->stub);
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (next) {
+        shards->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+static void btc_node_group_event_free(btc_node_group_event* ev)
+{
+    btc_free(ev->payload);
+    btc_free(ev);
+}
+
+/* hand a node event over to the group event loop
+   the message data in buf is copied unless it points into payload, the event takes the ownership of payload */
+static void btc_node_group_post_event(btc_node* node, enum btc_node_group_event_type type, const btc_p2p_msg_hdr* hdr, const struct const_buffer* buf, unsigned char* payload, uint64_t time)
+{
+    btc_node_group_shards* shards = node->nodegroup->shards;
+    btc_node_group_event* ev = btc_calloc(1, sizeof(*ev));
+    ev->type = type;
+    ev->node = node;
+    ev->time = time;
+    if (hdr)
+        memcpy(&ev->hdr, hdr, sizeof(*hdr));
+    if (payload) {
+        ev->payload = payload;
+        ev->payload_offset = (const unsigned char*)buf->p - payload;
+        ev->payload_len = buf->len;
+    } else if (buf && buf->len > 0) {
+        ev->payload = btc_malloc(buf->len);
+        memcpy(ev->payload, buf->p, buf->len);
+        ev->payload_len = buf->len;
+    }
+    btc_node_group_event_push(shards, ev);
+
+    /* wake up the group event loop unless a wakeup is already pending */
+    if (!__atomic_exchange_n(&shards->notify_pending, 1, __ATOMIC_SEQ_CST))
+        event_active(shards->notify_event, EV_READ, 0);
+}
+
+/* runs on the thread running the group event loop, calls the application callbacks */
+static void btc_node_group_notify_cb(evutil_socket_t fd, short event, void* ctx)
+{
+    UNUSED(fd);
+    UNUSED(event);
+    btc_node_group* group = (btc_node_group*)ctx;
+    btc_node_group_shards* shards = group->shards;
+
+    __atomic_exchange_n(&shards->notify_pending, 0, __ATOMIC_SEQ_CST);
+    btc_node_group_event* ev;
+    while ((ev = btc_node_group_event_pop(shards)) != NULL) {
+        btc_node* node = ev->node;
+        switch (ev->type) {
+        case GROUP_EVENT_MESSAGE:
+            if (group->postcmd_cb) {
+                struct const_buffer buf = {ev->payload + ev->payload_offset, ev->payload_len};
+                group->postcmd_cb(node, &ev->hdr, &buf);
+            }
+            break;
+        case GROUP_EVENT_STATE_CHANGED:
+            if (group->node_connection_state_changed_cb)
+                group->node_connection_state_changed_cb(node);
+            break;
+        case GROUP_EVENT_HANDSHAKE_DONE:
+            if (group->handshake_done_cb)
+                group->handshake_done_cb(node);
+            break;
+        case GROUP_EVENT_TIMER:
+            if (group->periodic_timer_cb)
+                group->periodic_timer_cb(node, &ev->time);
+            break;
+        case GROUP_EVENT_SEND_QUEUE:
+            if (group->send_queue_cb)
+                group->send_queue_cb(node, (ev->time != 0));
+            break;
+        }
+        btc_node_group_event_free(ev);
+    }
+}
+
+static void* btc_node_group_shard_thread(void* ctx)
+{
+    struct event_base* base = (struct event_base*)ctx;
+    btc_net_current_shard = base;
+    event_base_loop(base, EVLOOP_NO_EXIT_ON_EMPTY);
+    btc_net_current_shard = NULL;
+    return NULL;
+}
+
+static struct event_base* btc_node_event_base(btc_node* node)
+{
+    btc_node_group_shards* shards = node->nodegroup->shards;
+    if (!shards)
+        return node->nodegroup->event_base;
+    return shards->bases[node->nodeid % shards->count];
+}
+
+static void btc_node_stats_lock(btc_node* node)
+{
+    btc_node_group_shards* shards = node->nodegroup->shards;
+    if (shards)
+        pthread_mutex_lock(&shards->stats_locks[node->nodeid % shards->count]);
+}
+
+static void btc_node_stats_unlock(btc_node* node)
+{
+    btc_node_group_shards* shards = node->nodegroup->shards;
+    if (shards)
+        pthread_mutex_unlock(&shards->stats_locks[node->nodeid % shards->count]);
+}
+
+typedef struct btc_node_task_ {
+    btc_node* node;
+    void (*fn)(btc_node* node, cstring* data); /* takes the ownership of data */
+    cstring* data;
+    vector* parts; /* payload of a framed message, data is its header (fn is NULL) */
+} btc_node_task;
+
+static void btc_node_enqueue_framed(btc_node* node, cstring* header, vector* parts);
+
+static void btc_node_task_cb(evutil_socket_t fd, short event, void* ctx)
+{
+    UNUSED(fd);
+    UNUSED(event);
+    btc_node_task* task = (btc_node_task*)ctx;
+    if (task->fn)
+        task->fn(task->node, task->data);
+    else
+        btc_node_enqueue_framed(task->node, task->data, task->parts);
+    btc_free(task);
+}
+
+/* returns true if the calling thread is allowed to touch the nodes events */
+static btc_bool btc_node_on_shard(btc_node* node)
+{
+    btc_node_group_shards* shards = node->nodegroup->shards;
+    if (!shards || !__atomic_load_n(&shards->running, __ATOMIC_ACQUIRE))
+        return true;
+    return (btc_net_current_shard == btc_node_event_base(node));
+}
+
+static void btc_node_post_task_parts(btc_node* node, void (*fn)(btc_node* node, cstring* data), cstring* data, vector* parts)
+{
+    btc_node_task* task = btc_calloc(1, sizeof(*task));
+    task->node = node;
+    task->fn = fn;
+    task->data = data;
+    task->parts = parts;
+    struct timeval tv = {0, 0};
+    if (event_base_once(btc_node_event_base(node), -1, EV_TIMEOUT, btc_node_task_cb, task, &tv) != 0) {
+        if (task->data)
+            cstr_free(task->data, true);
+        if (task->parts)
+            vector_free(task->parts, true);
+        btc_free(task);
+    }
+}
+
+/* queue a call on the nodes shard thread (passing the ownership of data)
+   returns false if the caller is allowed to touch the node directly */
+static btc_bool btc_node_post_task(btc_node* node, void (*fn)(btc_node* node, cstring* data), cstring* data)
+{
+    if (btc_node_on_shard(node))
+        return false;
+
+    btc_node_post_task_parts(node, fn, data, NULL);
+    return true;
+}
+
+static void btc_node_group_shard_stop_cb(evutil_socket_t fd, short event, void* ctx)
+{
+    UNUSED(fd);
+    UNUSED(event);
+    btc_node_group* group = (btc_node_group*)ctx;
+    if (__atomic_load_n(&group->shards->shutdown, __ATOMIC_ACQUIRE)) {
+        btc_node_group_lock(group);
+        for (size_t i = 0; i < group->nodes->len; i++) {
+            btc_node* node = vector_idx(group->nodes, i);
+            if (btc_node_event_base(node) == btc_net_current_shard)
+                btc_node_disconnect(node);
+        }
+        btc_node_group_unlock(group);
+    }
+    event_base_loopbreak(btc_net_current_shard);
+}
+
+static void btc_node_group_shards_free(btc_node_group_shards* shards)
+{
+    if (!shards)
+        return;
+
+    btc_node_group_event* ev;
+    while ((ev = btc_node_group_event_pop(shards)) != NULL)
+        btc_node_group_event_free(ev);
+    if (shards->notify_event)
+        event_free(shards->notify_event);
+    for (unsigned int i = 0; i < shards->count; i++) {
+        if (shards->bases[i])
+            event_base_free(shards->bases[i]);
+        pthread_mutex_destroy(&shards->stats_locks[i]);
+    }
+    pthread_mutex_destroy(&shards->lock);
+    btc_free(shards->stats_locks);
+    btc_free(shards->bases);
+    btc_free(shards->threads);
+    btc_free(shards);
+}
+
+btc_bool btc_node_group_set_shards(btc_node_group* group, unsigned int count)
+{
+    if (group->shards)
+        return false;
+    if (count == 0)
+        return true;
+
+    /* event bases are only thread-aware if created after enabling the libevent locking */
+    if (evthread_use_pthreads() != 0)
+        return false;
+    struct event_base* base = event_base_new();
+    if (!base)
+        return false;
+    event_base_free(group->event_base);
+    group->event_base = base;
+
+    /* the checksums are verified on the shards */
+    btc_node_verify_pool_free(group->verify_pool);
+    group->verify_pool = NULL;
+
+    btc_node_group_shards* shards = btc_calloc(1, sizeof(*shards));
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&shards->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    shards->head = &shards->stub;
+    shards->tail = &shards->stub;
+    shards->count = count;
+    shards->bases = btc_calloc(count, sizeof(struct event_base*));
+    shards->threads = btc_calloc(count, sizeof(pthread_t));
+    shards->stats_locks = btc_calloc(count, sizeof(pthread_mutex_t));
+    for (unsigned int i = 0; i < count; i++)
+        pthread_mutex_init(&shards->stats_locks[i], NULL);
+    for (unsigned int i = 0; i < count; i++) {
+        shards->bases[i] = event_base_new();
+        if (!shards->bases[i]) {
+            btc_node_group_shards_free(shards);
+            return false;
+        }
+    }
+    shards->notify_event = event_new(group->event_base, -1, 0, btc_node_group_notify_cb, group);
+    group->shards = shards;
+    return true;
+}
+
+static uint64_t btc_net_time_us(void)
+{
+    struct timeval tv;
+    evutil_gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + (uint64_t)tv.tv_usec;
+}
+
+static btc_node_command_stats* btc_node_command_stats_get(btc_node_stats* stats, const char* command)
+{
+    for (unsigned int i = 0; i < stats->commands_count; i++) {
+        if (strncmp(stats->commands[i].command, command, 12) == 0)
+            return &stats->commands[i];
+    }
+    if (stats->commands_count == BTC_NODE_STATS_MAX_COMMANDS)
+        return NULL;
+    btc_node_command_stats* cmd_stats = &stats->commands[stats->commands_count++];
+    strncpy(cmd_stats->command, command, 12);
+    return cmd_stats;
+}
+
+static void btc_node_stats_count(btc_node* node, const char* command, size_t bytes, btc_bool incoming)
+{
+    btc_node_stats_lock(node);
+    btc_node_command_stats* cmd_stats = btc_node_command_stats_get(&node->stats, command);
+    if (incoming) {
+        node->stats.msgs_in++;
+        node->stats.bytes_in += bytes;
+        if (cmd_stats) {
+            cmd_stats->msgs_in++;
+            cmd_stats->bytes_in += bytes;
+        }
+    } else {
+        node->stats.msgs_out++;
+        node->stats.bytes_out += bytes;
+        if (cmd_stats) {
+            cmd_stats->msgs_out++;
+            cmd_stats->bytes_out += bytes;
+        }
+    }
+    btc_node_stats_unlock(node);
+}
+
+static uint64_t btc_node_average(uint64_t avg, uint64_t sample)
+{
+    /* exponentially weighted, a new sample counts a quarter */
+    return (avg == 0 ? sample : (avg * 3 + sample) / 4);
+}
+
+void btc_node_record_response(btc_node* node, size_t bytes, uint64_t elapsed_ms)
+{
+    if (elapsed_ms == 0)
+        elapsed_ms = 1;
+    btc_node_stats_lock(node);
+    if (bytes >= BTC_NODE_THROUGHPUT_MIN_SIZE)
+        node->stats.throughput_avg = btc_node_average(node->stats.throughput_avg, (uint64_t)bytes * 1000 / elapsed_ms);
+    else
+        node->stats.rtt_avg_ms = btc_node_average(node->stats.rtt_avg_ms, elapsed_ms);
+    btc_node_stats_unlock(node);
+}
+
+void btc_node_request_sent(btc_node* node)
+{
+    node->request_sent_ms = btc_net_time_us() / 1000;
+}
+
+void btc_node_response_received(btc_node* node, size_t bytes)
+{
+    if (!node->request_sent_ms)
+        return;
+    uint64_t now = btc_net_time_us() / 1000;
+    uint64_t elapsed = (now > node->request_sent_ms ? now - node->request_sent_ms : 0);
+    node->request_sent_ms = 0;
+    btc_node_record_response(node, bytes, elapsed);
+}
+
+static uint64_t btc_node_expected_response_ms(btc_node* node)
+{
+    btc_node_stats_lock(node);
+    uint64_t rtt = (node->stats.rtt_avg_ms ? node->stats.rtt_avg_ms : BTC_NODE_DEFAULT_RTT_MS);
+    uint64_t throughput = (node->stats.throughput_avg ? node->stats.throughput_avg : BTC_NODE_DEFAULT_THROUGHPUT);
+    btc_node_stats_unlock(node);
+    return rtt + BTC_NODE_SCORE_RESPONSE_SIZE * 1000 / throughput;
+}
 
-    do {
-        //check if message is complete
-        if (buf.len < BTC_P2P_HDRSZ) {
+uint64_t btc_node_sync_score(btc_node* node)
+{
+    return 1000000000ULL / (btc_node_expected_response_ms(node) + 1);
+}
+
+btc_bool btc_node_response_overdue(btc_node* node)
+{
+    if (!node->request_sent_ms)
+        return false;
+    uint64_t limit = 4 * btc_node_expected_response_ms(node);
+    if (limit < BTC_NODE_MIN_OVERDUE_MS)
+        limit = BTC_NODE_MIN_OVERDUE_MS;
+    return (btc_net_time_us() / 1000 > node->request_sent_ms + limit);
+}
+
+/* set the read watermarks, the read callback fires once at least min_needed bytes are available
+   and libevent stops reading from the socket once the buffered data hits the limit */
+static void btc_node_set_read_watermark(struct bufferevent* bev, size_t min_needed)
+{
+    size_t high = (min_needed > BTC_P2P_RECV_BUFFER_LIMIT) ? min_needed : BTC_P2P_RECV_BUFFER_LIMIT;
+    bufferevent_setwatermark(bev, EV_READ, min_needed, high);
+}
+
+void read_cb(struct bufferevent* bev, void* ctx)
+{
+    struct evbuffer* input = bufferevent_get_input(bev);
+    if (!input)
+        return;
+
+    btc_node* node = (btc_node*)ctx;
+
+    while ((node->state & NODE_CONNECTED) == NODE_CONNECTED) {
+        size_t length = evbuffer_get_length(input);
+        btc_node_stats_lock(node);
+        node->stats.recv_buffer_bytes = length;
+        btc_node_stats_unlock(node);
+        if (length < BTC_P2P_HDRSZ) {
+            btc_node_set_read_watermark(bev, BTC_P2P_HDRSZ);
             break;
         }
 
-        btc_p2p_deser_msghdr(&hdr, &buf);
+        /* parse the header in place, copy only if it spans multiple chunks */
+        unsigned char hdr_data[BTC_P2P_HDRSZ];
+        struct evbuffer_iovec vec;
+        struct const_buffer hdr_buf = {hdr_data, BTC_P2P_HDRSZ};
+        if (evbuffer_peek(input, BTC_P2P_HDRSZ, NULL, &vec, 1) >= 1 && vec.iov_len >= BTC_P2P_HDRSZ) {
+            hdr_buf.p = vec.iov_base;
+        } else {
+            evbuffer_copyout(input, hdr_data, BTC_P2P_HDRSZ);
+        }
+
+        btc_p2p_msg_hdr hdr;
+        btc_p2p_deser_msghdr(&hdr, &hdr_buf);
         if (hdr.data_len > BTC_MAX_P2P_MSG_SIZE) {
             // check for invalid message lengths
             btc_node_missbehave(node);
             return;
         }
-        if (buf.len < hdr.data_len) {
-            //if we haven't read the whole message, continue and wait for the next chunk
+
+        if ((!node->stats.first_headers_ms && hdr.type == BTC_MSG_TYPE_HEADERS) ||
+            (!node->stats.first_block_ms && hdr.type == BTC_MSG_TYPE_BLOCK)) {
+            uint64_t elapsed = btc_net_time_us() / 1000 - node->stats.time_connected;
+            btc_node_stats_lock(node);
+            if (hdr.type == BTC_MSG_TYPE_HEADERS)
+                node->stats.first_headers_ms = (elapsed > 0 ? elapsed : 1);
+            else
+                node->stats.first_block_ms = (elapsed > 0 ? elapsed : 1);
+            btc_node_stats_unlock(node);
+        }
+
+        size_t message_size = BTC_P2P_HDRSZ + hdr.data_len;
+        if (length < message_size) {
+            // wait until the whole message is buffered
+            btc_node_set_read_watermark(bev, message_size);
             break;
         }
-        if (buf.len >= hdr.data_len) {
-            //at least one message is complete
 
-            struct const_buffer cmd_data_buf = {buf.p, buf.len};
-            if ((node->state & NODE_CONNECTED) != NODE_CONNECTED) {
-                // ignore messages from disconnected peers
-                return;
+        btc_node_verify_pool* pool = node->nodegroup->verify_pool;
+        if (pool) {
+            // hand the payload over to the checksum verification workers
+            if (node->recv_pending_bytes >= BTC_P2P_RECV_BUFFER_LIMIT) {
+                node->recv_paused = true;
+                break;
             }
-            btc_node_parse_message(node, &hdr, &cmd_data_buf);
+            btc_node_verify_pool_submit(pool, node, &hdr, input);
+            continue;
+        }
 
-            //skip the size of the whole message
-            buf.p = (const unsigned char*)buf.p + hdr.data_len;
-            buf.len -= hdr.data_len;
+        if (node->nodegroup->shards && node->nodegroup->postcmd_cb) {
+            // the message goes to the group event loop, move it out of the input once and pass it on
+            unsigned char* payload = btc_malloc(hdr.data_len > 0 ? hdr.data_len : 1);
+            evbuffer_drain(input, BTC_P2P_HDRSZ);
+            evbuffer_remove(input, payload, hdr.data_len);
+            if (!btc_p2p_checksum_valid(&hdr, payload)) {
+                node->nodegroup->log_write_cb("Invalid checksum for command %s from node %d\n", hdr.command, node->nodeid);
+                btc_free(payload);
+                btc_node_missbehave(node);
+                return;
+            }
+            struct const_buffer payload_buf = {payload, hdr.data_len};
+            btc_node_parse_message_payload(node, &hdr, &payload_buf, payload);
+            if (node->event_bev != bev)
+                return;
+            continue;
+        }
 
-            read_upto = (void*)buf.p;
+        // linearize the complete message (no-op if it's already contiguous)
+        const unsigned char* message = evbuffer_pullup(input, message_size);
+        if (!message || !btc_p2p_checksum_valid(&hdr, message + BTC_P2P_HDRSZ)) {
+            node->nodegroup->log_write_cb("Invalid checksum for command %s from node %d\n", hdr.command, node->nodeid);
+            btc_node_missbehave(node);
+            return;
         }
-        if (buf.len == 0) {
-            //if we have "consumed" the whole buffer
-            node->recvBuffer->len = 0;
-            break;
+        struct const_buffer cmd_data_buf = {message + BTC_P2P_HDRSZ, hdr.data_len};
+        btc_node_parse_message(node, &hdr, &cmd_data_buf);
+
+        if (node->event_bev != bev) {
+            // the node has been disconnected, the buffer event is gone
+            return;
         }
-    } while (1);
+        evbuffer_drain(input, message_size);
+    }
+}
 
-    if (read_upto != NULL && node->recvBuffer->len != 0 && read_upto != (node->recvBuffer->str + node->recvBuffer->len)) {
-        char* end = node->recvBuffer->str + node->recvBuffer->len;
-        size_t available_chunk_data = end - read_upto;
-        //partial message
-        cstring* tmp = cstr_new_buf(read_upto, available_chunk_data);
-        cstr_free(node->recvBuffer, true);
-        node->recvBuffer = tmp;
+static size_t btc_node_send_queue_len(btc_node* node)
+{
+    size_t len = (node->send_batch ? node->send_batch->len : 0);
+    if (node->event_bev)
+        len += evbuffer_get_length(bufferevent_get_output(node->event_bev));
+    return len;
+}
+
+static void btc_node_send_queue_changed(btc_node* node, btc_bool paused)
+{
+    node->send_paused = paused;
+    if (node->nodegroup->send_queue_cb) {
+        if (node->nodegroup->shards)
+            btc_node_group_post_event(node, GROUP_EVENT_SEND_QUEUE, NULL, NULL, NULL, paused);
+        else
+            node->nodegroup->send_queue_cb(node, paused);
     }
 }
 
 void write_cb(struct bufferevent* ev, void* ctx)
 {
     UNUSED(ev);
-    UNUSED(ctx);
+    btc_node* node = (btc_node*)ctx;
+
+    /* the output drained below the low water mark */
+    size_t queued = btc_node_send_queue_len(node);
+    btc_node_stats_lock(node);
+    node->stats.send_queue_bytes = queued;
+    btc_node_stats_unlock(node);
+    if (node->send_paused && queued <= BTC_P2P_SEND_LOW_WATER)
+        btc_node_send_queue_changed(node, false);
 }
 
 void node_periodical_timer(int fd, short event, void* ctx)
@@ -142,26 +895,26 @@ void node_periodical_timer(int fd, short event, void* ctx)
     uint64_t now = time(NULL);
 
     /* pass data to the callback and give it a chance to cancle the call */
-    if (node->nodegroup->periodic_timer_cb)
-        if (!node->nodegroup->periodic_timer_cb(node, &now))
+    if (node->nodegroup->periodic_timer_cb) {
+        if (node->nodegroup->shards)
+            btc_node_group_post_event(node, GROUP_EVENT_TIMER, NULL, NULL, NULL, now);
+        else if (!node->nodegroup->periodic_timer_cb(node, &now))
             return;
+    }
 
     if (node->time_started_con + BTC_CONNECT_TIMEOUT_S < now && ((node->state & NODE_CONNECTING) == NODE_CONNECTING)) {
+        btc_node_group_lock(node->nodegroup);
         node->state = 0;
         node->time_started_con = 0;
         node->state |= NODE_ERRORED;
         node->state |= NODE_TIMEOUT;
+        btc_node_group_unlock(node->nodegroup);
         btc_node_connection_state_changed(node);
     }
 
     if (((node->state & NODE_CONNECTED) == NODE_CONNECTED) && node->lastping + BTC_PING_INTERVAL_S < now) {
         //time for a ping
-        uint64_t nonce;
-        btc_cheap_random_bytes((uint8_t*)&nonce, sizeof(nonce));
-        cstring* pingmsg = btc_p2p_message_new(node->nodegroup->chainparams->netmagic, BTC_MSG_PING, &nonce, sizeof(nonce));
-        btc_node_send(node, pingmsg);
-        cstr_free(pingmsg, true);
-        node->lastping = now;
+        btc_node_send_ping(node);
     }
 }
 
@@ -173,12 +926,15 @@ void event_cb(struct bufferevent* ev, short type, void* ctx)
 
     if (((type & BEV_EVENT_TIMEOUT) != 0) && ((node->state & NODE_CONNECTING) == NODE_CONNECTING)) {
         node->nodegroup->log_write_cb("Timout connecting to node %d.\n", node->nodeid);
+        btc_node_group_lock(node->nodegroup);
         node->state = 0;
         node->state |= NODE_ERRORED;
         node->state |= NODE_TIMEOUT;
+        btc_node_group_unlock(node->nodegroup);
         btc_node_connection_state_changed(node);
     } else if (((type & BEV_EVENT_EOF) != 0) ||
                ((type & BEV_EVENT_ERROR) != 0)) {
+        btc_node_group_lock(node->nodegroup);
         node->state = 0;
         node->state |= NODE_ERRORED;
         node->state |= NODE_DISCONNECTED;
@@ -189,12 +945,21 @@ void event_cb(struct bufferevent* ev, short type, void* ctx)
         else {
             node->nodegroup->log_write_cb("Error connecting to node %d.\n", node->nodeid);
         }
+        btc_node_group_unlock(node->nodegroup);
         btc_node_connection_state_changed(node);
     } else if (type & BEV_EVENT_CONNECTED) {
         node->nodegroup->log_write_cb("Successfull connected to node %d.\n", node->nodeid);
+        btc_node_group_lock(node->nodegroup);
         node->state |= NODE_CONNECTED;
         node->state &= ~NODE_CONNECTING;
         node->state &= ~NODE_ERRORED;
+        btc_node_group_unlock(node->nodegroup);
+        btc_node_stats_lock(node);
+        memset(&node->stats, 0, sizeof(node->stats));
+        node->stats.time_connected = btc_net_time_us() / 1000;
+        node->ping_sent_ms = 0;
+        node->request_sent_ms = 0;
+        btc_node_stats_unlock(node);
         btc_node_connection_state_changed(node);
         /* if callback is set, fire */
     }
@@ -209,12 +974,12 @@ btc_node* btc_node_new()
     node->state = 0;
     node->nonce = 0;
     node->services = 0;
+    node->version = 0;
     node->lastping = 0;
     node->time_started_con = 0;
     node->time_last_request = 0;
     btc_hash_clear(node->last_requested_inv);
 
-    node->recvBuffer = cstr_new_sz(BTC_P2P_MESSAGE_CHUNK_SIZE);
     node->hints = 0;
     return node;
 }
@@ -239,42 +1004,223 @@ void btc_node_release_events(btc_node* node)
         event_free(node->timer_event);
         node->timer_event = NULL;
     }
+
+    if (node->flush_event) {
+        event_free(node->flush_event);
+        node->flush_event = NULL;
+    }
+    if (node->send_batch) {
+        cstr_free(node->send_batch, true);
+        node->send_batch = NULL;
+    }
+    node->send_paused = false;
+}
+
+static void btc_node_missbehave_task(btc_node* node, cstring* data)
+{
+    UNUSED(data);
+    btc_node_missbehave(node);
 }
 
 btc_bool btc_node_missbehave(btc_node* node)
 {
+    if (btc_node_post_task(node, btc_node_missbehave_task, NULL))
+        return 0;
+
     node->nodegroup->log_write_cb("Mark node %d as missbehaved\n", node->nodeid);
+    btc_node_group_lock(node->nodegroup);
     node->state |= NODE_MISSBEHAVED;
+    btc_node_group_unlock(node->nodegroup);
     btc_node_connection_state_changed(node);
     return 0;
 }
 
+static void btc_node_disconnect_task(btc_node* node, cstring* data)
+{
+    UNUSED(data);
+    btc_node_disconnect(node);
+}
+
+static void btc_node_send_ping_task(btc_node* node, cstring* data)
+{
+    UNUSED(data);
+    btc_node_send_ping(node);
+}
+
+void btc_node_send_ping(btc_node* node)
+{
+    if (btc_node_post_task(node, btc_node_send_ping_task, NULL))
+        return;
+    if ((node->state & NODE_CONNECTED) != NODE_CONNECTED)
+        return;
+
+    uint64_t nonce;
+    btc_cheap_random_bytes((uint8_t*)&nonce, sizeof(nonce));
+    node->ping_nonce = nonce;
+    node->ping_sent_ms = btc_net_time_us() / 1000;
+    cstring* pingmsg = btc_p2p_message_new(node->nodegroup->chainparams->netmagic, BTC_MSG_PING, &nonce, sizeof(nonce));
+    btc_node_send_owned(node, pingmsg);
+    node->lastping = time(NULL);
+}
+
 void btc_node_disconnect(btc_node* node)
 {
+    if (btc_node_post_task(node, btc_node_disconnect_task, NULL))
+        return;
+
     if ((node->state & NODE_CONNECTED) == NODE_CONNECTED || (node->state & NODE_CONNECTING) == NODE_CONNECTING) {
         node->nodegroup->log_write_cb("Disconnect node %d\n", node->nodeid);
     }
     /* release buffer and timer event */
     btc_node_release_events(node);
 
+    btc_node_group_lock(node->nodegroup);
     node->state &= ~NODE_CONNECTING;
     node->state &= ~NODE_CONNECTED;
     node->state |= NODE_DISCONNECTED;
 
     node->time_started_con = 0;
+    btc_node_group_unlock(node->nodegroup);
+}
+
+void btc_node_free(btc_node* node)
+{
+    btc_node_disconnect(node);
+    btc_free(node);
+}
+
+void btc_node_free_cb(void* obj)
+{
+    btc_node* node = (btc_node*)obj;
+    btc_node_free(node);
+}
+
+/* the p2p address of a node (nodes connect via IPv4) */
+static void btc_node_p2p_address(btc_node* node, btc_p2p_address* addr)
+{
+    btc_p2p_address_init(addr);
+    btc_addr_to_p2paddr(&node->addr, addr);
+}
+
+static btc_bool btc_node_handle_version(btc_node* node, btc_p2p_msg_hdr* hdr, struct const_buffer* buf)
+{
+    (void)(hdr);
+    btc_p2p_version_msg v_msg_check;
+    if (!btc_p2p_msg_version_deser(&v_msg_check, buf)) {
+        return btc_node_missbehave(node);
+    }
+    if ((v_msg_check.services & BTC_NODE_NETWORK) != BTC_NODE_NETWORK) {
+        btc_node_disconnect(node);
+    }
+    node->bestknownheight = v_msg_check.start_height;
+    node->services = v_msg_check.services;
+    node->version = v_msg_check.version;
+    node->nodegroup->log_write_cb("Connected to node %d: %s (%d)\n", node->nodeid, v_msg_check.useragent, v_msg_check.start_height);
+    /* confirm version via verack */
+    cstring* verack = btc_p2p_message_new(node->nodegroup->chainparams->netmagic, BTC_MSG_VERACK, NULL, 0);
+    btc_node_send_owned(node, verack);
+    return true;
+}
+
+static btc_bool btc_node_handle_verack(btc_node* node, btc_p2p_msg_hdr* hdr, struct const_buffer* buf)
+{
+    (void)(hdr);
+    (void)(buf);
+    /* complete handshake if verack has been received */
+    node->version_handshake = true;
+
+    btc_node_group* group = node->nodegroup;
+    if (group->addrman) {
+        /* remember the peer as reachable and learn more addresses from it */
+        btc_p2p_address addr;
+        btc_node_p2p_address(node, &addr);
+        btc_node_group_lock(group);
+        btc_addrman_good(group->addrman, &addr, time(NULL));
+        btc_node_group_unlock(group);
+        cstring* getaddr = btc_p2p_message_new(group->chainparams->netmagic, BTC_MSG_GETADDR, NULL, 0);
+        btc_node_send_owned(node, getaddr);
+    }
+
+    if (node->nodegroup->prefer_headers && node->version >= BTC_SENDHEADERS_VERSION) {
+        cstring* sendheaders = btc_p2p_message_new(node->nodegroup->chainparams->netmagic, BTC_MSG_SENDHEADERS, NULL, 0);
+        btc_node_send_owned(node, sendheaders);
+    }
+
+    /* execute callback and inform that the node is ready for custom message logic */
+    if (node->nodegroup->handshake_done_cb) {
+        if (node->nodegroup->shards)
+            btc_node_group_post_event(node, GROUP_EVENT_HANDSHAKE_DONE, NULL, NULL, NULL, 0);
+        else
+            node->nodegroup->handshake_done_cb(node);
+    }
+    return true;
+}
+
+static btc_bool btc_node_handle_ping(btc_node* node, btc_p2p_msg_hdr* hdr, struct const_buffer* buf)
+{
+    (void)(hdr);
+    /* response pings */
+    uint64_t nonce = 0;
+    if (!deser_u64(&nonce, buf)) {
+        return btc_node_missbehave(node);
+    }
+    cstring* pongmsg = btc_p2p_message_new(node->nodegroup->chainparams->netmagic, BTC_MSG_PONG, &nonce, 8);
+    btc_node_send_owned(node, pongmsg);
+    return true;
 }
 
-void btc_node_free(btc_node* node)
+static btc_bool btc_node_handle_pong(btc_node* node, btc_p2p_msg_hdr* hdr, struct const_buffer* buf)
 {
-    btc_node_disconnect(node);
-    cstr_free(node->recvBuffer, true);
-    btc_free(node);
+    (void)(hdr);
+    /* measure the round trip time of our outstanding ping */
+    uint64_t nonce = 0;
+    struct const_buffer pong_buf = {buf->p, buf->len};
+    if (deser_u64(&nonce, &pong_buf) && node->ping_sent_ms && nonce == node->ping_nonce) {
+        uint64_t rtt = btc_net_time_us() / 1000 - node->ping_sent_ms;
+        unsigned int bucket = 0;
+        while (bucket < BTC_NODE_STATS_RTT_BUCKETS - 1 && rtt >= (25ULL << bucket))
+            bucket++;
+        btc_node_stats_lock(node);
+        node->stats.ping_rtt_hist[bucket]++;
+        node->stats.ping_rtt_last_ms = rtt;
+        node->stats.rtt_avg_ms = btc_node_average(node->stats.rtt_avg_ms, (rtt > 0 ? rtt : 1));
+        btc_node_stats_unlock(node);
+        node->ping_sent_ms = 0;
+    }
+    return true;
 }
 
-void btc_node_free_cb(void* obj)
+static btc_bool btc_node_handle_addr(btc_node* node, btc_p2p_msg_hdr* hdr, struct const_buffer* buf)
 {
-    btc_node* node = (btc_node*)obj;
-    btc_node_free(node);
+    (void)(hdr);
+    btc_node_group* group = node->nodegroup;
+    if (!group->addrman)
+        return true;
+
+    uint32_t count = 0;
+    if (!deser_varlen(&count, buf) || count > MAX_ADDR_TO_SEND) {
+        return btc_node_missbehave(node);
+    }
+    uint64_t now = time(NULL);
+    unsigned int learned = 0;
+    btc_bool valid = true;
+    btc_node_group_lock(group);
+    for (uint32_t i = 0; i < count; i++) {
+        btc_p2p_address addr;
+        btc_p2p_address_init(&addr);
+        if (!btc_p2p_deser_addr(BTC_PROTOCOL_VERSION, &addr, buf)) {
+            valid = false;
+            break;
+        }
+        if (btc_addrman_add(group->addrman, &addr, now))
+            learned++;
+    }
+    btc_node_group_unlock(group);
+    if (!valid) {
+        return btc_node_missbehave(node);
+    }
+    group->log_write_cb("Learned %u new addresses from node %d\n", learned, node->nodeid);
+    return true;
 }
 
 btc_node_group* btc_node_group_new(const btc_chainparams* chainparams)
@@ -298,11 +1244,48 @@ btc_node_group* btc_node_group_new(const btc_chainparams* chainparams)
     node_group->handshake_done_cb = NULL;
     node_group->log_write_cb = net_write_log_null;
     node_group->desired_amount_connected_nodes = 3;
+    node_group->prefer_headers = false;
+    node_group->addrman = NULL;
+    node_group->addrman_file = NULL;
+    node_group->addrman_save_event = NULL;
+    node_group->dns_base = NULL;
+    node_group->dns_seed_queries = NULL;
+    node_group->dns_seed_timeout_event = NULL;
+    node_group->discover_peers = false;
+    node_group->dns_seed_last_time = 0;
+    node_group->dns_reseed_event = NULL;
+
+    /* base message logic */
+    node_group->msg_handlers[BTC_MSG_TYPE_VERSION] = btc_node_handle_version;
+    node_group->msg_handlers[BTC_MSG_TYPE_VERACK] = btc_node_handle_verack;
+    node_group->msg_handlers[BTC_MSG_TYPE_PING] = btc_node_handle_ping;
+    node_group->msg_handlers[BTC_MSG_TYPE_PONG] = btc_node_handle_pong;
+    node_group->msg_handlers[BTC_MSG_TYPE_ADDR] = btc_node_handle_addr;
 
     return node_group;
 }
 
 void btc_node_group_shutdown(btc_node_group *group) {
+    /* the periodic timers and pending seed lookups would keep the event loop running */
+    if (group->addrman_save_event) {
+        event_del(group->addrman_save_event);
+        if (!btc_node_group_save_addrman(group))
+            group->log_write_cb("Writing the known peers to %s failed\n", group->addrman_file);
+    }
+    if (group->stats_dump_event)
+        event_del(group->stats_dump_event);
+    if (group->dns_reseed_event)
+        event_del(group->dns_reseed_event);
+    if (group->dns_seed_queries)
+        btc_node_group_cancel_seed_queries(group);
+
+    btc_node_group_shards* shards = group->shards;
+    if (shards && __atomic_load_n(&shards->running, __ATOMIC_ACQUIRE)) {
+        /* the shards disconnect their nodes once the event loop stops them */
+        __atomic_store_n(&shards->shutdown, 1, __ATOMIC_RELEASE);
+        event_base_loopbreak(group->event_base);
+        return;
+    }
     for (size_t i = 0; i < group->nodes->len; i++) {
         btc_node* node = vector_idx(group->nodes, i);
         btc_node_disconnect(node);
@@ -314,39 +1297,343 @@ void btc_node_group_free(btc_node_group* group)
     if (!group)
         return;
 
-    if (group->event_base) {
-        event_base_free(group->event_base);
-    }
+    btc_node_group_dns_free(group);
+
+    btc_node_verify_pool_free(group->verify_pool);
+    group->verify_pool = NULL;
 
+    /* store the known peers (and the scores of the connected ones) */
+    btc_node_group_set_addrman_file(group, NULL, 0);
+    btc_addrman_free(group->addrman);
+    group->addrman = NULL;
+
+    /* free the nodes (and their buffer events) before the event bases */
     if (group->nodes) {
         vector_free(group->nodes, true);
     }
+
+    btc_node_group_set_stats_dump(group, NULL, 0);
+
+    btc_node_group_shards_free(group->shards);
+    group->shards = NULL;
+
+    if (group->event_base) {
+        event_base_free(group->event_base);
+    }
     btc_free(group);
 }
 
 void btc_node_group_event_loop(btc_node_group* group)
 {
-    event_base_dispatch(group->event_base);
+    btc_node_group_shards* shards = group->shards;
+    if (!shards) {
+        event_base_dispatch(group->event_base);
+        return;
+    }
+
+    __atomic_store_n(&shards->shutdown, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&shards->running, 1, __ATOMIC_RELEASE);
+    unsigned int started = 0;
+    for (; started < shards->count; started++) {
+        if (pthread_create(&shards->threads[started], NULL, btc_node_group_shard_thread, shards->bases[started]) != 0)
+            break;
+    }
+    if (started == shards->count)
+        event_base_loop(group->event_base, EVLOOP_NO_EXIT_ON_EMPTY);
+
+    /* stop the shards, they disconnect their nodes if the group has been shut down */
+    struct timeval tv = {0, 0};
+    for (unsigned int i = 0; i < started; i++)
+        event_base_once(shards->bases[i], -1, EV_TIMEOUT, btc_node_group_shard_stop_cb, group, &tv);
+    for (unsigned int i = 0; i < started; i++)
+        pthread_join(shards->threads[i], NULL);
+    __atomic_store_n(&shards->running, 0, __ATOMIC_RELEASE);
+
+    /* deliver what the shards handed over before they stopped */
+    btc_node_group_notify_cb(-1, 0, group);
 }
 
 void btc_node_group_add_node(btc_node_group* group, btc_node* node)
 {
+    btc_node_group_lock(group);
     vector_add(group->nodes, node);
     node->nodegroup = group;
     node->nodeid = group->nodes->len;
+    btc_node_group_unlock(group);
 }
 
 int btc_node_group_amount_of_connected_nodes(btc_node_group* group, enum NODE_STATE state)
 {
     int cnt = 0;
+    btc_node_group_lock(group);
     for (size_t i = 0; i < group->nodes->len; i++) {
         btc_node* node = vector_idx(group->nodes, i);
         if ((node->state & state) == state)
             cnt++;
     }
+    btc_node_group_unlock(group);
     return cnt;
 }
 
+btc_node* btc_node_group_best_sync_node(btc_node_group* group, unsigned int height, btc_node* exclude)
+{
+    btc_node* best = NULL;
+    uint64_t best_score = 0;
+    btc_node_group_lock(group);
+    for (size_t i = 0; i < group->nodes->len; i++) {
+        btc_node* node = vector_idx(group->nodes, i);
+        if (node == exclude || (node->state & NODE_CONNECTED) != NODE_CONNECTED || !node->version_handshake || node->bestknownheight <= height)
+            continue;
+        uint64_t score = btc_node_sync_score(node);
+        if (!best || score > best_score) {
+            best = node;
+            best_score = score;
+        }
+    }
+    btc_node_group_unlock(group);
+    return best;
+}
+
+size_t btc_node_group_get_stats(btc_node_group* group, btc_node_stats* stats_out, size_t max)
+{
+    btc_node_group_lock(group);
+    size_t count = group->nodes->len;
+    for (size_t i = 0; i < count && i < max; i++) {
+        btc_node* node = vector_idx(group->nodes, i);
+        btc_node_stats_lock(node);
+        memcpy(&stats_out[i], &node->stats, sizeof(btc_node_stats));
+        btc_node_stats_unlock(node);
+        stats_out[i].nodeid = node->nodeid;
+        stats_out[i].state = node->state;
+        stats_out[i].recv_pending_bytes = node->recv_pending_bytes;
+    }
+    btc_node_group_unlock(group);
+    return count;
+}
+
+btc_bool btc_node_group_dump_stats(btc_node_group* group, const char* filename)
+{
+    size_t count = btc_node_group_get_stats(group, NULL, 0);
+    btc_node_stats* stats = btc_calloc(count > 0 ? count : 1, sizeof(btc_node_stats));
+    size_t available = btc_node_group_get_stats(group, stats, count);
+    if (available < count)
+        count = available;
+
+    /* write to a temporary file and replace the dump at once */
+    size_t tmplen = strlen(filename) + 5;
+    char* tmpfile = btc_malloc(tmplen);
+    snprintf(tmpfile, tmplen, "%s.tmp", filename);
+    FILE* file = fopen(tmpfile, "w");
+    if (!file) {
+        btc_free(tmpfile);
+        btc_free(stats);
+        return false;
+    }
+
+    fprintf(file, "time %llu nodes %u\n", (unsigned long long)time(NULL), (unsigned int)count);
+    for (size_t i = 0; i < count; i++) {
+        btc_node_stats* st = &stats[i];
+        fprintf(file, "node %d state %u connected %llu in %llu/%llu out %llu/%llu first_headers_ms %llu first_block_ms %llu "
+                      "send_queue %llu/%llu recv_buffer %llu recv_pending %llu parse_us %llu/%llu rtt_avg_ms %llu throughput_avg %llu ping_ms %llu ping_hist",
+                st->nodeid, st->state, (unsigned long long)st->time_connected,
+                (unsigned long long)st->msgs_in, (unsigned long long)st->bytes_in,
+                (unsigned long long)st->msgs_out, (unsigned long long)st->bytes_out,
+                (unsigned long long)st->first_headers_ms, (unsigned long long)st->first_block_ms,
+                (unsigned long long)st->send_queue_bytes, (unsigned long long)st->send_queue_max,
+                (unsigned long long)st->recv_buffer_bytes, (unsigned long long)st->recv_pending_bytes,
+                (unsigned long long)st->parse_time_us, (unsigned long long)st->parse_time_max_us,
+                (unsigned long long)st->rtt_avg_ms, (unsigned long long)st->throughput_avg,
+                (unsigned long long)st->ping_rtt_last_ms);
+        for (unsigned int j = 0; j < BTC_NODE_STATS_RTT_BUCKETS; j++)
+            fprintf(file, "%s%u", (j == 0 ? " " : ","), st->ping_rtt_hist[j]);
+        fprintf(file, "\n");
+        for (unsigned int j = 0; j < st->commands_count; j++) {
+            btc_node_command_stats* cmd_stats = &st->commands[j];
+            fprintf(file, "  cmd %s in %llu/%llu out %llu/%llu\n", cmd_stats->command,
+                    (unsigned long long)cmd_stats->msgs_in, (unsigned long long)cmd_stats->bytes_in,
+                    (unsigned long long)cmd_stats->msgs_out, (unsigned long long)cmd_stats->bytes_out);
+        }
+    }
+    btc_bool ret = (fclose(file) == 0 && rename(tmpfile, filename) == 0);
+    btc_free(tmpfile);
+    btc_free(stats);
+    return ret;
+}
+
+static void btc_node_group_stats_dump_cb(evutil_socket_t fd, short event, void* ctx)
+{
+    UNUSED(fd);
+    UNUSED(event);
+    btc_node_group* group = (btc_node_group*)ctx;
+    if (!btc_node_group_dump_stats(group, group->stats_dump_file))
+        group->log_write_cb("Writing the node statistics to %s failed\n", group->stats_dump_file);
+}
+
+btc_bool btc_node_group_set_stats_dump(btc_node_group* group, const char* filename, unsigned int interval_s)
+{
+    if (group->stats_dump_event) {
+        event_free(group->stats_dump_event);
+        group->stats_dump_event = NULL;
+    }
+    btc_free(group->stats_dump_file);
+    group->stats_dump_file = NULL;
+    if (!filename)
+        return true;
+    if (interval_s == 0)
+        return false;
+
+    group->stats_dump_file = btc_malloc(strlen(filename) + 1);
+    strcpy(group->stats_dump_file, filename);
+    group->stats_dump_event = event_new(group->event_base, -1, EV_PERSIST, btc_node_group_stats_dump_cb, group);
+    struct timeval tv = {interval_s, 0};
+    return (event_add(group->stats_dump_event, &tv) == 0);
+}
+
+btc_bool btc_node_group_save_addrman(btc_node_group* group)
+{
+    if (!group->addrman || !group->addrman_file)
+        return false;
+
+    btc_node_group_lock(group);
+    for (size_t i = 0; i < group->nodes->len; i++) {
+        btc_node* node = vector_idx(group->nodes, i);
+        if ((node->state & NODE_CONNECTED) != NODE_CONNECTED || !node->version_handshake)
+            continue;
+        btc_p2p_address addr;
+        btc_node_p2p_address(node, &addr);
+        btc_addrman_set_score(group->addrman, &addr, btc_node_sync_score(node));
+    }
+    btc_bool ret = true;
+    if (group->addrman->dirty)
+        ret = btc_addrman_save(group->addrman, group->chainparams->netmagic, group->addrman_file);
+    btc_node_group_unlock(group);
+    return ret;
+}
+
+static void btc_node_group_addrman_save_cb(evutil_socket_t fd, short event, void* ctx)
+{
+    UNUSED(fd);
+    UNUSED(event);
+    btc_node_group* group = (btc_node_group*)ctx;
+    if (!btc_node_group_save_addrman(group))
+        group->log_write_cb("Writing the known peers to %s failed\n", group->addrman_file);
+}
+
+btc_bool btc_node_group_set_addrman_file(btc_node_group* group, const char* filename, unsigned int interval_s)
+{
+    if (group->addrman_save_event) {
+        event_free(group->addrman_save_event);
+        group->addrman_save_event = NULL;
+    }
+    if (group->addrman_file) {
+        if (!btc_node_group_save_addrman(group))
+            group->log_write_cb("Writing the known peers to %s failed\n", group->addrman_file);
+        btc_free(group->addrman_file);
+        group->addrman_file = NULL;
+    }
+    if (!filename)
+        return true;
+    if (interval_s == 0)
+        return false;
+
+    if (!group->addrman)
+        group->addrman = btc_addrman_new();
+    if (!btc_addrman_load(group->addrman, group->chainparams->netmagic, filename, time(NULL)))
+        group->log_write_cb("Ignoring the unreadable peers file %s\n", filename);
+    group->addrman_file = btc_malloc(strlen(filename) + 1);
+    strcpy(group->addrman_file, filename);
+    group->addrman_save_event = event_new(group->event_base, -1, EV_PERSIST, btc_node_group_addrman_save_cb, group);
+    struct timeval tv = {interval_s, 0};
+    return (event_add(group->addrman_save_event, &tv) == 0);
+}
+
+/* set up the buffer event and the periodic timer on the nodes event base */
+static btc_bool btc_node_connect(btc_node* node)
+{
+    struct event_base* base = btc_node_event_base(node);
+    node->event_bev = bufferevent_socket_new(base, -1, BEV_OPT_CLOSE_ON_FREE);
+    bufferevent_setcb(node->event_bev, read_cb, write_cb, event_cb, node);
+    btc_node_set_read_watermark(node->event_bev, BTC_P2P_HDRSZ);
+    bufferevent_setwatermark(node->event_bev, EV_WRITE, BTC_P2P_SEND_LOW_WATER, 0);
+    bufferevent_enable(node->event_bev, EV_READ | EV_WRITE);
+    if (bufferevent_socket_connect(node->event_bev, (struct sockaddr*)&node->addr, sizeof(node->addr)) < 0) {
+        /* Error starting connection */
+        if (node->event_bev)
+            bufferevent_free(node->event_bev);
+        node->event_bev = NULL;
+        return false;
+    }
+
+    /* setup periodic timer */
+    node->time_started_con = time(NULL);
+    struct timeval tv;
+    tv.tv_sec = BTC_PERIODICAL_NODE_TIMER_S;
+    tv.tv_usec = 0;
+    node->timer_event = event_new(base, 0, EV_TIMEOUT | EV_PERSIST, node_periodical_timer,
+                                  (void*)node);
+    event_add(node->timer_event, &tv);
+    node->flush_event = event_new(base, -1, 0, btc_node_flush_cb, (void*)node);
+    return true;
+}
+
+static void btc_node_connect_task(btc_node* node, cstring* data)
+{
+    UNUSED(data);
+    if (!btc_node_connect(node)) {
+        btc_node_group_lock(node->nodegroup);
+        node->state &= ~NODE_CONNECTING;
+        node->state |= NODE_ERRORED;
+        btc_node_group_unlock(node->nodegroup);
+    }
+}
+
+static btc_bool btc_node_group_has_peer(btc_node_group* group, const btc_p2p_address* addr)
+{
+    for (size_t i = 0; i < group->nodes->len; i++) {
+        btc_p2p_address node_addr;
+        btc_node_p2p_address(vector_idx(group->nodes, i), &node_addr);
+        if (memcmp(node_addr.ip, addr->ip, 16) == 0 && node_addr.port == addr->port)
+            return true;
+    }
+    return false;
+}
+
+/* every known peer failed (like with a stale peers file), ask the DNS seeds again */
+static void btc_node_group_reseed_cb(evutil_socket_t fd, short event, void* ctx)
+{
+    UNUSED(fd);
+    UNUSED(event);
+    btc_node_group* group = (btc_node_group*)ctx;
+    if (group->dns_seed_queries && group->dns_seed_queries->len > 0)
+        return;
+    group->log_write_cb("Out of known peers, asking the DNS seeds\n");
+    btc_node_group_resolve_seeds(group);
+}
+
+/* add up to count of the best known peers that are not in the group yet */
+static size_t btc_node_group_add_peers_from_addrman(btc_node_group* group, size_t count)
+{
+    btc_node_group_lock(group);
+    vector* addrs = vector_new(count + group->nodes->len, NULL);
+    btc_addrman_select(group->addrman, count + group->nodes->len, time(NULL), addrs);
+    size_t added = 0;
+    for (size_t i = 0; i < addrs->len && added < count; i++) {
+        btc_p2p_address* addr = vector_idx(addrs, i);
+        if (btc_node_group_has_peer(group, addr))
+            continue;
+        btc_node* node = btc_node_new();
+        memset(&node->addr, 0, sizeof(node->addr));
+        btc_p2paddr_to_addr(addr, &node->addr);
+        btc_node_group_add_node(group, node);
+        added++;
+    }
+    vector_free(addrs, true);
+    btc_node_group_unlock(group);
+    if (added > 0)
+        group->log_write_cb("Added %d known peers\n", (int)added);
+    return added;
+}
+
 btc_bool btc_node_group_connect_next_nodes(btc_node_group* group)
 {
     btc_bool connected_at_least_to_one_node = false;
@@ -356,6 +1643,8 @@ btc_bool btc_node_group_connect_next_nodes(btc_node_group* group)
 
     connect_amount = connect_amount*3;
     /* search for a potential node that has not errored and is not connected or in connecting state */
+    btc_bool failed = false;
+    btc_node_group_lock(group);
     for (size_t i = 0; i < group->nodes->len; i++) {
         btc_node* node = vector_idx(group->nodes, i);
         if (
@@ -363,54 +1652,93 @@ btc_bool btc_node_group_connect_next_nodes(btc_node_group* group)
             !((node->state & NODE_CONNECTING) == NODE_CONNECTING) &&
             !((node->state & NODE_DISCONNECTED) == NODE_DISCONNECTED) &&
             !((node->state & NODE_ERRORED) == NODE_ERRORED)) {
-            /* setup buffer event */
-            node->event_bev = bufferevent_socket_new(group->event_base, -1, BEV_OPT_CLOSE_ON_FREE);
-            bufferevent_setcb(node->event_bev, read_cb, write_cb, event_cb, node);
-            bufferevent_enable(node->event_bev, EV_READ | EV_WRITE);
-            if (bufferevent_socket_connect(node->event_bev, (struct sockaddr*)&node->addr, sizeof(node->addr)) < 0) {
-                /* Error starting connection */
-                if (node->event_bev)
-                    bufferevent_free(node->event_bev);
-                return false;
+            if (group->shards) {
+                /* the nodes shard sets up the connection */
+                node->state |= NODE_CONNECTING;
+                node->time_started_con = time(NULL);
+                if (!btc_node_post_task(node, btc_node_connect_task, NULL))
+                    btc_node_connect_task(node, NULL);
+            } else {
+                if (!btc_node_connect(node)) {
+                    failed = true;
+                    break;
+                }
+                node->state |= NODE_CONNECTING;
             }
-
-            /* setup periodic timer */
-            node->time_started_con = time(NULL);
-            struct timeval tv;
-            tv.tv_sec = BTC_PERIODICAL_NODE_TIMER_S;
-            tv.tv_usec = 0;
-            node->timer_event = event_new(group->event_base, 0, EV_TIMEOUT | EV_PERSIST, node_periodical_timer,
-                                          (void*)node);
-            event_add(node->timer_event, &tv);
-            node->state |= NODE_CONNECTING;
             connected_at_least_to_one_node = true;
 
+            if (group->addrman) {
+                btc_p2p_address addr;
+                btc_node_p2p_address(node, &addr);
+                btc_addrman_attempt(group->addrman, &addr, time(NULL));
+            }
+
             node->nodegroup->log_write_cb("Trying to connect to %d...\n", node->nodeid);
 
             connect_amount--;
             if (connect_amount <= 0)
-                return true;
+                break;
         }
     }
+    btc_node_group_unlock(group);
+    if (failed)
+        return false;
+
+    /* out of candidates, take the next known peers instead of asking the DNS seeds again */
+    if (!connected_at_least_to_one_node && group->addrman && btc_node_group_add_peers_from_addrman(group, connect_amount) > 0)
+        return btc_node_group_connect_next_nodes(group);
+
+    /* the lookup runs on the event loop thread (at most once per interval), the peers get connected as the answers arrive */
+    if (!connected_at_least_to_one_node && group->discover_peers && !(group->dns_seed_queries && group->dns_seed_queries->len > 0)) {
+        uint64_t now = time(NULL);
+        struct timeval tv = {0, 0};
+        if (group->dns_seed_last_time + BTC_DNS_RESEED_INTERVAL_S > now)
+            tv.tv_sec = group->dns_seed_last_time + BTC_DNS_RESEED_INTERVAL_S - now;
+        if (!group->dns_reseed_event)
+            group->dns_reseed_event = event_new(group->event_base, -1, 0, btc_node_group_reseed_cb, group);
+        if (!event_pending(group->dns_reseed_event, EV_TIMEOUT, NULL))
+            event_add(group->dns_reseed_event, &tv);
+        return true;
+    }
+
     /* node group misses a node to connect to */
-    return connected_at_least_to_one_node;
+    return (connect_amount <= 0 || connected_at_least_to_one_node);
 }
 
 void btc_node_connection_state_changed(btc_node* node)
 {
-    if (node->nodegroup->node_connection_state_changed_cb)
-        node->nodegroup->node_connection_state_changed_cb(node);
+    btc_node_group* group = node->nodegroup;
+    if (group->addrman && (node->state & (NODE_ERRORED | NODE_MISSBEHAVED))) {
+        /* remember how useful the session was, or that the peer could not be used */
+        btc_p2p_address addr;
+        btc_node_p2p_address(node, &addr);
+        btc_node_group_lock(group);
+        if (node->version_handshake && (node->state & NODE_MISSBEHAVED) != NODE_MISSBEHAVED)
+            btc_addrman_set_score(group->addrman, &addr, btc_node_sync_score(node));
+        else
+            btc_addrman_failed(group->addrman, &addr);
+        btc_node_group_unlock(group);
+    }
+
+    if (node->nodegroup->node_connection_state_changed_cb) {
+        if (node->nodegroup->shards)
+            btc_node_group_post_event(node, GROUP_EVENT_STATE_CHANGED, NULL, NULL, NULL, 0);
+        else
+            node->nodegroup->node_connection_state_changed_cb(node);
+    }
 
     if ((node->state & NODE_ERRORED) == NODE_ERRORED) {
         btc_node_release_events(node);
 
         /* connect to more nodes are required */
         btc_bool should_connect_to_more_nodes = true;
-        if (node->nodegroup->should_connect_to_more_nodes_cb)
+        if (node->nodegroup->should_connect_to_more_nodes_cb && !node->nodegroup->shards)
             should_connect_to_more_nodes = node->nodegroup->should_connect_to_more_nodes_cb(node);
 
+        btc_node_group_lock(node->nodegroup);
         if (should_connect_to_more_nodes && (btc_node_group_amount_of_connected_nodes(node->nodegroup, NODE_CONNECTED) + btc_node_group_amount_of_connected_nodes(node->nodegroup, NODE_CONNECTING) < node->nodegroup->desired_amount_connected_nodes))
             btc_node_group_connect_next_nodes(node->nodegroup);
+        btc_node_group_unlock(node->nodegroup);
     }
     if ((node->state & NODE_MISSBEHAVED) == NODE_MISSBEHAVED) {
         if ((node->state & NODE_CONNECTED) == NODE_CONNECTED || (node->state & NODE_CONNECTING) == NODE_CONNECTING) {
@@ -420,14 +1748,207 @@ void btc_node_connection_state_changed(btc_node* node)
         btc_node_send_version(node);
 }
 
-void btc_node_send(btc_node* node, cstring* data)
+static void btc_node_free_sent_cb(const void* data, size_t datalen, void* extra)
 {
-    if ((node->state & NODE_CONNECTED) != NODE_CONNECTED)
+    UNUSED(data);
+    UNUSED(datalen);
+    cstr_free((cstring*)extra, true);
+}
+
+/* hand the coalesced messages over to the buffer event */
+static void btc_node_flush_batch(btc_node* node)
+{
+    cstring* batch = node->send_batch;
+    if (!batch)
+        return;
+    node->send_batch = NULL;
+    if (evbuffer_add_reference(bufferevent_get_output(node->event_bev), batch->str, batch->len, btc_node_free_sent_cb, batch) != 0)
+        cstr_free(batch, true);
+}
+
+static void btc_node_flush_cb(evutil_socket_t fd, short event, void* ctx)
+{
+    UNUSED(fd);
+    UNUSED(event);
+    btc_node* node = (btc_node*)ctx;
+    if (node->event_bev)
+        btc_node_flush_batch(node);
+}
+
+static void btc_node_send_queue_update(btc_node* node)
+{
+    size_t queued = btc_node_send_queue_len(node);
+    btc_node_stats_lock(node);
+    node->stats.send_queue_bytes = queued;
+    if (queued > node->stats.send_queue_max)
+        node->stats.send_queue_max = queued;
+    btc_node_stats_unlock(node);
+
+    if (!node->send_paused && queued > BTC_P2P_SEND_HIGH_WATER)
+        btc_node_send_queue_changed(node, true);
+}
+
+/* queue a message on the nodes output, frees data if owned */
+static void btc_node_enqueue(btc_node* node, cstring* data, btc_bool owned)
+{
+    if ((node->state & NODE_CONNECTED) != NODE_CONNECTED || !node->event_bev) {
+        if (owned)
+            cstr_free(data, true);
+        return;
+    }
+
+    /* the command is not zero terminated if it has 12 characters */
+    char command[13] = {0};
+    memcpy(command, data->str + 4, 12);
+    node->nodegroup->log_write_cb("sending message to node %d: %s\n", node->nodeid, command);
+    btc_node_stats_count(node, command, data->len, false);
+
+    if (data->len <= BTC_P2P_COALESCE_MAX_SIZE) {
+        /* collect small messages, they get written together at the end of the loop iteration */
+        if (!node->send_batch) {
+            node->send_batch = cstr_new_sz(BTC_P2P_MESSAGE_CHUNK_SIZE);
+            event_active(node->flush_event, EV_WRITE, 0);
+        }
+        cstr_append_buf(node->send_batch, data->str, data->len);
+        if (owned)
+            cstr_free(data, true);
+        if (node->send_batch->len >= BTC_P2P_MESSAGE_CHUNK_SIZE)
+            btc_node_flush_batch(node);
+    } else {
+        /* keep the order, earlier coalesced messages go first */
+        btc_node_flush_batch(node);
+        if (!owned)
+            data = cstr_new_buf(data->str, data->len);
+        if (evbuffer_add_reference(bufferevent_get_output(node->event_bev), data->str, data->len, btc_node_free_sent_cb, data) != 0)
+            cstr_free(data, true);
+    }
+
+    btc_node_send_queue_update(node);
+}
+
+/* queue a message header and its payload parts, the parts are referenced by the output (no copy) unless the
+   message gets coalesced, takes the ownership of header and parts */
+static void btc_node_enqueue_framed(btc_node* node, cstring* header, vector* parts)
+{
+    if ((node->state & NODE_CONNECTED) != NODE_CONNECTED || !node->event_bev) {
+        cstr_free(header, true);
+        vector_free(parts, true);
+        return;
+    }
+
+    size_t message_size = header->len;
+    for (size_t i = 0; i < parts->len; i++)
+        message_size += ((cstring*)vector_idx(parts, i))->len;
+
+    char command[13] = {0};
+    memcpy(command, header->str + 4, 12);
+    node->nodegroup->log_write_cb("sending message to node %d: %s\n", node->nodeid, command);
+    btc_node_stats_count(node, command, message_size, false);
+
+    if (message_size <= BTC_P2P_COALESCE_MAX_SIZE) {
+        /* small messages are coalesced like the ones sent with btc_node_send */
+        if (!node->send_batch) {
+            node->send_batch = cstr_new_sz(BTC_P2P_MESSAGE_CHUNK_SIZE);
+            event_active(node->flush_event, EV_WRITE, 0);
+        }
+        cstr_append_cstr(node->send_batch, header);
+        for (size_t i = 0; i < parts->len; i++)
+            cstr_append_cstr(node->send_batch, vector_idx(parts, i));
+        cstr_free(header, true);
+        vector_free(parts, true);
+        if (node->send_batch->len >= BTC_P2P_MESSAGE_CHUNK_SIZE)
+            btc_node_flush_batch(node);
+    } else {
+        /* keep the order, earlier coalesced messages go first */
+        btc_node_flush_batch(node);
+        struct evbuffer* output = bufferevent_get_output(node->event_bev);
+        evbuffer_add(output, header->str, header->len);
+        cstr_free(header, true);
+        for (size_t i = 0; i < parts->len; i++) {
+            cstring* part = vector_idx(parts, i);
+            if (part->len == 0)
+                continue;
+            /* the output owns the part once referenced */
+            parts->data[i] = NULL;
+            if (evbuffer_add_reference(output, part->str, part->len, btc_node_free_sent_cb, part) != 0)
+                cstr_free(part, true);
+        }
+        vector_free(parts, true);
+    }
+
+    btc_node_send_queue_update(node);
+}
+
+static void btc_node_free_part_cb(void* part)
+{
+    if (part)
+        cstr_free((cstring*)part, true);
+}
+
+void btc_node_send_message(btc_node* node, const char* command, cstring** parts, size_t parts_count, const unsigned char* checksum)
+{
+    struct const_buffer* bufs = btc_calloc(parts_count + 1, sizeof(*bufs));
+    vector* part_list = vector_new(parts_count + 1, btc_node_free_part_cb);
+    for (size_t i = 0; i < parts_count; i++) {
+        bufs[i].p = parts[i]->str;
+        bufs[i].len = parts[i]->len;
+        vector_add(part_list, parts[i]);
+    }
+
+    /* the checksum is hashed over the parts on the calling thread */
+    cstring* header = cstr_new_sz(BTC_P2P_HDRSZ);
+    cstr_resize(header, BTC_P2P_HDRSZ);
+    btc_p2p_message_header(node->nodegroup->chainparams->netmagic, command, bufs, parts_count, checksum, (unsigned char*)header->str);
+    btc_free(bufs);
+
+    if (!btc_node_on_shard(node)) {
+        btc_node_post_task_parts(node, NULL, header, part_list);
+        return;
+    }
+    btc_node_enqueue_framed(node, header, part_list);
+}
+
+/* write the queued messages to the socket right away instead of at the end of the loop iteration */
+void btc_node_flush(btc_node* node)
+{
+    /* the shard thread of the node writes its output concurrently */
+    if (!btc_node_on_shard(node) || (node->state & NODE_CONNECTED) != NODE_CONNECTED || !node->event_bev)
+        return;
+
+    btc_node_flush_batch(node);
+    struct evbuffer* output = bufferevent_get_output(node->event_bev);
+    evutil_socket_t fd = bufferevent_getfd(node->event_bev);
+    /* this relies on libevent keeping the front of a socket buffer events output frozen (only the buffer event
+       drains it), it is unfrozen for the write and frozen again like libevent does around its own writes
+       a partial write is fine, the buffer event writes the rest once the socket is writable */
+    if (fd >= 0 && evbuffer_get_length(output) > 0 && evbuffer_unfreeze(output, 1) == 0) {
+        int written = evbuffer_write(output, fd);
+        int err = EVUTIL_SOCKET_ERROR();
+        evbuffer_freeze(output, 1);
+        if (written < 0 && !BTC_NET_ERR_RW_RETRIABLE(err)) {
+            /* handled like a write error reported by the buffer event */
+            node->nodegroup->log_write_cb("Writing to node %d failed: %s\n", node->nodeid, evutil_socket_error_to_string(err));
+            event_cb(node->event_bev, BEV_EVENT_WRITING | BEV_EVENT_ERROR, node);
+            return;
+        }
+    }
+    write_cb(node->event_bev, node);
+}
+
+void btc_node_send_owned(btc_node* node, cstring* data)
+{
+    if (btc_node_post_task(node, btc_node_send_owned, data))
         return;
+    btc_node_enqueue(node, data, true);
+}
 
-    bufferevent_write(node->event_bev, data->str, data->len);
-    char* dummy = data->str + 4;
-    node->nodegroup->log_write_cb("sending message to node %d: %s\n", node->nodeid, dummy);
+void btc_node_send(btc_node* node, cstring* data)
+{
+    if (!btc_node_on_shard(node)) {
+        btc_node_post_task(node, btc_node_send_owned, cstr_new_buf(data->str, data->len));
+        return;
+    }
+    btc_node_enqueue(node, data, false);
 }
 
 void btc_node_send_version(btc_node* node)
@@ -457,64 +1978,227 @@ void btc_node_send_version(btc_node* node)
     cstring* p2p_msg = btc_p2p_message_new(node->nodegroup->chainparams->netmagic, BTC_MSG_VERSION, version_msg_cstr->str, version_msg_cstr->len);
 
     /* send message */
-    btc_node_send(node, p2p_msg);
+    btc_node_send_owned(node, p2p_msg);
 
     /* cleanup */
     cstr_free(version_msg_cstr, true);
-    cstr_free(p2p_msg, true);
 }
 
-int btc_node_parse_message(btc_node* node, btc_p2p_msg_hdr* hdr, struct const_buffer* buf)
+/* parse a message, payload (if not NULL) holds the message data and is freed or handed over to the group event loop */
+static int btc_node_parse_message_payload(btc_node* node, btc_p2p_msg_hdr* hdr, struct const_buffer* buf, unsigned char* payload)
 {
+    uint64_t start = btc_net_time_us();
     node->nodegroup->log_write_cb("received command from node %d: %s\n", node->nodeid, hdr->command);
+    btc_node_stats_count(node, hdr->command, BTC_P2P_HDRSZ + hdr->data_len, true);
     if (memcmp(hdr->netmagic, node->nodegroup->chainparams->netmagic, sizeof(node->nodegroup->chainparams->netmagic)) != 0) {
+        btc_free(payload);
         return btc_node_missbehave(node);
     }
 
     /* send the header and buffer to the possible callback */
     /* callback can decide to run the internal base message logic */
     if (!node->nodegroup->parse_cmd_cb || node->nodegroup->parse_cmd_cb(node, hdr, buf)) {
-        if (strcmp(hdr->command, BTC_MSG_VERSION) == 0) {
-            btc_p2p_version_msg v_msg_check;
-            if (!btc_p2p_msg_version_deser(&v_msg_check, buf)) {
-                return btc_node_missbehave(node);
-            }
-            if ((v_msg_check.services & BTC_NODE_NETWORK) != BTC_NODE_NETWORK) {
-                btc_node_disconnect(node);
-            }
-            node->bestknownheight = v_msg_check.start_height;
-            node->nodegroup->log_write_cb("Connected to node %d: %s (%d)\n", node->nodeid, v_msg_check.useragent, v_msg_check.start_height);
-            /* confirm version via verack */
-            cstring* verack = btc_p2p_message_new(node->nodegroup->chainparams->netmagic, BTC_MSG_VERACK, NULL, 0);
-            btc_node_send(node, verack);
-            cstr_free(verack, true);
-        } else if (strcmp(hdr->command, BTC_MSG_VERACK) == 0) {
-            /* complete handshake if verack has been received */
-            node->version_handshake = true;
-
-            /* execute callback and inform that the node is ready for custom message logic */
-            if (node->nodegroup->handshake_done_cb)
-                node->nodegroup->handshake_done_cb(node);
-        } else if (strcmp(hdr->command, BTC_MSG_PING) == 0) {
-            /* response pings */
-            uint64_t nonce = 0;
-            if (!deser_u64(&nonce, buf)) {
-                return btc_node_missbehave(node);
-            }
-            cstring* pongmsg = btc_p2p_message_new(node->nodegroup->chainparams->netmagic, BTC_MSG_PONG, &nonce, 8);
-            btc_node_send(node, pongmsg);
-            cstr_free(pongmsg, true);
+        btc_node_msg_handler handler = node->nodegroup->msg_handlers[hdr->type];
+        if (hdr->type != BTC_MSG_TYPE_UNKNOWN && handler && !handler(node, hdr, buf)) {
+            btc_free(payload);
+            return false;
         }
     }
 
     /* pass data to the "post command" callback */
-    if (node->nodegroup->postcmd_cb)
+    if (node->nodegroup->postcmd_cb && node->nodegroup->shards) {
+        btc_node_group_post_event(node, GROUP_EVENT_MESSAGE, hdr, buf, payload, 0);
+        payload = NULL;
+    } else if (node->nodegroup->postcmd_cb)
         node->nodegroup->postcmd_cb(node, hdr, buf);
-
+    btc_free(payload);
+
+    uint64_t parse_time = btc_net_time_us() - start;
+    btc_node_stats_lock(node);
+    node->stats.parse_time_us += parse_time;
+    if (parse_time > node->stats.parse_time_max_us)
+        node->stats.parse_time_max_us = parse_time;
+    btc_node_stats_unlock(node);
     return true;
 }
 
+int btc_node_parse_message(btc_node* node, btc_p2p_msg_hdr* hdr, struct const_buffer* buf)
+{
+    return btc_node_parse_message_payload(node, hdr, buf, NULL);
+}
+
 /* utility function to get peers (ips/port as char*) from a seed */
+/* an outstanding DNS seed lookup */
+typedef struct btc_dns_seed_query_ {
+    btc_node_group* group;
+    const char* seed;
+    struct evdns_getaddrinfo_request* request;
+    btc_bool starting; /* evdns may answer before the request has been returned */
+    btc_bool done;
+} btc_dns_seed_query;
+
+/* add the resolved peers that are not in the group yet */
+static size_t btc_node_group_add_resolved_peers(btc_node_group* group, struct evutil_addrinfo* res)
+{
+    size_t added = 0;
+    uint64_t now = time(NULL);
+    btc_node_group_lock(group);
+    for (struct evutil_addrinfo* ai = res; ai != NULL; ai = ai->ai_next) {
+        if (ai->ai_family != AF_INET)
+            continue;
+        btc_p2p_address addr;
+        btc_p2p_address_init(&addr);
+        btc_addr_to_p2paddr(ai->ai_addr, &addr);
+        addr.port = group->chainparams->default_port;
+        if (btc_node_group_has_peer(group, &addr))
+            continue;
+
+        btc_node* node = btc_node_new();
+        memset(&node->addr, 0, sizeof(node->addr));
+        btc_p2paddr_to_addr(&addr, &node->addr);
+        btc_node_group_add_node(group, node);
+        if (group->addrman)
+            btc_addrman_add(group->addrman, &addr, now);
+        added++;
+    }
+    btc_node_group_unlock(group);
+    return added;
+}
+
+static void btc_node_group_seed_resolved_cb(int result, struct evutil_addrinfo* res, void* ctx)
+{
+    btc_dns_seed_query* query = (btc_dns_seed_query*)ctx;
+    btc_node_group* group = query->group;
+    query->request = NULL;
+    if (result == 0) {
+        size_t added = btc_node_group_add_resolved_peers(group, res);
+        evutil_freeaddrinfo(res);
+        group->log_write_cb("DNS seed %s returned %d new peers\n", query->seed, (int)added);
+
+        /* start connecting without waiting for the other seeds */
+        if (added > 0 && btc_node_group_amount_of_connected_nodes(group, NODE_CONNECTED) + btc_node_group_amount_of_connected_nodes(group, NODE_CONNECTING) < group->desired_amount_connected_nodes)
+            btc_node_group_connect_next_nodes(group);
+    } else if (result != EVUTIL_EAI_CANCEL) {
+        group->log_write_cb("Resolving DNS seed %s failed: %s\n", query->seed, evutil_gai_strerror(result));
+    }
+
+    if (query->starting)
+        query->done = true;
+    else
+        vector_remove(group->dns_seed_queries, query);
+    if (group->dns_seed_queries->len == 0 && group->dns_seed_timeout_event)
+        event_del(group->dns_seed_timeout_event);
+}
+
+/* the cancelled lookups are reported (and released) from the event loop */
+static void btc_node_group_cancel_seed_queries(btc_node_group* group)
+{
+    for (size_t i = 0; i < group->dns_seed_queries->len; i++) {
+        btc_dns_seed_query* query = vector_idx(group->dns_seed_queries, i);
+        if (query->request) {
+            group->log_write_cb("Giving up on DNS seed %s\n", query->seed);
+            evdns_getaddrinfo_cancel(query->request);
+            query->request = NULL;
+        }
+    }
+}
+
+static void btc_node_group_seed_timeout_cb(evutil_socket_t fd, short event, void* ctx)
+{
+    UNUSED(fd);
+    UNUSED(event);
+    btc_node_group* group = (btc_node_group*)ctx;
+    btc_node_group_cancel_seed_queries(group);
+}
+
+static btc_bool btc_node_group_dns_base_new(btc_node_group* group, int flags)
+{
+    if (group->dns_base)
+        return true;
+    /* an idle resolver doesn't keep the event loop running */
+    group->dns_base = evdns_base_new(group->event_base, flags | EVDNS_BASE_DISABLE_WHEN_INACTIVE);
+    return (group->dns_base != NULL);
+}
+
+btc_bool btc_node_group_set_dns_nameserver(btc_node_group* group, const char* ip_port)
+{
+    if (!btc_node_group_dns_base_new(group, 0))
+        return false;
+    evdns_base_clear_nameservers_and_suspend(group->dns_base);
+    btc_bool ret = (evdns_base_nameserver_ip_add(group->dns_base, ip_port) == 0);
+    evdns_base_resume(group->dns_base);
+    return ret;
+}
+
+unsigned int btc_node_group_resolve_seeds(btc_node_group* group)
+{
+    if (!btc_node_group_dns_base_new(group, EVDNS_BASE_INITIALIZE_NAMESERVERS))
+        return 0;
+    group->dns_seed_last_time = time(NULL);
+    if (!group->dns_seed_queries)
+        group->dns_seed_queries = vector_new(8, btc_free);
+
+    struct evutil_addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+
+    unsigned int started = 0;
+    const size_t max_seeds = sizeof(group->chainparams->dnsseeds) / sizeof(group->chainparams->dnsseeds[0]);
+    for (size_t i = 0; i < max_seeds; i++) {
+        const char* seed = group->chainparams->dnsseeds[i].domain;
+        if (strlen(seed) == 0)
+            break;
+
+        btc_dns_seed_query* query = btc_calloc(1, sizeof(*query));
+        query->group = group;
+        query->seed = seed;
+        query->starting = true;
+        vector_add(group->dns_seed_queries, query);
+        struct evdns_getaddrinfo_request* request = evdns_getaddrinfo(group->dns_base, seed, NULL, &hints, btc_node_group_seed_resolved_cb, query);
+        query->starting = false;
+        if (query->done)
+            vector_remove(group->dns_seed_queries, query);
+        else
+            query->request = request;
+        started++;
+    }
+
+    /* unreachable nameservers would keep the lookups (and the event loop) waiting */
+    if (group->dns_seed_queries->len > 0) {
+        if (!group->dns_seed_timeout_event)
+            group->dns_seed_timeout_event = event_new(group->event_base, -1, 0, btc_node_group_seed_timeout_cb, group);
+        struct timeval tv = {BTC_DNS_SEED_TIMEOUT_S, 0};
+        event_add(group->dns_seed_timeout_event, &tv);
+    }
+    return started;
+}
+
+static void btc_node_group_dns_free(btc_node_group* group)
+{
+    if (group->dns_reseed_event) {
+        event_free(group->dns_reseed_event);
+        group->dns_reseed_event = NULL;
+    }
+    if (group->dns_seed_timeout_event) {
+        event_free(group->dns_seed_timeout_event);
+        group->dns_seed_timeout_event = NULL;
+    }
+    if (group->dns_seed_queries) {
+        /* let evdns report the cancelled lookups before the resolver goes away */
+        btc_node_group_cancel_seed_queries(group);
+        for (int i = 0; i < 10 && group->dns_seed_queries->len > 0; i++)
+            event_base_loop(group->event_base, EVLOOP_NONBLOCK);
+        vector_free(group->dns_seed_queries, true);
+        group->dns_seed_queries = NULL;
+    }
+    if (group->dns_base) {
+        evdns_base_free(group->dns_base, 0);
+        group->dns_base = NULL;
+    }
+}
+
 int btc_get_peers_from_dns(const char* seed, vector* ips_out, int port, int family)
 {
     if (!seed || !ips_out || (family != AF_INET && family != AF_INET6) || port > 99999) {
@@ -559,27 +2243,15 @@ int btc_get_peers_from_dns(const char* seed, vector* ips_out, int port, int fami
 
 btc_bool btc_node_group_add_peers_by_ip_or_seed(btc_node_group *group, const char *ips) {
     if (ips == NULL) {
+        group->discover_peers = true;
+
+        /* previously known peers spare the DNS lookup */
+        if (group->addrman && btc_node_group_add_peers_from_addrman(group, group->desired_amount_connected_nodes * 3) > 0)
+            return true;
+
         /* === DNS QUERY === */
-        /* get a couple of peers from a seed */
-        vector* ips_dns = vector_new(10, free);
-        const btc_dns_seed seed = group->chainparams->dnsseeds[0];
-        if (strlen(seed.domain) == 0) {
-            return false;
-        }
-        /* todo: make sure we have enought peers, eventually */
-        /* call another seeder */
-        btc_get_peers_from_dns(seed.domain, ips_dns, group->chainparams->default_port, AF_INET);
-        for (unsigned int i = 0; i < ips_dns->len; i++) {
-            char* ip = (char*)vector_idx(ips_dns, i);
-
-            /* create a node */
-            btc_node* node = btc_node_new();
-            if (btc_node_set_ipport(node, ip) > 0) {
-                /* add the node to the group */
-                btc_node_group_add_node(group, node);
-            }
-        }
-        vector_free(ips_dns, true);
+        /* ask all seeds at once, their peers get added and connected as the answers arrive */
+        return (btc_node_group_resolve_seeds(group) > 0);
     } else {
         // add comma seperated ips (nodes)
         char working_str[64];
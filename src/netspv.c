@@ -26,11 +26,14 @@
 
 #include <btc/block.h>
 #include <btc/blockchain.h>
+#include <btc/blockfilter.h>
 #include <btc/headersdb.h>
+#include <btc/headersdb_compact.h>
 #include <btc/headersdb_file.h>
 #include <btc/net.h>
 #include <btc/netspv.h>
 #include <btc/protocol.h>
+#include <btc/script.h>
 #include <btc/serialize.h>
 #include <btc/tx.h>
 #include <btc/utils.h>
@@ -46,6 +49,7 @@
 #endif
 
 #include <assert.h>
+#include <pthread.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -56,10 +60,475 @@ static const unsigned int MIN_TIME_DELTA_FOR_STATE_CHECK = 5;
 static const unsigned int BLOCK_GAP_TO_DEDUCT_TO_START_SCAN_FROM = 5;
 static const unsigned int BLOCKS_DELTA_IN_S = 600;
 static const unsigned int COMPLETED_WHEN_NUM_NODES_AT_SAME_HEIGHT = 2;
+static const unsigned int CHECKSUM_VERIFY_THREADS = 2;
+static const unsigned int BLOCK_PARSER_THREADS = 2;
+static const unsigned int BLOCK_DOWNLOAD_WINDOW = 128;
+static const unsigned int BLOCK_DOWNLOAD_MAX_PER_PEER = 16;
+static const uint64_t BLOCK_DOWNLOAD_TIMEOUT_MS = 20000;
+static const double BLOOM_FILTER_FP_RATE = 0.0001;
+static const size_t CMPCT_TX_POOL_SIZE = 5000;
+static const size_t CMPCT_MAX_PENDING_BLOCKS = 8;
+
+/* a block of the download queue, requested from node (NULL if unassigned)
+   blocks received out of order are kept until all previous blocks arrived */
+typedef struct btc_spv_block_request_
+{
+    btc_uint256 hash;
+    uint32_t height; /* known height (blocks from the filter scan), 0 if the header still needs to be connected */
+    btc_node *node;
+    btc_node *stalled_node; /* node the block has timed out on */
+    uint64_t requested_ms;
+    uint8_t *data;
+    size_t data_len;
+
+    /* merkle block received from merkle_node, waiting for the matched transactions that follow it */
+    btc_node *merkle_node;
+    uint8_t merkle_header[80];
+    btc_uint256 *merkle_matches;
+    size_t merkle_match_count;
+    size_t merkle_received;
+    cstring *merkle_txs;
+} btc_spv_block_request;
+
+/* compact filter scan of the blocks after the scan start
+   filters are requested in batches together with their filter hashes (cfheaders),
+   each filter is checked against the advertised hash and the filter headers of the batches must connect
+   the cfheaders are also requested from a second filter peer, a batch is only trusted if both agree,
+   otherwise all its blocks are downloaded */
+typedef struct btc_spv_filter_sync_
+{
+    btc_bool scanning; /* scan start reached, the blocks are checked with filters */
+    btc_bool headers_done; /* no more headers to load */
+    uint32_t start_height; /* height of the first block hash */
+    btc_uint256 *block_hashes; /* hashes of the blocks to scan */
+    size_t count;
+    size_t alloc;
+    size_t next; /* position of the next filter to check */
+    unsigned int matched;
+
+    /* outstanding getcfheaders/getcfilters request for [batch_start, batch_end) */
+    btc_node *node;
+    uint64_t request_time;
+    size_t batch_start;
+    size_t batch_end;
+    btc_bool have_filter_hashes;
+    btc_uint256 *filter_hashes; /* of the batch, from cfheaders */
+    btc_uint256 prev_header; /* filter header before the batch */
+    btc_uint256 last_header; /* filter header of the last checked batch */
+    btc_bool have_last_header;
+    int last_header_nodeid; /* the only node vouching for last_header, -1 if two nodes agreed on it */
+    uint8_t *batch_matches; /* filters of the batch that matched, queued once the batch is trusted */
+
+    /* cross-check of the batch with a second filter peer */
+    btc_node *check_node;
+    btc_bool have_check_hashes;
+    btc_uint256 *check_hashes;
+    btc_uint256 check_prev_header;
+} btc_spv_filter_sync;
+
+/* compact block waiting for the blocktxn response of node */
+typedef struct btc_spv_cmpct_request_
+{
+    btc_node *node;
+    btc_cmpctblock *cb;
+} btc_spv_cmpct_request;
+
+/* block in the processing pipeline: queued by the event loop, parsed by a worker, passed to the callbacks in order */
+typedef struct btc_spv_block_job_
+{
+    btc_blockindex index;
+    uint8_t *txs_data; /* the serialized transactions */
+    size_t txs_len;
+    uint32_t tx_count;
+    vector *txs; /* parsed btc_tx */
+    btc_bool done;
+    uint64_t queued_us;
+    uint64_t parse_start_us;
+    uint64_t parsed_us;
+    struct btc_spv_block_job_ *next_work; /* work queue */
+    struct btc_spv_block_job_ *next; /* delivery queue (in chain order) */
+} btc_spv_block_job;
+
+typedef struct btc_spv_block_pipeline_
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t *threads;
+    unsigned int threads_count;
+    btc_bool shutdown;
+    size_t max_pending;
+
+    btc_spv_block_job *work_head;
+    btc_spv_block_job *work_tail;
+    btc_spv_block_job *deliver_head;
+    btc_spv_block_job *deliver_tail;
+    btc_spv_pipeline_stats stats;
+
+    /* wakes up the event loop once blocks are parsed, only pending while blocks are in the pipeline */
+    evutil_socket_t notify_fds[2];
+    struct event *notify_event;
+    btc_bool notify_pending;
+    btc_spv_client *client;
+} btc_spv_block_pipeline;
 
 static btc_bool btc_net_spv_node_timer_callback(btc_node *node, uint64_t *now);
 void btc_net_spv_post_cmd(btc_node *node, btc_p2p_msg_hdr *hdr, struct const_buffer *buf);
 void btc_net_spv_node_handshake_done(btc_node *node);
+void btc_net_spv_node_request_headers_or_blocks(btc_node *node, btc_bool blocks);
+static void btc_net_spv_request_filters(btc_spv_client *client);
+static void btc_net_spv_filter_batch_reset(btc_spv_filter_sync *fs);
+static btc_bool btc_net_spv_node_can_serve_blocks(btc_node *node);
+static void btc_net_spv_load_bloom_filter(btc_spv_client *client, btc_node *node);
+static void btc_net_spv_check_sync_completed(btc_spv_client *client);
+static void btc_net_spv_continue_rescan(btc_spv_client *client);
+
+static void btc_spv_block_request_free(void *e)
+{
+    btc_spv_block_request *req = (btc_spv_block_request *)e;
+    if (req->data)
+        btc_free(req->data);
+    btc_free(req->merkle_matches);
+    if (req->merkle_txs)
+        cstr_free(req->merkle_txs, true);
+    btc_free(req);
+}
+
+static void btc_spv_cmpct_request_free(void *e)
+{
+    btc_spv_cmpct_request *req = (btc_spv_cmpct_request *)e;
+    btc_cmpctblock_free(req->cb);
+    btc_free(req);
+}
+
+static void btc_net_spv_cstr_free(void *e)
+{
+    cstr_free((cstring *)e, true);
+}
+
+static uint64_t btc_net_spv_time_us(void)
+{
+    struct timeval tv;
+    evutil_gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + (uint64_t)tv.tv_usec;
+}
+
+static uint64_t btc_net_spv_time_ms(void)
+{
+    return btc_net_spv_time_us() / 1000;
+}
+
+static void btc_net_spv_tx_free(void *e)
+{
+    btc_tx_free((btc_tx *)e);
+}
+
+static void btc_spv_watcher_free(void *e)
+{
+    btc_spv_watcher *watcher = (btc_spv_watcher *)e;
+    vector_free(watcher->keys, true);
+    btc_free(watcher);
+}
+
+static void btc_spv_block_job_free(btc_spv_block_job *job)
+{
+    if (job->txs)
+        vector_free(job->txs, true);
+    btc_free(job->txs_data);
+    btc_free(job);
+}
+
+static void btc_spv_pipeline_stage_add(btc_spv_pipeline_stage *stage, uint64_t start_us, uint64_t end_us)
+{
+    uint64_t us = (end_us > start_us ? end_us - start_us : 0);
+    stage->count++;
+    stage->total_us += us;
+    if (us > stage->max_us)
+        stage->max_us = us;
+}
+
+static void btc_spv_block_job_parse(btc_spv_block_job *job)
+{
+    struct const_buffer buf = { job->txs_data, job->txs_len };
+    job->txs = vector_new(job->tx_count > 0 ? job->tx_count : 1, btc_net_spv_tx_free);
+    for (uint32_t i = 0; i < job->tx_count; i++)
+    {
+        btc_tx *tx = btc_tx_new();
+        size_t consumed = 0;
+        if (!btc_tx_deserialize(buf.p, buf.len, tx, &consumed, true) || !deser_skip(&buf, consumed))
+        {
+            btc_tx_free(tx);
+            break;
+        }
+        vector_add(job->txs, tx);
+    }
+}
+
+/* pass a transaction to the watchers owning one of its outputs */
+static void btc_net_spv_dispatch_watchers(btc_spv_client *client, btc_tx *tx, unsigned int pos, btc_blockindex *pindex)
+{
+    if (client->watch_index->count == 0 || !tx->vout)
+        return;
+
+    vector *matches = client->watch_matches;
+    vector_resize(matches, 0);
+    for (size_t i = 0; i < tx->vout->len; i++)
+    {
+        btc_tx_out *tx_out = vector_idx(tx->vout, i);
+        if (tx_out->script_pubkey)
+            btc_script_matcher_find_owners(client->watch_index, (const uint8_t *)tx_out->script_pubkey->str, tx_out->script_pubkey->len, matches);
+    }
+    if (matches->len == 0)
+        return;
+
+    uint64_t seq = ++client->watch_tx_seq;
+    for (size_t i = 0; i < matches->len; i++)
+    {
+        btc_spv_watcher *watcher = vector_idx(matches, i);
+        /* an earlier callback may have removed the watcher */
+        if (i > 0 && vector_find(client->watchers, watcher) < 0)
+            continue;
+        if (watcher->last_tx_seq == seq)
+            continue;
+        watcher->last_tx_seq = seq;
+        watcher->sync_transaction(watcher->ctx, tx, pos, pindex);
+    }
+}
+
+/* pass the parsed transactions to the callback (on the event loop) */
+static void btc_spv_block_job_deliver(btc_spv_block_pipeline *pipeline, btc_spv_block_job *job)
+{
+    btc_spv_client *client = pipeline->client;
+    uint64_t start = btc_net_spv_time_us();
+    if (job->txs->len < job->tx_count)
+        client->nodegroup->log_write_cb("Error deserializing transaction %d of the block at height %d\n", (int)job->txs->len, job->index.height);
+    for (size_t i = 0; i < job->txs->len; i++)
+    {
+        if (client->sync_transaction) { client->sync_transaction(client->sync_transaction_ctx, vector_idx(job->txs, i), (unsigned int)i, &job->index); }
+        btc_net_spv_dispatch_watchers(client, vector_idx(job->txs, i), (unsigned int)i, &job->index);
+    }
+    uint64_t end = btc_net_spv_time_us();
+
+    pthread_mutex_lock(&pipeline->lock);
+    btc_spv_pipeline_stage_add(&pipeline->stats.reorder, job->parsed_us, start);
+    btc_spv_pipeline_stage_add(&pipeline->stats.callback, start, end);
+    pipeline->stats.blocks++;
+    pipeline->stats.txs += job->txs->len;
+    pipeline->stats.pending--;
+    pthread_mutex_unlock(&pipeline->lock);
+}
+
+static void *btc_spv_block_pipeline_worker(void *ctx)
+{
+    btc_spv_block_pipeline *pipeline = (btc_spv_block_pipeline *)ctx;
+    pthread_mutex_lock(&pipeline->lock);
+    while (1)
+    {
+        while (!pipeline->work_head && !pipeline->shutdown)
+            pthread_cond_wait(&pipeline->cond, &pipeline->lock);
+        if (pipeline->shutdown)
+            break;
+        btc_spv_block_job *job = pipeline->work_head;
+        pipeline->work_head = job->next_work;
+        if (!pipeline->work_head)
+            pipeline->work_tail = NULL;
+        job->parse_start_us = btc_net_spv_time_us();
+        btc_spv_pipeline_stage_add(&pipeline->stats.queued, job->queued_us, job->parse_start_us);
+        pthread_mutex_unlock(&pipeline->lock);
+
+        btc_spv_block_job_parse(job);
+        uint64_t parsed = btc_net_spv_time_us();
+
+        pthread_mutex_lock(&pipeline->lock);
+        job->parsed_us = parsed;
+        job->done = true;
+        btc_spv_pipeline_stage_add(&pipeline->stats.parse, job->parse_start_us, parsed);
+        /* the event loop drains all pending notifications at once */
+        char c = 0;
+        if (send(pipeline->notify_fds[1], &c, 1, 0) < 0) {
+            /* notification pipe is full, the loop will pick up this block anyway */
+        }
+    }
+    pthread_mutex_unlock(&pipeline->lock);
+    return NULL;
+}
+
+/* completion handler on the event loop, passes the parsed blocks in chain order */
+static void btc_spv_block_pipeline_notify_cb(evutil_socket_t fd, short event, void *ctx)
+{
+    (void)event;
+    btc_spv_block_pipeline *pipeline = (btc_spv_block_pipeline *)ctx;
+    char buf[256];
+    while (recv(fd, buf, sizeof(buf), 0) > 0) {
+    }
+
+    pthread_mutex_lock(&pipeline->lock);
+    btc_spv_block_job *done_head = NULL;
+    btc_spv_block_job *done_tail = NULL;
+    while (pipeline->deliver_head && pipeline->deliver_head->done)
+    {
+        btc_spv_block_job *job = pipeline->deliver_head;
+        pipeline->deliver_head = job->next;
+        job->next = NULL;
+        if (done_tail)
+            done_tail->next = job;
+        else
+            done_head = job;
+        done_tail = job;
+    }
+    if (!pipeline->deliver_head)
+    {
+        pipeline->deliver_tail = NULL;
+        event_del(pipeline->notify_event);
+        pipeline->notify_pending = false;
+    }
+    pthread_mutex_unlock(&pipeline->lock);
+
+    if (!done_head)
+        return;
+    while (done_head)
+    {
+        btc_spv_block_job *job = done_head;
+        done_head = job->next;
+        btc_spv_block_job_deliver(pipeline, job);
+        btc_spv_block_job_free(job);
+    }
+
+    /* the pipeline has room for more blocks */
+    btc_spv_client *client = pipeline->client;
+    btc_net_spv_continue_rescan(client);
+    btc_net_spv_schedule_blocks(client);
+    btc_net_spv_check_sync_completed(client);
+}
+
+/* hand the transactions of a connected block over to the pipeline (copies them) */
+static void btc_spv_block_pipeline_submit(btc_spv_block_pipeline *pipeline, const btc_blockindex *pindex, uint32_t tx_count, struct const_buffer *txs)
+{
+    btc_spv_block_job *job = btc_calloc(1, sizeof(*job));
+    memcpy(&job->index, pindex, sizeof(job->index));
+    job->tx_count = tx_count;
+    job->txs_len = txs->len;
+    job->txs_data = btc_malloc(txs->len > 0 ? txs->len : 1);
+    memcpy(job->txs_data, txs->p, txs->len);
+    job->queued_us = btc_net_spv_time_us();
+
+    pthread_mutex_lock(&pipeline->lock);
+    pipeline->stats.pending++;
+    if (pipeline->stats.pending > pipeline->stats.pending_max)
+        pipeline->stats.pending_max = pipeline->stats.pending;
+    if (pipeline->threads_count == 0)
+    {
+        /* parse on the event loop */
+        btc_spv_pipeline_stage_add(&pipeline->stats.queued, job->queued_us, job->queued_us);
+        pthread_mutex_unlock(&pipeline->lock);
+        job->parse_start_us = job->queued_us;
+        btc_spv_block_job_parse(job);
+        job->parsed_us = btc_net_spv_time_us();
+        pthread_mutex_lock(&pipeline->lock);
+        btc_spv_pipeline_stage_add(&pipeline->stats.parse, job->parse_start_us, job->parsed_us);
+        pthread_mutex_unlock(&pipeline->lock);
+        btc_spv_block_job_deliver(pipeline, job);
+        btc_spv_block_job_free(job);
+        return;
+    }
+
+    if (pipeline->deliver_tail)
+        pipeline->deliver_tail->next = job;
+    else
+        pipeline->deliver_head = job;
+    pipeline->deliver_tail = job;
+    if (pipeline->work_tail)
+        pipeline->work_tail->next_work = job;
+    else
+        pipeline->work_head = job;
+    pipeline->work_tail = job;
+    pthread_cond_signal(&pipeline->cond);
+    pthread_mutex_unlock(&pipeline->lock);
+
+    if (!pipeline->notify_pending)
+    {
+        event_add(pipeline->notify_event, NULL);
+        pipeline->notify_pending = true;
+    }
+}
+
+static size_t btc_spv_block_pipeline_pending(btc_spv_block_pipeline *pipeline)
+{
+    pthread_mutex_lock(&pipeline->lock);
+    size_t pending = pipeline->stats.pending;
+    pthread_mutex_unlock(&pipeline->lock);
+    return pending;
+}
+
+static void btc_spv_block_pipeline_free(btc_spv_block_pipeline *pipeline)
+{
+    if (!pipeline)
+        return;
+
+    pthread_mutex_lock(&pipeline->lock);
+    pipeline->shutdown = true;
+    pthread_cond_broadcast(&pipeline->cond);
+    pthread_mutex_unlock(&pipeline->lock);
+    for (unsigned int i = 0; i < pipeline->threads_count; i++)
+        pthread_join(pipeline->threads[i], NULL);
+
+    /* blocks not passed to the callbacks yet are dropped */
+    btc_spv_block_job *job = pipeline->deliver_head;
+    while (job)
+    {
+        btc_spv_block_job *next = job->next;
+        btc_spv_block_job_free(job);
+        job = next;
+    }
+
+    if (pipeline->notify_event)
+    {
+        event_del(pipeline->notify_event);
+        event_free(pipeline->notify_event);
+        evutil_closesocket(pipeline->notify_fds[0]);
+        evutil_closesocket(pipeline->notify_fds[1]);
+    }
+    pthread_cond_destroy(&pipeline->cond);
+    pthread_mutex_destroy(&pipeline->lock);
+    btc_free(pipeline->threads);
+    btc_free(pipeline);
+}
+
+btc_bool btc_spv_client_set_block_workers(btc_spv_client *client, unsigned int threads, unsigned int max_pending)
+{
+    btc_spv_block_pipeline_free(client->block_pipeline);
+    btc_spv_block_pipeline *pipeline = btc_calloc(1, sizeof(*pipeline));
+    client->block_pipeline = pipeline;
+    pipeline->client = client;
+    pipeline->max_pending = (max_pending > 0 && max_pending < BLOCK_DOWNLOAD_WINDOW ? max_pending : BLOCK_DOWNLOAD_WINDOW);
+    pthread_mutex_init(&pipeline->lock, NULL);
+    pthread_cond_init(&pipeline->cond, NULL);
+    if (threads == 0)
+        return true;
+
+    if (evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, pipeline->notify_fds) != 0)
+        return false;
+    evutil_make_socket_nonblocking(pipeline->notify_fds[0]);
+    evutil_make_socket_nonblocking(pipeline->notify_fds[1]);
+    pipeline->notify_event = event_new(client->nodegroup->event_base, pipeline->notify_fds[0], EV_READ | EV_PERSIST, btc_spv_block_pipeline_notify_cb, pipeline);
+
+    pipeline->threads = btc_calloc(threads, sizeof(pthread_t));
+    for (unsigned int i = 0; i < threads; i++)
+    {
+        if (pthread_create(&pipeline->threads[i], NULL, btc_spv_block_pipeline_worker, pipeline) != 0)
+            break;
+        pipeline->threads_count++;
+    }
+    /* without workers, the blocks get parsed on the event loop */
+    return (pipeline->threads_count == threads);
+}
+
+void btc_spv_client_get_pipeline_stats(btc_spv_client *client, btc_spv_pipeline_stats *stats)
+{
+    btc_spv_block_pipeline *pipeline = client->block_pipeline;
+    pthread_mutex_lock(&pipeline->lock);
+    memcpy(stats, &pipeline->stats, sizeof(*stats));
+    pthread_mutex_unlock(&pipeline->lock);
+}
 
 void btc_net_set_spv(btc_node_group *nodegroup)
 {
@@ -67,6 +536,7 @@ void btc_net_set_spv(btc_node_group *nodegroup)
     nodegroup->handshake_done_cb = btc_net_spv_node_handshake_done;
     nodegroup->node_connection_state_changed_cb = NULL;
     nodegroup->periodic_timer_cb = btc_net_spv_node_timer_callback;
+    nodegroup->prefer_headers = true;
 }
 
 btc_spv_client* btc_spv_client_new(const btc_chainparams *params, btc_bool debug, btc_bool headers_memonly)
@@ -85,6 +555,9 @@ btc_spv_client* btc_spv_client_new(const btc_chainparams *params, btc_bool debug
     client->nodegroup->ctx = client;
     client->nodegroup->desired_amount_connected_nodes = 3; /* TODO */
 
+    /* keep the hashing of (large) block messages off the event loop */
+    btc_node_group_set_verify_threads(client->nodegroup, CHECKSUM_VERIFY_THREADS);
+
     btc_net_set_spv(client->nodegroup);
 
     if (debug) {
@@ -94,7 +567,8 @@ btc_spv_client* btc_spv_client_new(const btc_chainparams *params, btc_bool debug
     if (params == &btc_chainparams_main) {
         client->use_checkpoints = true;
     }
-    client->headers_db = &btc_headers_db_interface_file;
+    /* in-memory only headers are kept in the compact (array based) database */
+    client->headers_db = (headers_memonly ? &btc_headers_db_interface_compact : &btc_headers_db_interface_file);
     client->headers_db_ctx = client->headers_db->init(params, headers_memonly);
 
     // set callbacks
@@ -104,6 +578,35 @@ btc_spv_client* btc_spv_client_new(const btc_chainparams *params, btc_bool debug
     client->header_message_processed = NULL;
     client->sync_transaction = NULL;
 
+    client->block_queue = vector_new(BLOCK_DOWNLOAD_WINDOW, btc_spv_block_request_free);
+    client->block_queue_more = false;
+    client->block_download_timeout_ms = BLOCK_DOWNLOAD_TIMEOUT_MS;
+    client->block_download_timer = NULL;
+    client->block_pipeline = NULL;
+    btc_spv_client_set_block_workers(client, BLOCK_PARSER_THREADS, 0);
+    client->headers_pipelining = true;
+    client->use_compact_filters = false;
+    client->watched_scripts = vector_new(8, btc_net_spv_cstr_free);
+    client->filter_sync = btc_calloc(1, sizeof(btc_spv_filter_sync));
+    client->filter_sync->filter_hashes = btc_calloc(MAX_GETCFILTERS_SIZE, sizeof(btc_uint256));
+    client->filter_sync->check_hashes = btc_calloc(MAX_GETCFILTERS_SIZE, sizeof(btc_uint256));
+    client->filter_sync->batch_matches = btc_calloc(MAX_GETCFILTERS_SIZE, sizeof(uint8_t));
+    client->use_bloom_filter = false;
+    client->watched_outpoints = vector_new(8, btc_net_spv_cstr_free);
+    client->watchers = vector_new(8, btc_spv_watcher_free);
+    client->watch_index = btc_script_matcher_new(0);
+    client->watch_matches = vector_new(8, NULL);
+    client->watch_tx_seq = 0;
+    client->block_store = NULL;
+    client->rescanning = false;
+    client->rescan_completed = NULL;
+    client->bloom_fp_rate = BLOOM_FILTER_FP_RATE;
+    client->bloom_filter = NULL;
+    client->bloom_filter_dirty = true;
+    client->use_compact_blocks = false;
+    client->tx_pool = btc_cmpct_txpool_new(CMPCT_TX_POOL_SIZE);
+    client->cmpct_blocks = vector_new(CMPCT_MAX_PENDING_BLOCKS, btc_spv_cmpct_request_free);
+
     return client;
 }
 
@@ -130,6 +633,63 @@ void btc_spv_client_free(btc_spv_client *client)
         client->headers_db = NULL;
     }
 
+    if (client->block_download_timer) {
+        event_free(client->block_download_timer);
+        client->block_download_timer = NULL;
+    }
+
+    if (client->block_queue) {
+        vector_free(client->block_queue, true);
+        client->block_queue = NULL;
+    }
+
+    if (client->watched_scripts) {
+        vector_free(client->watched_scripts, true);
+        client->watched_scripts = NULL;
+    }
+
+    if (client->watched_outpoints) {
+        vector_free(client->watched_outpoints, true);
+        client->watched_outpoints = NULL;
+    }
+
+    if (client->watchers) {
+        vector_free(client->watchers, true);
+        client->watchers = NULL;
+    }
+    btc_script_matcher_free(client->watch_index);
+    client->watch_index = NULL;
+    if (client->watch_matches) {
+        vector_free(client->watch_matches, true);
+        client->watch_matches = NULL;
+    }
+
+    btc_bloom_filter_free(client->bloom_filter);
+    client->bloom_filter = NULL;
+
+    btc_cmpct_txpool_free(client->tx_pool);
+    client->tx_pool = NULL;
+
+    if (client->cmpct_blocks) {
+        vector_free(client->cmpct_blocks, true);
+        client->cmpct_blocks = NULL;
+    }
+
+    if (client->filter_sync) {
+        btc_free(client->filter_sync->block_hashes);
+        btc_free(client->filter_sync->filter_hashes);
+        btc_free(client->filter_sync->check_hashes);
+        btc_free(client->filter_sync->batch_matches);
+        btc_free(client->filter_sync);
+        client->filter_sync = NULL;
+    }
+
+    btc_spv_block_pipeline_free(client->block_pipeline);
+    client->block_pipeline = NULL;
+
+    btc_blockstore_free(client->block_store);
+    client->block_store = NULL;
+
     if (client->nodegroup) {
         btc_node_group_free(client->nodegroup);
         client->nodegroup = NULL;
@@ -138,6 +698,105 @@ void btc_spv_client_free(btc_spv_client *client)
     free(client);
 }
 
+void btc_spv_client_watch_script(btc_spv_client *client, const uint8_t *script, size_t script_len)
+{
+    vector_add(client->watched_scripts, cstr_new_buf(script, script_len));
+    client->bloom_filter_dirty = true;
+}
+
+void btc_spv_client_watch_outpoint(btc_spv_client *client, const btc_uint256 txid, uint32_t n)
+{
+    cstring *outpoint = cstr_new_sz(36);
+    ser_u256(outpoint, txid);
+    ser_u32(outpoint, n);
+    vector_add(client->watched_outpoints, outpoint);
+    client->bloom_filter_dirty = true;
+}
+
+btc_spv_watcher* btc_spv_client_add_watcher(btc_spv_client *client, void (*sync_transaction)(void *ctx, btc_tx *tx, unsigned int pos, btc_blockindex *blockindex), void *ctx)
+{
+    btc_spv_watcher *watcher = btc_calloc(1, sizeof(*watcher));
+    watcher->sync_transaction = sync_transaction;
+    watcher->ctx = ctx;
+    watcher->keys = vector_new(8, btc_free);
+    vector_add(client->watchers, watcher);
+    return watcher;
+}
+
+void btc_spv_client_remove_watcher(btc_spv_client *client, btc_spv_watcher *watcher)
+{
+    for (size_t i = 0; i < watcher->keys->len; i++)
+        btc_script_matcher_remove_key(client->watch_index, vector_idx(watcher->keys, i), watcher);
+    vector_remove(client->watchers, watcher);
+}
+
+static btc_bool btc_spv_watcher_add_key(btc_spv_client *client, btc_spv_watcher *watcher, const btc_script_match_key *key)
+{
+    if (!btc_script_matcher_add_key(client->watch_index, key, watcher))
+        return false;
+
+    btc_script_match_key *key_copy = btc_malloc(sizeof(*key_copy));
+    memcpy(key_copy, key, sizeof(*key_copy));
+    vector_add(watcher->keys, key_copy);
+    return true;
+}
+
+btc_bool btc_spv_watcher_watch_script(btc_spv_client *client, btc_spv_watcher *watcher, const uint8_t *script, size_t script_len)
+{
+    btc_script_match_key key;
+    btc_script_match_key_from_script(script, script_len, &key);
+    if (!btc_spv_watcher_add_key(client, watcher, &key))
+        return false;
+
+    btc_spv_client_watch_script(client, script, script_len);
+    return true;
+}
+
+btc_bool btc_spv_watcher_watch_keyhash(btc_spv_client *client, btc_spv_watcher *watcher, const btc_uint160 hash160)
+{
+    btc_script_match_key key;
+    btc_script_match_key_from_keyhash(hash160, &key);
+    if (!btc_spv_watcher_add_key(client, watcher, &key))
+        return false;
+
+    /* the filters only know the scripts (a P2PK output also matches the hash160 in a bloom filter) */
+    cstring *script = cstr_new_sz(25);
+    btc_script_build_p2pkh(script, hash160);
+    btc_spv_client_watch_script(client, (const uint8_t *)script->str, script->len);
+    cstr_resize(script, 0);
+    btc_script_build_p2wpkh(script, hash160);
+    btc_spv_client_watch_script(client, (const uint8_t *)script->str, script->len);
+    cstr_free(script, true);
+    return true;
+}
+
+btc_bool btc_spv_client_open_block_store(btc_spv_client *client, const char *dir)
+{
+    btc_blockstore_free(client->block_store);
+    client->block_store = btc_blockstore_new(client->chainparams);
+    if (!btc_blockstore_open(client->block_store, dir))
+    {
+        btc_blockstore_free(client->block_store);
+        client->block_store = NULL;
+        return false;
+    }
+    return true;
+}
+
+btc_bool btc_spv_client_rescan(btc_spv_client *client, uint32_t from_height)
+{
+    if (!client->block_store || client->rescanning || client->block_queue->len > 0)
+        return false;
+
+    btc_blockindex *tip = client->headers_db->getchaintip(client->headers_db_ctx);
+    client->rescanning = true;
+    client->rescan_next_height = from_height;
+    client->rescan_end_height = tip->height;
+    client->rescan_have_prev = false;
+    btc_net_spv_continue_rescan(client);
+    return true;
+}
+
 btc_bool btc_spv_client_load(btc_spv_client *client, const char *file_path)
 {
     if (!client)
@@ -150,6 +809,14 @@ btc_bool btc_spv_client_load(btc_spv_client *client, const char *file_path)
 
 }
 
+btc_bool btc_spv_client_import_snapshot(btc_spv_client *client, const char *file_path)
+{
+    if (!client || !client->headers_db)
+        return false;
+
+    return client->headers_db->import_snapshot(client->headers_db_ctx, client->chainparams, file_path, NULL);
+}
+
 void btc_net_spv_periodic_statecheck(btc_node *node, uint64_t *now)
 {
     /* statecheck logic */
@@ -163,7 +830,21 @@ void btc_net_spv_periodic_statecheck(btc_node *node, uint64_t *now)
     if (client->last_headersrequest_time > 0 && *now > client->last_headersrequest_time)
     {
         int64_t timedetla = *now - client->last_headersrequest_time;
-        if (timedetla > HEADERS_MAX_RESPONSE_TIME)
+        btc_node *sync_node = btc_net_spv_headers_sync_node(client);
+        btc_node *faster_node = NULL;
+        if (sync_node && btc_node_response_overdue(sync_node))
+            faster_node = btc_node_group_best_sync_node(client->nodegroup, client->headers_db->getchaintip(client->headers_db_ctx)->height, sync_node);
+
+        if (timedetla <= HEADERS_MAX_RESPONSE_TIME && faster_node)
+        {
+            /* rotate away from the slow peer (keep it connected, its measurements will count the delay) */
+            client->nodegroup->log_write_cb("Header response from node %d is overdue (%d s), switching to node %d\n", sync_node->nodeid, timedetla, faster_node->nodeid);
+            btc_node_response_received(sync_node, 0);
+            sync_node->state &= ~NODE_HEADERSYNC;
+            client->last_headersrequest_time = 0;
+            btc_net_spv_node_request_headers_or_blocks(faster_node, false);
+        }
+        else if (timedetla > HEADERS_MAX_RESPONSE_TIME)
         {
             client->nodegroup->log_write_cb("No header response in time (used %d) for node %d\n", timedetla, node->nodeid);
             /* disconnect the node if we haven't got a header after requesting some with a getheaders message */
@@ -188,6 +869,28 @@ void btc_net_spv_periodic_statecheck(btc_node *node, uint64_t *now)
         }
     }
 
+    /* check if the compact filter request (or its cross-check) has stalled */
+    btc_spv_filter_sync *fs = client->filter_sync;
+    if (fs->node)
+    {
+        btc_bool check_pending = (fs->check_node && !fs->have_check_hashes);
+        btc_node *stalled = NULL;
+        if ((fs->node->state & NODE_CONNECTED) != NODE_CONNECTED)
+            stalled = fs->node;
+        else if (check_pending && (fs->check_node->state & NODE_CONNECTED) != NODE_CONNECTED)
+            stalled = fs->check_node;
+        else if (*now > fs->request_time + HEADERS_MAX_RESPONSE_TIME)
+            stalled = (check_pending && fs->next == fs->batch_end ? fs->check_node : fs->node);
+        if (stalled)
+        {
+            client->nodegroup->log_write_cb("No compact filter response in time for node %d\n", stalled->nodeid);
+            if ((stalled->state & NODE_CONNECTED) == NODE_CONNECTED)
+                btc_node_disconnect(stalled);
+            btc_net_spv_filter_batch_reset(fs);
+        }
+    }
+    btc_net_spv_request_filters(client);
+
     /* check if we need to sync headers from a different peer */
     if ((client->stateflags & SPV_HEADER_SYNC_FLAG) == SPV_HEADER_SYNC_FLAG)
     {
@@ -216,8 +919,9 @@ static btc_bool btc_net_spv_node_timer_callback(btc_node *node, uint64_t *now)
     return true;
 }
 
-void btc_net_spv_fill_block_locator(btc_spv_client *client, vector *blocklocators)
+size_t btc_net_spv_fill_block_locator(btc_spv_client *client, btc_uint256 *locators, size_t max_locators)
 {
+    size_t count = 0;
     if (client->headers_db->getchaintip(client->headers_db_ctx)->height == 0)
     {
         if (client->use_checkpoints && client->oldest_item_of_interest > BLOCK_GAP_TO_DEDUCT_TO_START_SCAN_FROM * BLOCKS_DELTA_IN_S) {
@@ -228,49 +932,54 @@ void btc_net_spv_fill_block_locator(btc_spv_client *client, vector *blocklocator
             for (int i = (sizeof(btc_mainnet_checkpoint_array) / sizeof(btc_mainnet_checkpoint_array[0]))-1; i >= 0 ; i--)
             {
                 const btc_checkpoint *cp = &btc_mainnet_checkpoint_array[i];
-                if ( btc_mainnet_checkpoint_array[i].timestamp < min_timestamp)
+                if ( btc_mainnet_checkpoint_array[i].timestamp < min_timestamp && count < max_locators)
                 {
-                    btc_uint256 *hash = btc_calloc(1, sizeof(btc_uint256));
-                    utils_uint256_sethex((char *)btc_mainnet_checkpoint_array[i].hash, (uint8_t *)hash);
-                    vector_add(blocklocators, (void *)hash);
+                    utils_uint256_sethex((char *)btc_mainnet_checkpoint_array[i].hash, (uint8_t *)locators[count]);
 
                     if (!client->headers_db->has_checkpoint_start(client->headers_db_ctx)) {
-                        client->headers_db->set_checkpoint_start(client->headers_db_ctx, *hash, btc_mainnet_checkpoint_array[i].height);
+                        client->headers_db->set_checkpoint_start(client->headers_db_ctx, locators[count], btc_mainnet_checkpoint_array[i].height);
                     }
+                    count++;
                 }
             }
-            if (blocklocators->len > 0) {
+            if (count > 0) {
                 // return if we could fill up the blocklocator with checkpoints
-                return;
+                return count;
             }
         }
-        btc_uint256 *hash = btc_calloc(1, sizeof(btc_uint256));
-        memcpy(hash, &client->chainparams->genesisblockhash, sizeof(btc_uint256));
-        vector_add(blocklocators, (void *)hash);
+        memcpy(locators[0], &client->chainparams->genesisblockhash, sizeof(btc_uint256));
         client->nodegroup->log_write_cb("Setting blocklocator with genesis block\n");
+        return 1;
     }
     else
     {
-        client->headers_db->fill_blocklocator_tip(client->headers_db_ctx, blocklocators);
+        return client->headers_db->fill_blocklocator_tip(client->headers_db_ctx, locators, max_locators);
     }
 }
 
-void btc_net_spv_node_request_headers_or_blocks(btc_node *node, btc_bool blocks)
+static void btc_net_spv_node_request_after(btc_node *node, btc_bool blocks, btc_uint256 start_hash)
 {
     // request next headers
-    vector *blocklocators = vector_new(1, free);
+    btc_spv_client *client = (btc_spv_client *)node->nodegroup->ctx;
+    btc_uint256 locators[MAX_LOCATOR_SZ];
+    size_t locators_count = 0;
+    if (start_hash) {
+        /* continue after a hash not yet connected to the chain */
+        memcpy(locators[locators_count++], start_hash, sizeof(btc_uint256));
+    }
+    locators_count += btc_net_spv_fill_block_locator(client, &locators[locators_count], MAX_LOCATOR_SZ - locators_count);
 
-    btc_net_spv_fill_block_locator((btc_spv_client *)node->nodegroup->ctx, blocklocators);
+    /* the vector only references the flat locator array (no per hash heap allocation) */
+    vector *blocklocators = vector_new(locators_count, NULL);
+    for (size_t i = 0; i < locators_count; i++)
+        vector_add(blocklocators, locators[i]);
 
     cstring *getheader_msg = cstr_new_sz(256);
     btc_p2p_msg_getheaders(blocklocators, NULL, getheader_msg);
 
-    /* create p2p message */
-    cstring *p2p_msg = btc_p2p_message_new(node->nodegroup->chainparams->netmagic, (blocks ? BTC_MSG_GETBLOCKS : BTC_MSG_GETHEADERS), getheader_msg->str, getheader_msg->len);
-    cstr_free(getheader_msg, true);
-
-    /* send message */
-    btc_node_send(node, p2p_msg);
+    /* send message (the payload is passed on without a copy) */
+    btc_node_send_message(node, (blocks ? BTC_MSG_GETBLOCKS : BTC_MSG_GETHEADERS), &getheader_msg, 1, NULL);
+    btc_node_request_sent(node);
     node->state |= ( blocks ? NODE_BLOCKSYNC : NODE_HEADERSYNC);
 
     /* remember last headers request time */
@@ -283,7 +992,29 @@ void btc_net_spv_node_request_headers_or_blocks(btc_node *node, btc_bool blocks)
 
     /* cleanup */
     vector_free(blocklocators, true);
-    cstr_free(p2p_msg, true);
+}
+
+void btc_net_spv_node_request_headers_or_blocks(btc_node *node, btc_bool blocks)
+{
+    btc_spv_client *client = (btc_spv_client *)node->nodegroup->ctx;
+    if (blocks && client->block_queue->len > 0) {
+        /* continue after the last block already queued for download */
+        btc_spv_block_request *last = vector_idx(client->block_queue, client->block_queue->len - 1);
+        btc_net_spv_node_request_after(node, blocks, last->hash);
+        return;
+    }
+    btc_net_spv_node_request_after(node, blocks, NULL);
+}
+
+btc_node *btc_net_spv_headers_sync_node(btc_spv_client *client)
+{
+    for (size_t i = 0; i < client->nodegroup->nodes->len; i++)
+    {
+        btc_node *check_node = vector_idx(client->nodegroup->nodes, i);
+        if ((check_node->state & NODE_HEADERSYNC) == NODE_HEADERSYNC && (check_node->state & NODE_CONNECTED) == NODE_CONNECTED)
+            return check_node;
+    }
+    return NULL;
 }
 
 btc_bool btc_net_spv_request_headers(btc_spv_client *client)
@@ -302,45 +1033,24 @@ btc_bool btc_net_spv_request_headers(btc_spv_client *client)
     }
 
     /* We are not downloading headers at this point */
-    /* try to request headers from a peer where the version handshake has been done */
-    btc_bool new_headers_available = false;
-    unsigned int nodes_at_same_height = 0;
-    if (client->headers_db->getchaintip(client->headers_db_ctx)->header.timestamp > client->oldest_item_of_interest - (BLOCK_GAP_TO_DEDUCT_TO_START_SCAN_FROM * BLOCKS_DELTA_IN_S) )
+    /* request headers from the best scoring peer where the version handshake has been done */
+    btc_blockindex *chaintip = client->headers_db->getchaintip(client->headers_db_ctx);
+    btc_node *best_node = btc_node_group_best_sync_node(client->nodegroup, chaintip->height, NULL);
+    if (best_node)
     {
-        // no need to fetch headers;
-    }
-    else {
-        for(size_t i =0;i< client->nodegroup->nodes->len; i++)
-        {
-            btc_node *check_node = vector_idx(client->nodegroup->nodes, i);
-            if ( ((check_node->state & NODE_CONNECTED) == NODE_CONNECTED) && check_node->version_handshake)
-            {
-                if (check_node->bestknownheight > client->headers_db->getchaintip(client->headers_db_ctx)->height) {
-                    btc_net_spv_node_request_headers_or_blocks(check_node, false);
-                    new_headers_available = true;
-                    return true;
-                } else if (check_node->bestknownheight == client->headers_db->getchaintip(client->headers_db_ctx)->height) {
-                    nodes_at_same_height++;
-                }
-            }
-        }
+        /* fetch blocks if no new headers are required */
+        btc_bool blocks = (chaintip->header.timestamp > client->oldest_item_of_interest - (BLOCK_GAP_TO_DEDUCT_TO_START_SCAN_FROM * BLOCKS_DELTA_IN_S));
+        btc_net_spv_node_request_headers_or_blocks(best_node, blocks);
+        return true;
     }
 
-    if (!new_headers_available && btc_node_group_amount_of_connected_nodes(client->nodegroup, NODE_CONNECTED) > 0) {
-        // try to fetch blocks if no new headers are available but connected nodes are reachable
-        for(size_t i =0;i< client->nodegroup->nodes->len; i++)
-        {
-            btc_node *check_node = vector_idx(client->nodegroup->nodes, i);
-            if ( ((check_node->state & NODE_CONNECTED) == NODE_CONNECTED) && check_node->version_handshake)
-            {
-                if (check_node->bestknownheight > client->headers_db->getchaintip(client->headers_db_ctx)->height) {
-                    btc_net_spv_node_request_headers_or_blocks(check_node, true);
-                    return true;
-                } else if (check_node->bestknownheight == client->headers_db->getchaintip(client->headers_db_ctx)->height) {
-                    nodes_at_same_height++;
-                }
-            }
-        }
+    unsigned int nodes_at_same_height = 0;
+    for(size_t i =0;i< client->nodegroup->nodes->len; i++)
+    {
+        btc_node *check_node = vector_idx(client->nodegroup->nodes, i);
+        if ( ((check_node->state & NODE_CONNECTED) == NODE_CONNECTED) && check_node->version_handshake &&
+             check_node->bestknownheight == chaintip->height)
+            nodes_at_same_height++;
     }
 
     if ( nodes_at_same_height >= COMPLETED_WHEN_NUM_NODES_AT_SAME_HEIGHT &&
@@ -356,124 +1066,1127 @@ btc_bool btc_net_spv_request_headers(btc_spv_client *client)
 }
 void btc_net_spv_node_handshake_done(btc_node *node)
 {
-    btc_net_spv_request_headers((btc_spv_client*)node->nodegroup->ctx);
+    btc_spv_client *client = (btc_spv_client*)node->nodegroup->ctx;
+    btc_net_spv_request_headers(client);
+    btc_net_spv_load_bloom_filter(client, node);
+
+    if (client->use_compact_blocks)
+    {
+        /* high bandwidth mode: new blocks are sent as compact blocks without an inv/getdata round trip */
+        cstring *sendcmpct = cstr_new_sz(9);
+        uint8_t announce = 1;
+        ser_bytes(sendcmpct, &announce, 1);
+        ser_u64(sendcmpct, BTC_CMPCTBLOCK_VERSION);
+        btc_node_send_owned(node, btc_p2p_message_new(client->nodegroup->chainparams->netmagic, BTC_MSG_SENDCMPCT, sendcmpct->str, sendcmpct->len));
+        cstr_free(sendcmpct, true);
+    }
+
+    /* let the new peer take a share of the pending block downloads */
+    if (client->block_queue->len > 0)
+        btc_net_spv_schedule_blocks(client);
+    btc_net_spv_request_filters(client);
 }
 
-void btc_net_spv_post_cmd(btc_node *node, btc_p2p_msg_hdr *hdr, struct const_buffer *buf)
+/* (re)build the bloom filter from the watched scripts and outpoints if they changed
+   and load it on the node, a rebuilt filter is loaded on all connected nodes */
+static void btc_net_spv_load_bloom_filter(btc_spv_client *client, btc_node *node)
 {
-    btc_spv_client *client = (btc_spv_client *)node->nodegroup->ctx;
+    if (!client->use_bloom_filter)
+        return;
 
-    if (strcmp(hdr->command, BTC_MSG_INV) == 0 && (node->state & NODE_BLOCKSYNC) == NODE_BLOCKSYNC)
+    btc_bool rebuilt = false;
+    if (!client->bloom_filter || client->bloom_filter_dirty)
     {
-        struct const_buffer original_inv = { buf->p, buf->len };
-        uint32_t varlen;
-        deser_varlen(&varlen, buf);
-        btc_bool contains_block = false;
-
-        client->nodegroup->log_write_cb("Get inv request with %d items\n", varlen);
-
-        for (unsigned int i=0;i<varlen;i++)
+        /* the data pushes of the scripts (hash160s, pubkeys) are matched by the peers */
+        vector *elements = vector_new(client->watched_scripts->len + client->watched_outpoints->len + 1, btc_net_spv_cstr_free);
+        for (size_t i = 0; i < client->watched_scripts->len; i++)
         {
-            uint32_t type;
-            deser_u32(&type, buf);
-            if (type == BTC_INV_TYPE_BLOCK)
-                contains_block = true;
-
-            /* skip the hash, we are going to directly use the inv-buffer for the getdata */
-            /* this means we don't support invs contanining blocks and txns as a getblock answer */
-            if (type == BTC_INV_TYPE_BLOCK) {
-                deser_u256(node->last_requested_inv, buf);
-            }
-            else {
-                deser_skip(buf, 32);
+            vector *ops = vector_new(4, btc_script_op_free_cb);
+            btc_script_get_ops(vector_idx(client->watched_scripts, i), ops);
+            for (size_t j = 0; j < ops->len; j++)
+            {
+                btc_script_op *op = vector_idx(ops, j);
+                if (op->datalen > 0)
+                    vector_add(elements, cstr_new_buf(op->data, op->datalen));
             }
+            vector_free(ops, true);
+        }
+        for (size_t i = 0; i < client->watched_outpoints->len; i++)
+        {
+            cstring *outpoint = vector_idx(client->watched_outpoints, i);
+            vector_add(elements, cstr_new_buf(outpoint->str, outpoint->len));
         }
 
-        if (contains_block)
+        uint32_t tweak;
+        btc_cheap_random_bytes((uint8_t *)&tweak, sizeof(tweak));
+        btc_bloom_filter_free(client->bloom_filter);
+        client->bloom_filter = btc_bloom_filter_new(elements->len, client->bloom_fp_rate, tweak, BTC_BLOOM_UPDATE_ALL);
+        for (size_t i = 0; i < elements->len; i++)
         {
-            node->time_last_request = time(NULL);
-
-            /* request the blocks */
-            client->nodegroup->log_write_cb("Requesting %d blocks\n", varlen);
-            cstring *p2p_msg = btc_p2p_message_new(node->nodegroup->chainparams->netmagic, BTC_MSG_GETDATA, original_inv.p, original_inv.len);
-            btc_node_send(node, p2p_msg);
-            cstr_free(p2p_msg, true);
-
-            if (varlen >= 500) {
-                /* directly request more blocks */
-                /* not sure if this is clever if we want to download, as example, the complete chain */
-                btc_net_spv_node_request_headers_or_blocks(node, true);
-            }
+            cstring *element = vector_idx(elements, i);
+            btc_bloom_filter_insert(client->bloom_filter, (const uint8_t *)element->str, element->len);
         }
+        vector_free(elements, true);
+        client->bloom_filter_dirty = false;
+        rebuilt = true;
     }
-    if (strcmp(hdr->command, BTC_MSG_BLOCK) == 0)
-    {
-        btc_bool connected;
-        btc_blockindex *pindex = client->headers_db->connect_hdr(client->headers_db_ctx, buf, false, &connected);
-        /* deserialize the p2p header */
-        if (!pindex) {
-            /* deserialization failed */
-            return;
-        }
 
-        uint32_t amount_of_txs;
-        if (!deser_varlen(&amount_of_txs, buf)) {
-            /* deserialization transaction varint failed */
-            return;
+    cstring *payload = cstr_new_sz(client->bloom_filter->size + 16);
+    btc_bloom_filter_serialize(client->bloom_filter, payload);
+    for (size_t i = 0; i < client->nodegroup->nodes->len; i++)
+    {
+        btc_node *n = vector_idx(client->nodegroup->nodes, i);
+        if ((rebuilt && btc_net_spv_node_can_serve_blocks(n)) || n == node)
+            btc_node_send_owned(n, btc_p2p_message_new(client->nodegroup->chainparams->netmagic, BTC_MSG_FILTERLOAD, payload->str, payload->len));
+    }
+    cstr_free(payload, true);
+}
+
+static void btc_net_spv_process_block(btc_spv_client *client, struct const_buffer *buf, uint32_t height)
+{
+    size_t block_size = buf->len;
+    const uint8_t *raw_block = buf->p;
+    btc_bool connected = true;
+    btc_blockindex known_index;
+    btc_blockindex *pindex = &known_index;
+    if (height > 0) {
+        /* the header has already been connected (filter scan) */
+        memset(&known_index, 0, sizeof(known_index));
+        if (!btc_block_header_deserialize(&known_index.header, buf))
+            return;
+        btc_block_header_hash(&known_index.header, known_index.hash);
+        known_index.height = height;
+    }
+    else {
+        pindex = client->headers_db->connect_hdr(client->headers_db_ctx, buf, false, &connected);
+    }
+    /* deserialize the p2p header */
+    if (!pindex) {
+        /* deserialization failed */
+        return;
+    }
+
+    uint32_t amount_of_txs;
+    if (!deser_varlen(&amount_of_txs, buf)) {
+        /* deserialization transaction varint failed */
+        return;
+    }
+
+    /* for now, only scan if the block could be connected on top */
+    if (connected) {
+        if (client->header_connected && height == 0) { client->header_connected(client); }
+        client->nodegroup->log_write_cb("Downloaded new block with size %d and %d transactions at height %d\n", (int)block_size, amount_of_txs, pindex->height);
+
+        /* merkle blocks only have the matched transactions */
+        if (client->block_store && !client->use_bloom_filter)
+            btc_blockstore_put(client->block_store, pindex->hash, pindex->height, raw_block, block_size);
+
+        /* the transactions are parsed off the event loop and passed to sync_transaction in chain order */
+        btc_spv_block_pipeline_submit(client->block_pipeline, pindex, amount_of_txs, buf);
+    }
+    else {
+        client->nodegroup->log_write_cb("Could not connect block on top of the chain\n");
+    }
+}
+
+static btc_spv_block_request *btc_net_spv_find_block_request(btc_spv_client *client, btc_uint256 hash)
+{
+    for (size_t i = 0; i < client->block_queue->len; i++)
+    {
+        btc_spv_block_request *req = vector_idx(client->block_queue, i);
+        if (btc_hash_equal(req->hash, hash))
+            return req;
+    }
+    return NULL;
+}
+
+static btc_bool btc_net_spv_queue_block(btc_spv_client *client, btc_uint256 hash, uint32_t height)
+{
+    if (btc_net_spv_find_block_request(client, hash))
+        return false;
+
+    /* skip blocks we have already connected (blocks with a known height only have their header connected) */
+    btc_blockindex *chaintip = client->headers_db->getchaintip(client->headers_db_ctx);
+    if (height == 0 && btc_hash_equal(chaintip->hash, hash))
+        return false;
+
+    btc_spv_block_request *req = btc_calloc(1, sizeof(*req));
+    memcpy(req->hash, hash, sizeof(btc_uint256));
+    req->height = height;
+    vector_add(client->block_queue, req);
+    return true;
+}
+
+static void btc_net_spv_merkle_reset(btc_spv_block_request *req)
+{
+    btc_free(req->merkle_matches);
+    req->merkle_matches = NULL;
+    req->merkle_match_count = 0;
+    req->merkle_received = 0;
+    if (req->merkle_txs)
+        cstr_free(req->merkle_txs, true);
+    req->merkle_txs = NULL;
+    req->merkle_node = NULL;
+}
+
+static void btc_net_spv_block_download_timer_cb(evutil_socket_t fd, short event, void *ctx)
+{
+    (void)fd;
+    (void)event;
+    btc_net_spv_schedule_blocks((btc_spv_client *)ctx);
+}
+
+static btc_bool btc_net_spv_node_can_serve_blocks(btc_node *node)
+{
+    return ((node->state & NODE_CONNECTED) == NODE_CONNECTED && node->version_handshake && (node->state & NODE_MISSBEHAVED) != NODE_MISSBEHAVED);
+}
+
+void btc_net_spv_schedule_blocks(btc_spv_client *client)
+{
+    vector *nodes = client->nodegroup->nodes;
+    size_t window = (client->block_queue->len < BLOCK_DOWNLOAD_WINDOW ? client->block_queue->len : BLOCK_DOWNLOAD_WINDOW);
+    uint64_t now = btc_net_spv_time_ms();
+
+    /* per node: amount of blocks in flight, the score and the getdata inv entries */
+    unsigned int *in_flight = btc_calloc(nodes->len + 1, sizeof(unsigned int));
+    uint64_t *scores = btc_calloc(nodes->len + 1, sizeof(uint64_t));
+    cstring **getdata = btc_calloc(nodes->len + 1, sizeof(cstring *));
+    unsigned int *getdata_count = btc_calloc(nodes->len + 1, sizeof(unsigned int));
+    uint32_t inv_type = (client->use_bloom_filter ? BTC_INV_TYPE_FILTERED_BLOCK : BTC_INV_TYPE_BLOCK);
+
+    /* peers need the current filter before merkle blocks are requested */
+    if (client->use_bloom_filter && client->bloom_filter_dirty)
+        btc_net_spv_load_bloom_filter(client, NULL);
+
+    for (size_t i = 0; i < nodes->len; i++)
+    {
+        btc_node *node = vector_idx(nodes, i);
+        if (btc_net_spv_node_can_serve_blocks(node))
+            scores[i] = btc_node_sync_score(node) + 1;
+    }
+
+    /* release requests from disconnected or timed out peers */
+    size_t outstanding = 0;
+    for (size_t i = 0; i < window; i++)
+    {
+        btc_spv_block_request *req = vector_idx(client->block_queue, i);
+        if (!req->node || req->data)
+            continue;
+
+        ssize_t pos = vector_find(nodes, req->node);
+        uint64_t elapsed = (now > req->requested_ms ? now - req->requested_ms : 0);
+        if (pos < 0 || scores[pos] == 0) {
+            btc_net_spv_merkle_reset(req);
+            req->node = NULL;
+        }
+        else if (elapsed > client->block_download_timeout_ms) {
+            client->nodegroup->log_write_cb("Block request timed out on node %d after %llu ms, reassigning\n", req->node->nodeid, (unsigned long long)elapsed);
+            /* count the stall as a slow response */
+            btc_node_record_response(req->node, 0, elapsed);
+            btc_net_spv_merkle_reset(req);
+            req->stalled_node = req->node;
+            req->node = NULL;
+        }
+        else {
+            in_flight[pos]++;
         }
+    }
 
-        // flag off the block request stall check
-        node->time_last_request = time(NULL);
+    /* blocks waiting in the processing pipeline count against the window */
+    btc_spv_block_pipeline *pipeline = client->block_pipeline;
+    size_t requested = btc_spv_block_pipeline_pending(pipeline);
+    for (size_t i = 0; i < nodes->len; i++)
+        requested += in_flight[i];
 
-        // for now, turn of stall checks if we are near the tip
-        if (pindex->header.timestamp > node->time_last_request - 30*60) {
-            node->time_last_request = 0;
+    /* assign the unrequested blocks to the best scoring peers with free slots */
+    for (size_t i = 0; i < window; i++)
+    {
+        btc_spv_block_request *req = vector_idx(client->block_queue, i);
+        if (req->node || req->data)
+            continue;
+        if (requested >= pipeline->max_pending)
+        {
+            pthread_mutex_lock(&pipeline->lock);
+            pipeline->stats.backpressure++;
+            pthread_mutex_unlock(&pipeline->lock);
+            break;
+        }
+
+        ssize_t best = -1;
+        uint64_t best_score = 0;
+        for (size_t j = 0; j < nodes->len; j++)
+        {
+            if (scores[j] == 0 || in_flight[j] >= BLOCK_DOWNLOAD_MAX_PER_PEER)
+                continue;
+            /* avoid the peer the block has stalled on, unless there is no other one */
+            uint64_t score = (vector_idx(nodes, j) == req->stalled_node ? 1 : scores[j]);
+            if (score > best_score) {
+                best = j;
+                best_score = score;
+            }
         }
+        if (best < 0)
+            break;
+
+        req->node = vector_idx(nodes, best);
+        req->requested_ms = now;
+        in_flight[best]++;
+        requested++;
+        if (!getdata[best])
+            getdata[best] = cstr_new_sz(BLOCK_DOWNLOAD_MAX_PER_PEER * 36);
+        ser_u32(getdata[best], inv_type);
+        ser_u256(getdata[best], req->hash);
+        getdata_count[best]++;
+    }
+
+    for (size_t i = 0; i < nodes->len; i++)
+    {
+        outstanding += in_flight[i];
+        if (!getdata[i])
+            continue;
+
+        btc_node *node = vector_idx(nodes, i);
+        client->nodegroup->log_write_cb("Requesting %d blocks from node %d\n", getdata_count[i], node->nodeid);
+        /* the inv count is framed in front of the collected invs without copying them */
+        cstring *inv_msg[2] = { cstr_new_sz(5), getdata[i] };
+        ser_varlen(inv_msg[0], getdata_count[i]);
+        btc_node_send_message(node, BTC_MSG_GETDATA, inv_msg, 2, NULL);
+
+        /* txs the peer has already announced to us are not sent again after a merkle block,
+           the pong marks the end of the responses */
+        if (client->use_bloom_filter)
+            btc_node_send_ping(node);
+    }
+
+    btc_free(in_flight);
+    btc_free(scores);
+    btc_free(getdata);
+    btc_free(getdata_count);
 
-        /* for now, only scan if the block could be connected on top */
-        if (connected) {
-            if (client->header_connected) { client->header_connected(client); }
-            time_t lasttime = pindex->header.timestamp;
-            printf("Downloaded new block with size %d at height %d (%s)\n", hdr->data_len, pindex->height, ctime(&lasttime));
-            uint64_t start = time(NULL);
-            printf("Start parsing %d transactions...", amount_of_txs);
+    /* request the next blocks once the queue no longer fills the window */
+    if (client->block_queue_more && client->block_queue->len < BLOCK_DOWNLOAD_WINDOW)
+    {
+        btc_node *sync_node = NULL;
+        for (size_t i = 0; i < nodes->len; i++)
+        {
+            btc_node *node = vector_idx(nodes, i);
+            if ((node->state & NODE_BLOCKSYNC) == NODE_BLOCKSYNC && (node->state & NODE_CONNECTED) == NODE_CONNECTED)
+                sync_node = node;
+        }
+        if (!sync_node) {
+            btc_net_spv_request_headers(client);
+        }
+        else if (sync_node->time_last_request == 0) {
+            btc_net_spv_node_request_headers_or_blocks(sync_node, true);
+        }
+    }
+
+    /* check the block requests for timeouts as long as some are in flight */
+    if (outstanding > 0)
+    {
+        if (!client->block_download_timer)
+            client->block_download_timer = event_new(client->nodegroup->event_base, -1, EV_PERSIST, btc_net_spv_block_download_timer_cb, client);
+        if (!event_pending(client->block_download_timer, EV_TIMEOUT, NULL))
+        {
+            uint64_t interval_ms = client->block_download_timeout_ms / 4;
+            if (interval_ms < 10)
+                interval_ms = 10;
+            if (interval_ms > 1000)
+                interval_ms = 1000;
+            struct timeval tv = { (long)(interval_ms / 1000), (long)(interval_ms % 1000) * 1000 };
+            event_add(client->block_download_timer, &tv);
+        }
+    }
+    else if (client->block_download_timer) {
+        event_del(client->block_download_timer);
+    }
+}
+
+static void btc_net_spv_check_rescan_completed(btc_spv_client *client)
+{
+    if (!client->rescanning || client->rescan_next_height <= client->rescan_end_height)
+        return;
+    if (client->block_queue->len > 0 || btc_spv_block_pipeline_pending(client->block_pipeline) > 0)
+        return;
+
+    client->rescanning = false;
+    if (client->rescan_completed) { client->rescan_completed(client); }
+}
+
+/* get the stored block of the rescan at the height (the raw transactions in txs_out)
+   the main chain header selects the block if it is in memory, otherwise the most recently
+   stored block at the height connecting to the previous block of the rescan */
+static btc_bool btc_net_spv_rescan_block(btc_spv_client *client, uint32_t height, btc_blockindex *index_out, uint32_t *tx_count_out, struct const_buffer *txs_out)
+{
+    vector *candidates = vector_new(2, NULL);
+    btc_blockindex *pindex = client->headers_db->get_by_height(client->headers_db_ctx, height);
+    if (pindex)
+    {
+        const btc_blockstore_entry *entry = btc_blockstore_find(client->block_store, pindex->hash);
+        if (entry)
+            vector_add(candidates, (void *)entry);
+    }
+    else
+        btc_blockstore_find_height(client->block_store, height, candidates);
+
+    btc_bool found = false;
+    for (size_t i = candidates->len; i > 0 && !found; i--)
+    {
+        const btc_blockstore_entry *entry = vector_idx(candidates, i - 1);
+        const uint8_t *data = NULL;
+        size_t len = 0;
+        if (!btc_blockstore_get(client->block_store, entry->hash, &data, &len))
+            continue;
+        struct const_buffer buf = { data, len };
+        memset(index_out, 0, sizeof(*index_out));
+        if (!btc_block_header_deserialize(&index_out->header, &buf) || !deser_varlen(tx_count_out, &buf))
+            continue;
+        if (!pindex && client->rescan_have_prev && memcmp(index_out->header.prev_block, client->rescan_prev_hash, sizeof(btc_uint256)) != 0)
+            continue;
+        index_out->height = height;
+        memcpy(index_out->hash, entry->hash, sizeof(btc_uint256));
+        *txs_out = buf;
+        found = true;
+    }
+    vector_free(candidates, true);
+    return found;
+}
 
-            size_t consumedlength = 0;
-            for (unsigned int i=0;i<amount_of_txs;i++)
+/* pass the next blocks of the rescan from the block store to the pipeline, as long as it has room */
+static void btc_net_spv_continue_rescan(btc_spv_client *client)
+{
+    btc_spv_block_pipeline *pipeline = client->block_pipeline;
+    while (client->rescanning && client->rescan_next_height <= client->rescan_end_height &&
+           btc_spv_block_pipeline_pending(pipeline) < pipeline->max_pending)
+    {
+        uint32_t height = client->rescan_next_height;
+        btc_blockindex index;
+        uint32_t tx_count = 0;
+        struct const_buffer buf = { NULL, 0 };
+        if (!btc_net_spv_rescan_block(client, height, &index, &tx_count, &buf))
+        {
+            if (!client->headers_db->get_by_height(client->headers_db_ctx, height))
             {
-                btc_tx* tx = btc_tx_new();
-                if (!btc_tx_deserialize(buf->p, buf->len, tx, &consumedlength, true)) {
-                    printf("Error deserializing transaction\n");
+                /* the hash of the block is unknown, it can't be downloaded, skip to the next stored block */
+                uint32_t lowest = client->headers_db->lowest_height(client->headers_db_ctx);
+                if (lowest <= height)
+                {
+                    client->nodegroup->log_write_cb("Rescan stopped, the block at height %d is not in the block store\n", height);
+                    client->rescan_next_height = client->rescan_end_height + 1;
+                    break;
                 }
-                deser_skip(buf, consumedlength);
+                vector *stored = vector_new(2, NULL);
+                uint32_t next = height + 1;
+                while (next < lowest && btc_blockstore_find_height(client->block_store, next, stored) == 0)
+                    next++;
+                vector_free(stored, true);
+                client->nodegroup->log_write_cb("Blocks %d to %d are not in the block store and their headers are not in memory, skipped\n", height, next - 1);
+                client->rescan_next_height = next;
+                client->rescan_have_prev = false;
+                continue;
+            }
+
+            /* download the blocks from here on, the headers are already connected */
+            unsigned int queued = 0;
+            for (uint32_t h = height; h <= client->rescan_end_height; h++)
+            {
+                btc_blockindex *missing = client->headers_db->get_by_height(client->headers_db_ctx, h);
+                if (!missing)
+                    break;
+                queued += btc_net_spv_queue_block(client, missing->hash, h);
+            }
+            client->nodegroup->log_write_cb("Block at height %d is not in the block store, downloading %d blocks\n", height, queued);
+            client->rescan_next_height = client->rescan_end_height + 1;
+            btc_net_spv_schedule_blocks(client);
+            break;
+        }
+
+        btc_spv_block_pipeline_submit(pipeline, &index, tx_count, &buf);
+        memcpy(client->rescan_prev_hash, index.hash, sizeof(btc_uint256));
+        client->rescan_have_prev = true;
+        client->rescan_next_height++;
+    }
+    btc_net_spv_check_rescan_completed(client);
+}
+
+static void btc_net_spv_check_sync_completed(btc_spv_client *client)
+{
+    btc_spv_filter_sync *fs = client->filter_sync;
+    btc_net_spv_check_rescan_completed(client);
+    if (client->block_queue->len > 0 || client->block_queue_more)
+        return;
+    if (btc_spv_block_pipeline_pending(client->block_pipeline) > 0)
+        return;
+    if (fs->scanning && (!fs->headers_done || fs->next < fs->count || fs->node))
+        return;
+
+    // last requested block reached, consider stop syncing
+    if (!client->called_sync_completed && client->sync_completed) { client->sync_completed(client); client->called_sync_completed = true; }
+}
+
+/* best scoring node serving compact filters (other than exclude) */
+static btc_node *btc_net_spv_filter_node(btc_spv_client *client, btc_node *exclude)
+{
+    btc_node *best = NULL;
+    uint64_t best_score = 0;
+    for (size_t i = 0; i < client->nodegroup->nodes->len; i++)
+    {
+        btc_node *node = vector_idx(client->nodegroup->nodes, i);
+        if (node == exclude || !btc_net_spv_node_can_serve_blocks(node) || (node->services & BTC_NODE_COMPACT_FILTERS) != BTC_NODE_COMPACT_FILTERS)
+            continue;
+        uint64_t score = btc_node_sync_score(node);
+        if (!best || score > best_score) {
+            best = node;
+            best_score = score;
+        }
+    }
+    return best;
+}
+
+/* remember a connected header for the filter scan */
+static void btc_net_spv_filter_add_block(btc_spv_client *client, btc_blockindex *pindex)
+{
+    btc_spv_filter_sync *fs = client->filter_sync;
+    if (fs->count == 0)
+        fs->start_height = pindex->height;
+    else if (pindex->height != fs->start_height + fs->count)
+        return;
+
+    if (fs->count == fs->alloc) {
+        fs->alloc = (fs->alloc ? fs->alloc * 2 : MAX_HEADERS_RESULTS);
+        fs->block_hashes = btc_realloc(fs->block_hashes, fs->alloc * sizeof(btc_uint256));
+    }
+    memcpy(fs->block_hashes[fs->count++], pindex->hash, sizeof(btc_uint256));
+}
+
+/* request the filters (and their hashes) of the next batch of blocks */
+static void btc_net_spv_request_filters(btc_spv_client *client)
+{
+    btc_spv_filter_sync *fs = client->filter_sync;
+    if (!fs->scanning || fs->node || fs->next >= fs->count)
+        return;
+
+    btc_node *node = btc_net_spv_filter_node(client, NULL);
+    if (!node)
+        return;
+
+    fs->batch_start = fs->next;
+    fs->batch_end = fs->next + MAX_GETCFILTERS_SIZE;
+    if (fs->batch_end > fs->count)
+        fs->batch_end = fs->count;
+    fs->have_filter_hashes = false;
+    fs->node = node;
+    fs->request_time = time(NULL);
+    memset(fs->batch_matches, 0, MAX_GETCFILTERS_SIZE);
+
+    /* a single peer could serve consistent filters leaving out our matches, ask a second one for the filter headers */
+    fs->check_node = btc_net_spv_filter_node(client, node);
+    fs->have_check_hashes = false;
+
+    client->nodegroup->log_write_cb("Requesting compact filters for heights %d to %d from node %d\n", fs->start_height + fs->batch_start, fs->start_height + fs->batch_end - 1, node->nodeid);
+    cstring *request = cstr_new_sz(64);
+    btc_p2p_msg_getcfilters(BTC_BLOCKFILTER_TYPE_BASIC, fs->start_height + fs->batch_start, fs->block_hashes[fs->batch_end - 1], request);
+    btc_node_send_owned(node, btc_p2p_message_new(client->nodegroup->chainparams->netmagic, BTC_MSG_GETCFHEADERS, request->str, request->len));
+    btc_node_send_owned(node, btc_p2p_message_new(client->nodegroup->chainparams->netmagic, BTC_MSG_GETCFILTERS, request->str, request->len));
+    btc_node_request_sent(node);
+    if (fs->check_node)
+    {
+        client->nodegroup->log_write_cb("Cross-checking the filter headers with node %d\n", fs->check_node->nodeid);
+        btc_node_send_owned(fs->check_node, btc_p2p_message_new(client->nodegroup->chainparams->netmagic, BTC_MSG_GETCFHEADERS, request->str, request->len));
+        btc_node_request_sent(fs->check_node);
+    }
+    cstr_free(request, true);
+}
+
+/* forget the outstanding batch, it will be requested again */
+static void btc_net_spv_filter_batch_reset(btc_spv_filter_sync *fs)
+{
+    fs->node = NULL;
+    fs->check_node = NULL;
+    fs->next = fs->batch_start;
+    fs->have_filter_hashes = false;
+    fs->have_check_hashes = false;
+}
+
+/* drop the outstanding filter request (the batch will be requested again) */
+static void btc_net_spv_filter_request_failed(btc_spv_client *client, btc_node *node, const char *reason)
+{
+    btc_spv_filter_sync *fs = client->filter_sync;
+    client->nodegroup->log_write_cb("Compact filter request failed on node %d: %s\n", node->nodeid, reason);
+    btc_net_spv_filter_batch_reset(fs);
+    btc_node_missbehave(node);
+    btc_net_spv_request_filters(client);
+}
+
+/* the batch is done once all its filters have been checked and the second node has sent its filter headers */
+static void btc_net_spv_filter_batch_completed(btc_spv_client *client)
+{
+    btc_spv_filter_sync *fs = client->filter_sync;
+    if (!fs->node || fs->next < fs->batch_end || (fs->check_node && !fs->have_check_hashes))
+        return;
+
+    size_t count = fs->batch_end - fs->batch_start;
+    btc_uint256 last_header;
+    memcpy(last_header, fs->prev_header, sizeof(btc_uint256));
+    for (size_t i = 0; i < count; i++)
+        btc_blockfilter_header(fs->filter_hashes[i], last_header, last_header);
 
-                /* send info to possible callback */
-                if (client->sync_transaction) { client->sync_transaction(client->sync_transaction_ctx, tx, i, pindex); }
+    if (!fs->check_node)
+    {
+        /* no other filter peer to ask, the node only has to be consistent with itself */
+        memcpy(fs->last_header, last_header, sizeof(btc_uint256));
+        fs->have_last_header = true;
+        fs->last_header_nodeid = fs->node->nodeid;
+    }
+    else
+    {
+        btc_uint256 check_header;
+        memcpy(check_header, fs->check_prev_header, sizeof(btc_uint256));
+        for (size_t i = 0; i < count; i++)
+            btc_blockfilter_header(fs->check_hashes[i], check_header, check_header);
 
-                btc_tx_free(tx);
+        if (btc_hash_equal(last_header, check_header))
+        {
+            memcpy(fs->last_header, last_header, sizeof(btc_uint256));
+            fs->have_last_header = true;
+            fs->last_header_nodeid = -1;
+        }
+        else
+        {
+            /* the nodes disagree on the chain of filter headers, the next batch can't be checked against it */
+            fs->have_last_header = false;
+            if (memcmp(fs->filter_hashes, fs->check_hashes, count * sizeof(btc_uint256)) != 0)
+            {
+                /* one of them serves wrong filters, there is no way to tell which one, so the blocks get checked instead */
+                client->nodegroup->log_write_cb("Filter headers of node %d and node %d disagree, downloading the blocks at heights %d to %d\n", fs->node->nodeid, fs->check_node->nodeid, fs->start_height + fs->batch_start, fs->start_height + fs->batch_end - 1);
+                memset(fs->batch_matches, 1, count);
             }
-            printf("done (took %llu secs)\n", time(NULL) - start);
         }
-        else {
-            fprintf(stderr, "Could not connect block on top of the chain\n");
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        if (fs->batch_matches[i])
+            btc_net_spv_queue_block(client, fs->block_hashes[fs->batch_start + i], fs->start_height + fs->batch_start + i);
+    }
+    fs->node = NULL;
+    fs->check_node = NULL;
+
+    if (client->block_queue->len > 0)
+        btc_net_spv_schedule_blocks(client);
+    btc_net_spv_request_filters(client);
+    btc_net_spv_check_sync_completed(client);
+}
+
+static void btc_net_spv_cfheaders_received(btc_spv_client *client, btc_node *node, struct const_buffer *buf)
+{
+    btc_spv_filter_sync *fs = client->filter_sync;
+    btc_bool check = (fs->check_node == node && !fs->have_check_hashes);
+    if (!check && (fs->node != node || fs->have_filter_hashes))
+        return;
+
+    uint8_t *prev_header = (check ? fs->check_prev_header : fs->prev_header);
+    btc_uint256 *hashes = (check ? fs->check_hashes : fs->filter_hashes);
+    uint8_t filter_type;
+    btc_uint256 stop_hash;
+    uint32_t count;
+    if (!btc_p2p_deser_msg_cfheaders(&filter_type, stop_hash, prev_header, &count, buf) ||
+        filter_type != BTC_BLOCKFILTER_TYPE_BASIC ||
+        !btc_hash_equal(stop_hash, fs->block_hashes[fs->batch_end - 1]) ||
+        count != fs->batch_end - fs->batch_start) {
+        btc_net_spv_filter_request_failed(client, node, "unexpected cfheaders");
+        return;
+    }
+
+    /* the filter headers have to continue the previous batch
+       a node is only blamed if two nodes agreed on it or if it contradicts itself */
+    if (fs->have_last_header && !btc_hash_equal(prev_header, fs->last_header)) {
+        if (fs->last_header_nodeid < 0 || fs->last_header_nodeid == node->nodeid) {
+            btc_net_spv_filter_request_failed(client, node, "filter headers do not connect");
+            return;
+        }
+        client->nodegroup->log_write_cb("Filter headers of node %d do not connect to the unchecked ones of node %d\n", node->nodeid, fs->last_header_nodeid);
+        fs->have_last_header = false;
+    }
+
+    for (uint32_t i = 0; i < count; i++)
+        deser_u256(hashes[i], buf);
+    if (check) {
+        btc_node_response_received(node, 0);
+        fs->have_check_hashes = true;
+        btc_net_spv_filter_batch_completed(client);
+    }
+    else
+        fs->have_filter_hashes = true;
+}
+
+static void btc_net_spv_cfilter_received(btc_spv_client *client, btc_node *node, struct const_buffer *buf)
+{
+    btc_spv_filter_sync *fs = client->filter_sync;
+    if (fs->node != node || !fs->have_filter_hashes || fs->next >= fs->batch_end)
+        return;
+
+    uint8_t filter_type;
+    btc_uint256 block_hash, filter_hash;
+    struct const_buffer filter;
+    if (!btc_p2p_deser_msg_cfilter(&filter_type, block_hash, &filter, buf) ||
+        filter_type != BTC_BLOCKFILTER_TYPE_BASIC ||
+        !btc_hash_equal(block_hash, fs->block_hashes[fs->next])) {
+        btc_net_spv_filter_request_failed(client, node, "unexpected cfilter");
+        return;
+    }
+
+    btc_blockfilter_hash(filter.p, filter.len, filter_hash);
+    if (!btc_hash_equal(filter_hash, fs->filter_hashes[fs->next - fs->batch_start])) {
+        btc_net_spv_filter_request_failed(client, node, "filter does not match its filter header");
+        return;
+    }
+
+    /* only blocks with a possible match are downloaded (once the batch is trusted) */
+    if (btc_blockfilter_match_any(block_hash, filter.p, filter.len, client->watched_scripts)) {
+        client->nodegroup->log_write_cb("Compact filter match at height %d\n", fs->start_height + fs->next);
+        fs->batch_matches[fs->next - fs->batch_start] = 1;
+        fs->matched++;
+    }
+    fs->next++;
+
+    if (fs->next == fs->batch_end)
+    {
+        btc_node_response_received(node, 0);
+        btc_net_spv_filter_batch_completed(client);
+    }
+}
+
+static void btc_net_spv_block_request_completed(btc_spv_client *client, btc_node *node, btc_spv_block_request *req, uint8_t *data, size_t data_len);
+
+static void btc_net_spv_block_received(btc_spv_client *client, btc_node *node, struct const_buffer *buf)
+{
+    /* identify the block by its header hash */
+    btc_block_header header;
+    btc_uint256 hash;
+    struct const_buffer header_buf = { buf->p, buf->len };
+    if (!btc_block_header_deserialize(&header, &header_buf))
+        return;
+    btc_block_header_hash(&header, hash);
+
+    btc_spv_block_request *req = btc_net_spv_find_block_request(client, hash);
+    if (!req)
+    {
+        /* not part of a download (like a relayed new block), process it directly if nothing is pending */
+        if (client->block_queue->len == 0)
+            btc_net_spv_process_block(client, buf, 0);
+        return;
+    }
+    if (req->data) {
+        /* duplicate from a reassigned request */
+        return;
+    }
+
+    uint8_t *data = btc_malloc(buf->len);
+    memcpy(data, buf->p, buf->len);
+    btc_net_spv_block_request_completed(client, node, req, data, buf->len);
+}
+
+/* store the received block (takes ownership of data) and pass the blocks in chain order */
+static void btc_net_spv_block_request_completed(btc_spv_client *client, btc_node *node, btc_spv_block_request *req, uint8_t *data, size_t data_len)
+{
+    if (req->node == node)
+        btc_node_record_response(node, data_len + BTC_P2P_HDRSZ, btc_net_spv_time_ms() - req->requested_ms);
+    req->data = data;
+    req->data_len = data_len;
+
+    /* pass the blocks in chain order */
+    while (client->block_queue->len > 0)
+    {
+        btc_spv_block_request *head = vector_idx(client->block_queue, 0);
+        if (!head->data)
+            break;
+        struct const_buffer block = { head->data, head->data_len };
+        btc_net_spv_process_block(client, &block, head->height);
+        vector_remove_idx(client->block_queue, 0);
+    }
+
+    btc_net_spv_schedule_blocks(client);
+    btc_net_spv_check_sync_completed(client);
+}
+
+static btc_spv_block_request *btc_net_spv_pending_merkle_block(btc_spv_client *client, btc_node *node)
+{
+    /* requests are only made within the window */
+    for (size_t i = 0; i < client->block_queue->len && i < BLOCK_DOWNLOAD_WINDOW; i++)
+    {
+        btc_spv_block_request *req = vector_idx(client->block_queue, i);
+        if (req->merkle_node == node && !req->data)
+            return req;
+    }
+    return NULL;
+}
+
+/* complete the pending merkle block of the node as a block of its header and the received matched txs */
+static void btc_net_spv_merkle_block_finish(btc_spv_client *client, btc_node *node)
+{
+    btc_spv_block_request *req = btc_net_spv_pending_merkle_block(client, node);
+    if (!req)
+        return;
+
+    if (req->merkle_received < req->merkle_match_count)
+        client->nodegroup->log_write_cb("Merkle block from node %d is missing %d matched transactions\n", node->nodeid, (int)(req->merkle_match_count - req->merkle_received));
+
+    cstring *block = cstr_new_sz(sizeof(req->merkle_header) + 5 + req->merkle_txs->len);
+    cstr_append_buf(block, req->merkle_header, sizeof(req->merkle_header));
+    ser_varlen(block, (uint32_t)req->merkle_received);
+    cstr_append_buf(block, req->merkle_txs->str, req->merkle_txs->len);
+    btc_net_spv_merkle_reset(req);
+
+    uint8_t *data = btc_malloc(block->len);
+    memcpy(data, block->str, block->len);
+    btc_net_spv_block_request_completed(client, node, req, data, block->len);
+    cstr_free(block, true);
+}
+
+static void btc_net_spv_merkle_block_received(btc_spv_client *client, btc_node *node, struct const_buffer *buf)
+{
+    const uint8_t *header_data = buf->p;
+
+    btc_block_header header;
+    btc_uint256 *matches = NULL;
+    size_t match_count = 0;
+    if (!btc_merkleblock_deser(&header, &matches, &match_count, buf))
+    {
+        client->nodegroup->log_write_cb("Invalid merkle block from node %d\n", node->nodeid);
+        btc_node_missbehave(node);
+        return;
+    }
+
+    btc_uint256 hash;
+    btc_block_header_hash(&header, hash);
+    btc_spv_block_request *req = btc_net_spv_find_block_request(client, hash);
+    if (!req || req->data || req->merkle_node)
+    {
+        /* not requested, already received or pending from a different node */
+        btc_free(matches);
+        return;
+    }
+
+    memcpy(req->merkle_header, header_data, sizeof(req->merkle_header));
+    req->merkle_node = node;
+    req->merkle_matches = matches;
+    req->merkle_match_count = match_count;
+    req->merkle_received = 0;
+    req->merkle_txs = cstr_new_sz(256 * match_count + 1);
+    if (match_count == 0)
+        btc_net_spv_merkle_block_finish(client, node);
+}
+
+static void btc_net_spv_merkle_tx_received(btc_spv_client *client, btc_node *node, struct const_buffer *buf)
+{
+    btc_spv_block_request *req = btc_net_spv_pending_merkle_block(client, node);
+    if (!req)
+        return;
+
+    /* only the txids of the matched txs need to be hashed */
+    size_t consumed = 0;
+    btc_uint256 txid;
+    btc_tx *tx = btc_tx_new();
+    btc_bool valid = btc_tx_deserialize(buf->p, buf->len, tx, &consumed, true);
+    if (valid)
+        btc_tx_hash(tx, txid);
+    btc_tx_free(tx);
+    if (!valid)
+        return;
+
+    for (size_t i = 0; i < req->merkle_match_count; i++)
+    {
+        if (btc_hash_equal(req->merkle_matches[i], txid))
+        {
+            /* clear the match to ignore duplicates */
+            btc_hash_clear(req->merkle_matches[i]);
+            cstr_append_buf(req->merkle_txs, buf->p, consumed);
+            req->merkle_received++;
+            break;
         }
+    }
+    if (req->merkle_received == req->merkle_match_count)
+        btc_net_spv_merkle_block_finish(client, node);
+}
+
+static void btc_net_spv_request_block(btc_spv_client *client, btc_node *node, btc_uint256 hash)
+{
+    cstring *inv_msg = cstr_new_sz(37);
+    ser_varlen(inv_msg, 1);
+    ser_u32(inv_msg, BTC_INV_TYPE_BLOCK);
+    ser_u256(inv_msg, hash);
+    btc_node_send_owned(node, btc_p2p_message_new(client->nodegroup->chainparams->netmagic, BTC_MSG_GETDATA, inv_msg->str, inv_msg->len));
+    cstr_free(inv_msg, true);
+}
+
+/* pass the reconstructed block on like a received block, request the full block if it does not match its header */
+static void btc_net_spv_cmpctblock_completed(btc_spv_client *client, btc_node *node, btc_cmpctblock *cb)
+{
+    cstring *block = cstr_new_sz(1024);
+    if (btc_cmpctblock_to_block(cb, block))
+    {
+        struct const_buffer buf = { block->str, block->len };
+        btc_net_spv_block_received(client, node, &buf);
+    }
+    else {
+        client->nodegroup->log_write_cb("Compact block reconstruction failed, requesting the full block from node %d\n", node->nodeid);
+        btc_net_spv_request_block(client, node, cb->hash);
+    }
+    cstr_free(block, true);
+}
 
-        if (btc_hash_equal(node->last_requested_inv, pindex->hash)) {
-            // last requested block reached, consider stop syncing
-            if (!client->called_sync_completed && client->sync_completed) { client->sync_completed(client); client->called_sync_completed = true; }
+static void btc_net_spv_cmpctblock_received(btc_spv_client *client, btc_node *node, struct const_buffer *buf)
+{
+    btc_cmpctblock *cb = btc_cmpctblock_new();
+    btc_bool reconstructed = btc_cmpctblock_deser(cb, buf, client->tx_pool);
+    if (!cb->txs)
+    {
+        /* the header or the short ids could not be parsed */
+        btc_cmpctblock_free(cb);
+        btc_node_missbehave(node);
+        return;
+    }
+
+    /* only blocks on top of our tip are followed, further back the headers need to be synced first */
+    btc_blockindex *chaintip = client->headers_db->getchaintip(client->headers_db_ctx);
+    btc_bool pending = false;
+    for (size_t i = 0; i < client->cmpct_blocks->len; i++)
+    {
+        btc_spv_cmpct_request *req = vector_idx(client->cmpct_blocks, i);
+        pending |= btc_hash_equal(req->cb->hash, cb->hash);
+    }
+    if (pending || !btc_hash_equal(cb->header.prev_block, chaintip->hash))
+    {
+        btc_cmpctblock_free(cb);
+        return;
+    }
+
+    if (!reconstructed)
+    {
+        client->nodegroup->log_write_cb("Compact block with colliding short ids, requesting the full block from node %d\n", node->nodeid);
+        btc_net_spv_request_block(client, node, cb->hash);
+        btc_cmpctblock_free(cb);
+        return;
+    }
+
+    client->nodegroup->log_write_cb("Compact block with %d txs, %d missing\n", cb->tx_count, cb->missing_count);
+    if (cb->missing_count == 0)
+    {
+        btc_net_spv_cmpctblock_completed(client, node, cb);
+        btc_cmpctblock_free(cb);
+        return;
+    }
+
+    /* request the missing txs, the oldest pending block is dropped if there are too many */
+    cstring *getblocktxn = cstr_new_sz(36 + cb->missing_count * 3);
+    btc_cmpctblock_getblocktxn(cb, getblocktxn);
+    btc_node_send_owned(node, btc_p2p_message_new(client->nodegroup->chainparams->netmagic, BTC_MSG_GETBLOCKTXN, getblocktxn->str, getblocktxn->len));
+    cstr_free(getblocktxn, true);
+
+    if (client->cmpct_blocks->len >= CMPCT_MAX_PENDING_BLOCKS)
+        vector_remove_idx(client->cmpct_blocks, 0);
+    btc_spv_cmpct_request *req = btc_calloc(1, sizeof(*req));
+    req->node = node;
+    req->cb = cb;
+    vector_add(client->cmpct_blocks, req);
+}
+
+static void btc_net_spv_blocktxn_received(btc_spv_client *client, btc_node *node, struct const_buffer *buf)
+{
+    btc_uint256 hash;
+    struct const_buffer hash_buf = { buf->p, buf->len };
+    if (!deser_u256(hash, &hash_buf))
+        return;
+
+    for (size_t i = 0; i < client->cmpct_blocks->len; i++)
+    {
+        btc_spv_cmpct_request *req = vector_idx(client->cmpct_blocks, i);
+        if (req->node != node || !btc_hash_equal(req->cb->hash, hash))
+            continue;
+
+        /* take the request out of the pending list before passing the block on */
+        btc_cmpctblock *cb = req->cb;
+        req->cb = NULL;
+        vector_remove_idx(client->cmpct_blocks, i);
+        if (btc_cmpctblock_fill(cb, buf))
+            btc_net_spv_cmpctblock_completed(client, node, cb);
+        else
+            btc_net_spv_request_block(client, node, hash);
+        btc_cmpctblock_free(cb);
+        return;
+    }
+}
+
+static void btc_net_spv_tx_inv_received(btc_spv_client *client, btc_node *node, struct const_buffer *buf)
+{
+    uint32_t varlen;
+    if (!deser_varlen(&varlen, buf))
+        return;
+
+    /* fetch the relayed txs that are not yet in the pool */
+    cstring *getdata = cstr_new_sz(64);
+    uint32_t count = 0;
+    for (unsigned int i = 0; i < varlen; i++)
+    {
+        uint32_t type;
+        btc_uint256 hash;
+        if (!deser_u32(&type, buf) || !deser_u256(hash, buf))
+            break;
+        if (type == BTC_INV_TYPE_TX && !btc_cmpct_txpool_contains(client->tx_pool, hash)) {
+            ser_u32(getdata, BTC_INV_TYPE_TX);
+            ser_u256(getdata, hash);
+            count++;
+        }
+    }
+    if (count > 0)
+    {
+        cstring *inv_msg[2] = { cstr_new_sz(5), getdata };
+        ser_varlen(inv_msg[0], count);
+        btc_node_send_message(node, BTC_MSG_GETDATA, inv_msg, 2, NULL);
+    }
+    else
+        cstr_free(getdata, true);
+}
+
+static btc_bool btc_net_spv_pipeline_headers(btc_spv_client *client, btc_node *node, uint32_t amount_of_headers, const struct const_buffer *buf)
+{
+    if (!client->headers_pipelining || amount_of_headers != MAX_HEADERS_RESULTS || (node->state & NODE_HEADERSYNC) != NODE_HEADERSYNC)
+        return false;
+
+    /* each header is followed by the (zero) tx count */
+    const size_t header_size = 81;
+    if (buf->len < amount_of_headers * header_size)
+        return false;
+
+    /* only if the batch continues our tip */
+    btc_block_header first, last;
+    struct const_buffer first_buf = { buf->p, header_size };
+    struct const_buffer last_buf = { (const uint8_t *)buf->p + (amount_of_headers - 1) * header_size, header_size };
+    if (!btc_block_header_deserialize(&first, &first_buf) || !btc_block_header_deserialize(&last, &last_buf))
+        return false;
+    btc_blockindex *chaintip = client->headers_db->getchaintip(client->headers_db_ctx);
+    if (!btc_hash_equal(first.prev_block, chaintip->hash))
+        return false;
+
+    /* the batch will switch to the block download, no more headers are needed */
+    btc_bool filter_scan = (client->filter_sync->scanning || (client->use_compact_filters && btc_net_spv_filter_node(client, NULL)));
+    if (!filter_scan && last.timestamp > client->oldest_item_of_interest - (BLOCK_GAP_TO_DEDUCT_TO_START_SCAN_FROM * BLOCKS_DELTA_IN_S))
+        return false;
+
+    /* continue with a clearly faster peer if there is one */
+    btc_node *next_node = node;
+    btc_node *best_node = btc_node_group_best_sync_node(client->nodegroup, chaintip->height + amount_of_headers, node);
+    if (best_node && btc_node_sync_score(best_node) > btc_node_sync_score(node) * 3 / 2)
+    {
+        client->nodegroup->log_write_cb("Continue header sync with faster node %d\n", best_node->nodeid);
+        node->state &= ~NODE_HEADERSYNC;
+        next_node = best_node;
+    }
+
+    btc_uint256 last_hash;
+    btc_block_header_hash(&last, last_hash);
+    client->nodegroup->log_write_cb("Requesting headers after height %d from node %d (pipelined)\n", chaintip->height + amount_of_headers, next_node->nodeid);
+    btc_net_spv_node_request_after(next_node, false, last_hash);
+    /* the request has to be on the wire while the batch gets connected */
+    btc_node_flush(next_node);
+    return true;
+}
+
+void btc_net_spv_post_cmd(btc_node *node, btc_p2p_msg_hdr *hdr, struct const_buffer *buf)
+{
+    btc_spv_client *client = (btc_spv_client *)node->nodegroup->ctx;
+
+    /* the matched txs directly follow a merkle block, any other message completes it */
+    if (client->use_bloom_filter && hdr->type != BTC_MSG_TYPE_TX)
+        btc_net_spv_merkle_block_finish(client, node);
+
+    if (client->use_compact_blocks && hdr->type == BTC_MSG_TYPE_INV)
+    {
+        struct const_buffer inv_buf = { buf->p, buf->len };
+        btc_net_spv_tx_inv_received(client, node, &inv_buf);
+    }
+
+    if (hdr->type == BTC_MSG_TYPE_INV && (node->state & NODE_BLOCKSYNC) == NODE_BLOCKSYNC)
+    {
+        uint32_t varlen;
+        deser_varlen(&varlen, buf);
+        btc_bool contains_block = false;
+        unsigned int queued = 0;
+
+        client->nodegroup->log_write_cb("Get inv request with %d items\n", varlen);
+
+        for (unsigned int i=0;i<varlen;i++)
+        {
+            uint32_t type;
+            btc_uint256 hash;
+            if (!deser_u32(&type, buf) || !deser_u256(hash, buf))
+                break;
+
+            /* blocks are queued and fetched in parallel, other inv types are ignored */
+            if (type == BTC_INV_TYPE_BLOCK) {
+                contains_block = true;
+                memcpy(node->last_requested_inv, hash, sizeof(btc_uint256));
+                if (btc_net_spv_queue_block(client, hash, 0))
+                    queued++;
+            }
+        }
+
+        if (contains_block)
+        {
+            /* the getblocks request has been answered */
+            node->time_last_request = 0;
+            btc_node_response_received(node, BTC_P2P_HDRSZ + hdr->data_len);
+            client->block_queue_more = (varlen >= 500);
+
+            client->nodegroup->log_write_cb("Queued %d blocks (%d in queue)\n", queued, client->block_queue->len);
+            btc_net_spv_schedule_blocks(client);
         }
     }
-    if (strcmp(hdr->command, BTC_MSG_HEADERS) == 0)
+    if (hdr->type == BTC_MSG_TYPE_BLOCK)
+    {
+        btc_net_spv_block_received(client, node, buf);
+    }
+    if (hdr->type == BTC_MSG_TYPE_MERKLEBLOCK)
+    {
+        btc_net_spv_merkle_block_received(client, node, buf);
+    }
+    if (hdr->type == BTC_MSG_TYPE_TX)
+    {
+        if (client->use_compact_blocks)
+            btc_cmpct_txpool_add(client->tx_pool, buf->p, buf->len);
+        btc_net_spv_merkle_tx_received(client, node, buf);
+    }
+    if (hdr->type == BTC_MSG_TYPE_CMPCTBLOCK)
+    {
+        btc_net_spv_cmpctblock_received(client, node, buf);
+    }
+    if (hdr->type == BTC_MSG_TYPE_BLOCKTXN)
+    {
+        btc_net_spv_blocktxn_received(client, node, buf);
+    }
+    if (hdr->type == BTC_MSG_TYPE_HEADERS)
     {
         uint32_t amount_of_headers;
         if (!deser_varlen(&amount_of_headers, buf)) return;
         uint64_t now = time(NULL);
         client->nodegroup->log_write_cb("Got %d headers (took %d s) from node %d\n", amount_of_headers, now - client->last_headersrequest_time, node->nodeid);
 
-        // flag off the request stall check
-        client->last_headersrequest_time = 0;
+        /* new blocks announced by the peer (sendheaders), not a response to an outstanding getheaders */
+        btc_bool requested = ((node->state & NODE_HEADERSYNC) == NODE_HEADERSYNC && client->last_headersrequest_time > 0);
+        btc_bool announcement = (!requested && amount_of_headers < MAX_HEADERS_RESULTS);
+        if (!announcement) {
+            btc_node_response_received(node, BTC_P2P_HDRSZ + hdr->data_len);
+            // flag off the request stall check
+            client->last_headersrequest_time = 0;
+        }
+
+        /* request the next headers before connecting this batch to hide the round trip */
+        btc_bool pipelined = btc_net_spv_pipeline_headers(client, node, amount_of_headers, buf);
 
         unsigned int connected_headers = 0;
+        unsigned int queued_blocks = 0;
+        btc_bool headers_missing = false;
         for (unsigned int i=0;i<amount_of_headers;i++)
         {
             btc_bool connected;
@@ -493,18 +2206,49 @@ void btc_net_spv_post_cmd(btc_node *node, btc_p2p_msg_hdr *hdr, struct const_buf
 
             if (!connected)
             {
-                /* error, header sequence missmatch
-                   mark node as missbehaving */
-                client->nodegroup->log_write_cb("Got invalid headers (not in sequence) from node %d\n", node->nodeid);
-                node->state &= ~NODE_HEADERSYNC;
-                btc_node_missbehave(node);
+                if ((node->state & NODE_HEADERSYNC) == NODE_HEADERSYNC)
+                {
+                    /* error, the response to our locator is not in sequence
+                       mark node as missbehaving */
+                    client->nodegroup->log_write_cb("Got invalid headers (not in sequence) from node %d\n", node->nodeid);
+                    node->state &= ~NODE_HEADERSYNC;
+                    btc_node_missbehave(node);
 
-                /* see if we can fetch headers from a different peer */
-                btc_net_spv_request_headers(client);
+                    /* see if we can fetch headers from a different peer */
+                    btc_net_spv_request_headers(client);
+                }
+                else if (!headers_missing)
+                {
+                    /* unsolicited headers with an unknown parent (kept as orphans by the headers db),
+                       request the missing headers, the orphans will connect once they arrive */
+                    client->nodegroup->log_write_cb("Got unconnected headers from node %d, requesting the gap\n", node->nodeid);
+                    headers_missing = true;
+                    btc_net_spv_request_headers(client);
+                }
             }
             else {
                 connected_headers++;
-                if (pindex->header.timestamp > client->oldest_item_of_interest - (BLOCK_GAP_TO_DEDUCT_TO_START_SCAN_FROM * BLOCKS_DELTA_IN_S) ) {
+                if (client->header_connected) { client->header_connected(client); }
+                if (client->filter_sync->scanning) {
+                    btc_net_spv_filter_add_block(client, pindex);
+                }
+                else if (pindex->header.timestamp > client->oldest_item_of_interest - (BLOCK_GAP_TO_DEDUCT_TO_START_SCAN_FROM * BLOCKS_DELTA_IN_S) &&
+                         client->use_compact_filters && btc_net_spv_filter_node(client, NULL)) {
+
+                    /* check the compact filters of the blocks from this point, keep loading the headers */
+                    client->nodegroup->log_write_cb("start scanning compact filters at height %d\n", pindex->height);
+                    client->filter_sync->scanning = true;
+                    btc_net_spv_filter_add_block(client, pindex);
+                }
+                else if (announcement && pindex->header.timestamp > client->oldest_item_of_interest - (BLOCK_GAP_TO_DEDUCT_TO_START_SCAN_FROM * BLOCKS_DELTA_IN_S)) {
+
+                    /* fetch the announced block directly, no getblocks/inv round trip */
+                    client->stateflags &= ~SPV_HEADER_SYNC_FLAG;
+                    client->stateflags |= SPV_FULLBLOCK_SYNC_FLAG;
+                    if (btc_net_spv_queue_block(client, pindex->hash, pindex->height))
+                        queued_blocks++;
+                }
+                else if (pindex->header.timestamp > client->oldest_item_of_interest - (BLOCK_GAP_TO_DEDUCT_TO_START_SCAN_FROM * BLOCKS_DELTA_IN_S) ) {
 
                     /* we should start loading block from this point */
                     client->stateflags &= ~SPV_HEADER_SYNC_FLAG;
@@ -525,22 +2269,52 @@ void btc_net_spv_post_cmd(btc_node *node, btc_p2p_msg_hdr *hdr, struct const_buf
 
         client->nodegroup->log_write_cb("Connected %d headers\n", connected_headers);
         client->nodegroup->log_write_cb("Chaintip at height %d\n", chaintip->height);
+        if (queued_blocks > 0)
+            btc_net_spv_schedule_blocks(client);
 
         /* call the header message processed callback and allow canceling the further logic commands */
         if (client->header_message_processed && client->header_message_processed(client, node, chaintip) == false)
             return;
 
-        if (amount_of_headers == MAX_HEADERS_RESULTS && ((node->state & NODE_BLOCKSYNC) != NODE_BLOCKSYNC))
+        if (pipelined)
+        {
+            /* the next headers have already been requested */
+        }
+        else if (amount_of_headers == MAX_HEADERS_RESULTS && ((node->state & NODE_BLOCKSYNC) != NODE_BLOCKSYNC))
         {
             /* peer sent maximal amount of headers, very likely, there will be more */
             time_t lasttime = chaintip->header.timestamp;
             client->nodegroup->log_write_cb("chain size: %d, last time %s", chaintip->height, ctime(&lasttime));
-            btc_net_spv_node_request_headers_or_blocks(node, false);
+
+            /* continue with a clearly faster peer if there is one */
+            btc_node *next_node = node;
+            btc_node *best_node = btc_node_group_best_sync_node(client->nodegroup, chaintip->height, node);
+            if (best_node && btc_node_sync_score(best_node) > btc_node_sync_score(node) * 3 / 2)
+            {
+                client->nodegroup->log_write_cb("Continue header sync with faster node %d\n", best_node->nodeid);
+                node->state &= ~NODE_HEADERSYNC;
+                next_node = best_node;
+            }
+            btc_net_spv_node_request_headers_or_blocks(next_node, false);
         }
         else
         {
             /* headers download seems to be completed */
-            /* we should have switched to block request if the oldest_item_of_interest was set correctly */
+            /* we should have switched to block request (or filter scan) if the oldest_item_of_interest was set correctly */
+            client->filter_sync->headers_done = true;
         }
+
+        if (client->filter_sync->scanning) {
+            btc_net_spv_request_filters(client);
+            btc_net_spv_check_sync_completed(client);
+        }
+    }
+    if (hdr->type == BTC_MSG_TYPE_CFHEADERS)
+    {
+        btc_net_spv_cfheaders_received(client, node, buf);
+    }
+    if (hdr->type == BTC_MSG_TYPE_CFILTER)
+    {
+        btc_net_spv_cfilter_received(client, node, buf);
     }
 }
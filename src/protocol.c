@@ -32,6 +32,7 @@
 #include <btc/utils.h>
 
 #include <assert.h>
+#include <string.h>
 #include <time.h>
 
 enum {
@@ -51,28 +52,45 @@ void btc_p2p_address_init(btc_p2p_address* addr)
     memset(addr, 0, sizeof(*addr));
 }
 
-cstring* btc_p2p_message_new(const unsigned char netmagic[4], const char* command, const void* data, uint32_t data_len)
+void btc_p2p_message_header(const unsigned char netmagic[4], const char* command, const struct const_buffer* parts, size_t parts_count, const unsigned char* checksum, unsigned char hdr_out[24])
 {
-    cstring* s = cstr_new_sz(BTC_P2P_HDRSZ + data_len);
-
     /* network identifier (magic number) */
-    cstr_append_buf(s, netmagic, 4);
+    memcpy(hdr_out, netmagic, 4);
 
     /* command string */
-    char command_null[12];
-    memset(command_null, 0, 12);
-    memcpy(command_null, command, strlen(command));
-    //memset(command_null+strlen(command), 0, 12-strlen(command));
-    cstr_append_buf(s, command_null, 12);
+    memset(hdr_out + 4, 0, 12);
+    memcpy(hdr_out + 4, command, strlen(command));
 
     /* data length, always 4 bytes */
+    uint32_t data_len = 0;
+    for (size_t i = 0; i < parts_count; i++)
+        data_len += parts[i].len;
     uint32_t data_len_le = htole32(data_len);
-    cstr_append_buf(s, &data_len_le, 4);
+    memcpy(hdr_out + 16, &data_len_le, 4);
 
     /* data checksum (first 4 bytes of the double sha256 hash of the pl) */
+    if (checksum) {
+        memcpy(hdr_out + 20, checksum, 4);
+        return;
+    }
+    SHA2_CTX ctx;
     btc_uint256 msghash;
-    btc_hash(data, data_len, msghash);
-    cstr_append_buf(s, &msghash[0], 4);
+    sha256_Init(&ctx);
+    for (size_t i = 0; i < parts_count; i++)
+        sha256_Update(&ctx, parts[i].p, parts[i].len);
+    sha256_Final(msghash, &ctx);
+    sha256_Raw(msghash, SHA256_DIGEST_LENGTH, msghash);
+    memcpy(hdr_out + 20, msghash, 4);
+}
+
+cstring* btc_p2p_message_new(const unsigned char netmagic[4], const char* command, const void* data, uint32_t data_len)
+{
+    cstring* s = cstr_new_sz(BTC_P2P_HDRSZ + data_len);
+
+    unsigned char hdr[24];
+    struct const_buffer payload = {data, data_len};
+    btc_p2p_message_header(netmagic, command, &payload, 1, NULL, hdr);
+    cstr_append_buf(s, hdr, BTC_P2P_HDRSZ);
 
     /* data payload */
     if (data_len > 0)
@@ -131,10 +149,12 @@ void btc_p2paddr_to_addr(btc_p2p_address* p2p_addr, struct sockaddr* addr_out)
     if (!is_ipv4_mapped(p2p_addr->ip)) {
         /* ipv6 */
         struct sockaddr_in6* saddr = (struct sockaddr_in6*)addr_out;
+        saddr->sin6_family = AF_INET6;
         memcpy(&saddr->sin6_addr, p2p_addr->ip, 16);
         saddr->sin6_port = htons(p2p_addr->port);
     } else {
         struct sockaddr_in* saddr = (struct sockaddr_in*)addr_out;
+        saddr->sin_family = AF_INET;
         memcpy(&saddr->sin_addr, &p2p_addr->ip[12], 4);
         saddr->sin_port = htons(p2p_addr->port);
     }
@@ -279,10 +299,131 @@ btc_bool btc_p2p_deser_msg_getheaders(vector* blocklocators, btc_uint256 hashsto
     return true;
 }
 
+void btc_p2p_msg_getcfilters(uint8_t filter_type, uint32_t start_height, const btc_uint256 stop_hash, cstring* s)
+{
+    ser_bytes(s, &filter_type, 1);
+    ser_u32(s, start_height);
+    ser_bytes(s, stop_hash, BTC_HASH_LENGTH);
+}
+
+btc_bool btc_p2p_deser_msg_cfilter(uint8_t* filter_type, btc_uint256 block_hash, struct const_buffer* filter, struct const_buffer* buf)
+{
+    uint32_t filter_len;
+    if (!deser_bytes(filter_type, buf, 1))
+        return false;
+    if (!deser_u256(block_hash, buf))
+        return false;
+    if (!deser_varlen(&filter_len, buf) || filter_len > buf->len)
+        return false;
+    filter->p = buf->p;
+    filter->len = filter_len;
+    return deser_skip(buf, filter_len);
+}
+
+btc_bool btc_p2p_deser_msg_cfheaders(uint8_t* filter_type, btc_uint256 stop_hash, btc_uint256 prev_header, uint32_t* count, struct const_buffer* buf)
+{
+    if (!deser_bytes(filter_type, buf, 1))
+        return false;
+    if (!deser_u256(stop_hash, buf))
+        return false;
+    if (!deser_u256(prev_header, buf))
+        return false;
+    if (!deser_varlen(count, buf) || (uint64_t)*count * BTC_HASH_LENGTH > buf->len)
+        return false;
+    return true;
+}
+
+/* command names by message type */
+static const char* btc_p2p_msg_type_commands[BTC_MSG_TYPE_COUNT] = {
+    NULL,
+    "version",
+    "verack",
+    "ping",
+    "pong",
+    "getdata",
+    "getheaders",
+    "headers",
+    "getblocks",
+    "block",
+    "inv",
+    "tx",
+    "getcfilters",
+    "cfilter",
+    "getcfheaders",
+    "cfheaders",
+    "filterload",
+    "merkleblock",
+    "sendcmpct",
+    "cmpctblock",
+    "getblocktxn",
+    "blocktxn",
+    "sendheaders",
+    "addr",
+    "getaddr",
+    "notfound",
+    "reject",
+    "mempool",
+    "feefilter",
+    "filteradd",
+    "filterclear",
+    "getcfcheckpt",
+    "cfcheckpt",
+    "wtxidrelay",
+    "sendaddrv2",
+    "addrv2",
+};
+
+/* perfect hash of the known commands: every command has its own bucket,
+   the table has to be regenerated (multiplier and shift) when adding a command */
+#define BTC_MSG_TYPE_HASH_MUL 1703
+#define BTC_MSG_TYPE_HASH_SHIFT 12
+#define BTC_MSG_TYPE_BUCKETS 64
+
+static const uint8_t btc_p2p_msg_type_buckets[BTC_MSG_TYPE_BUCKETS] = {
+    BTC_MSG_TYPE_SENDHEADERS, BTC_MSG_TYPE_UNKNOWN, BTC_MSG_TYPE_CFHEADERS, BTC_MSG_TYPE_VERACK,
+    BTC_MSG_TYPE_UNKNOWN, BTC_MSG_TYPE_UNKNOWN, BTC_MSG_TYPE_PONG, BTC_MSG_TYPE_UNKNOWN,
+    BTC_MSG_TYPE_MEMPOOL, BTC_MSG_TYPE_UNKNOWN, BTC_MSG_TYPE_GETDATA, BTC_MSG_TYPE_MERKLEBLOCK,
+    BTC_MSG_TYPE_FEEFILTER, BTC_MSG_TYPE_GETHEADERS, BTC_MSG_TYPE_UNKNOWN, BTC_MSG_TYPE_GETADDR,
+    BTC_MSG_TYPE_UNKNOWN, BTC_MSG_TYPE_GETCFCHECKPT, BTC_MSG_TYPE_ADDR, BTC_MSG_TYPE_FILTERADD,
+    BTC_MSG_TYPE_SENDADDRV2, BTC_MSG_TYPE_CFILTER, BTC_MSG_TYPE_NOTFOUND, BTC_MSG_TYPE_INV,
+    BTC_MSG_TYPE_UNKNOWN, BTC_MSG_TYPE_HEADERS, BTC_MSG_TYPE_CMPCTBLOCK, BTC_MSG_TYPE_UNKNOWN,
+    BTC_MSG_TYPE_CFCHECKPT, BTC_MSG_TYPE_FILTERLOAD, BTC_MSG_TYPE_UNKNOWN, BTC_MSG_TYPE_UNKNOWN,
+    BTC_MSG_TYPE_REJECT, BTC_MSG_TYPE_GETCFILTERS, BTC_MSG_TYPE_UNKNOWN, BTC_MSG_TYPE_UNKNOWN,
+    BTC_MSG_TYPE_UNKNOWN, BTC_MSG_TYPE_UNKNOWN, BTC_MSG_TYPE_SENDCMPCT, BTC_MSG_TYPE_UNKNOWN,
+    BTC_MSG_TYPE_UNKNOWN, BTC_MSG_TYPE_WTXIDRELAY, BTC_MSG_TYPE_UNKNOWN, BTC_MSG_TYPE_UNKNOWN,
+    BTC_MSG_TYPE_UNKNOWN, BTC_MSG_TYPE_UNKNOWN, BTC_MSG_TYPE_PING, BTC_MSG_TYPE_VERSION,
+    BTC_MSG_TYPE_TX, BTC_MSG_TYPE_UNKNOWN, BTC_MSG_TYPE_ADDRV2, BTC_MSG_TYPE_UNKNOWN,
+    BTC_MSG_TYPE_GETBLOCKTXN, BTC_MSG_TYPE_UNKNOWN, BTC_MSG_TYPE_GETCFHEADERS, BTC_MSG_TYPE_UNKNOWN,
+    BTC_MSG_TYPE_FILTERCLEAR, BTC_MSG_TYPE_UNKNOWN, BTC_MSG_TYPE_UNKNOWN, BTC_MSG_TYPE_UNKNOWN,
+    BTC_MSG_TYPE_BLOCKTXN, BTC_MSG_TYPE_GETBLOCKS, BTC_MSG_TYPE_UNKNOWN, BTC_MSG_TYPE_BLOCK,
+};
+
+enum btc_p2p_msg_type btc_p2p_msg_type_from_command(const char* command)
+{
+    uint32_t hash = 0;
+    for (unsigned int i = 0; i < 12 && command[i]; i++)
+        hash = hash * BTC_MSG_TYPE_HASH_MUL + (unsigned char)command[i];
+    uint8_t type = btc_p2p_msg_type_buckets[(hash >> BTC_MSG_TYPE_HASH_SHIFT) & (BTC_MSG_TYPE_BUCKETS - 1)];
+
+    /* a single compare confirms the command (unknown commands can hash to any bucket) */
+    if (type == BTC_MSG_TYPE_UNKNOWN || strncmp(command, btc_p2p_msg_type_commands[type], 12) != 0)
+        return BTC_MSG_TYPE_UNKNOWN;
+    return (enum btc_p2p_msg_type)type;
+}
+
+const char* btc_p2p_msg_type_command(enum btc_p2p_msg_type type)
+{
+    if (type <= BTC_MSG_TYPE_UNKNOWN || type >= BTC_MSG_TYPE_COUNT)
+        return NULL;
+    return btc_p2p_msg_type_commands[type];
+}
+
 void btc_p2p_deser_msghdr(btc_p2p_msg_hdr* hdr, struct const_buffer* buf)
 {
     deser_bytes(hdr->netmagic, buf, 4);
     deser_bytes(hdr->command, buf, 12);
+    hdr->command[12] = 0;
+    hdr->type = btc_p2p_msg_type_from_command(hdr->command);
     deser_u32(&hdr->data_len, buf);
     deser_bytes(hdr->hash, buf, 4);
 }
@@ -0,0 +1,286 @@
+/*
+
+ The MIT License (MIT)
+
+ Copyright (c) 2016 libbtc developers
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES
+ OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+
+#include <string.h>
+
+#include <btc/scriptmatch.h>
+
+#include <btc/blockfilter.h>
+#include <btc/hash.h>
+#include <btc/random.h>
+#include <btc/ripemd160.h>
+#include <btc/script.h>
+
+#define SCRIPTMATCH_MIN_CAPACITY 16
+/* bits of the prefilter per table slot (at most half of the slots are used) */
+#define SCRIPTMATCH_PREFILTER_BITS_PER_SLOT 8
+
+static void btc_script_match_key_set(btc_script_match_key* key, enum btc_script_match_type type, uint8_t version, const uint8_t* data, size_t len)
+{
+    memset(key->data, 0, sizeof(key->data));
+    key->data[0] = (uint8_t)type;
+    key->data[1] = version;
+    key->data[2] = (uint8_t)len;
+    memcpy(key->data + 3, data, len);
+}
+
+void btc_script_match_key_from_keyhash(const btc_uint160 hash160, btc_script_match_key* key_out)
+{
+    btc_script_match_key_set(key_out, BTC_SCRIPT_MATCH_KEYHASH, 0, hash160, sizeof(btc_uint160));
+}
+
+void btc_script_match_key_from_script(const uint8_t* script, size_t len, btc_script_match_key* key_out)
+{
+    if (len == 25 && script[0] == OP_DUP && script[1] == OP_HASH160 && script[2] == 20 && script[23] == OP_EQUALVERIFY && script[24] == OP_CHECKSIG) {
+        btc_script_match_key_set(key_out, BTC_SCRIPT_MATCH_KEYHASH, 0, script + 3, 20);
+    }
+    else if (len == 23 && script[0] == OP_HASH160 && script[1] == 20 && script[22] == OP_EQUAL) {
+        btc_script_match_key_set(key_out, BTC_SCRIPT_MATCH_SCRIPTHASH, 0, script + 2, 20);
+    }
+    else if (len == 22 && script[0] == OP_0 && script[1] == 20) {
+        /* P2WPKH pays to the same key hash as P2PKH */
+        btc_script_match_key_set(key_out, BTC_SCRIPT_MATCH_KEYHASH, 0, script + 2, 20);
+    }
+    else if ((len == 35 && script[0] == 33 && script[34] == OP_CHECKSIG) || (len == 67 && script[0] == 65 && script[66] == OP_CHECKSIG)) {
+        btc_uint256 pubkey_hash;
+        btc_uint160 hash160;
+        btc_hash_sngl_sha256(script + 1, len - 2, pubkey_hash);
+        btc_ripemd160(pubkey_hash, sizeof(pubkey_hash), hash160);
+        btc_script_match_key_set(key_out, BTC_SCRIPT_MATCH_KEYHASH, 0, hash160, 20);
+    }
+    else if (len >= 4 && len <= 34 && (script[0] == OP_0 || (script[0] >= OP_1 && script[0] <= OP_16)) && (size_t)script[1] + 2 == len) {
+        uint8_t version = (script[0] == OP_0 ? 0 : script[0] - OP_1 + 1);
+        btc_script_match_key_set(key_out, BTC_SCRIPT_MATCH_WITNESS_PROGRAM, version, script + 2, script[1]);
+    }
+    else {
+        btc_uint256 script_hash;
+        btc_hash_sngl_sha256(script, len, script_hash);
+        btc_script_match_key_set(key_out, BTC_SCRIPT_MATCH_SCRIPT, 0, script_hash, sizeof(script_hash));
+    }
+}
+
+static uint64_t btc_script_matcher_hash(const btc_script_matcher* matcher, const btc_script_match_key* key)
+{
+    /* 0 marks an empty slot */
+    return btc_siphash(matcher->k0, matcher->k1, key->data, sizeof(key->data)) | 1;
+}
+
+static void btc_script_matcher_prefilter_set(btc_script_matcher* matcher, uint64_t hash)
+{
+    size_t mask = matcher->prefilter_bits - 1;
+    size_t bit_a = (size_t)(hash >> 1) & mask;
+    size_t bit_b = (size_t)(hash >> 33) & mask;
+    matcher->prefilter[bit_a / 64] |= (1ULL << (bit_a % 64));
+    matcher->prefilter[bit_b / 64] |= (1ULL << (bit_b % 64));
+}
+
+static btc_bool btc_script_matcher_prefilter_contains(const btc_script_matcher* matcher, uint64_t hash)
+{
+    size_t mask = matcher->prefilter_bits - 1;
+    size_t bit_a = (size_t)(hash >> 1) & mask;
+    size_t bit_b = (size_t)(hash >> 33) & mask;
+    return ((matcher->prefilter[bit_a / 64] >> (bit_a % 64)) & 1) && ((matcher->prefilter[bit_b / 64] >> (bit_b % 64)) & 1);
+}
+
+static btc_bool btc_script_matcher_slot_is(const btc_script_match_slot* slot, uint64_t hash, const btc_script_match_key* key)
+{
+    return (slot->hash == hash && memcmp(slot->key.data, key->data, sizeof(key->data)) == 0);
+}
+
+/* slot of the key and owner, or the empty slot to insert it at */
+static btc_script_match_slot* btc_script_matcher_find_slot(const btc_script_matcher* matcher, uint64_t hash, const btc_script_match_key* key, const void* owner)
+{
+    size_t mask = matcher->capacity - 1;
+    for (size_t pos = (size_t)hash & mask;; pos = (pos + 1) & mask) {
+        btc_script_match_slot* slot = &matcher->slots[pos];
+        if (slot->hash == 0 || (btc_script_matcher_slot_is(slot, hash, key) && slot->owner == owner))
+            return slot;
+    }
+}
+
+static void btc_script_matcher_build_prefilter(btc_script_matcher* matcher)
+{
+    memset(matcher->prefilter, 0, matcher->prefilter_bits / 8);
+    for (size_t i = 0; i < matcher->capacity; i++) {
+        if (matcher->slots[i].hash != 0)
+            btc_script_matcher_prefilter_set(matcher, matcher->slots[i].hash);
+    }
+    matcher->removed = 0;
+}
+
+static void btc_script_matcher_alloc(btc_script_matcher* matcher, size_t capacity)
+{
+    matcher->capacity = capacity;
+    matcher->slots = btc_calloc(capacity, sizeof(btc_script_match_slot));
+    matcher->prefilter_bits = capacity * SCRIPTMATCH_PREFILTER_BITS_PER_SLOT;
+    matcher->prefilter = btc_calloc(matcher->prefilter_bits / 64, sizeof(uint64_t));
+}
+
+static void btc_script_matcher_grow(btc_script_matcher* matcher)
+{
+    btc_script_match_slot* old_slots = matcher->slots;
+    size_t old_capacity = matcher->capacity;
+    btc_free(matcher->prefilter);
+    btc_script_matcher_alloc(matcher, old_capacity * 2);
+
+    for (size_t i = 0; i < old_capacity; i++) {
+        btc_script_match_slot* old_slot = &old_slots[i];
+        if (old_slot->hash == 0)
+            continue;
+        btc_script_match_slot* slot = btc_script_matcher_find_slot(matcher, old_slot->hash, &old_slot->key, old_slot->owner);
+        memcpy(slot, old_slot, sizeof(*slot));
+    }
+    btc_free(old_slots);
+    btc_script_matcher_build_prefilter(matcher);
+}
+
+btc_script_matcher* btc_script_matcher_new(size_t expected)
+{
+    btc_script_matcher* matcher = btc_calloc(1, sizeof(*matcher));
+    size_t capacity = SCRIPTMATCH_MIN_CAPACITY;
+    while (capacity < expected * 2)
+        capacity *= 2;
+    btc_script_matcher_alloc(matcher, capacity);
+
+    uint8_t keys[16];
+    btc_random_bytes(keys, sizeof(keys), 0);
+    memcpy(&matcher->k0, keys, sizeof(matcher->k0));
+    memcpy(&matcher->k1, keys + 8, sizeof(matcher->k1));
+    return matcher;
+}
+
+void btc_script_matcher_free(btc_script_matcher* matcher)
+{
+    if (!matcher)
+        return;
+
+    btc_free(matcher->slots);
+    btc_free(matcher->prefilter);
+    btc_free(matcher);
+}
+
+btc_bool btc_script_matcher_add_key(btc_script_matcher* matcher, const btc_script_match_key* key, void* owner)
+{
+    if ((matcher->count + 1) * 2 > matcher->capacity)
+        btc_script_matcher_grow(matcher);
+
+    uint64_t hash = btc_script_matcher_hash(matcher, key);
+    btc_script_match_slot* slot = btc_script_matcher_find_slot(matcher, hash, key, owner);
+    if (slot->hash != 0)
+        return false;
+
+    slot->hash = hash;
+    memcpy(&slot->key, key, sizeof(*key));
+    slot->owner = owner;
+    btc_script_matcher_prefilter_set(matcher, hash);
+    matcher->count++;
+    return true;
+}
+
+btc_bool btc_script_matcher_remove_key(btc_script_matcher* matcher, const btc_script_match_key* key, void* owner)
+{
+    uint64_t hash = btc_script_matcher_hash(matcher, key);
+    btc_script_match_slot* slot = btc_script_matcher_find_slot(matcher, hash, key, owner);
+    if (slot->hash == 0)
+        return false;
+
+    /* shift the following slots of the probe sequence back (no tombstones) */
+    size_t mask = matcher->capacity - 1;
+    size_t hole = (size_t)(slot - matcher->slots);
+    for (size_t pos = (hole + 1) & mask; matcher->slots[pos].hash != 0; pos = (pos + 1) & mask) {
+        size_t home = (size_t)matcher->slots[pos].hash & mask;
+        /* the slot can fill the hole if its home is not between the hole and its position */
+        if (((pos - home) & mask) >= ((pos - hole) & mask)) {
+            memcpy(&matcher->slots[hole], &matcher->slots[pos], sizeof(btc_script_match_slot));
+            hole = pos;
+        }
+    }
+    memset(&matcher->slots[hole], 0, sizeof(btc_script_match_slot));
+    matcher->count--;
+
+    /* rebuild the prefilter once as many keys have been removed as are left */
+    if (++matcher->removed > matcher->count)
+        btc_script_matcher_build_prefilter(matcher);
+    return true;
+}
+
+btc_bool btc_script_matcher_add_script(btc_script_matcher* matcher, const uint8_t* script, size_t len)
+{
+    btc_script_match_key key;
+    btc_script_match_key_from_script(script, len, &key);
+    return btc_script_matcher_add_key(matcher, &key, NULL);
+}
+
+btc_bool btc_script_matcher_add_keyhash(btc_script_matcher* matcher, const btc_uint160 hash160)
+{
+    btc_script_match_key key;
+    btc_script_match_key_from_keyhash(hash160, &key);
+    return btc_script_matcher_add_key(matcher, &key, NULL);
+}
+
+btc_bool btc_script_matcher_match_script(const btc_script_matcher* matcher, const uint8_t* script, size_t len)
+{
+    return (btc_script_matcher_find_owners(matcher, script, len, NULL) > 0);
+}
+
+size_t btc_script_matcher_find_owners(const btc_script_matcher* matcher, const uint8_t* script, size_t len, vector* owners_out)
+{
+    if (matcher->count == 0)
+        return 0;
+
+    btc_script_match_key key;
+    btc_script_match_key_from_script(script, len, &key);
+    uint64_t hash = btc_script_matcher_hash(matcher, &key);
+    if (!btc_script_matcher_prefilter_contains(matcher, hash))
+        return 0;
+
+    /* the slots of all owners of the key are in the same probe sequence */
+    size_t found = 0;
+    size_t mask = matcher->capacity - 1;
+    for (size_t pos = (size_t)hash & mask; matcher->slots[pos].hash != 0; pos = (pos + 1) & mask) {
+        const btc_script_match_slot* slot = &matcher->slots[pos];
+        if (!btc_script_matcher_slot_is(slot, hash, &key))
+            continue;
+        found++;
+        if (!owners_out)
+            break;
+        vector_add(owners_out, slot->owner);
+    }
+    return found;
+}
+
+btc_bool btc_script_matcher_match_tx(const btc_script_matcher* matcher, const btc_tx* tx)
+{
+    if (!tx->vout)
+        return false;
+
+    for (size_t i = 0; i < tx->vout->len; i++) {
+        btc_tx_out* tx_out = vector_idx(tx->vout, i);
+        if (tx_out->script_pubkey && btc_script_matcher_match_script(matcher, (const uint8_t*)tx_out->script_pubkey->str, tx_out->script_pubkey->len))
+            return true;
+    }
+    return false;
+}
@@ -234,7 +234,7 @@ btc_bool broadcast_should_connect_more(btc_node* node)
 void broadcast_post_cmd(struct btc_node_* node, btc_p2p_msg_hdr* hdr, struct const_buffer* buf)
 {
     struct broadcast_ctx* ctx = (struct broadcast_ctx*)node->nodegroup->ctx;
-    if (strcmp(hdr->command, BTC_MSG_INV) == 0) {
+    if (hdr->type == BTC_MSG_TYPE_INV) {
         /* hash the tx */
         /* TODO: cache the hash */
         btc_uint256 hash;
@@ -261,7 +261,7 @@ void broadcast_post_cmd(struct btc_node_* node, btc_p2p_msg_hdr* hdr, struct con
                 printf("tx successfully seen on node %d\n", node->nodeid);
             }
         }
-    } else if (strcmp(hdr->command, BTC_MSG_GETDATA) == 0 && ((node->hints & (1 << 1)) != (1 << 1))) {
+    } else if (hdr->type == BTC_MSG_TYPE_GETDATA && ((node->hints & (1 << 1)) != (1 << 1))) {
         ctx->getdata_from_peers++;
         //only allow a single object in getdata for the broadcaster
         uint32_t vsize;
@@ -280,10 +280,7 @@ void broadcast_post_cmd(struct btc_node_* node, btc_p2p_msg_hdr* hdr, struct con
         /* send the tx */
         cstring* tx_ser = cstr_new_sz(1024);
         btc_tx_serialize(tx_ser, ctx->tx, true);
-        cstring* p2p_msg = btc_p2p_message_new(node->nodegroup->chainparams->netmagic, BTC_MSG_TX, tx_ser->str, tx_ser->len);
-        cstr_free(tx_ser, true);
-        btc_node_send(node, p2p_msg);
-        cstr_free(p2p_msg, true);
+        btc_node_send_message(node, BTC_MSG_TX, &tx_ser, 1, NULL);
 
         /* set hint bit 1 == tx sent */
         node->hints |= (1 << 1);
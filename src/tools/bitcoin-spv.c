@@ -28,6 +28,7 @@
 
 #include <btc/chainparams.h>
 #include <btc/ecc.h>
+#include <btc/headersdb_file.h>
 #include <btc/net.h>
 #include <btc/netspv.h>
 #include <btc/protocol.h>
@@ -56,6 +57,8 @@ static struct option long_options[] =
         {"maxnodes", no_argument, NULL, 'm'},
         {"dbfile", no_argument, NULL, 'f'},
         {"continuous", no_argument, NULL, 'c'},
+        {"snapshot", required_argument, NULL, 'p'},
+        {"peersfile", required_argument, NULL, 'a'},
         {NULL, 0, NULL, 0}};
 
 static void print_version()
@@ -66,9 +69,10 @@ static void print_version()
 static void print_usage()
 {
     print_version();
-    printf("Usage: bitcoin-spv (-c|continuous) (-i|-ips <ip,ip,...]>) (-m[--maxpeers] <int>) (-t[--testnet]) (-f <headersfile|0 for in mem only>) (-r[--regtest]) (-d[--debug]) (-s[--timeout] <secs>) <command>\n");
+    printf("Usage: bitcoin-spv (-c|continuous) (-i|-ips <ip,ip,...]>) (-m[--maxpeers] <int>) (-t[--testnet]) (-f <headersfile|0 for in mem only>) (-p[--snapshot] <headers snapshot file>) (-a[--peersfile] <known peers file>) (-r[--regtest]) (-d[--debug]) (-s[--timeout] <secs>) <command>\n");
     printf("Supported commands:\n");
     printf("        scan      (scan blocks up to the tip, creates header.db file)\n");
+    printf("        export    (write all headers from the headers database to the -p snapshot file)\n");
     printf("\nExamples: \n");
     printf("Sync up to the chain tip and stores all headers in headers.db (quit once synced):\n");
     printf("> bitcoin-spv scan\n\n");
@@ -76,6 +80,10 @@ static void print_usage()
     printf("> bitcoin-spv -d scan\n\n");
     printf("Sync up, show debug info, don't store headers in file (only in memory), wait for new blocks:\n");
     printf("> bitcoin-spv -d -f 0 -c scan\n\n");
+    printf("Import the headers up to a checkpoint from a local snapshot file before syncing:\n");
+    printf("> bitcoin-spv -p headers.snapshot scan\n\n");
+    printf("Remember the peers between runs (reconnect without asking the DNS seeds):\n");
+    printf("> bitcoin-spv -a peers.dat scan\n\n");
 }
 
 static bool showError(const char* er)
@@ -115,6 +123,8 @@ int main(int argc, char* argv[])
     int timeout = 15;
     int maxnodes = 10;
     char* dbfile = 0;
+    char* snapshotfile = 0;
+    char* peersfile = 0;
     const btc_chainparams* chain = &btc_chainparams_main;
 
     if (argc <= 1 || strlen(argv[argc - 1]) == 0 || argv[argc - 1][0] == '-') {
@@ -125,7 +135,7 @@ int main(int argc, char* argv[])
     data = argv[argc - 1];
 
     /* get arguments */
-    while ((opt = getopt_long_only(argc, argv, "i:ctrds:m:f:", long_options, &long_index)) != -1) {
+    while ((opt = getopt_long_only(argc, argv, "i:ctrds:m:f:p:a:", long_options, &long_index)) != -1) {
         switch (opt) {
         case 'c':
             quit_when_synced = false;
@@ -151,6 +161,12 @@ int main(int argc, char* argv[])
         case 'f':
             dbfile = optarg;
             break;
+        case 'p':
+            snapshotfile = optarg;
+            break;
+        case 'a':
+            peersfile = optarg;
+            break;
         case 'v':
             print_version();
             exit(EXIT_SUCCESS);
@@ -207,7 +223,14 @@ int main(int argc, char* argv[])
             printf("Could not load or create headers database...aborting\n");
             ret = EXIT_FAILURE;
         }
+        else if (snapshotfile && !btc_spv_client_import_snapshot(client, snapshotfile)) {
+            printf("Could not import the headers snapshot...aborting\n");
+            ret = EXIT_FAILURE;
+        }
         else {
+            /* peers known from previous runs spare the DNS seed lookup */
+            if (peersfile && !btc_node_group_set_addrman_file(client->nodegroup, peersfile, 60))
+                printf("Could not use the peers file %s\n", peersfile);
             printf("Discover peers...");
             btc_spv_client_discover_peers(client, ips);
             printf("done\n");
@@ -218,6 +241,24 @@ int main(int argc, char* argv[])
         }
         btc_ecc_stop();
     }
+    else if (strcmp(data, "export") == 0) {
+        if (!snapshotfile || (dbfile && dbfile[0] == '0')) {
+            return showError("Export requires a headers database file and a snapshot file (-p)");
+        }
+        btc_headers_db* db = btc_headers_db_new(chain, false);
+        /* keep all headers in memory for the export */
+        btc_headers_db_set_mem_budget(db, 0);
+        if (!btc_headers_db_load(db, (dbfile ? dbfile : "headers.db")) ||
+            !btc_headers_db_export_snapshot(db, chain, snapshotfile)) {
+            printf("Exporting the headers snapshot failed\n");
+            ret = EXIT_FAILURE;
+        }
+        else {
+            printf("Exported headers up to height %d\n", btc_headersdb_getchaintip(db)->height);
+            ret = EXIT_SUCCESS;
+        }
+        btc_headers_db_free(db);
+    }
     else {
         printf("Invalid command (use -?)\n");
         ret = EXIT_FAILURE;
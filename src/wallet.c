@@ -220,6 +220,7 @@ btc_wallet* btc_wallet_new(const btc_chainparams *params)
 
     wallet->wtxes_rbtree = 0;
     wallet->hdkeys_rbtree = 0;
+    wallet->matcher = btc_script_matcher_new(0);
     return wallet;
 }
 
@@ -243,6 +244,7 @@ void btc_wallet_free(btc_wallet* wallet)
 
     btc_btree_tdestroy(wallet->wtxes_rbtree, btc_free);
     btc_btree_tdestroy(wallet->hdkeys_rbtree, btc_free);
+    btc_script_matcher_free(wallet->matcher);
 
     btc_free(wallet);
 }
@@ -384,6 +386,7 @@ btc_bool btc_wallet_load(btc_wallet* wallet, const char* file_path, int *error,
 
                 // add the node to the binary tree
                 btc_wallet_hdnode* checknode = tsearch(whdnode, &wallet->hdkeys_rbtree, btc_wallet_hdnode_compare);
+                btc_script_matcher_add_keyhash(wallet->matcher, whdnode->pubkeyhash);
 
             }
         }
@@ -442,6 +445,7 @@ btc_wallet_hdnode* btc_wallet_next_key(btc_wallet* wallet)
     //add it to the binary tree
     // tree manages memory
     btc_wallet_hdnode* checknode = tsearch(whdnode, &wallet->hdkeys_rbtree, btc_wallet_hdnode_compare);
+    btc_script_matcher_add_keyhash(wallet->matcher, whdnode->pubkeyhash);
 
     //serialize and store node
     cstring* record = cstr_new_sz(256);
@@ -602,38 +606,16 @@ int64_t btc_wallet_wtx_get_credit(btc_wallet* wallet, btc_wtx* wtx)
 
 btc_bool btc_wallet_txout_is_mine(btc_wallet* wallet, btc_tx_out* tx_out)
 {
-    if (!wallet || !tx_out) return false;
-
-    btc_bool ismine = false;
-
-    vector* vec = vector_new(16, free);
-    enum btc_tx_out_type type2 = btc_script_classify(tx_out->script_pubkey, vec);
+    if (!wallet || !tx_out || !tx_out->script_pubkey) return false;
 
     //TODO: Multisig, etc.
-    if (type2 == BTC_TX_PUBKEYHASH) {
-        //TODO: find a better format for vector elements (not a pure pointer)
-        uint8_t* hash160 = vector_idx(vec, 0);
-        if (btc_wallet_have_key(wallet, hash160))
-            ismine = true;
-    }
-
-    vector_free(vec, true);
-
-    return ismine;
+    return btc_script_matcher_match_script(wallet->matcher, (const uint8_t*)tx_out->script_pubkey->str, tx_out->script_pubkey->len);
 }
 
 btc_bool btc_wallet_is_mine(btc_wallet* wallet, const btc_tx *tx)
 {
     if (!wallet || !tx) return false;
-    if (tx->vout) {
-        for (unsigned int i = 0; i < tx->vout->len; i++) {
-            btc_tx_out* tx_out = vector_idx(tx->vout, i);
-            if (tx_out && btc_wallet_txout_is_mine(wallet, tx_out)) {
-                return true;
-            }
-        }
-    }
-    return false;
+    return btc_script_matcher_match_tx(wallet->matcher, tx);
 }
 
 int64_t btc_wallet_get_debit_txi(btc_wallet *wallet, const btc_tx_in *txin) {
@@ -0,0 +1,167 @@
+/**********************************************************************
+ * Copyright (c) 2016 Jonas Schnelli                                  *
+ * Distributed under the MIT software license, see the accompanying   *
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.*
+ **********************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <btc/addrman.h>
+#include <btc/chainparams.h>
+#include <btc/protocol.h>
+#include <btc/utils.h>
+
+#include "utest.h"
+
+static void test_addrman_address(btc_p2p_address* addr, uint8_t last_byte, uint16_t port, uint32_t time)
+{
+    btc_p2p_address_init(addr);
+    addr->ip[10] = 0xff;
+    addr->ip[11] = 0xff;
+    addr->ip[12] = 10;
+    addr->ip[13] = 0;
+    addr->ip[14] = 0;
+    addr->ip[15] = last_byte;
+    addr->port = port;
+    addr->time = time;
+    addr->services = 1;
+}
+
+void test_addrman()
+{
+    const uint64_t now = 1500000000;
+    btc_addrman* addrman = btc_addrman_new();
+    btc_p2p_address addr;
+
+    /* relayed addresses, refreshed but not duplicated */
+    for (uint8_t i = 1; i <= 8; i++) {
+        test_addrman_address(&addr, i, 8333, (uint32_t)(now - 3600));
+        u_assert_int_eq(btc_addrman_add(addrman, &addr, now), true);
+    }
+    test_addrman_address(&addr, 1, 8333, (uint32_t)(now - 60));
+    u_assert_int_eq(btc_addrman_add(addrman, &addr, now), false);
+    u_assert_int_eq(addrman->entries->len, 8);
+    u_assert_int_eq(btc_addrman_find(addrman, &addr)->addr.time, now - 60);
+
+    /* a relayed time in the future is clamped, stale and IPv6 addresses are ignored */
+    test_addrman_address(&addr, 9, 8333, (uint32_t)(now + 86400));
+    u_assert_int_eq(btc_addrman_add(addrman, &addr, now), true);
+    u_assert_int_eq(btc_addrman_find(addrman, &addr)->addr.time, now);
+    test_addrman_address(&addr, 10, 8333, (uint32_t)(now - BTC_ADDRMAN_HORIZON - 1));
+    u_assert_int_eq(btc_addrman_add(addrman, &addr, now), false);
+    test_addrman_address(&addr, 10, 8333, (uint32_t)now);
+    addr.ip[0] = 0x20;
+    addr.ip[1] = 0x01;
+    u_assert_int_eq(btc_addrman_add(addrman, &addr, now), false);
+    u_assert_int_eq(addrman->entries->len, 9);
+
+    /* peers 3 and 5 have been connected before, 5 synced faster */
+    test_addrman_address(&addr, 3, 8333, 0);
+    btc_addrman_attempt(addrman, &addr, now - 3000);
+    btc_addrman_good(addrman, &addr, now - 3000);
+    btc_addrman_set_score(addrman, &addr, 100);
+    test_addrman_address(&addr, 5, 8333, 0);
+    btc_addrman_attempt(addrman, &addr, now - 3000);
+    btc_addrman_good(addrman, &addr, now - 3000);
+    btc_addrman_set_score(addrman, &addr, 900);
+
+    /* peer 2 doesn't answer */
+    test_addrman_address(&addr, 2, 8333, 0);
+    for (int i = 0; i < 3; i++) {
+        btc_addrman_attempt(addrman, &addr, now - 3000);
+        btc_addrman_failed(addrman, &addr);
+    }
+
+    /* the fast peer first, a quarter of the slots for untried addresses */
+    vector* selected = vector_new(8, NULL);
+    u_assert_int_eq(btc_addrman_select(addrman, 4, now, selected), 4);
+    btc_p2p_address* first = vector_idx(selected, 0);
+    btc_p2p_address* second = vector_idx(selected, 1);
+    btc_p2p_address* third = vector_idx(selected, 2);
+    btc_p2p_address* fourth = vector_idx(selected, 3);
+    u_assert_int_eq(first->ip[15], 5);
+    u_assert_int_eq(second->ip[15], 3);
+    u_assert_int_eq(third->ip[15], 9);
+    u_assert_int_eq(fourth->ip[15], 1);
+    vector_free(selected, true);
+
+    /* the failing peer is never selected, recently tried ones are skipped */
+    selected = vector_new(8, NULL);
+    test_addrman_address(&addr, 4, 8333, 0);
+    btc_addrman_attempt(addrman, &addr, now);
+    u_assert_int_eq(btc_addrman_select(addrman, 20, now, selected), 7);
+    for (size_t i = 0; i < selected->len; i++) {
+        btc_p2p_address* sel = vector_idx(selected, i);
+        u_assert_int_eq(sel->ip[15] != 2 && sel->ip[15] != 4, true);
+    }
+    vector_free(selected, true);
+
+    /* a full addrman evicts the failing peer first, never the connected ones */
+    addrman->max_entries = 9;
+    test_addrman_address(&addr, 20, 8333, (uint32_t)now);
+    u_assert_int_eq(btc_addrman_add(addrman, &addr, now), true);
+    u_assert_int_eq(addrman->entries->len, 9);
+    test_addrman_address(&addr, 2, 8333, 0);
+    u_assert_is_null(btc_addrman_find(addrman, &addr));
+    test_addrman_address(&addr, 21, 8333, (uint32_t)now);
+    u_assert_int_eq(btc_addrman_add(addrman, &addr, now), true);
+    test_addrman_address(&addr, 3, 8333, 0);
+    u_assert_not_null(btc_addrman_find(addrman, &addr));
+    test_addrman_address(&addr, 5, 8333, 0);
+    u_assert_not_null(btc_addrman_find(addrman, &addr));
+    addrman->max_entries = BTC_ADDRMAN_MAX_ENTRIES;
+
+    /* roundtrip, bound to the network */
+    cstring* ser = cstr_new_sz(1024);
+    btc_addrman_serialize(addrman, btc_chainparams_main.netmagic, ser);
+    btc_addrman* restored = btc_addrman_new();
+    struct const_buffer buf = {ser->str, ser->len};
+    u_assert_int_eq(btc_addrman_deserialize(restored, btc_chainparams_test.netmagic, &buf, now), false);
+    u_assert_int_eq(btc_addrman_deserialize(restored, btc_chainparams_main.netmagic, &buf, now), true);
+    u_assert_int_eq(restored->entries->len, addrman->entries->len);
+    btc_addrman_entry* entry = btc_addrman_find(restored, &addr);
+    u_assert_not_null(entry);
+    u_assert_int_eq(entry->score, 900);
+    u_assert_int_eq(entry->successes, 1);
+    u_assert_int_eq(entry->last_success, now - 3000);
+    btc_addrman_free(restored);
+
+    /* a corrupted record is detected */
+    ser->str[ser->len / 2] ^= 0x01;
+    restored = btc_addrman_new();
+    struct const_buffer corrupted = {ser->str, ser->len};
+    u_assert_int_eq(btc_addrman_deserialize(restored, btc_chainparams_main.netmagic, &corrupted, now), false);
+    btc_addrman_free(restored);
+    cstr_free(ser, true);
+
+    /* file storage, a missing file gives an empty addrman */
+    const char* filename = "/tmp/libbtc_addrman_test.dat";
+    unlink(filename);
+    restored = btc_addrman_new();
+    u_assert_int_eq(btc_addrman_load(restored, btc_chainparams_main.netmagic, filename, now), true);
+    u_assert_int_eq(restored->entries->len, 0);
+    btc_addrman_free(restored);
+
+    u_assert_int_eq(btc_addrman_save(addrman, btc_chainparams_main.netmagic, filename), true);
+    u_assert_int_eq(addrman->dirty, false);
+    restored = btc_addrman_new();
+    u_assert_int_eq(btc_addrman_load(restored, btc_chainparams_main.netmagic, filename, now), true);
+    u_assert_int_eq(restored->entries->len, addrman->entries->len);
+    selected = vector_new(8, NULL);
+    u_assert_int_eq(btc_addrman_select(restored, 1, now, selected), 1);
+    first = vector_idx(selected, 0);
+    u_assert_int_eq(first->ip[15], 5);
+    vector_free(selected, true);
+
+    /* entries gone stale since the last run are dropped while loading */
+    btc_addrman_free(restored);
+    restored = btc_addrman_new();
+    u_assert_int_eq(btc_addrman_load(restored, btc_chainparams_main.netmagic, filename, now + BTC_ADDRMAN_HORIZON + 3600), true);
+    u_assert_int_eq(restored->entries->len, 0);
+    btc_addrman_free(restored);
+    unlink(filename);
+
+    btc_addrman_free(addrman);
+}
@@ -0,0 +1,98 @@
+/**********************************************************************
+ * Copyright (c) 2016 libbtc developers                               *
+ * Distributed under the MIT software license, see the accompanying   *
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.*
+ **********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <btc/blockfilter.h>
+#include <btc/utils.h>
+
+#include "utest.h"
+
+static void blockfilter_test_cstr_free(void* s)
+{
+    cstr_free(s, true);
+}
+
+void test_blockfilter()
+{
+    /* SipHash-2-4 reference vectors (key 00..0f, message 00..(n-1)) */
+    uint8_t data[15];
+    for (unsigned int i = 0; i < sizeof(data); i++)
+        data[i] = i;
+    u_assert_int_eq(btc_siphash(0x0706050403020100ULL, 0x0f0e0d0c0b0a0908ULL, data, 0) == 0x726fdb47dd0e0e31ULL, true);
+    u_assert_int_eq(btc_siphash(0x0706050403020100ULL, 0x0f0e0d0c0b0a0908ULL, data, 15) == 0xa129ca6149be45e5ULL, true);
+
+    /* BIP158 test vector, basic filter of the testnet genesis block */
+    btc_uint256 block_hash;
+    utils_uint256_sethex("000000000933ea01ad0ee984209779baaec3ced90fa3f408719526f8d77f4943", block_hash);
+    const char* script_hex = "4104678afdb0fe5548271967f1a67130b7105cd6a828e03909a67962e0ea1f61deb649f6bc3f4cef38c4f35504e51ec112de5c384df7ba0b8d578a4c702b6bf11d5fac";
+    uint8_t script[67];
+    int outlen = 0;
+    utils_hex_to_bin(script_hex, script, strlen(script_hex), &outlen);
+    u_assert_int_eq(outlen, 67);
+
+    vector* elements = vector_new(1, NULL);
+    cstring* genesis_script = cstr_new_buf(script, sizeof(script));
+    vector_add(elements, genesis_script);
+    cstring* filter = cstr_new_sz(16);
+    btc_blockfilter_build(block_hash, elements, filter);
+    char hex[128];
+    utils_bin_to_hex((unsigned char*)filter->str, filter->len, hex);
+    u_assert_str_eq(hex, "019dfca8");
+    u_assert_int_eq(btc_blockfilter_match(block_hash, (const uint8_t*)filter->str, filter->len, script, sizeof(script)), true);
+    u_assert_int_eq(btc_blockfilter_match(block_hash, (const uint8_t*)filter->str, filter->len, script, sizeof(script) - 1), false);
+
+    btc_uint256 filter_hash, prev_header, filter_header;
+    memset(prev_header, 0, sizeof(prev_header));
+    btc_blockfilter_hash((const uint8_t*)filter->str, filter->len, filter_hash);
+    btc_blockfilter_header(filter_hash, prev_header, filter_header);
+    btc_uint256 expected_header;
+    utils_uint256_sethex("21584579b7eb08997773e5aeff3a7f932700042d0ed2a6129012b7d7ae81b750", expected_header);
+    u_assert_mem_eq(filter_header, expected_header, sizeof(btc_uint256));
+    cstr_free(filter, true);
+    cstr_free(genesis_script, true);
+    vector_free(elements, true);
+
+    /* larger sets, every element matches, unknown ones (very likely) don't */
+    elements = vector_new(500, blockfilter_test_cstr_free);
+    vector* unknown = vector_new(100, blockfilter_test_cstr_free);
+    for (unsigned int i = 0; i < 600; i++) {
+        uint8_t element[25];
+        memset(element, (uint8_t)i, sizeof(element));
+        element[0] = (uint8_t)(i >> 8);
+        vector_add(i < 500 ? elements : unknown, cstr_new_buf(element, sizeof(element)));
+    }
+    filter = cstr_new_sz(1024);
+    btc_blockfilter_build(block_hash, elements, filter);
+    for (unsigned int i = 0; i < elements->len; i++) {
+        cstring* element = vector_idx(elements, i);
+        u_assert_int_eq(btc_blockfilter_match(block_hash, (const uint8_t*)filter->str, filter->len, (const uint8_t*)element->str, element->len), true);
+    }
+    for (unsigned int i = 0; i < unknown->len; i++) {
+        cstring* element = vector_idx(unknown, i);
+        u_assert_int_eq(btc_blockfilter_match(block_hash, (const uint8_t*)filter->str, filter->len, (const uint8_t*)element->str, element->len), false);
+    }
+
+    /* batch matching */
+    u_assert_int_eq(btc_blockfilter_match_any(block_hash, (const uint8_t*)filter->str, filter->len, unknown), false);
+    vector_add(unknown, cstr_new_cstr(vector_idx(elements, 250)));
+    u_assert_int_eq(btc_blockfilter_match_any(block_hash, (const uint8_t*)filter->str, filter->len, unknown), true);
+
+    /* a different block hash keys a different set */
+    block_hash[0] ^= 1;
+    u_assert_int_eq(btc_blockfilter_match_any(block_hash, (const uint8_t*)filter->str, filter->len, unknown), false);
+
+    /* empty and truncated filters never match */
+    uint8_t empty_filter[1] = {0};
+    u_assert_int_eq(btc_blockfilter_match_any(block_hash, empty_filter, sizeof(empty_filter), unknown), false);
+    u_assert_int_eq(btc_blockfilter_match(block_hash, (const uint8_t*)filter->str, 3, script, sizeof(script)), false);
+
+    cstr_free(filter, true);
+    vector_free(elements, true);
+    vector_free(unknown, true);
+}
@@ -0,0 +1,130 @@
+/**********************************************************************
+ * Copyright (c) 2016 libbtc developers                               *
+ * Distributed under the MIT software license, see the accompanying   *
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.*
+ **********************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <btc/blockstore.h>
+#include <btc/chainparams.h>
+#include <btc/hash.h>
+#include <btc/utils.h>
+
+#include "utest.h"
+
+#define BLOCKSTORE_TEST_DIR "/tmp/libbtc_blockstore_test"
+#define BLOCKSTORE_TEST_BLOCKS 20
+#define BLOCKSTORE_TEST_BLOCK_SIZE 100
+
+static void blockstore_test_block(uint32_t height, uint8_t* block, btc_uint256 hash)
+{
+    memset(block, (int)height, BLOCKSTORE_TEST_BLOCK_SIZE);
+    memcpy(block, &height, sizeof(height));
+    btc_hash(block, BLOCKSTORE_TEST_BLOCK_SIZE, hash);
+}
+
+static void blockstore_test_cleanup()
+{
+    char path[64];
+    for (unsigned int i = 0; i < 32; i++) {
+        snprintf(path, sizeof(path), "%s/blk%05u.dat", BLOCKSTORE_TEST_DIR, i);
+        unlink(path);
+    }
+    rmdir(BLOCKSTORE_TEST_DIR);
+}
+
+static btc_bool blockstore_test_has(btc_blockstore* store, uint32_t height)
+{
+    uint8_t block[BLOCKSTORE_TEST_BLOCK_SIZE];
+    btc_uint256 hash;
+    blockstore_test_block(height, block, hash);
+    const uint8_t* data = NULL;
+    size_t len = 0;
+    if (!btc_blockstore_get(store, hash, &data, &len))
+        return false;
+    return (len == sizeof(block) && memcmp(data, block, len) == 0);
+}
+
+void test_blockstore()
+{
+    uint8_t block[BLOCKSTORE_TEST_BLOCK_SIZE];
+    btc_uint256 hash;
+    blockstore_test_cleanup();
+
+    /* five blocks per file */
+    btc_blockstore* store = btc_blockstore_new(&btc_chainparams_main);
+    store->max_file_size = 5 * (BTC_BLOCKSTORE_RECORD_HDR_SIZE + BLOCKSTORE_TEST_BLOCK_SIZE);
+    u_assert_int_eq(btc_blockstore_open(store, BLOCKSTORE_TEST_DIR), true);
+    for (uint32_t height = 1; height <= BLOCKSTORE_TEST_BLOCKS; height++) {
+        blockstore_test_block(height, block, hash);
+        u_assert_int_eq(btc_blockstore_put(store, hash, height, block, sizeof(block)), true);
+        /* blocks are readable right after they have been written */
+        u_assert_int_eq(blockstore_test_has(store, height), true);
+    }
+    u_assert_int_eq(btc_blockstore_put(store, hash, BLOCKSTORE_TEST_BLOCKS, block, sizeof(block)), false);
+    u_assert_int_eq(store->current_file, 3);
+    u_assert_int_eq(blockstore_test_has(store, 1), true);
+    u_assert_int_eq(btc_blockstore_find(store, hash)->height, BLOCKSTORE_TEST_BLOCKS);
+    btc_blockstore_free(store);
+
+    /* the index is rebuilt when opening the store, a partially written record is dropped */
+    FILE* f = fopen(BLOCKSTORE_TEST_DIR "/blk00003.dat", "ab");
+    fwrite(block, 50, 1, f);
+    fclose(f);
+    store = btc_blockstore_new(&btc_chainparams_main);
+    store->max_file_size = 5 * (BTC_BLOCKSTORE_RECORD_HDR_SIZE + BLOCKSTORE_TEST_BLOCK_SIZE);
+    u_assert_int_eq(btc_blockstore_open(store, BLOCKSTORE_TEST_DIR), true);
+    u_assert_int_eq(store->entries->len, BLOCKSTORE_TEST_BLOCKS);
+    u_assert_int_eq(store->total_bytes, BLOCKSTORE_TEST_BLOCKS * (BTC_BLOCKSTORE_RECORD_HDR_SIZE + BLOCKSTORE_TEST_BLOCK_SIZE));
+    for (uint32_t height = 1; height <= BLOCKSTORE_TEST_BLOCKS; height++)
+        u_assert_int_eq(blockstore_test_has(store, height), true);
+    blockstore_test_block(BLOCKSTORE_TEST_BLOCKS + 1, block, hash);
+    u_assert_int_eq(btc_blockstore_put(store, hash, BLOCKSTORE_TEST_BLOCKS + 1, block, sizeof(block)), true);
+    u_assert_int_eq(blockstore_test_has(store, BLOCKSTORE_TEST_BLOCKS + 1), true);
+
+    /* lookup by height, a fork block at the same height comes after the first one */
+    vector* entries = vector_new(2, NULL);
+    u_assert_int_eq(btc_blockstore_find_height(store, 7, entries), 1);
+    u_assert_int_eq(((btc_blockstore_entry*)vector_idx(entries, 0))->height, 7);
+    memset(block, 0xfe, sizeof(block));
+    btc_uint256 forkhash;
+    btc_hash(block, sizeof(block), forkhash);
+    u_assert_int_eq(btc_blockstore_put(store, forkhash, 7, block, sizeof(block)), true);
+    vector_resize(entries, 0);
+    u_assert_int_eq(btc_blockstore_find_height(store, 7, entries), 2);
+    u_assert_mem_eq(((btc_blockstore_entry*)vector_idx(entries, 1))->hash, forkhash, BTC_HASH_LENGTH);
+    vector_resize(entries, 0);
+    u_assert_int_eq(btc_blockstore_find_height(store, BLOCKSTORE_TEST_BLOCKS + 2, entries), 0);
+
+    /* files with only blocks below the retention height are deleted */
+    btc_blockstore_set_retention(store, 8, 0);
+    u_assert_int_eq(store->first_file, 1);
+    u_assert_int_eq(blockstore_test_has(store, 5), false);
+    u_assert_int_eq(blockstore_test_has(store, 6), true);
+    vector_resize(entries, 0);
+    u_assert_int_eq(btc_blockstore_find_height(store, 5, entries), 0);
+    u_assert_int_eq(btc_blockstore_find_height(store, 6, entries), 1);
+    vector_free(entries, true);
+    u_assert_int_eq(access(BLOCKSTORE_TEST_DIR "/blk00000.dat", F_OK) == 0, false);
+
+    /* the oldest files are deleted to stay within the byte budget, never the one being written */
+    btc_blockstore_set_retention(store, 0, 8 * (BTC_BLOCKSTORE_RECORD_HDR_SIZE + BLOCKSTORE_TEST_BLOCK_SIZE));
+    u_assert_int_eq(store->first_file, 3);
+    u_assert_int_eq(blockstore_test_has(store, 15), false);
+    u_assert_int_eq(blockstore_test_has(store, 16), true);
+    btc_blockstore_set_retention(store, 0, 1);
+    u_assert_int_eq(store->first_file, 4);
+    u_assert_int_eq(store->entries->len, 2);
+    u_assert_int_eq(blockstore_test_has(store, BLOCKSTORE_TEST_BLOCKS + 1), true);
+    btc_blockstore_free(store);
+
+    /* the store belongs to a network */
+    store = btc_blockstore_new(&btc_chainparams_test);
+    u_assert_int_eq(btc_blockstore_open(store, BLOCKSTORE_TEST_DIR), false);
+    btc_blockstore_free(store);
+
+    blockstore_test_cleanup();
+}
@@ -0,0 +1,189 @@
+/**********************************************************************
+ * Copyright (c) 2016 libbtc developers                               *
+ * Distributed under the MIT software license, see the accompanying   *
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.*
+ **********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <btc/bloom.h>
+#include <btc/serialize.h>
+#include <btc/utils.h>
+
+#include "utest.h"
+
+static void bloom_test_serialized(const btc_bloom_filter* filter, const char* expected_hex)
+{
+    char hex[128];
+    cstring* ser = cstr_new_sz(32);
+    btc_bloom_filter_serialize(filter, ser);
+    utils_bin_to_hex((unsigned char*)ser->str, ser->len, hex);
+    u_assert_str_eq(hex, expected_hex);
+    cstr_free(ser, true);
+}
+
+/* build a partial merkle tree over total_tx txids, matching every match_every'th tx, and extract it again */
+static void bloom_test_partial_merkle_tree(uint32_t total_tx, uint32_t match_every)
+{
+    btc_uint256* txids = btc_calloc(total_tx, sizeof(btc_uint256));
+    btc_bool* matches = btc_calloc(total_tx, sizeof(btc_bool));
+    size_t expected_matches = 0;
+    for (uint32_t i = 0; i < total_tx; i++) {
+        memset(txids[i], 0, sizeof(btc_uint256));
+        memcpy(txids[i], &i, sizeof(i));
+        txids[i][31] = 0xab;
+        matches[i] = (match_every > 0 && i % match_every == 0);
+        if (matches[i])
+            expected_matches++;
+    }
+
+    /* the merkle root of the full tree (nothing matched) is the single hash */
+    btc_bool* none = btc_calloc(total_tx, sizeof(btc_bool));
+    cstring* full = cstr_new_sz(64);
+    btc_partial_merkle_tree_build(txids, none, total_tx, full);
+    u_assert_int_eq(full->len, 4 + 1 + 32 + 1 + 1);
+    btc_uint256 merkle_root;
+    memcpy(merkle_root, full->str + 5, sizeof(btc_uint256));
+
+    cstring* pmt = cstr_new_sz(1024);
+    btc_partial_merkle_tree_build(txids, matches, total_tx, pmt);
+    struct const_buffer buf = {pmt->str, pmt->len};
+    btc_uint256 root;
+    btc_uint256* extracted = NULL;
+    size_t extracted_count = 0;
+    u_assert_int_eq(btc_partial_merkle_tree_extract(&buf, root, &extracted, &extracted_count), true);
+    u_assert_mem_eq(root, merkle_root, sizeof(btc_uint256));
+    u_assert_int_eq(extracted_count, expected_matches);
+    for (size_t i = 0, j = 0; i < total_tx; i++) {
+        if (matches[i])
+            u_assert_mem_eq(extracted[j++], txids[i], sizeof(btc_uint256));
+    }
+    btc_free(extracted);
+
+    /* a modified hash changes the root */
+    pmt->str[10] ^= 1;
+    buf.p = pmt->str;
+    buf.len = pmt->len;
+    u_assert_int_eq(btc_partial_merkle_tree_extract(&buf, root, &extracted, &extracted_count), true);
+    u_assert_int_eq(memcmp(root, merkle_root, sizeof(btc_uint256)) != 0, true);
+    btc_free(extracted);
+
+    /* a truncated tree is rejected */
+    pmt->str[10] ^= 1;
+    buf.p = pmt->str;
+    buf.len = pmt->len - 1;
+    u_assert_int_eq(btc_partial_merkle_tree_extract(&buf, root, &extracted, &extracted_count), false);
+
+    cstr_free(pmt, true);
+    cstr_free(full, true);
+    btc_free(none);
+    btc_free(matches);
+    btc_free(txids);
+}
+
+void test_bloom()
+{
+    /* MurmurHash3 reference vectors */
+    uint8_t data[4] = {0x00, 0x11, 0x22, 0x33};
+    u_assert_uint32_eq(btc_murmur3(0x00000000, data, 0), 0x00000000);
+    u_assert_uint32_eq(btc_murmur3(0xFBA4C795, data, 0), 0x6a396f08);
+    u_assert_uint32_eq(btc_murmur3(0xffffffff, data, 0), 0x81f16f39);
+    u_assert_uint32_eq(btc_murmur3(0x00000000, data, 1), 0x514e28b7);
+    u_assert_uint32_eq(btc_murmur3(0xFBA4C795, data, 1), 0xea3f0b17);
+    u_assert_uint32_eq(btc_murmur3(0x00000000, data, 2), 0x16c6b7ab);
+    u_assert_uint32_eq(btc_murmur3(0x00000000, data, 3), 0x8eb51c3d);
+    u_assert_uint32_eq(btc_murmur3(0x00000000, data, 4), 0xb4471bf8);
+
+    /* BIP37 filter test vectors */
+    uint8_t element[20];
+    int outlen = 0;
+    btc_bloom_filter* filter = btc_bloom_filter_new(3, 0.01, 0, BTC_BLOOM_UPDATE_ALL);
+    utils_hex_to_bin("99108ad8ed9bb6274d3980bab5a85c048f0950c8", element, 40, &outlen);
+    btc_bloom_filter_insert(filter, element, sizeof(element));
+    u_assert_int_eq(btc_bloom_filter_contains(filter, element, sizeof(element)), true);
+    element[0] = 0x19;
+    u_assert_int_eq(btc_bloom_filter_contains(filter, element, sizeof(element)), false);
+    utils_hex_to_bin("b5a2c786d9ef4658287ced5914b37a1b4aa32eee", element, 40, &outlen);
+    btc_bloom_filter_insert(filter, element, sizeof(element));
+    utils_hex_to_bin("b9300670b4c5366e95b2699e8b18bc75e5f729c5", element, 40, &outlen);
+    btc_bloom_filter_insert(filter, element, sizeof(element));
+    u_assert_int_eq(btc_bloom_filter_contains(filter, element, sizeof(element)), true);
+    bloom_test_serialized(filter, "03614e9b050000000000000001");
+    btc_bloom_filter_free(filter);
+
+    filter = btc_bloom_filter_new(3, 0.01, 2147483649UL, BTC_BLOOM_UPDATE_ALL);
+    utils_hex_to_bin("99108ad8ed9bb6274d3980bab5a85c048f0950c8", element, 40, &outlen);
+    btc_bloom_filter_insert(filter, element, sizeof(element));
+    utils_hex_to_bin("b5a2c786d9ef4658287ced5914b37a1b4aa32eee", element, 40, &outlen);
+    btc_bloom_filter_insert(filter, element, sizeof(element));
+    utils_hex_to_bin("b9300670b4c5366e95b2699e8b18bc75e5f729c5", element, 40, &outlen);
+    btc_bloom_filter_insert(filter, element, sizeof(element));
+    bloom_test_serialized(filter, "03ce4299050000000100008001");
+    btc_bloom_filter_free(filter);
+
+    /* the size is limited */
+    filter = btc_bloom_filter_new(1000000, 0.0001, 0, BTC_BLOOM_UPDATE_NONE);
+    u_assert_int_eq(filter->size, BTC_BLOOM_MAX_FILTER_SIZE);
+    btc_bloom_filter_free(filter);
+
+    /* partial merkle trees of different shapes */
+    bloom_test_partial_merkle_tree(1, 1);
+    bloom_test_partial_merkle_tree(2, 2);
+    bloom_test_partial_merkle_tree(7, 3);
+    bloom_test_partial_merkle_tree(100, 7);
+    bloom_test_partial_merkle_tree(1000, 1);
+    bloom_test_partial_merkle_tree(4095, 500);
+
+    /* duplicated subtrees are rejected (CVE-2012-2459): 3 txs where the last one is repeated as 4th leaf */
+    btc_uint256 txids[4];
+    btc_bool all[4] = {true, true, true, true};
+    for (unsigned int i = 0; i < 4; i++) {
+        memset(txids[i], i + 1, sizeof(btc_uint256));
+    }
+    memcpy(txids[3], txids[2], sizeof(btc_uint256));
+    cstring* pmt = cstr_new_sz(256);
+    btc_partial_merkle_tree_build(txids, all, 4, pmt);
+    struct const_buffer buf = {pmt->str, pmt->len};
+    btc_uint256 root;
+    btc_uint256* extracted = NULL;
+    size_t extracted_count = 0;
+    u_assert_int_eq(btc_partial_merkle_tree_extract(&buf, root, &extracted, &extracted_count), false);
+    cstr_free(pmt, true);
+
+    /* merkle block with a header that commits to the tree */
+    btc_bool matches[4] = {false, true, false, false};
+    memset(txids[3], 4, sizeof(btc_uint256));
+    pmt = cstr_new_sz(256);
+    btc_partial_merkle_tree_build(txids, matches, 4, pmt);
+    btc_bool none[4] = {false, false, false, false};
+    cstring* full = cstr_new_sz(64);
+    btc_partial_merkle_tree_build(txids, none, 4, full);
+
+    btc_block_header header;
+    memset(&header, 0, sizeof(header));
+    header.version = 1;
+    memcpy(header.merkle_root, full->str + 5, sizeof(btc_uint256));
+    cstring* merkleblock = cstr_new_sz(512);
+    btc_block_header_serialize(merkleblock, &header);
+    cstr_append_buf(merkleblock, pmt->str, pmt->len);
+    btc_block_header header_out;
+    buf.p = merkleblock->str;
+    buf.len = merkleblock->len;
+    u_assert_int_eq(btc_merkleblock_deser(&header_out, &extracted, &extracted_count, &buf), true);
+    u_assert_int_eq(extracted_count, 1);
+    u_assert_mem_eq(extracted[0], txids[1], sizeof(btc_uint256));
+    btc_free(extracted);
+
+    /* wrong merkle root */
+    merkleblock->str[36] ^= 1;
+    buf.p = merkleblock->str;
+    buf.len = merkleblock->len;
+    u_assert_int_eq(btc_merkleblock_deser(&header_out, &extracted, &extracted_count, &buf), false);
+    u_assert_int_eq(extracted_count, 0);
+
+    cstr_free(merkleblock, true);
+    cstr_free(full, true);
+    cstr_free(pmt, true);
+}
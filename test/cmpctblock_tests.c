@@ -0,0 +1,151 @@
+/**********************************************************************
+ * Copyright (c) 2016 libbtc developers                               *
+ * Distributed under the MIT software license, see the accompanying   *
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.*
+ **********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <btc/cmpctblock.h>
+#include <btc/serialize.h>
+#include <btc/tx.h>
+#include <btc/utils.h>
+
+#include "utest.h"
+
+#define CMPCT_TEST_TXS 5
+
+void test_cmpctblock()
+{
+    /* merkle root of block 100000 */
+    const char* txids_hex[4] = {
+        "8c14f0db3df150123e6f3dbbf30f8b955a8249b62ac1d1ff16284aefa3d06d87",
+        "fff2525b8931402dd09222c50775608f75787bd2b87e56995a7bdd30f79702c4",
+        "6359f0868171b1d194cbee1af2f16ea598ae8fad666d9b012c8ed2b79a236ec4",
+        "e9a66845e05d5abc0ad04ec80f774a7e585c6e8db975962d069a522137b80c1d"};
+    uint8_t txids[4 * 32];
+    for (unsigned int i = 0; i < 4; i++)
+        utils_uint256_sethex((char*)txids_hex[i], txids + i * 32);
+    btc_uint256 root, expected_root;
+    btc_block_merkle_root(txids, 4, root);
+    utils_uint256_sethex("f3e94742aca4b5ef85488dc37c06c3282295ffec960994b2c0d5ac2a25a95766", expected_root);
+    u_assert_mem_eq(root, expected_root, sizeof(btc_uint256));
+
+    /* a block of a coinbase and four txs */
+    cstring* txs[CMPCT_TEST_TXS];
+    uint8_t block_txids[CMPCT_TEST_TXS * 32];
+    for (unsigned int i = 0; i < CMPCT_TEST_TXS; i++) {
+        btc_tx* tx = btc_tx_new();
+        btc_tx_in* tx_in = btc_tx_in_new();
+        tx_in->script_sig = cstr_new_sz(0);
+        vector_add(tx->vin, tx_in);
+        btc_tx_add_data_out(tx, 0, (const uint8_t*)&i, sizeof(i));
+        txs[i] = cstr_new_sz(64);
+        btc_tx_serialize(txs[i], tx, true);
+        btc_tx_hash(tx, block_txids + i * 32);
+        btc_tx_free(tx);
+    }
+    btc_block_header header;
+    memset(&header, 0, sizeof(header));
+    header.version = 1;
+    header.timestamp = 1296688602;
+    header.bits = 0x207fffff;
+    btc_block_merkle_root(block_txids, CMPCT_TEST_TXS, header.merkle_root);
+    cstring* block = cstr_new_sz(1024);
+    btc_block_header_serialize(block, &header);
+    ser_varlen(block, CMPCT_TEST_TXS);
+    for (unsigned int i = 0; i < CMPCT_TEST_TXS; i++)
+        cstr_append_cstr(block, txs[i]);
+
+    cstring* cmpctblock = cstr_new_sz(256);
+    u_assert_int_eq(btc_cmpctblock_build((const uint8_t*)block->str, block->len, 0x1122334455667788ULL, cmpctblock), true);
+    /* header, nonce, 4 short ids, the prefilled coinbase */
+    u_assert_int_eq(cmpctblock->len, 80 + 8 + 1 + 4 * BTC_CMPCTBLOCK_SHORTID_LEN + 1 + 1 + txs[0]->len);
+
+    /* the pool has two of the txs and an unrelated one */
+    btc_cmpct_txpool* pool = btc_cmpct_txpool_new(10);
+    u_assert_int_eq(btc_cmpct_txpool_add(pool, (const uint8_t*)txs[1]->str, txs[1]->len), true);
+    u_assert_int_eq(btc_cmpct_txpool_add(pool, (const uint8_t*)txs[1]->str, txs[1]->len), false);
+    u_assert_int_eq(btc_cmpct_txpool_add(pool, (const uint8_t*)txs[2]->str, txs[2]->len), true);
+    u_assert_int_eq(btc_cmpct_txpool_contains(pool, block_txids + 2 * 32), true);
+    u_assert_int_eq(btc_cmpct_txpool_contains(pool, block_txids + 3 * 32), false);
+
+    btc_cmpctblock* cb = btc_cmpctblock_new();
+    struct const_buffer buf = {cmpctblock->str, cmpctblock->len};
+    u_assert_int_eq(btc_cmpctblock_deser(cb, &buf, pool), true);
+    u_assert_int_eq(cb->tx_count, CMPCT_TEST_TXS);
+    u_assert_int_eq(cb->missing_count, 2);
+
+    /* the missing txs 3 and 4 are requested differentially encoded */
+    cstring* getblocktxn = cstr_new_sz(64);
+    btc_cmpctblock_getblocktxn(cb, getblocktxn);
+    u_assert_int_eq(getblocktxn->len, 32 + 3);
+    u_assert_int_eq(getblocktxn->str[32], 2);
+    u_assert_int_eq(getblocktxn->str[33], 3);
+    u_assert_int_eq(getblocktxn->str[34], 0);
+
+    cstring* reconstructed = cstr_new_sz(1024);
+    u_assert_int_eq(btc_cmpctblock_to_block(cb, reconstructed), false);
+
+    /* txs in the wrong order do not match the merkle root */
+    btc_cmpctblock* cb_wrong = btc_cmpctblock_new();
+    buf.p = cmpctblock->str;
+    buf.len = cmpctblock->len;
+    u_assert_int_eq(btc_cmpctblock_deser(cb_wrong, &buf, pool), true);
+    cstring* blocktxn = cstr_new_sz(256);
+    ser_u256(blocktxn, cb->hash);
+    ser_varlen(blocktxn, 2);
+    cstr_append_cstr(blocktxn, txs[4]);
+    cstr_append_cstr(blocktxn, txs[3]);
+    buf.p = blocktxn->str;
+    buf.len = blocktxn->len;
+    u_assert_int_eq(btc_cmpctblock_fill(cb_wrong, &buf), true);
+    u_assert_int_eq(btc_cmpctblock_to_block(cb_wrong, reconstructed), false);
+    btc_cmpctblock_free(cb_wrong);
+
+    cstr_resize(blocktxn, 0);
+    ser_u256(blocktxn, cb->hash);
+    ser_varlen(blocktxn, 2);
+    cstr_append_cstr(blocktxn, txs[3]);
+    cstr_append_cstr(blocktxn, txs[4]);
+    buf.p = blocktxn->str;
+    buf.len = blocktxn->len;
+    u_assert_int_eq(btc_cmpctblock_fill(cb, &buf), true);
+    u_assert_int_eq(btc_cmpctblock_to_block(cb, reconstructed), true);
+    u_assert_int_eq(reconstructed->len, block->len);
+    u_assert_mem_eq(reconstructed->str, block->str, block->len);
+    btc_cmpctblock_free(cb);
+
+    /* with all txs in the pool nothing is missing */
+    btc_cmpct_txpool_add(pool, (const uint8_t*)txs[3]->str, txs[3]->len);
+    btc_cmpct_txpool_add(pool, (const uint8_t*)txs[4]->str, txs[4]->len);
+    cb = btc_cmpctblock_new();
+    buf.p = cmpctblock->str;
+    buf.len = cmpctblock->len;
+    u_assert_int_eq(btc_cmpctblock_deser(cb, &buf, pool), true);
+    u_assert_int_eq(cb->missing_count, 0);
+    cstr_resize(reconstructed, 0);
+    u_assert_int_eq(btc_cmpctblock_to_block(cb, reconstructed), true);
+    u_assert_mem_eq(reconstructed->str, block->str, block->len);
+    btc_cmpctblock_free(cb);
+    btc_cmpct_txpool_free(pool);
+
+    /* the oldest txs are replaced once the pool is full */
+    pool = btc_cmpct_txpool_new(2);
+    for (unsigned int i = 0; i < 3; i++)
+        btc_cmpct_txpool_add(pool, (const uint8_t*)txs[i]->str, txs[i]->len);
+    u_assert_int_eq(pool->size, 2);
+    u_assert_int_eq(btc_cmpct_txpool_contains(pool, block_txids), false);
+    u_assert_int_eq(btc_cmpct_txpool_contains(pool, block_txids + 2 * 32), true);
+    btc_cmpct_txpool_free(pool);
+
+    cstr_free(blocktxn, true);
+    cstr_free(reconstructed, true);
+    cstr_free(getblocktxn, true);
+    cstr_free(cmpctblock, true);
+    cstr_free(block, true);
+    for (unsigned int i = 0; i < CMPCT_TEST_TXS; i++)
+        cstr_free(txs[i], true);
+}
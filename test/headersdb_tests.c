@@ -0,0 +1,537 @@
+/**********************************************************************
+ * Copyright (c) 2017 Jonas Schnelli                                  *
+ * Distributed under the MIT software license, see the accompanying   *
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.*
+ **********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <btc/block.h>
+#include <btc/blockchain.h>
+#include <btc/chainparams.h>
+#include <btc/headersdb_compact.h>
+#include <btc/headersdb_file.h>
+#include <btc/protocol.h>
+#include <btc/utils.h>
+
+#include "utest.h"
+
+/* connects a chain of (fake, no PoW) headers on top of the current tip */
+static btc_bool headersdb_test_build_chain(btc_headers_db* db, unsigned int amount, btc_uint256* hashes_out)
+{
+    btc_block_header header;
+    memset(&header, 0, sizeof(header));
+    header.version = 1;
+    for (unsigned int i = 0; i < amount; i++) {
+        btc_blockindex* tip = btc_headersdb_getchaintip(db);
+        memcpy(header.prev_block, tip->hash, BTC_HASH_LENGTH);
+        header.timestamp = 1231006505 + (tip->height + 1) * 600;
+        header.nonce = i;
+
+        cstring* s = cstr_new_sz(80);
+        btc_block_header_serialize(s, &header);
+        struct const_buffer buf = {s->str, s->len};
+        btc_bool connected = false;
+        btc_blockindex* pindex = btc_headers_db_connect_hdr(db, &buf, false, &connected);
+        cstr_free(s, true);
+        if (!pindex || !connected)
+            return false;
+        if (hashes_out)
+            memcpy(hashes_out[pindex->height], pindex->hash, BTC_HASH_LENGTH);
+    }
+    return true;
+}
+
+/* connects headers via a headers database interface on top of the given hash */
+static btc_bool headersdb_test_build_on(const btc_headers_db_interface* iface, void* db, const uint8_t* prev, uint32_t height, unsigned int amount, uint32_t nonce_base, btc_uint256* hashes_out)
+{
+    btc_block_header header;
+    btc_uint256 prevhash;
+    memset(&header, 0, sizeof(header));
+    header.version = 1;
+    memcpy(prevhash, prev, BTC_HASH_LENGTH);
+    for (unsigned int i = 0; i < amount; i++) {
+        memcpy(header.prev_block, prevhash, BTC_HASH_LENGTH);
+        header.timestamp = 1231006505 + (height + i + 1) * 600;
+        header.nonce = nonce_base + i;
+
+        cstring* s = cstr_new_sz(80);
+        btc_block_header_serialize(s, &header);
+        struct const_buffer buf = {s->str, s->len};
+        btc_bool connected = false;
+        btc_blockindex* pindex = iface->connect_hdr(db, &buf, false, &connected);
+        cstr_free(s, true);
+        if (!pindex || !connected || pindex->height != height + i + 1)
+            return false;
+        memcpy(prevhash, pindex->hash, BTC_HASH_LENGTH);
+        if (hashes_out)
+            memcpy(hashes_out[pindex->height], pindex->hash, BTC_HASH_LENGTH);
+    }
+    return true;
+}
+
+static btc_bool headersdb_test_connect(btc_headers_db* db, const btc_block_header* header)
+{
+    cstring* s = cstr_new_sz(80);
+    btc_block_header_serialize(s, header);
+    struct const_buffer buf = {s->str, s->len};
+    btc_bool connected = false;
+    btc_blockindex* pindex = btc_headers_db_connect_hdr(db, &buf, false, &connected);
+    cstr_free(s, true);
+    return (pindex && connected);
+}
+
+static btc_bool headersdb_test_connect_compact(btc_headers_db_compact* db, const btc_block_header* header)
+{
+    cstring* s = cstr_new_sz(80);
+    btc_block_header_serialize(s, header);
+    struct const_buffer buf = {s->str, s->len};
+    btc_bool connected = false;
+    btc_blockindex* pindex = btc_headers_db_compact_connect_hdr(db, &buf, false, &connected);
+    cstr_free(s, true);
+    return (pindex && connected);
+}
+
+static void test_headersdb_orphans()
+{
+    const unsigned int chainlen = 40;
+    btc_uint256 hashes[41];
+    btc_block_header headers[41];
+
+    btc_headers_db* src = btc_headers_db_new(&btc_chainparams_main, true);
+    btc_headers_db_set_mem_budget(src, 0);
+    u_assert_int_eq(headersdb_test_build_chain(src, chainlen, hashes), true);
+    btc_blockindex* tip = btc_headersdb_getchaintip(src);
+    for (unsigned int h = 1; h <= chainlen; h++)
+        btc_block_header_copy(&headers[h], &btc_headersdb_get_ancestor(src, tip, h)->header);
+    btc_headers_db_free(src);
+
+    btc_headers_db* db = btc_headers_db_new(&btc_chainparams_main, true);
+
+    /* headers 11-20 arrive first (reversed), then a duplicate */
+    for (unsigned int h = 20; h > 10; h--)
+        u_assert_int_eq(headersdb_test_connect(db, &headers[h]), false);
+    u_assert_int_eq(headersdb_test_connect(db, &headers[15]), false);
+    u_assert_int_eq(db->orphan_stats.count, 10);
+    u_assert_int_eq(db->orphan_stats.added, 10);
+    u_assert_int_eq(db->orphan_stats.duplicates, 1);
+    u_assert_int_eq(btc_headers_db_have_orphan(db, hashes[12]), true);
+    u_assert_int_eq(btc_headersdb_getchaintip(db)->height, 0);
+
+    /* the missing parents connect the orphans in a cascade */
+    for (unsigned int h = 1; h <= 10; h++)
+        u_assert_int_eq(headersdb_test_connect(db, &headers[h]), true);
+    tip = btc_headersdb_getchaintip(db);
+    u_assert_int_eq(tip->height, 20);
+    u_assert_mem_eq(tip->hash, hashes[20], BTC_HASH_LENGTH);
+    u_assert_int_eq(db->orphan_stats.count, 0);
+    u_assert_int_eq(db->orphan_stats.mem_bytes, 0);
+    u_assert_int_eq(db->orphan_stats.connected, 10);
+    u_assert_int_eq(btc_headers_db_have_orphan(db, hashes[12]), false);
+
+    /* size bound, the oldest orphans are evicted */
+    size_t mem_per_orphan;
+    u_assert_int_eq(headersdb_test_connect(db, &headers[40]), false);
+    mem_per_orphan = db->orphan_stats.mem_bytes;
+    btc_headers_db_set_orphan_limits(db, 5 * mem_per_orphan, BTC_HEADERS_DB_DEFAULT_ORPHAN_EXPIRE);
+    for (unsigned int h = 39; h > 22; h--)
+        u_assert_int_eq(headersdb_test_connect(db, &headers[h]), false);
+    u_assert_int_eq(db->orphan_stats.count, 5);
+    u_assert_int_eq(db->orphan_stats.evicted_size, 13);
+    u_assert_int_eq(btc_headers_db_have_orphan(db, hashes[40]), false);
+    u_assert_int_eq(btc_headers_db_have_orphan(db, hashes[23]), true);
+
+    /* the remaining orphans connect once the gap is filled */
+    u_assert_int_eq(headersdb_test_connect(db, &headers[21]), true);
+    u_assert_int_eq(headersdb_test_connect(db, &headers[22]), true);
+    u_assert_int_eq(btc_headersdb_getchaintip(db)->height, 27);
+    u_assert_int_eq(db->orphan_stats.count, 0);
+
+    /* age bound */
+    u_assert_int_eq(headersdb_test_connect(db, &headers[30]), false);
+    btc_headers_db_expire_orphans(db, time(NULL));
+    u_assert_int_eq(db->orphan_stats.count, 1);
+    btc_headers_db_expire_orphans(db, time(NULL) + BTC_HEADERS_DB_DEFAULT_ORPHAN_EXPIRE + 1);
+    u_assert_int_eq(db->orphan_stats.count, 0);
+    u_assert_int_eq(db->orphan_stats.evicted_age, 1);
+
+    btc_headers_db_free(db);
+
+    /* the compact database keeps orphans as well */
+    btc_headers_db_compact* cdb = btc_headers_db_compact_new(&btc_chainparams_main, true);
+    for (unsigned int h = 20; h > 10; h--)
+        u_assert_int_eq(headersdb_test_connect_compact(cdb, &headers[h]), false);
+    u_assert_int_eq(headersdb_test_connect_compact(cdb, &headers[15]), false);
+    u_assert_int_eq(cdb->orphans->len, 10);
+    u_assert_int_eq(btc_headers_db_compact_have_orphan(cdb, hashes[12]), true);
+    u_assert_int_eq(btc_headers_db_compact_getchaintip(cdb)->height, 0);
+    for (unsigned int h = 1; h <= 10; h++)
+        u_assert_int_eq(headersdb_test_connect_compact(cdb, &headers[h]), true);
+    u_assert_int_eq(btc_headers_db_compact_getchaintip(cdb)->height, 20);
+    u_assert_mem_eq(btc_headers_db_compact_getchaintip(cdb)->hash, hashes[20], BTC_HASH_LENGTH);
+    u_assert_int_eq(cdb->orphans->len, 0);
+
+    /* size and age bounds */
+    for (unsigned int h = 0; h < BTC_HEADERS_DB_COMPACT_MAX_ORPHANS + 5; h++) {
+        btc_block_header orphan;
+        btc_block_header_copy(&orphan, &headers[30]);
+        orphan.nonce = h;
+        u_assert_int_eq(headersdb_test_connect_compact(cdb, &orphan), false);
+    }
+    u_assert_int_eq(cdb->orphans->len, BTC_HEADERS_DB_COMPACT_MAX_ORPHANS);
+    btc_headers_db_compact_expire_orphans(cdb, time(NULL));
+    u_assert_int_eq(cdb->orphans->len, BTC_HEADERS_DB_COMPACT_MAX_ORPHANS);
+    btc_headers_db_compact_expire_orphans(cdb, time(NULL) + BTC_HEADERS_DB_COMPACT_ORPHAN_EXPIRE + 1);
+    u_assert_int_eq(cdb->orphans->len, 0);
+    btc_headers_db_compact_free(cdb);
+}
+
+static const char* snapshottmpfile = "/tmp/headers_snapshot_test";
+static const char* headerstmpfile = "/tmp/headers_db_test";
+
+static void test_headersdb_snapshot()
+{
+    const unsigned int chainlen = 300;
+    btc_uint256 hashes[301];
+
+    btc_headers_db* src = btc_headers_db_new(&btc_chainparams_main, true);
+    btc_headers_db_set_mem_budget(src, 0);
+    u_assert_int_eq(headersdb_test_build_chain(src, chainlen, hashes), true);
+    unlink(snapshottmpfile);
+    u_assert_int_eq(btc_headers_db_export_snapshot(src, &btc_chainparams_main, snapshottmpfile), true);
+    btc_headers_db_free(src);
+
+    /* import with a pinned final hash */
+    btc_headers_db* db = btc_headers_db_new(&btc_chainparams_main, true);
+    u_assert_int_eq(btc_headers_db_import_snapshot(db, &btc_chainparams_main, snapshottmpfile, hashes[chainlen]), true);
+    btc_blockindex* tip = btc_headersdb_getchaintip(db);
+    u_assert_int_eq(tip->height, chainlen);
+    u_assert_mem_eq(tip->hash, hashes[chainlen], BTC_HASH_LENGTH);
+    u_assert_mem_eq(btc_headersdb_get_ancestor(db, tip, tip->height - 5)->hash, hashes[chainlen - 5], BTC_HASH_LENGTH);
+    u_assert_mem_eq(btc_headers_db_interface_file.get_by_height(db, chainlen - 5)->hash, hashes[chainlen - 5], BTC_HASH_LENGTH);
+    u_assert_is_null(btc_headers_db_interface_file.get_by_height(db, chainlen + 1));
+    uint32_t lowest = btc_headers_db_interface_file.lowest_height(db);
+    u_assert_int_eq(lowest, db->chainbottom->height);
+    u_assert_mem_eq(btc_headers_db_interface_file.get_by_height(db, lowest)->hash, hashes[lowest], BTC_HASH_LENGTH);
+
+    /* the snapshot no longer connects to the tip */
+    u_assert_int_eq(btc_headers_db_import_snapshot(db, &btc_chainparams_main, snapshottmpfile, hashes[chainlen]), false);
+    btc_headers_db_free(db);
+
+    /* the compact in-memory database imports through the interface */
+    const btc_headers_db_interface* iface = &btc_headers_db_interface_compact;
+    btc_headers_db_compact* cdb = iface->init(&btc_chainparams_main, true);
+    u_assert_int_eq(iface->import_snapshot(cdb, &btc_chainparams_main, snapshottmpfile, hashes[chainlen - 1]), false);
+    u_assert_int_eq(iface->getchaintip(cdb)->height, 0);
+    u_assert_int_eq(iface->import_snapshot(cdb, &btc_chainparams_main, snapshottmpfile, hashes[chainlen]), true);
+    u_assert_int_eq(iface->getchaintip(cdb)->height, chainlen);
+    u_assert_mem_eq(iface->getchaintip(cdb)->hash, hashes[chainlen], BTC_HASH_LENGTH);
+    u_assert_mem_eq(btc_headers_db_compact_get(cdb, chainlen - 5)->hash, hashes[chainlen - 5], BTC_HASH_LENGTH);
+    u_assert_int_eq(btc_headers_db_compact_find(cdb, hashes[17])->height, 17);
+    u_assert_int_eq(iface->import_snapshot(cdb, &btc_chainparams_main, snapshottmpfile, hashes[chainlen]), false);
+    u_assert_int_eq(headersdb_test_build_on(iface, cdb, hashes[chainlen], chainlen, 1, chainlen, NULL), true);
+    u_assert_int_eq(iface->getchaintip(cdb)->height, chainlen + 1);
+    iface->free(cdb);
+
+    /* imported headers are stored in the database file */
+    unlink(headerstmpfile);
+    db = btc_headers_db_new(&btc_chainparams_main, false);
+    u_assert_int_eq(btc_headers_db_load(db, headerstmpfile), true);
+    u_assert_int_eq(btc_headers_db_import_snapshot(db, &btc_chainparams_main, snapshottmpfile, hashes[chainlen]), true);
+    btc_headers_db_free(db);
+    db = btc_headers_db_new(&btc_chainparams_main, false);
+    u_assert_int_eq(btc_headers_db_load(db, headerstmpfile), true);
+    u_assert_mem_eq(btc_headersdb_getchaintip(db)->hash, hashes[chainlen], BTC_HASH_LENGTH);
+    btc_headers_db_free(db);
+    unlink(headerstmpfile);
+
+    /* wrong pinned hash, no compiled-in checkpoint at that height, wrong network */
+    db = btc_headers_db_new(&btc_chainparams_main, true);
+    u_assert_int_eq(btc_headers_db_import_snapshot(db, &btc_chainparams_main, snapshottmpfile, hashes[chainlen - 1]), false);
+    u_assert_int_eq(btc_headers_db_import_snapshot(db, &btc_chainparams_main, snapshottmpfile, NULL), false);
+    u_assert_int_eq(btc_headersdb_getchaintip(db)->height, 0);
+    btc_headers_db_free(db);
+    db = btc_headers_db_new(&btc_chainparams_test, true);
+    u_assert_int_eq(btc_headers_db_import_snapshot(db, &btc_chainparams_test, snapshottmpfile, hashes[chainlen]), false);
+    btc_headers_db_free(db);
+
+    /* a modified header breaks the sequence */
+    FILE* file = fopen(snapshottmpfile, "r+b");
+    fseek(file, -200, SEEK_END);
+    fputc(0x42, file);
+    fclose(file);
+    db = btc_headers_db_new(&btc_chainparams_main, true);
+    u_assert_int_eq(btc_headers_db_import_snapshot(db, &btc_chainparams_main, snapshottmpfile, hashes[chainlen]), false);
+    u_assert_int_eq(btc_headersdb_getchaintip(db)->height, 0);
+    btc_headers_db_free(db);
+
+    /* a truncated snapshot is rejected before anything is connected */
+    u_assert_int_eq(truncate(snapshottmpfile, 52 + 100 * 80 + 40), 0);
+    db = btc_headers_db_new(&btc_chainparams_main, true);
+    u_assert_int_eq(btc_headers_db_import_snapshot(db, &btc_chainparams_main, snapshottmpfile, hashes[chainlen]), false);
+    u_assert_int_eq(btc_headersdb_getchaintip(db)->height, 0);
+    btc_headers_db_free(db);
+    unlink(snapshottmpfile);
+}
+
+static void test_headersdb_compact()
+{
+    const unsigned int chainlen = 20000;
+    const btc_headers_db_interface* iface = &btc_headers_db_interface_compact;
+    btc_uint256* hashes = btc_calloc(chainlen + 1, sizeof(btc_uint256));
+    btc_uint256* forkhashes = btc_calloc(chainlen + 2, sizeof(btc_uint256));
+    btc_uint256 locators[MAX_LOCATOR_SZ];
+
+    btc_headers_db_compact* db = iface->init(&btc_chainparams_main, true);
+    memcpy(hashes[0], btc_chainparams_main.genesisblockhash, BTC_HASH_LENGTH);
+    u_assert_int_eq(iface->has_checkpoint_start(db), false);
+    u_assert_int_eq(headersdb_test_build_on(iface, db, hashes[0], 0, chainlen, 0, hashes), true);
+
+    btc_blockindex* tip = iface->getchaintip(db);
+    u_assert_int_eq(tip->height, chainlen);
+    u_assert_mem_eq(tip->hash, hashes[chainlen], BTC_HASH_LENGTH);
+    u_assert_int_eq(db->hash_index_used, db->headers_count + 1);
+
+    /* lookups by hash and height */
+    for (unsigned int h = 0; h <= chainlen; h += 13) {
+        btc_blockindex* pindex = btc_headers_db_compact_find(db, hashes[h]);
+        u_assert_not_null(pindex);
+        u_assert_int_eq(pindex->height, h);
+        pindex = btc_headers_db_compact_get(db, h);
+        u_assert_mem_eq(pindex->hash, hashes[h], BTC_HASH_LENGTH);
+        if (h > 0)
+            u_assert_mem_eq(pindex->header.prev_block, hashes[h - 1], BTC_HASH_LENGTH);
+    }
+    u_assert_is_null(btc_headers_db_compact_get(db, chainlen + 1));
+    u_assert_int_eq(btc_headers_db_compact_find_height_by_time(db, 1231006505 + 1234 * 600), 1234);
+    u_assert_int_eq(btc_headers_db_compact_find_height_by_time(db, 1231006505 + 1234 * 600 - 1), 1234);
+    u_assert_int_eq(btc_headers_db_compact_find_height_by_time(db, 1231006505 + (chainlen + 1) * 600), -1);
+
+    /* must use less than half of the memory of the blockindex tree (calloc'ed index, tree node, malloc overhead) */
+    u_assert_int_eq(btc_headers_db_compact_mem_usage(db) < chainlen * (sizeof(btc_blockindex) + sizeof(struct btc_btree_node) + 4 * sizeof(void*)) / 2, true);
+
+    /* locator */
+    size_t count = iface->fill_blocklocator_tip(db, locators, MAX_LOCATOR_SZ);
+    for (unsigned int i = 0; i < 12; i++) {
+        u_assert_mem_eq(locators[i], hashes[chainlen - i], BTC_HASH_LENGTH);
+    }
+    u_assert_mem_eq(locators[12], hashes[chainlen - 13], BTC_HASH_LENGTH);
+    u_assert_mem_eq(locators[13], hashes[chainlen - 17], BTC_HASH_LENGTH);
+    u_assert_mem_eq(locators[count - 1], btc_chainparams_main.genesisblockhash, BTC_HASH_LENGTH);
+
+    /* disconnect and reconnect the tip */
+    u_assert_int_eq(iface->disconnect_tip(db), true);
+    tip = iface->getchaintip(db);
+    u_assert_int_eq(tip->height, chainlen - 1);
+    u_assert_is_null(btc_headers_db_compact_find(db, hashes[chainlen]));
+    u_assert_int_eq(headersdb_test_build_on(iface, db, hashes[chainlen - 1], chainlen - 1, 1, chainlen - 1, NULL), true);
+    u_assert_mem_eq(iface->getchaintip(db)->hash, hashes[chainlen], BTC_HASH_LENGTH);
+
+    /* a shorter fork does not change the tip, a longer one reorgs the chain */
+    memcpy(forkhashes[chainlen - 10], hashes[chainlen - 10], BTC_HASH_LENGTH);
+    u_assert_int_eq(headersdb_test_build_on(iface, db, hashes[chainlen - 10], chainlen - 10, 10, 1000000, forkhashes), true);
+    u_assert_mem_eq(iface->getchaintip(db)->hash, hashes[chainlen], BTC_HASH_LENGTH);
+    u_assert_is_null(btc_headers_db_compact_find(db, forkhashes[chainlen - 5]));
+    u_assert_int_eq(headersdb_test_build_on(iface, db, forkhashes[chainlen], chainlen, 1, 2000000, forkhashes), true);
+    tip = iface->getchaintip(db);
+    u_assert_int_eq(tip->height, chainlen + 1);
+    u_assert_mem_eq(tip->hash, forkhashes[chainlen + 1], BTC_HASH_LENGTH);
+    for (unsigned int h = chainlen - 9; h <= chainlen; h++) {
+        u_assert_mem_eq(btc_headers_db_compact_get(db, h)->hash, forkhashes[h], BTC_HASH_LENGTH);
+        u_assert_is_null(btc_headers_db_compact_find(db, hashes[h]));
+    }
+    u_assert_int_eq(btc_headers_db_compact_find(db, hashes[chainlen - 10])->height, chainlen - 10);
+
+    /* the header growing the hash index is indexed once, disconnecting it removes it from the index */
+    btc_headers_db_compact* growdb = iface->init(&btc_chainparams_main, true);
+    size_t grow_at = growdb->hash_index_size * 3 / 4;
+    u_assert_int_eq(headersdb_test_build_on(iface, growdb, hashes[0], 0, grow_at - 1, 0, NULL), true);
+    u_assert_int_eq(growdb->hash_index_size, 4096);
+    u_assert_int_eq(headersdb_test_build_on(iface, growdb, hashes[grow_at - 1], grow_at - 1, 1, grow_at - 1, NULL), true);
+    u_assert_int_eq(growdb->hash_index_size, 8192);
+    u_assert_int_eq(growdb->hash_index_used, grow_at + 1);
+    u_assert_int_eq(iface->disconnect_tip(growdb), true);
+    u_assert_int_eq(growdb->hash_index_used, grow_at);
+    u_assert_is_null(btc_headers_db_compact_find(growdb, hashes[grow_at]));
+    u_assert_int_eq(btc_headers_db_compact_find(growdb, hashes[grow_at - 1])->height, grow_at - 1);
+    iface->free(growdb);
+
+    /* checkpoint start resets the chain */
+    iface->set_checkpoint_start(db, hashes[16000], 16000);
+    u_assert_int_eq(iface->has_checkpoint_start(db), true);
+    u_assert_int_eq(iface->getchaintip(db)->height, 16000);
+    u_assert_int_eq(headersdb_test_build_on(iface, db, hashes[16000], 16000, 20, 16000, NULL), true);
+    count = iface->fill_blocklocator_tip(db, locators, MAX_LOCATOR_SZ);
+    u_assert_mem_eq(locators[count - 1], hashes[16000], BTC_HASH_LENGTH);
+    u_assert_is_null(btc_headers_db_compact_get(db, 15999));
+    u_assert_is_null(iface->get_by_height(db, 15999));
+    u_assert_mem_eq(iface->get_by_height(db, 16010)->hash, btc_headers_db_compact_get(db, 16011)->header.prev_block, BTC_HASH_LENGTH);
+    u_assert_int_eq(iface->lowest_height(db), 16000);
+    u_assert_mem_eq(btc_headers_db_compact_get(db, 16001)->header.prev_block, hashes[16000], BTC_HASH_LENGTH);
+
+    iface->free(db);
+    btc_free(forkhashes);
+    btc_free(hashes);
+}
+
+/* a fork branching at the chain bottom becomes longer than the main chain */
+static void test_headersdb_window_fork()
+{
+    const unsigned int chainlen = 50;
+    btc_uint256* hashes = btc_calloc(chainlen + 20, sizeof(btc_uint256));
+    btc_uint256* forkhashes = btc_calloc(chainlen + 20, sizeof(btc_uint256));
+    btc_uint256 sidehash;
+    const btc_headers_db_interface* iface = &btc_headers_db_interface_file;
+
+    btc_headers_db* db = btc_headers_db_new(&btc_chainparams_main, true);
+    btc_headers_db_set_mem_budget(db, 2 * 1024);
+    unsigned int window = db->max_hdr_in_mem;
+    u_assert_int_eq(window > 2 && window < chainlen, true);
+    u_assert_int_eq(headersdb_test_build_chain(db, chainlen, hashes), true);
+    uint32_t bottom = db->chainbottom->height;
+    u_assert_int_eq(bottom, chainlen - window + 1);
+
+    /* a side branch of the main chain, released with the branch it belongs to */
+    u_assert_int_eq(headersdb_test_build_on(iface, db, hashes[bottom + 2], bottom + 2, 1, 3000000, NULL), true);
+    u_assert_int_eq(db->fork_headers->len, 1);
+    memcpy(sidehash, ((btc_blockindex*)vector_idx(db->fork_headers, 0))->hash, BTC_HASH_LENGTH);
+
+    /* the fork reaches the height of the tip, then passes it */
+    memcpy(forkhashes[bottom], hashes[bottom], BTC_HASH_LENGTH);
+    u_assert_int_eq(headersdb_test_build_on(iface, db, hashes[bottom], bottom, chainlen - bottom, 1000000, forkhashes), true);
+    u_assert_mem_eq(btc_headersdb_getchaintip(db)->hash, hashes[chainlen], BTC_HASH_LENGTH);
+    u_assert_int_eq(headersdb_test_build_on(iface, db, forkhashes[chainlen], chainlen, 1, 2000000, forkhashes), true);
+
+    btc_blockindex* tip = btc_headersdb_getchaintip(db);
+    u_assert_int_eq(tip->height, chainlen + 1);
+    u_assert_mem_eq(tip->hash, forkhashes[chainlen + 1], BTC_HASH_LENGTH);
+    u_assert_int_eq(db->chainbottom->height, bottom + 1);
+    u_assert_is_null(db->chainbottom->prev);
+    for (unsigned int h = bottom + 1; h <= chainlen + 1; h++) {
+        u_assert_mem_eq(btc_headersdb_get_ancestor(db, tip, h)->hash, forkhashes[h], BTC_HASH_LENGTH);
+    }
+
+    /* the old branch, its side branch and the old bottom are no longer in memory */
+    for (unsigned int h = bottom; h <= chainlen; h++) {
+        u_assert_is_null(btc_headersdb_find(db, hashes[h]));
+    }
+    u_assert_is_null(btc_headersdb_find(db, sidehash));
+    u_assert_int_eq(db->fork_headers->len, 0);
+
+    /* the window keeps following the new chain */
+    u_assert_int_eq(headersdb_test_build_on(iface, db, forkhashes[chainlen + 1], chainlen + 1, 10, 2000001, forkhashes), true);
+    tip = btc_headersdb_getchaintip(db);
+    u_assert_int_eq(tip->height - db->chainbottom->height + 1, window);
+    u_assert_mem_eq(btc_headersdb_get_ancestor(db, tip, db->chainbottom->height)->hash, forkhashes[db->chainbottom->height], BTC_HASH_LENGTH);
+
+    /* disconnecting a header releases the forks on top of it */
+    u_assert_int_eq(headersdb_test_build_on(iface, db, forkhashes[tip->height - 1], tip->height - 1, 1, 4000000, NULL), true);
+    btc_headersdb_disconnect_tip(db);
+    u_assert_int_eq(db->fork_headers->len, 1);
+    btc_headersdb_disconnect_tip(db);
+    u_assert_int_eq(db->fork_headers->len, 0);
+    btc_headers_db_free(db);
+
+    btc_free(forkhashes);
+    btc_free(hashes);
+}
+
+void test_headersdb()
+{
+    const unsigned int chainlen = 2000;
+    btc_uint256* hashes = btc_calloc(chainlen + 1, sizeof(btc_uint256));
+    btc_uint256 locators[MAX_LOCATOR_SZ];
+
+    /* full in-memory chain */
+    btc_headers_db* db = btc_headers_db_new(&btc_chainparams_main, true);
+    btc_headers_db_set_mem_budget(db, 0);
+    memcpy(hashes[0], btc_chainparams_main.genesisblockhash, BTC_HASH_LENGTH);
+    u_assert_int_eq(headersdb_test_build_chain(db, chainlen, hashes), true);
+
+    btc_blockindex* tip = btc_headersdb_getchaintip(db);
+    u_assert_int_eq(tip->height, chainlen);
+
+    /* ancestor lookups via skip pointers */
+    for (unsigned int h = 0; h <= chainlen; h += 7) {
+        btc_blockindex* ancestor = btc_headersdb_get_ancestor(db, tip, h);
+        u_assert_not_null(ancestor);
+        u_assert_int_eq(ancestor->height, h);
+        u_assert_mem_eq(ancestor->hash, hashes[h], BTC_HASH_LENGTH);
+    }
+    u_assert_is_null(btc_headersdb_get_ancestor(db, tip, chainlen + 1));
+    btc_blockindex* mid = btc_headersdb_get_ancestor(db, tip, 1234);
+    u_assert_mem_eq(btc_headersdb_get_ancestor(db, mid, 1000)->hash, hashes[1000], BTC_HASH_LENGTH);
+
+    /* exponential block locator, first 12 entries back-to-back */
+    size_t count = btc_headers_db_fill_block_locator(db, locators, MAX_LOCATOR_SZ);
+    u_assert_int_eq(count > 11, true);
+    u_assert_int_eq(count < 32, true);
+    for (unsigned int i = 0; i < 12; i++) {
+        u_assert_mem_eq(locators[i], hashes[chainlen - i], BTC_HASH_LENGTH);
+    }
+    u_assert_mem_eq(locators[12], hashes[chainlen - 13], BTC_HASH_LENGTH);
+    u_assert_mem_eq(locators[13], hashes[chainlen - 17], BTC_HASH_LENGTH);
+    u_assert_mem_eq(locators[count - 1], btc_chainparams_main.genesisblockhash, BTC_HASH_LENGTH);
+
+    /* the locator must end with the genesis even if the array is too small */
+    count = btc_headers_db_fill_block_locator(db, locators, 5);
+    u_assert_int_eq(count, 5);
+    u_assert_mem_eq(locators[0], hashes[chainlen], BTC_HASH_LENGTH);
+    u_assert_mem_eq(locators[4], btc_chainparams_main.genesisblockhash, BTC_HASH_LENGTH);
+    btc_headers_db_free(db);
+
+    /* pruned chain (only a window of headers in memory) */
+    db = btc_headers_db_new(&btc_chainparams_main, true);
+    u_assert_int_eq(headersdb_test_build_chain(db, 500, hashes), true);
+    tip = btc_headersdb_getchaintip(db);
+    u_assert_int_eq(db->chainbottom->height > 0, true);
+    u_assert_is_null(btc_headersdb_get_ancestor(db, tip, db->chainbottom->height - 1));
+    u_assert_mem_eq(btc_headersdb_get_ancestor(db, tip, db->chainbottom->height)->hash, hashes[db->chainbottom->height], BTC_HASH_LENGTH);
+    count = btc_headers_db_fill_block_locator(db, locators, MAX_LOCATOR_SZ);
+    u_assert_mem_eq(locators[count - 1], db->chainbottom->hash, BTC_HASH_LENGTH);
+    btc_headers_db_free(db);
+
+    /* window sized by a memory budget */
+    db = btc_headers_db_new(&btc_chainparams_main, true);
+    btc_headers_db_set_mem_budget(db, 10 * 1024);
+    unsigned int window = db->max_hdr_in_mem;
+    u_assert_int_eq(window > 10 && window < 100, true);
+    u_assert_int_eq(headersdb_test_build_chain(db, 300, hashes), true);
+    tip = btc_headersdb_getchaintip(db);
+    u_assert_int_eq(tip->height - db->chainbottom->height + 1, window);
+    u_assert_is_null(db->chainbottom->prev);
+
+    /* switch to a longer fork, window must follow the fork */
+    btc_headersdb_disconnect_tip(db);
+    btc_headersdb_disconnect_tip(db);
+    u_assert_int_eq(headersdb_test_build_chain(db, 5, hashes), true);
+    tip = btc_headersdb_getchaintip(db);
+    u_assert_int_eq(tip->height, 303);
+    u_assert_int_eq(tip->height - db->chainbottom->height + 1, window);
+    for (unsigned int h = db->chainbottom->height; h <= tip->height; h++) {
+        u_assert_mem_eq(btc_headersdb_get_ancestor(db, tip, h)->hash, hashes[h], BTC_HASH_LENGTH);
+    }
+
+    /* shrinking the budget drops the oldest headers */
+    btc_headers_db_set_mem_budget(db, 2 * 1024);
+    u_assert_int_eq(db->max_hdr_in_mem < window, true);
+    u_assert_int_eq(tip->height - db->chainbottom->height + 1, db->max_hdr_in_mem);
+    u_assert_int_eq(headersdb_test_build_chain(db, 50, hashes), true);
+    tip = btc_headersdb_getchaintip(db);
+    u_assert_int_eq(tip->height - db->chainbottom->height + 1, db->max_hdr_in_mem);
+    u_assert_mem_eq(btc_headersdb_get_ancestor(db, tip, db->chainbottom->height)->hash, hashes[db->chainbottom->height], BTC_HASH_LENGTH);
+    btc_headers_db_free(db);
+
+    test_headersdb_window_fork();
+
+    btc_free(hashes);
+
+    test_headersdb_orphans();
+    test_headersdb_snapshot();
+    test_headersdb_compact();
+}
@@ -1,10 +1,24 @@
 #include "utest.h"
 #include <btc/block.h>
+#include <btc/hash.h>
 #include <btc/net.h>
 #include <btc/utils.h>
 #include <btc/serialize.h>
 #include <btc/tx.h>
 
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/dns.h>
+#include <event2/dns_struct.h>
+#include <event2/listener.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
 static btc_bool timer_cb(btc_node *node, uint64_t *now)
 {
     if (node->time_started_con + 300 < *now)
@@ -199,3 +213,1082 @@ void test_net_basics_plus_download_block()
     /* cleanup */
     btc_node_group_free(group); //will also free the nodes structures from the heap
 }
+
+/* local peer feeding messages through a loopback connection */
+static const unsigned int recv_test_block_size = 300000;
+static const char* recv_test_commands[] = {"ping", "block", "headers", "pong"};
+static unsigned int recv_test_count = 0;
+static btc_bool recv_test_valid = true;
+static btc_bool recv_test_corrupt = false;
+static uint32_t recv_test_node_state = 0;
+static size_t recv_test_node_pending = 0;
+static struct bufferevent* recv_test_peer_bev = NULL;
+
+static void recv_test_accept_cb(struct evconnlistener* listener, evutil_socket_t fd, struct sockaddr* addr, int socklen, void* ctx)
+{
+    (void)(addr);
+    (void)(socklen);
+    btc_node_group* group = ctx;
+    recv_test_peer_bev = bufferevent_socket_new(evconnlistener_get_base(listener), fd, BEV_OPT_CLOSE_ON_FREE);
+
+    /* multiple messages in a single write, a large one spanning many reads */
+    uint8_t* payload = btc_malloc(recv_test_block_size);
+    for (unsigned int i = 0; i < recv_test_block_size; i++)
+        payload[i] = (uint8_t)i;
+    for (unsigned int i = 0; i < sizeof(recv_test_commands) / sizeof(recv_test_commands[0]); i++) {
+        size_t len = (i == 1) ? recv_test_block_size : (i == 2 ? 0 : 8);
+        cstring* msg = btc_p2p_message_new(group->chainparams->netmagic, recv_test_commands[i], payload, len);
+        if (recv_test_corrupt && i == 3) {
+            /* flip a payload bit of the last message */
+            msg->str[msg->len - 1] ^= 1;
+        }
+        bufferevent_write(recv_test_peer_bev, msg->str, msg->len);
+        cstr_free(msg, true);
+    }
+    btc_free(payload);
+    bufferevent_enable(recv_test_peer_bev, EV_WRITE);
+}
+
+static btc_bool recv_test_parse_cmd(struct btc_node_ *node, btc_p2p_msg_hdr *hdr, struct const_buffer *buf)
+{
+    size_t expected_len = (recv_test_count == 1) ? recv_test_block_size : (recv_test_count == 2 ? 0 : 8);
+    if (recv_test_count >= sizeof(recv_test_commands) / sizeof(recv_test_commands[0]) ||
+        strcmp(hdr->command, recv_test_commands[recv_test_count]) != 0 ||
+        hdr->data_len != expected_len || buf->len != expected_len) {
+        recv_test_valid = false;
+    }
+    for (size_t i = 0; i < buf->len && recv_test_valid; i++) {
+        if (((const uint8_t*)buf->p)[i] != (uint8_t)i)
+            recv_test_valid = false;
+    }
+    recv_test_count++;
+    if (recv_test_count == sizeof(recv_test_commands) / sizeof(recv_test_commands[0]))
+        event_base_loopexit(node->nodegroup->event_base, NULL);
+
+    /* skip the internal logic */
+    return false;
+}
+
+static void recv_test_state_changed(struct btc_node_ *node)
+{
+    if ((node->state & NODE_MISSBEHAVED) == NODE_MISSBEHAVED)
+        event_base_loopexit(node->nodegroup->event_base, NULL);
+}
+
+static void recv_test_run(unsigned int verify_threads, btc_bool corrupt)
+{
+    recv_test_count = 0;
+    recv_test_valid = true;
+    recv_test_corrupt = corrupt;
+    recv_test_peer_bev = NULL;
+
+    btc_node_group* group = btc_node_group_new(NULL);
+    group->desired_amount_connected_nodes = 1;
+    group->parse_cmd_cb = recv_test_parse_cmd;
+    group->node_connection_state_changed_cb = recv_test_state_changed;
+    if (!btc_node_group_set_verify_threads(group, verify_threads))
+        recv_test_valid = false;
+
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sin.sin_port = 0;
+    struct evconnlistener* listener = evconnlistener_new_bind(group->event_base, recv_test_accept_cb, group, LEV_OPT_REUSEABLE | LEV_OPT_CLOSE_ON_FREE, -1, (struct sockaddr*)&sin, sizeof(sin));
+    socklen_t sinlen = sizeof(sin);
+    getsockname(evconnlistener_get_fd(listener), (struct sockaddr*)&sin, &sinlen);
+
+    char ipport[32];
+    sprintf(ipport, "127.0.0.1:%d", ntohs(sin.sin_port));
+    btc_node* node = btc_node_new();
+    btc_node_set_ipport(node, ipport);
+    btc_node_group_add_node(group, node);
+    btc_node_group_connect_next_nodes(group);
+
+    struct timeval tv = {10, 0};
+    event_base_loopexit(group->event_base, &tv);
+    btc_node_group_event_loop(group);
+
+    recv_test_node_state = node->state;
+    recv_test_node_pending = node->recv_pending_bytes;
+    btc_node_group_shutdown(group);
+    if (recv_test_peer_bev)
+        bufferevent_free(recv_test_peer_bev);
+    evconnlistener_free(listener);
+    btc_node_group_free(group);
+}
+
+void test_net_recv_framing()
+{
+    /* checksums verified on the event loop and by worker threads */
+    for (unsigned int threads = 0; threads <= 2; threads += 2) {
+        recv_test_run(threads, false);
+        u_assert_int_eq(recv_test_valid, true);
+        u_assert_int_eq(recv_test_count, 4);
+        u_assert_int_eq(recv_test_node_state & NODE_MISSBEHAVED, 0);
+        u_assert_int_eq(recv_test_node_pending, 0);
+
+        /* a corrupted payload is not passed to the parser */
+        recv_test_run(threads, true);
+        u_assert_int_eq(recv_test_valid, true);
+        u_assert_int_eq(recv_test_count, 3);
+        u_assert_int_eq(recv_test_node_state & NODE_MISSBEHAVED, NODE_MISSBEHAVED);
+    }
+}
+
+/* local peers feeding sequenced messages to nodes spread over multiple shards */
+#define SHARD_TEST_NODES 4
+static const unsigned int shard_test_messages = 50;
+static unsigned int shard_test_received[SHARD_TEST_NODES];
+static unsigned int shard_test_total = 0;
+static unsigned int shard_test_echos = 0;
+static btc_bool shard_test_valid = true;
+static int shard_test_parsed_on_main = 0;
+static int shard_test_state_changes = 0;
+static pthread_t shard_test_main_thread;
+static struct bufferevent* shard_test_peer_bevs[SHARD_TEST_NODES];
+static unsigned int shard_test_peers = 0;
+
+static void shard_test_check_done(btc_node_group* group)
+{
+    if (shard_test_total == SHARD_TEST_NODES * shard_test_messages && shard_test_echos == SHARD_TEST_NODES)
+        btc_node_group_shutdown(group);
+}
+
+static void shard_test_peer_read_cb(struct bufferevent* bev, void* ctx)
+{
+    /* the nodes also send their version message */
+    struct evbuffer* input = bufferevent_get_input(bev);
+    while (evbuffer_get_length(input) >= BTC_P2P_HDRSZ) {
+        unsigned char hdr_data[BTC_P2P_HDRSZ];
+        struct const_buffer hdr_buf = {hdr_data, BTC_P2P_HDRSZ};
+        btc_p2p_msg_hdr hdr;
+        evbuffer_copyout(input, hdr_data, BTC_P2P_HDRSZ);
+        btc_p2p_deser_msghdr(&hdr, &hdr_buf);
+        if (evbuffer_get_length(input) < BTC_P2P_HDRSZ + hdr.data_len)
+            break;
+        if (strcmp(hdr.command, "echo") == 0)
+            shard_test_echos++;
+        evbuffer_drain(input, BTC_P2P_HDRSZ + hdr.data_len);
+    }
+    shard_test_check_done((btc_node_group*)ctx);
+}
+
+static void shard_test_accept_cb(struct evconnlistener* listener, evutil_socket_t fd, struct sockaddr* addr, int socklen, void* ctx)
+{
+    (void)(addr);
+    (void)(socklen);
+    btc_node_group* group = ctx;
+    if (shard_test_peers >= SHARD_TEST_NODES) {
+        evutil_closesocket(fd);
+        return;
+    }
+    struct bufferevent* bev = bufferevent_socket_new(evconnlistener_get_base(listener), fd, BEV_OPT_CLOSE_ON_FREE);
+    shard_test_peer_bevs[shard_test_peers++] = bev;
+    bufferevent_setcb(bev, shard_test_peer_read_cb, NULL, NULL, group);
+    for (uint32_t i = 0; i < shard_test_messages; i++) {
+        cstring* msg = btc_p2p_message_new(group->chainparams->netmagic, "seq", &i, sizeof(i));
+        bufferevent_write(bev, msg->str, msg->len);
+        cstr_free(msg, true);
+    }
+    bufferevent_enable(bev, EV_READ | EV_WRITE);
+}
+
+static btc_bool shard_test_parse_cmd(struct btc_node_ *node, btc_p2p_msg_hdr *hdr, struct const_buffer *buf)
+{
+    (void)(node);
+    (void)(hdr);
+    (void)(buf);
+    if (pthread_equal(pthread_self(), shard_test_main_thread))
+        __atomic_add_fetch(&shard_test_parsed_on_main, 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+static void shard_test_postcmd(struct btc_node_ *node, btc_p2p_msg_hdr *hdr, struct const_buffer *buf)
+{
+    /* application callbacks run on the event loop thread, in order per node */
+    uint32_t seq = 0;
+    if (!pthread_equal(pthread_self(), shard_test_main_thread) ||
+        strcmp(hdr->command, "seq") != 0 || node->nodeid < 1 || node->nodeid > SHARD_TEST_NODES ||
+        !deser_u32(&seq, buf) || seq != shard_test_received[node->nodeid - 1]) {
+        shard_test_valid = false;
+        return;
+    }
+    if (seq == 0) {
+        /* send from the event loop thread, the nodes shard writes it */
+        cstring* echo = btc_p2p_message_new(node->nodegroup->chainparams->netmagic, "echo", NULL, 0);
+        btc_node_send(node, echo);
+        cstr_free(echo, true);
+    }
+    shard_test_received[node->nodeid - 1]++;
+    shard_test_total++;
+    shard_test_check_done(node->nodegroup);
+}
+
+static void shard_test_state_changed(struct btc_node_ *node)
+{
+    (void)(node);
+    if (!pthread_equal(pthread_self(), shard_test_main_thread))
+        shard_test_valid = false;
+    shard_test_state_changes++;
+}
+
+void test_net_shards()
+{
+    memset(shard_test_received, 0, sizeof(shard_test_received));
+    shard_test_main_thread = pthread_self();
+
+    btc_node_group* group = btc_node_group_new(NULL);
+    u_assert_int_eq(btc_node_group_set_shards(group, 2), true);
+    u_assert_int_eq(btc_node_group_set_verify_threads(group, 2), false);
+    group->desired_amount_connected_nodes = SHARD_TEST_NODES;
+    group->parse_cmd_cb = shard_test_parse_cmd;
+    group->postcmd_cb = shard_test_postcmd;
+    group->node_connection_state_changed_cb = shard_test_state_changed;
+
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sin.sin_port = 0;
+    struct evconnlistener* listener = evconnlistener_new_bind(group->event_base, shard_test_accept_cb, group, LEV_OPT_REUSEABLE | LEV_OPT_CLOSE_ON_FREE, -1, (struct sockaddr*)&sin, sizeof(sin));
+    socklen_t sinlen = sizeof(sin);
+    getsockname(evconnlistener_get_fd(listener), (struct sockaddr*)&sin, &sinlen);
+
+    char ipport[32];
+    sprintf(ipport, "127.0.0.1:%d", ntohs(sin.sin_port));
+    btc_node* nodes[SHARD_TEST_NODES];
+    for (unsigned int i = 0; i < SHARD_TEST_NODES; i++) {
+        nodes[i] = btc_node_new();
+        btc_node_set_ipport(nodes[i], ipport);
+        btc_node_group_add_node(group, nodes[i]);
+    }
+    btc_node_group_connect_next_nodes(group);
+
+    struct timeval tv = {10, 0};
+    event_base_loopexit(group->event_base, &tv);
+    btc_node_group_event_loop(group);
+
+    u_assert_int_eq(shard_test_valid, true);
+    u_assert_int_eq(shard_test_total, SHARD_TEST_NODES * shard_test_messages);
+    u_assert_int_eq(shard_test_echos, SHARD_TEST_NODES);
+    u_assert_int_eq(shard_test_parsed_on_main, 0);
+    u_assert_int_eq(shard_test_state_changes >= SHARD_TEST_NODES, true);
+    for (unsigned int i = 0; i < SHARD_TEST_NODES; i++) {
+        u_assert_int_eq(shard_test_received[i], shard_test_messages);
+        u_assert_int_eq(nodes[i]->state & NODE_CONNECTED, 0);
+        u_assert_int_eq(nodes[i]->state & NODE_DISCONNECTED, NODE_DISCONNECTED);
+    }
+
+    for (unsigned int i = 0; i < shard_test_peers; i++)
+        bufferevent_free(shard_test_peer_bevs[i]);
+    evconnlistener_free(listener);
+    btc_node_group_free(group);
+}
+
+/* local peer that stops reading until the node paused its producers */
+static const unsigned int send_test_small = 100;
+static const size_t send_test_big_size = 200000;
+static unsigned int send_test_big_sent = 0;
+static unsigned int send_test_small_received = 0;
+static unsigned int send_test_big_received = 0;
+static btc_bool send_test_coalesced = false;
+static int send_test_paused = 0;
+static int send_test_resumed = 0;
+static struct bufferevent* send_test_peer_bev = NULL;
+/* messages framed from payload parts (btc_node_send_message) */
+static const unsigned int send_test_framed = 2;
+static unsigned int send_test_framed_received = 0;
+static btc_bool send_test_framed_valid = true;
+
+static void send_test_peer_read_cb(struct bufferevent* bev, void* ctx)
+{
+    struct evbuffer* input = bufferevent_get_input(bev);
+    while (evbuffer_get_length(input) >= BTC_P2P_HDRSZ) {
+        unsigned char hdr_data[BTC_P2P_HDRSZ];
+        struct const_buffer hdr_buf = {hdr_data, BTC_P2P_HDRSZ};
+        btc_p2p_msg_hdr hdr;
+        evbuffer_copyout(input, hdr_data, BTC_P2P_HDRSZ);
+        btc_p2p_deser_msghdr(&hdr, &hdr_buf);
+        if (evbuffer_get_length(input) < BTC_P2P_HDRSZ + hdr.data_len)
+            break;
+        if (strcmp(hdr.command, "small") == 0)
+            send_test_small_received++;
+        if (strcmp(hdr.command, "big") == 0)
+            send_test_big_received++;
+        if (strcmp(hdr.command, "framed") == 0) {
+            /* the payload parts arrive in order (first byte of each part is its index) behind a valid checksum */
+            unsigned char* message = evbuffer_pullup(input, BTC_P2P_HDRSZ + hdr.data_len);
+            btc_uint256 hash;
+            btc_hash(message + BTC_P2P_HDRSZ, hdr.data_len, hash);
+            if (memcmp(hash, hdr.hash, 4) != 0 || hdr.data_len != send_test_big_size + 8 ||
+                message[BTC_P2P_HDRSZ] != 0 || message[BTC_P2P_HDRSZ + 8] != 1)
+                send_test_framed_valid = false;
+            send_test_framed_received++;
+        }
+        evbuffer_drain(input, BTC_P2P_HDRSZ + hdr.data_len);
+    }
+    if (send_test_small_received == send_test_small && send_test_big_received == send_test_big_sent &&
+        send_test_framed_received == send_test_framed && send_test_resumed)
+        event_base_loopexit(((btc_node_group*)ctx)->event_base, NULL);
+}
+
+static void send_test_accept_cb(struct evconnlistener* listener, evutil_socket_t fd, struct sockaddr* addr, int socklen, void* ctx)
+{
+    (void)(addr);
+    (void)(socklen);
+    send_test_peer_bev = bufferevent_socket_new(evconnlistener_get_base(listener), fd, BEV_OPT_CLOSE_ON_FREE);
+    bufferevent_setcb(send_test_peer_bev, send_test_peer_read_cb, NULL, NULL, ctx);
+    if (send_test_paused)
+        bufferevent_enable(send_test_peer_bev, EV_READ);
+    else
+        bufferevent_disable(send_test_peer_bev, EV_READ);
+}
+
+static void send_test_state_changed(struct btc_node_ *node)
+{
+    if ((node->state & NODE_CONNECTED) != NODE_CONNECTED || send_test_big_sent > 0)
+        return;
+
+    /* small messages are collected and written at once */
+    uint64_t nonce = 0;
+    for (unsigned int i = 0; i < send_test_small; i++) {
+        cstring* msg = btc_p2p_message_new(node->nodegroup->chainparams->netmagic, "small", &nonce, sizeof(nonce));
+        btc_node_send(node, msg);
+        cstr_free(msg, true);
+    }
+    send_test_coalesced = (evbuffer_get_length(bufferevent_get_output(node->event_bev)) + node->send_batch->len == send_test_small * (BTC_P2P_HDRSZ + sizeof(nonce)));
+
+    /* produce until the send queue is full */
+    uint8_t* payload = btc_calloc(1, send_test_big_size);
+    while (!node->send_paused && send_test_big_sent < 100) {
+        btc_node_send_owned(node, btc_p2p_message_new(node->nodegroup->chainparams->netmagic, "big", payload, send_test_big_size));
+        send_test_big_sent++;
+    }
+
+    /* frame a message from two parts, once hashing them and once reusing the checksum */
+    uint8_t part_index = 1;
+    cstring* parts[2] = {cstr_new_buf(&nonce, sizeof(nonce)), cstr_new_buf(payload, send_test_big_size)};
+    memcpy(parts[1]->str, &part_index, 1);
+    cstring* full = cstr_new_cstr(parts[0]);
+    cstr_append_cstr(full, parts[1]);
+    btc_uint256 checksum;
+    btc_hash((const unsigned char*)full->str, full->len, checksum);
+    btc_node_send_message(node, "framed", parts, 2, NULL);
+    parts[0] = cstr_new_buf(&nonce, sizeof(nonce));
+    parts[1] = cstr_new_buf(full->str + sizeof(nonce), send_test_big_size);
+    btc_node_send_message(node, "framed", parts, 2, checksum);
+    cstr_free(full, true);
+    btc_free(payload);
+}
+
+static void send_test_queue_cb(struct btc_node_ *node, btc_bool paused)
+{
+    (void)(node);
+    if (paused) {
+        send_test_paused++;
+        /* let the peer drain the queue (once accepted) */
+        if (send_test_peer_bev)
+            bufferevent_enable(send_test_peer_bev, EV_READ);
+    }
+    else
+        send_test_resumed++;
+}
+
+void test_net_send_queue()
+{
+    btc_node_group* group = btc_node_group_new(NULL);
+    group->desired_amount_connected_nodes = 1;
+    group->node_connection_state_changed_cb = send_test_state_changed;
+    group->send_queue_cb = send_test_queue_cb;
+
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sin.sin_port = 0;
+    struct evconnlistener* listener = evconnlistener_new_bind(group->event_base, send_test_accept_cb, group, LEV_OPT_REUSEABLE | LEV_OPT_CLOSE_ON_FREE, -1, (struct sockaddr*)&sin, sizeof(sin));
+    socklen_t sinlen = sizeof(sin);
+    getsockname(evconnlistener_get_fd(listener), (struct sockaddr*)&sin, &sinlen);
+
+    char ipport[32];
+    sprintf(ipport, "127.0.0.1:%d", ntohs(sin.sin_port));
+    btc_node* node = btc_node_new();
+    btc_node_set_ipport(node, ipport);
+    btc_node_group_add_node(group, node);
+    btc_node_group_connect_next_nodes(group);
+
+    struct timeval tv = {10, 0};
+    event_base_loopexit(group->event_base, &tv);
+    btc_node_group_event_loop(group);
+
+    u_assert_int_eq(send_test_coalesced, true);
+    u_assert_int_eq(send_test_big_sent, BTC_P2P_SEND_HIGH_WATER / send_test_big_size + 1);
+    u_assert_int_eq(send_test_paused, 1);
+    u_assert_int_eq(send_test_resumed, 1);
+    u_assert_int_eq(send_test_small_received, send_test_small);
+    u_assert_int_eq(send_test_big_received, send_test_big_sent);
+    u_assert_int_eq(send_test_framed_received, send_test_framed);
+    u_assert_int_eq(send_test_framed_valid, true);
+    u_assert_int_eq(node->send_paused, false);
+
+    btc_node_group_shutdown(group);
+    if (send_test_peer_bev)
+        bufferevent_free(send_test_peer_bev);
+    evconnlistener_free(listener);
+    btc_node_group_free(group);
+}
+
+/* local peer answering a ping and sending headers and a block */
+static const size_t stats_test_block_size = 1000;
+static const uint64_t stats_test_nonce = 42;
+static struct bufferevent* stats_test_peer_bev = NULL;
+
+static void stats_test_accept_cb(struct evconnlistener* listener, evutil_socket_t fd, struct sockaddr* addr, int socklen, void* ctx)
+{
+    (void)(addr);
+    (void)(socklen);
+    btc_node_group* group = ctx;
+    stats_test_peer_bev = bufferevent_socket_new(evconnlistener_get_base(listener), fd, BEV_OPT_CLOSE_ON_FREE);
+
+    uint8_t* payload = btc_calloc(1, stats_test_block_size);
+    cstring* msgs[4];
+    msgs[0] = btc_p2p_message_new(group->chainparams->netmagic, BTC_MSG_HEADERS, NULL, 0);
+    msgs[1] = btc_p2p_message_new(group->chainparams->netmagic, BTC_MSG_BLOCK, payload, stats_test_block_size);
+    msgs[2] = btc_p2p_message_new(group->chainparams->netmagic, BTC_MSG_PONG, &stats_test_nonce, sizeof(stats_test_nonce));
+    msgs[3] = btc_p2p_message_new(group->chainparams->netmagic, "done", NULL, 0);
+    for (unsigned int i = 0; i < 4; i++) {
+        bufferevent_write(stats_test_peer_bev, msgs[i]->str, msgs[i]->len);
+        cstr_free(msgs[i], true);
+    }
+    btc_free(payload);
+    bufferevent_enable(stats_test_peer_bev, EV_WRITE);
+}
+
+static void stats_test_state_changed(struct btc_node_ *node)
+{
+    if ((node->state & NODE_CONNECTED) != NODE_CONNECTED)
+        return;
+
+    /* pretend a ping has been sent 30ms ago */
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    node->ping_nonce = stats_test_nonce;
+    node->ping_sent_ms = (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000 - 30;
+}
+
+static void stats_test_postcmd(struct btc_node_ *node, btc_p2p_msg_hdr *hdr, struct const_buffer *buf)
+{
+    (void)(buf);
+    if (strcmp(hdr->command, "done") == 0)
+        event_base_loopexit(node->nodegroup->event_base, NULL);
+}
+
+void test_net_stats()
+{
+    const char* dumpfile = "/tmp/net_stats_test";
+    btc_node_group* group = btc_node_group_new(NULL);
+    group->desired_amount_connected_nodes = 1;
+    group->node_connection_state_changed_cb = stats_test_state_changed;
+    group->postcmd_cb = stats_test_postcmd;
+    u_assert_int_eq(btc_node_group_set_stats_dump(group, dumpfile, 0), false);
+    u_assert_int_eq(btc_node_group_set_stats_dump(group, dumpfile, 60), true);
+
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sin.sin_port = 0;
+    struct evconnlistener* listener = evconnlistener_new_bind(group->event_base, stats_test_accept_cb, group, LEV_OPT_REUSEABLE | LEV_OPT_CLOSE_ON_FREE, -1, (struct sockaddr*)&sin, sizeof(sin));
+    socklen_t sinlen = sizeof(sin);
+    getsockname(evconnlistener_get_fd(listener), (struct sockaddr*)&sin, &sinlen);
+
+    char ipport[32];
+    sprintf(ipport, "127.0.0.1:%d", ntohs(sin.sin_port));
+    btc_node* node = btc_node_new();
+    btc_node_set_ipport(node, ipport);
+    btc_node_group_add_node(group, node);
+    btc_node_group_connect_next_nodes(group);
+
+    struct timeval tv = {10, 0};
+    event_base_loopexit(group->event_base, &tv);
+    btc_node_group_event_loop(group);
+
+    btc_node_stats stats;
+    u_assert_int_eq(btc_node_group_get_stats(group, &stats, 1), 1);
+    u_assert_int_eq(stats.nodeid, 1);
+    u_assert_int_eq(stats.state & NODE_CONNECTED, NODE_CONNECTED);
+    u_assert_int_eq(stats.time_connected > 0, true);
+    u_assert_int_eq(stats.msgs_in, 4);
+    u_assert_int_eq(stats.bytes_in, 4 * BTC_P2P_HDRSZ + stats_test_block_size + sizeof(stats_test_nonce));
+    u_assert_int_eq(stats.commands_count, 5);
+
+    /* the version message has been sent */
+    u_assert_str_eq(stats.commands[0].command, "version");
+    u_assert_int_eq(stats.commands[0].msgs_out, 1);
+    u_assert_int_eq(stats.commands[0].msgs_in, 0);
+    u_assert_int_eq(stats.msgs_out, 1);
+    u_assert_int_eq(stats.bytes_out, stats.commands[0].bytes_out);
+    u_assert_int_eq(stats.send_queue_max, stats.bytes_out);
+
+    u_assert_str_eq(stats.commands[2].command, "block");
+    u_assert_int_eq(stats.commands[2].msgs_in, 1);
+    u_assert_int_eq(stats.commands[2].bytes_in, BTC_P2P_HDRSZ + stats_test_block_size);
+    u_assert_int_eq(stats.first_headers_ms > 0, true);
+    u_assert_int_eq(stats.first_block_ms >= stats.first_headers_ms, true);
+
+    /* 30ms+ lands in the 25-50ms bucket (or later if the machine is slow) */
+    unsigned int pings = 0;
+    for (unsigned int i = 0; i < BTC_NODE_STATS_RTT_BUCKETS; i++)
+        pings += stats.ping_rtt_hist[i];
+    u_assert_int_eq(pings, 1);
+    u_assert_int_eq(stats.ping_rtt_hist[0], 0);
+    u_assert_int_eq(stats.ping_rtt_last_ms >= 30, true);
+    u_assert_int_eq(node->ping_sent_ms, 0);
+
+    /* text dump */
+    u_assert_int_eq(btc_node_group_dump_stats(group, dumpfile), true);
+    FILE* file = fopen(dumpfile, "r");
+    u_assert_int_eq(file != NULL, true);
+    char line[1024];
+    unsigned int cmd_lines = 0;
+    btc_bool node_line = false;
+    while (fgets(line, sizeof(line), file)) {
+        if (strncmp(line, "node 1 ", 7) == 0)
+            node_line = true;
+        if (strncmp(line, "  cmd ", 6) == 0)
+            cmd_lines++;
+    }
+    fclose(file);
+    unlink(dumpfile);
+    u_assert_int_eq(node_line, true);
+    u_assert_int_eq(cmd_lines, 5);
+
+    btc_node_group_shutdown(group);
+    if (stats_test_peer_bev)
+        bufferevent_free(stats_test_peer_bev);
+    evconnlistener_free(listener);
+    btc_node_group_free(group);
+}
+
+/* local stand-in peers answering pings with an injected delay */
+typedef struct score_test_peer_ {
+    unsigned int delay_ms;
+    struct bufferevent* bev;
+} score_test_peer;
+
+typedef struct score_test_pong_ {
+    struct bufferevent* bev;
+    cstring* msg;
+} score_test_pong;
+
+static score_test_peer score_test_peers[2];
+static unsigned int score_test_pongs = 0;
+
+static void score_test_pong_cb(evutil_socket_t fd, short event, void* ctx)
+{
+    (void)(fd);
+    (void)(event);
+    score_test_pong* pong = ctx;
+    bufferevent_write(pong->bev, pong->msg->str, pong->msg->len);
+    cstr_free(pong->msg, true);
+    btc_free(pong);
+}
+
+static void score_test_peer_read_cb(struct bufferevent* bev, void* ctx)
+{
+    score_test_peer* peer = ctx;
+    struct evbuffer* input = bufferevent_get_input(bev);
+    while (evbuffer_get_length(input) >= BTC_P2P_HDRSZ) {
+        unsigned char hdr_data[BTC_P2P_HDRSZ];
+        struct const_buffer hdr_buf = {hdr_data, BTC_P2P_HDRSZ};
+        btc_p2p_msg_hdr hdr;
+        evbuffer_copyout(input, hdr_data, BTC_P2P_HDRSZ);
+        btc_p2p_deser_msghdr(&hdr, &hdr_buf);
+        if (evbuffer_get_length(input) < BTC_P2P_HDRSZ + hdr.data_len)
+            break;
+        evbuffer_drain(input, BTC_P2P_HDRSZ);
+        uint8_t payload[8];
+        if (strcmp(hdr.command, BTC_MSG_PING) == 0 && hdr.data_len == sizeof(payload)) {
+            evbuffer_remove(input, payload, sizeof(payload));
+            score_test_pong* pong = btc_calloc(1, sizeof(*pong));
+            pong->bev = bev;
+            pong->msg = btc_p2p_message_new(btc_chainparams_main.netmagic, BTC_MSG_PONG, payload, sizeof(payload));
+            struct timeval tv = {0, peer->delay_ms * 1000};
+            event_base_once(bufferevent_get_base(bev), -1, EV_TIMEOUT, score_test_pong_cb, pong, &tv);
+        } else {
+            evbuffer_drain(input, hdr.data_len);
+        }
+    }
+}
+
+static void score_test_accept_cb(struct evconnlistener* listener, evutil_socket_t fd, struct sockaddr* addr, int socklen, void* ctx)
+{
+    (void)(addr);
+    (void)(socklen);
+    score_test_peer* peer = ctx;
+    peer->bev = bufferevent_socket_new(evconnlistener_get_base(listener), fd, BEV_OPT_CLOSE_ON_FREE);
+    bufferevent_setcb(peer->bev, score_test_peer_read_cb, NULL, NULL, peer);
+    bufferevent_enable(peer->bev, EV_READ | EV_WRITE);
+}
+
+static void score_test_state_changed(struct btc_node_ *node)
+{
+    if ((node->state & NODE_CONNECTED) == NODE_CONNECTED)
+        btc_node_send_ping(node);
+}
+
+static void score_test_postcmd(struct btc_node_ *node, btc_p2p_msg_hdr *hdr, struct const_buffer *buf)
+{
+    (void)(buf);
+    if (strcmp(hdr->command, BTC_MSG_PONG) == 0 && ++score_test_pongs == 2)
+        event_base_loopexit(node->nodegroup->event_base, NULL);
+}
+
+static uint64_t score_test_now_ms()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+void test_net_peer_scoring()
+{
+    btc_node_group* group = btc_node_group_new(NULL);
+    btc_node* nodes[3];
+    for (unsigned int i = 0; i < 3; i++) {
+        nodes[i] = btc_node_new();
+        btc_node_group_add_node(group, nodes[i]);
+        nodes[i]->state = NODE_CONNECTED;
+        nodes[i]->version_handshake = true;
+        nodes[i]->bestknownheight = 200;
+    }
+
+    /* fast node, slow node and an unmeasured one */
+    btc_node_record_response(nodes[0], 100, 20);
+    btc_node_record_response(nodes[0], 200000, 100);
+    btc_node_record_response(nodes[1], 100, 300);
+    btc_node_record_response(nodes[1], 200000, 2000);
+    u_assert_int_eq(nodes[0]->stats.rtt_avg_ms, 20);
+    u_assert_int_eq(nodes[0]->stats.throughput_avg, 2000000);
+    u_assert_int_eq(btc_node_sync_score(nodes[0]) > btc_node_sync_score(nodes[1]), true);
+    u_assert_int_eq(btc_node_sync_score(nodes[1]) > btc_node_sync_score(nodes[2]), true);
+
+    /* a slow response pulls the average down */
+    uint64_t score = btc_node_sync_score(nodes[0]);
+    btc_node_record_response(nodes[0], 100, 1000);
+    u_assert_int_eq(nodes[0]->stats.rtt_avg_ms, (20 * 3 + 1000) / 4);
+    u_assert_int_eq(btc_node_sync_score(nodes[0]) < score, true);
+
+    u_assert_int_eq(btc_node_group_best_sync_node(group, 100, NULL) == nodes[0], true);
+    u_assert_int_eq(btc_node_group_best_sync_node(group, 100, nodes[0]) == nodes[1], true);
+    nodes[1]->bestknownheight = 100;
+    u_assert_int_eq(btc_node_group_best_sync_node(group, 100, nodes[0]) == nodes[2], true);
+    u_assert_int_eq(btc_node_group_best_sync_node(group, 200, NULL) == NULL, true);
+
+    /* stalling requests get overdue */
+    u_assert_int_eq(btc_node_response_overdue(nodes[0]), false);
+    nodes[0]->request_sent_ms = score_test_now_ms() - 1000;
+    u_assert_int_eq(btc_node_response_overdue(nodes[0]), false);
+    nodes[0]->request_sent_ms = score_test_now_ms() - 6000;
+    u_assert_int_eq(btc_node_response_overdue(nodes[0]), true);
+    btc_node_response_received(nodes[0], 0);
+    u_assert_int_eq(nodes[0]->request_sent_ms, 0);
+    u_assert_int_eq(nodes[0]->stats.rtt_avg_ms >= (265 * 3 + 6000) / 4, true);
+    for (unsigned int i = 0; i < 3; i++)
+        nodes[i]->state = 0;
+    btc_node_group_free(group);
+
+    /* round trip times measured against peers with injected delays */
+    group = btc_node_group_new(NULL);
+    group->desired_amount_connected_nodes = 2;
+    group->node_connection_state_changed_cb = score_test_state_changed;
+    group->postcmd_cb = score_test_postcmd;
+    score_test_pongs = 0;
+    struct evconnlistener* listeners[2];
+    for (unsigned int i = 0; i < 2; i++) {
+        score_test_peers[i].delay_ms = (i == 0 ? 5 : 200);
+        score_test_peers[i].bev = NULL;
+
+        struct sockaddr_in sin;
+        memset(&sin, 0, sizeof(sin));
+        sin.sin_family = AF_INET;
+        sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        sin.sin_port = 0;
+        listeners[i] = evconnlistener_new_bind(group->event_base, score_test_accept_cb, &score_test_peers[i], LEV_OPT_REUSEABLE | LEV_OPT_CLOSE_ON_FREE, -1, (struct sockaddr*)&sin, sizeof(sin));
+        socklen_t sinlen = sizeof(sin);
+        getsockname(evconnlistener_get_fd(listeners[i]), (struct sockaddr*)&sin, &sinlen);
+
+        char ipport[32];
+        sprintf(ipport, "127.0.0.1:%d", ntohs(sin.sin_port));
+        nodes[i] = btc_node_new();
+        btc_node_set_ipport(nodes[i], ipport);
+        btc_node_group_add_node(group, nodes[i]);
+    }
+    btc_node_group_connect_next_nodes(group);
+
+    struct timeval tv = {10, 0};
+    event_base_loopexit(group->event_base, &tv);
+    btc_node_group_event_loop(group);
+
+    u_assert_int_eq(score_test_pongs, 2);
+    u_assert_int_eq(nodes[0]->stats.rtt_avg_ms < 100, true);
+    u_assert_int_eq(nodes[1]->stats.rtt_avg_ms >= 190, true);
+    for (unsigned int i = 0; i < 2; i++) {
+        nodes[i]->version_handshake = true;
+        nodes[i]->bestknownheight = 10;
+    }
+    u_assert_int_eq(btc_node_group_best_sync_node(group, 0, NULL) == nodes[0], true);
+
+    btc_node_group_shutdown(group);
+    for (unsigned int i = 0; i < 2; i++) {
+        if (score_test_peers[i].bev)
+            bufferevent_free(score_test_peers[i].bev);
+        evconnlistener_free(listeners[i]);
+    }
+    btc_node_group_free(group);
+}
+
+/* local peer completing the handshake and relaying two addresses */
+static struct bufferevent* addrman_test_peer_bev = NULL;
+
+static void addrman_test_send(btc_node_group* group, const char* command, const void* data, size_t len)
+{
+    cstring* msg = btc_p2p_message_new(group->chainparams->netmagic, command, data, len);
+    bufferevent_write(addrman_test_peer_bev, msg->str, msg->len);
+    cstr_free(msg, true);
+}
+
+static void addrman_test_accept_cb(struct evconnlistener* listener, evutil_socket_t fd, struct sockaddr* addr, int socklen, void* ctx)
+{
+    (void)(addr);
+    (void)(socklen);
+    btc_node_group* group = ctx;
+    addrman_test_peer_bev = bufferevent_socket_new(evconnlistener_get_base(listener), fd, BEV_OPT_CLOSE_ON_FREE);
+    bufferevent_enable(addrman_test_peer_bev, EV_READ | EV_WRITE);
+
+    btc_p2p_version_msg version_msg;
+    btc_p2p_address addr_local;
+    btc_p2p_address_init(&addr_local);
+    btc_p2p_msg_version_init(&version_msg, &addr_local, &addr_local, "/addrman-test/", false);
+    version_msg.services = BTC_NODE_NETWORK;
+    cstring* payload = cstr_new_sz(256);
+    btc_p2p_msg_version_ser(&version_msg, payload);
+    addrman_test_send(group, BTC_MSG_VERSION, payload->str, payload->len);
+    addrman_test_send(group, BTC_MSG_VERACK, NULL, 0);
+
+    cstr_resize(payload, 0);
+    ser_varlen(payload, 2);
+    for (uint8_t i = 1; i <= 2; i++) {
+        btc_p2p_address relayed;
+        btc_p2p_address_init(&relayed);
+        relayed.ip[10] = 0xff;
+        relayed.ip[11] = 0xff;
+        relayed.ip[12] = 10;
+        relayed.ip[15] = i;
+        relayed.port = 8333;
+        relayed.services = BTC_NODE_NETWORK;
+        relayed.time = (uint32_t)time(NULL) - 600;
+        btc_p2p_ser_addr(BTC_PROTOCOL_VERSION, &relayed, payload);
+    }
+    addrman_test_send(group, BTC_MSG_ADDR, payload->str, payload->len);
+    addrman_test_send(group, "done", NULL, 0);
+    cstr_free(payload, true);
+}
+
+static void addrman_test_postcmd(struct btc_node_ *node, btc_p2p_msg_hdr *hdr, struct const_buffer *buf)
+{
+    (void)(buf);
+    if (strcmp(hdr->command, "done") == 0)
+        event_base_loopexit(node->nodegroup->event_base, NULL);
+}
+
+void test_net_addrman()
+{
+    const char* peersfile = "/tmp/net_addrman_test";
+    unlink(peersfile);
+    btc_node_group* group = btc_node_group_new(NULL);
+    group->desired_amount_connected_nodes = 1;
+    group->postcmd_cb = addrman_test_postcmd;
+    u_assert_int_eq(btc_node_group_set_addrman_file(group, peersfile, 0), false);
+    u_assert_int_eq(btc_node_group_set_addrman_file(group, peersfile, 60), true);
+    u_assert_int_eq(group->addrman->entries->len, 0);
+
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sin.sin_port = 0;
+    struct evconnlistener* listener = evconnlistener_new_bind(group->event_base, addrman_test_accept_cb, group, LEV_OPT_REUSEABLE | LEV_OPT_CLOSE_ON_FREE, -1, (struct sockaddr*)&sin, sizeof(sin));
+    socklen_t sinlen = sizeof(sin);
+    getsockname(evconnlistener_get_fd(listener), (struct sockaddr*)&sin, &sinlen);
+
+    char ipport[32];
+    sprintf(ipport, "127.0.0.1:%d", ntohs(sin.sin_port));
+    u_assert_int_eq(btc_node_group_add_peers_by_ip_or_seed(group, ipport), true);
+    btc_node_group_connect_next_nodes(group);
+
+    struct timeval tv = {10, 0};
+    event_base_loopexit(group->event_base, &tv);
+    btc_node_group_event_loop(group);
+
+    /* the peer has been asked for addresses and is remembered as reachable */
+    btc_node_stats stats;
+    u_assert_int_eq(btc_node_group_get_stats(group, &stats, 1), 1);
+    unsigned int getaddr_sent = 0;
+    for (unsigned int i = 0; i < stats.commands_count; i++) {
+        if (strcmp(stats.commands[i].command, BTC_MSG_GETADDR) == 0)
+            getaddr_sent = stats.commands[i].msgs_out;
+    }
+    u_assert_int_eq(getaddr_sent, 1);
+    u_assert_int_eq(group->addrman->entries->len, 3);
+    btc_node* node = vector_idx(group->nodes, 0);
+    btc_p2p_address node_addr;
+    btc_p2p_address_init(&node_addr);
+    btc_addr_to_p2paddr(&node->addr, &node_addr);
+    btc_addrman_entry* entry = btc_addrman_find(group->addrman, &node_addr);
+    u_assert_not_null(entry);
+    u_assert_int_eq(entry->successes, 1);
+
+    if (addrman_test_peer_bev)
+        bufferevent_free(addrman_test_peer_bev);
+    addrman_test_peer_bev = NULL;
+    evconnlistener_free(listener);
+
+    /* the shutdown saves the known peers, the save timer no longer keeps the event loop running */
+    unlink(peersfile);
+    btc_node_group_shutdown(group);
+    u_assert_int_eq(access(peersfile, F_OK), 0);
+    u_assert_int_eq(event_pending(group->addrman_save_event, EV_TIMEOUT, NULL), 0);
+    btc_node_group_free(group);
+
+    /* the next start takes the known peers instead of asking a DNS seed,
+       the peer just tried waits for the retry delay */
+    group = btc_node_group_new(NULL);
+    group->desired_amount_connected_nodes = 1;
+    u_assert_int_eq(btc_node_group_set_addrman_file(group, peersfile, 60), true);
+    u_assert_int_eq(group->addrman->entries->len, 3);
+    entry = btc_addrman_find(group->addrman, &node_addr);
+    u_assert_not_null(entry);
+    u_assert_int_eq(entry->successes, 1);
+    u_assert_int_eq(btc_node_group_add_peers_by_ip_or_seed(group, NULL), true);
+    u_assert_int_eq(group->nodes->len, 2);
+    btc_node_group_free(group);
+    unlink(peersfile);
+}
+
+/* stub nameserver for the seeds: seed-a answers at once, seed-b late and seed-c never */
+typedef struct dns_test_ctx_ {
+    struct event_base* base;
+    unsigned int queries;
+    unsigned int accepted;
+    btc_bool accepted_before_b;
+    btc_bool b_answered;
+    struct evdns_server_request* b_request;
+    struct bufferevent* peer_bev;
+} dns_test_ctx;
+
+static dns_test_ctx dns_test;
+
+static void dns_test_stop_cb(evutil_socket_t fd, short event, void* ctx)
+{
+    (void)(fd);
+    (void)(event);
+    (void)(ctx);
+    event_base_loopexit(dns_test.base, NULL);
+}
+
+static void dns_test_answer_b_cb(evutil_socket_t fd, short event, void* ctx)
+{
+    (void)(fd);
+    (void)(event);
+    (void)(ctx);
+    /* the peer of seed-a again and one that refuses connections */
+    uint32_t addrs[2] = {htonl(INADDR_LOOPBACK), htonl(INADDR_LOOPBACK + 1)};
+    evdns_server_request_add_a_reply(dns_test.b_request, dns_test.b_request->questions[0]->name, 2, addrs, 60);
+    evdns_server_request_respond(dns_test.b_request, 0);
+    dns_test.b_request = NULL;
+    dns_test.b_answered = true;
+
+    struct timeval tv = {0, 300 * 1000};
+    event_base_once(dns_test.base, -1, EV_TIMEOUT, dns_test_stop_cb, NULL, &tv);
+}
+
+static void dns_test_request_cb(struct evdns_server_request* req, void* data)
+{
+    (void)(data);
+    dns_test.queries++;
+    const char* name = (req->nquestions == 1 ? req->questions[0]->name : "");
+    /* evdns randomizes the case of the names */
+    if (evutil_ascii_strcasecmp(name, "seed-a.test") == 0) {
+        uint32_t addr = htonl(INADDR_LOOPBACK);
+        evdns_server_request_add_a_reply(req, name, 1, &addr, 60);
+        evdns_server_request_respond(req, 0);
+    } else if (evutil_ascii_strcasecmp(name, "seed-b.test") == 0 && !dns_test.b_request && !dns_test.b_answered) {
+        dns_test.b_request = req;
+        struct timeval tv = {0, 500 * 1000};
+        event_base_once(dns_test.base, -1, EV_TIMEOUT, dns_test_answer_b_cb, NULL, &tv);
+    } else {
+        evdns_server_request_drop(req);
+    }
+}
+
+static void dns_test_accept_cb(struct evconnlistener* listener, evutil_socket_t fd, struct sockaddr* addr, int socklen, void* ctx)
+{
+    (void)(addr);
+    (void)(socklen);
+    (void)(ctx);
+    dns_test.accepted++;
+    if (!dns_test.b_answered)
+        dns_test.accepted_before_b = true;
+    if (dns_test.peer_bev)
+        bufferevent_free(dns_test.peer_bev);
+    dns_test.peer_bev = bufferevent_socket_new(evconnlistener_get_base(listener), fd, BEV_OPT_CLOSE_ON_FREE);
+}
+
+void test_net_dns_seeds()
+{
+    btc_chainparams params = btc_chainparams_regtest;
+    strcpy(params.dnsseeds[0].domain, "seed-a.test");
+    strcpy(params.dnsseeds[1].domain, "seed-b.test");
+    strcpy(params.dnsseeds[2].domain, "seed-c.test");
+    btc_node_group* group = btc_node_group_new(&params);
+    memset(&dns_test, 0, sizeof(dns_test));
+    dns_test.base = group->event_base;
+
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sin.sin_port = 0;
+    struct evconnlistener* listener = evconnlistener_new_bind(group->event_base, dns_test_accept_cb, NULL, LEV_OPT_REUSEABLE | LEV_OPT_CLOSE_ON_FREE, -1, (struct sockaddr*)&sin, sizeof(sin));
+    socklen_t sinlen = sizeof(sin);
+    getsockname(evconnlistener_get_fd(listener), (struct sockaddr*)&sin, &sinlen);
+    params.default_port = ntohs(sin.sin_port);
+
+    evutil_socket_t dns_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    sin.sin_port = 0;
+    u_assert_int_eq(bind(dns_fd, (struct sockaddr*)&sin, sizeof(sin)), 0);
+    sinlen = sizeof(sin);
+    getsockname(dns_fd, (struct sockaddr*)&sin, &sinlen);
+    evutil_make_socket_nonblocking(dns_fd);
+    struct evdns_server_port* dns_port = evdns_add_server_port_with_base(group->event_base, dns_fd, 0, dns_test_request_cb, NULL);
+    char nameserver[32];
+    sprintf(nameserver, "127.0.0.1:%d", ntohs(sin.sin_port));
+    u_assert_int_eq(btc_node_group_set_dns_nameserver(group, nameserver), true);
+
+    /* all seeds are asked at once, nothing is known before the event loop runs */
+    u_assert_int_eq(btc_node_group_add_peers_by_ip_or_seed(group, NULL), true);
+    u_assert_int_eq(group->nodes->len, 0);
+    u_assert_int_eq(group->dns_seed_queries->len, 3);
+
+    struct timeval tv = {10, 0};
+    event_base_loopexit(group->event_base, &tv);
+    btc_node_group_event_loop(group);
+
+    /* the peer of the first answer has been connected while seed-b was still pending */
+    u_assert_int_eq(dns_test.b_answered, true);
+    u_assert_int_eq(dns_test.queries >= 3, true);
+    u_assert_int_eq(dns_test.accepted, 1);
+    u_assert_int_eq(dns_test.accepted_before_b, true);
+
+    /* known peers are not added twice */
+    u_assert_int_eq(group->nodes->len, 2);
+    btc_node* node = vector_idx(group->nodes, 1);
+    struct sockaddr_in* node_sin = (struct sockaddr_in*)&node->addr;
+    u_assert_int_eq(ntohl(node_sin->sin_addr.s_addr), INADDR_LOOPBACK + 1);
+    u_assert_int_eq(ntohs(node_sin->sin_port), params.default_port);
+
+    /* seed-c is still pending, its lookup gets cancelled */
+    u_assert_int_eq(group->dns_seed_queries->len, 1);
+
+    btc_node_group_shutdown(group);
+    if (dns_test.peer_bev)
+        bufferevent_free(dns_test.peer_bev);
+    evconnlistener_free(listener);
+    evdns_close_server_port(dns_port);
+    btc_node_group_free(group);
+}
+
+static void dns_reseed_accept_cb(struct evconnlistener* listener, evutil_socket_t fd, struct sockaddr* addr, int socklen, void* ctx)
+{
+    dns_test_accept_cb(listener, fd, addr, socklen, ctx);
+    event_base_loopexit(dns_test.base, NULL);
+}
+
+void test_net_dns_reseed()
+{
+    btc_chainparams params = btc_chainparams_regtest;
+    strcpy(params.dnsseeds[0].domain, "seed-a.test");
+    params.dnsseeds[1].domain[0] = 0;
+    btc_node_group* group = btc_node_group_new(&params);
+    group->desired_amount_connected_nodes = 1;
+    memset(&dns_test, 0, sizeof(dns_test));
+    dns_test.base = group->event_base;
+
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sin.sin_port = 0;
+    struct evconnlistener* listener = evconnlistener_new_bind(group->event_base, dns_reseed_accept_cb, NULL, LEV_OPT_REUSEABLE | LEV_OPT_CLOSE_ON_FREE, -1, (struct sockaddr*)&sin, sizeof(sin));
+    socklen_t sinlen = sizeof(sin);
+    getsockname(evconnlistener_get_fd(listener), (struct sockaddr*)&sin, &sinlen);
+    params.default_port = ntohs(sin.sin_port);
+
+    /* a port nobody listens on */
+    evutil_socket_t closed_fd = socket(AF_INET, SOCK_STREAM, 0);
+    sin.sin_port = 0;
+    u_assert_int_eq(bind(closed_fd, (struct sockaddr*)&sin, sizeof(sin)), 0);
+    sinlen = sizeof(sin);
+    getsockname(closed_fd, (struct sockaddr*)&sin, &sinlen);
+    uint16_t closed_port = ntohs(sin.sin_port);
+    evutil_closesocket(closed_fd);
+
+    evutil_socket_t dns_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    sin.sin_port = 0;
+    u_assert_int_eq(bind(dns_fd, (struct sockaddr*)&sin, sizeof(sin)), 0);
+    sinlen = sizeof(sin);
+    getsockname(dns_fd, (struct sockaddr*)&sin, &sinlen);
+    evutil_make_socket_nonblocking(dns_fd);
+    struct evdns_server_port* dns_port = evdns_add_server_port_with_base(group->event_base, dns_fd, 0, dns_test_request_cb, NULL);
+    char nameserver[32];
+    sprintf(nameserver, "127.0.0.1:%d", ntohs(sin.sin_port));
+    u_assert_int_eq(btc_node_group_set_dns_nameserver(group, nameserver), true);
+
+    /* the only known peer (like from a stale peers file) is gone */
+    group->addrman = btc_addrman_new();
+    btc_p2p_address stale;
+    btc_p2p_address_init(&stale);
+    stale.ip[10] = 0xff;
+    stale.ip[11] = 0xff;
+    stale.ip[12] = 127;
+    stale.ip[15] = 1;
+    stale.port = closed_port;
+    stale.services = BTC_NODE_NETWORK;
+    stale.time = (uint32_t)time(NULL) - 600;
+    u_assert_int_eq(btc_addrman_add(group->addrman, &stale, time(NULL)), true);
+
+    u_assert_int_eq(btc_node_group_add_peers_by_ip_or_seed(group, NULL), true);
+    u_assert_int_eq(group->nodes->len, 1);
+    u_assert_is_null(group->dns_seed_queries);
+    btc_node_group_connect_next_nodes(group);
+
+    struct timeval tv = {10, 0};
+    event_base_loopexit(group->event_base, &tv);
+    btc_node_group_event_loop(group);
+
+    /* the failed connection made the group ask the seed, its peer got connected */
+    u_assert_int_eq(dns_test.queries >= 1, true);
+    u_assert_int_eq(dns_test.accepted, 1);
+    u_assert_int_eq(group->nodes->len, 2);
+    btc_node* node = vector_idx(group->nodes, 0);
+    u_assert_int_eq((node->state & NODE_ERRORED) == NODE_ERRORED, true);
+
+    btc_node_group_shutdown(group);
+    if (dns_test.peer_bev)
+        bufferevent_free(dns_test.peer_bev);
+    evconnlistener_free(listener);
+    evdns_close_server_port(dns_port);
+    btc_node_group_free(group);
+}
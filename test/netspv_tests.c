@@ -1,8 +1,26 @@
 #include "utest.h"
 #include <btc/block.h>
+#include <btc/blockfilter.h>
+#include <btc/bloom.h>
+#include <btc/cmpctblock.h>
+#include <btc/headersdb_file.h>
 #include <btc/net.h>
 #include <btc/netspv.h>
+#include <btc/protocol.h>
+#include <btc/serialize.h>
+#include <btc/tx.h>
 
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+#include <event2/listener.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
 #include <unistd.h>
 
 void test_spv_sync_completed(btc_spv_client* client) {
@@ -35,3 +53,1248 @@ void test_netspv()
     btc_spv_client_runloop(client);
     btc_spv_client_free(client);
 }
+
+/* local stand-in peers serving a chain of regtest blocks */
+#define BLOCKDL_TEST_PEERS 3
+#define BLOCKDL_TEST_BLOCKS 60
+#define HEADERS_TEST_BLOCKS 4500
+
+enum blockdl_test_behavior {
+    BLOCKDL_TEST_STALL,
+    BLOCKDL_TEST_SLOW,
+    BLOCKDL_TEST_FAST
+};
+
+typedef struct blockdl_test_peer_ {
+    enum blockdl_test_behavior behavior;
+    struct bufferevent* bev;
+    unsigned int headers_delay_ms;
+    uint64_t services;
+    unsigned int requested;
+    unsigned int served;
+    btc_bloom_filter* bloom; /* loaded with filterload */
+    unsigned int txs_served; /* matched txs sent after merkle blocks */
+    btc_bool sendcmpct; /* high bandwidth compact blocks requested */
+    unsigned int blocktxn_requested; /* txs requested with getblocktxn */
+    btc_bool sendheaders; /* new blocks are announced with headers */
+    unsigned int locator_requests; /* getheaders and getblocks received */
+    cstring* hidden_filter; /* served instead of the filter of the block at hide_pos, leaves out its match */
+    unsigned int hide_pos;
+} blockdl_test_peer;
+
+typedef struct blockdl_test_reply_ {
+    struct bufferevent* bev;
+    cstring* msg;
+} blockdl_test_reply;
+
+static blockdl_test_peer blockdl_test_peers[BLOCKDL_TEST_PEERS];
+static cstring** blockdl_test_blocks = NULL;
+static btc_uint256* blockdl_test_hashes = NULL;
+static cstring** blockdl_test_scripts = NULL; /* the output script of each block */
+static cstring** blockdl_test_filters = NULL;
+static btc_uint256* blockdl_test_filter_headers = NULL;
+static unsigned int blockdl_test_chain_len = 0;
+/* headers are synced up to this height, the blocks after it are downloaded */
+#define BLOCKDL_TEST_SCAN_FROM 10
+static unsigned int blockdl_test_next_height = BLOCKDL_TEST_SCAN_FROM + 1;
+static btc_bool blockdl_test_in_order = true;
+static btc_bool blockdl_test_completed = false;
+
+/* new block on top of the chain, announced as compact block once its first txs have been relayed */
+#define CMPCT_TEST_TXS 4
+static cstring* cmpct_test_txs[CMPCT_TEST_TXS];
+static btc_uint256 cmpct_test_txids[CMPCT_TEST_TXS];
+static cstring* cmpct_test_block = NULL;
+
+static void blockdl_test_create_blocks(unsigned int chain_len)
+{
+    blockdl_test_chain_len = chain_len;
+    blockdl_test_blocks = btc_calloc(chain_len, sizeof(cstring*));
+    blockdl_test_hashes = btc_calloc(chain_len, sizeof(btc_uint256));
+    blockdl_test_scripts = btc_calloc(chain_len, sizeof(cstring*));
+    blockdl_test_filters = btc_calloc(chain_len, sizeof(cstring*));
+    blockdl_test_filter_headers = btc_calloc(chain_len, sizeof(btc_uint256));
+    vector* elements = vector_new(1, NULL);
+    btc_uint256 prev_filter_header;
+    memset(prev_filter_header, 0, sizeof(prev_filter_header));
+
+    btc_block_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.prev_block, btc_chainparams_regtest.genesisblockhash, sizeof(btc_uint256));
+    for (unsigned int i = 0; i < chain_len; i++) {
+        header.version = 1;
+        header.timestamp = 1296688602 + (i + 1) * 600;
+        header.bits = 0x207fffff;
+        header.nonce = i;
+
+        btc_tx* tx = btc_tx_new();
+        btc_tx_in* tx_in = btc_tx_in_new();
+        tx_in->script_sig = cstr_new_sz(0);
+        vector_add(tx->vin, tx_in);
+        btc_tx_add_data_out(tx, 0, (const uint8_t*)&i, sizeof(i));
+        btc_tx_hash(tx, header.merkle_root);
+
+        blockdl_test_blocks[i] = cstr_new_sz(256);
+        btc_block_header_serialize(blockdl_test_blocks[i], &header);
+        ser_varlen(blockdl_test_blocks[i], 1);
+        btc_tx_serialize(blockdl_test_blocks[i], tx, false);
+        btc_block_header_hash(&header, blockdl_test_hashes[i]);
+        memcpy(header.prev_block, blockdl_test_hashes[i], sizeof(btc_uint256));
+
+        /* basic filter of the block (the single output script) */
+        blockdl_test_scripts[i] = cstr_new_cstr(((btc_tx_out*)vector_idx(tx->vout, 0))->script_pubkey);
+        vector_resize(elements, 0);
+        vector_add(elements, blockdl_test_scripts[i]);
+        blockdl_test_filters[i] = cstr_new_sz(16);
+        btc_blockfilter_build(blockdl_test_hashes[i], elements, blockdl_test_filters[i]);
+        btc_uint256 filter_hash;
+        btc_blockfilter_hash((const uint8_t*)blockdl_test_filters[i]->str, blockdl_test_filters[i]->len, filter_hash);
+        btc_blockfilter_header(filter_hash, prev_filter_header, blockdl_test_filter_headers[i]);
+        memcpy(prev_filter_header, blockdl_test_filter_headers[i], sizeof(btc_uint256));
+        btc_tx_free(tx);
+    }
+    vector_free(elements, true);
+}
+
+static void blockdl_test_reply_cb(evutil_socket_t fd, short event, void* ctx)
+{
+    (void)(fd);
+    (void)(event);
+    blockdl_test_reply* reply = ctx;
+    bufferevent_write(reply->bev, reply->msg->str, reply->msg->len);
+    cstr_free(reply->msg, true);
+    btc_free(reply);
+}
+
+/* write the (concatenated) messages at once, keeps their order */
+static void blockdl_test_write(struct bufferevent* bev, cstring* msgs)
+{
+    blockdl_test_reply* reply = btc_calloc(1, sizeof(*reply));
+    reply->bev = bev;
+    reply->msg = msgs;
+    struct timeval tv = {0, 0};
+    event_base_once(bufferevent_get_base(bev), -1, EV_TIMEOUT, blockdl_test_reply_cb, reply, &tv);
+}
+
+static void blockdl_test_send(struct bufferevent* bev, const char* command, const void* data, uint32_t len, unsigned int delay_ms)
+{
+    blockdl_test_reply* reply = btc_calloc(1, sizeof(*reply));
+    reply->bev = bev;
+    reply->msg = btc_p2p_message_new(btc_chainparams_regtest.netmagic, command, data, len);
+    struct timeval tv = {0, delay_ms * 1000};
+    event_base_once(bufferevent_get_base(bev), -1, EV_TIMEOUT, blockdl_test_reply_cb, reply, &tv);
+}
+
+/* position after the first known hash of a getheaders/getblocks locator */
+static unsigned int blockdl_test_locator_start(struct const_buffer* buf)
+{
+    uint32_t version, count = 0;
+    btc_uint256 locator;
+    deser_u32(&version, buf);
+    deser_varlen(&count, buf);
+    for (unsigned int i = 0; i < count && deser_u256(locator, buf); i++) {
+        for (unsigned int j = 0; j < blockdl_test_chain_len; j++) {
+            if (memcmp(locator, blockdl_test_hashes[j], sizeof(btc_uint256)) == 0)
+                return j + 1;
+        }
+    }
+    return 0;
+}
+
+/* filter of the block at pos as served by the peer */
+static cstring* blockdl_test_peer_filter(blockdl_test_peer* peer, unsigned int pos)
+{
+    if (peer->hidden_filter && pos == peer->hide_pos)
+        return peer->hidden_filter;
+    return blockdl_test_filters[pos];
+}
+
+/* filter header of the block at pos, consistent with the filters served by the peer */
+static void blockdl_test_peer_filter_header(blockdl_test_peer* peer, unsigned int pos, btc_uint256 header_out)
+{
+    if (!peer->hidden_filter || pos < peer->hide_pos) {
+        memcpy(header_out, blockdl_test_filter_headers[pos], sizeof(btc_uint256));
+        return;
+    }
+    if (peer->hide_pos > 0)
+        memcpy(header_out, blockdl_test_filter_headers[peer->hide_pos - 1], sizeof(btc_uint256));
+    else
+        memset(header_out, 0, sizeof(btc_uint256));
+    for (unsigned int i = peer->hide_pos; i <= pos; i++) {
+        cstring* filter = blockdl_test_peer_filter(peer, i);
+        btc_uint256 filter_hash;
+        btc_blockfilter_hash((const uint8_t*)filter->str, filter->len, filter_hash);
+        btc_blockfilter_header(filter_hash, header_out, header_out);
+    }
+}
+
+/* send the merkle block of the block at pos (with its single tx) followed by the tx if it matches the loaded filter */
+static void blockdl_test_send_merkle_block(blockdl_test_peer* peer, unsigned int pos)
+{
+    cstring* block = blockdl_test_blocks[pos];
+    btc_tx* tx = btc_tx_new();
+    size_t consumed = 0;
+    btc_tx_deserialize((const uint8_t*)block->str + 81, block->len - 81, tx, &consumed, false);
+    btc_uint256 txid;
+    btc_tx_hash(tx, txid);
+    btc_tx_free(tx);
+
+    /* match the txid or the data push of the output script */
+    cstring* script = blockdl_test_scripts[pos];
+    btc_bool match = peer->bloom && (btc_bloom_filter_contains(peer->bloom, txid, sizeof(txid)) ||
+                                     btc_bloom_filter_contains(peer->bloom, (const uint8_t*)script->str + 2, script->len - 2));
+
+    cstring* merkleblock = cstr_new_sz(256);
+    cstr_append_buf(merkleblock, block->str, 80);
+    btc_partial_merkle_tree_build(&txid, &match, 1, merkleblock);
+
+    /* the tx has to directly follow the merkle block */
+    cstring* msgs = btc_p2p_message_new(btc_chainparams_regtest.netmagic, BTC_MSG_MERKLEBLOCK, merkleblock->str, merkleblock->len);
+    if (match) {
+        peer->txs_served++;
+        cstring* tx_msg = btc_p2p_message_new(btc_chainparams_regtest.netmagic, BTC_MSG_TX, block->str + 81, consumed);
+        cstr_append_cstr(msgs, tx_msg);
+        cstr_free(tx_msg, true);
+    }
+    blockdl_test_write(peer->bev, msgs);
+    cstr_free(merkleblock, true);
+}
+
+static void blockdl_test_peer_read_cb(struct bufferevent* bev, void* ctx)
+{
+    blockdl_test_peer* peer = ctx;
+    struct evbuffer* input = bufferevent_get_input(bev);
+    while (evbuffer_get_length(input) >= BTC_P2P_HDRSZ) {
+        unsigned char hdr_data[BTC_P2P_HDRSZ];
+        struct const_buffer hdr_buf = {hdr_data, BTC_P2P_HDRSZ};
+        btc_p2p_msg_hdr hdr;
+        evbuffer_copyout(input, hdr_data, BTC_P2P_HDRSZ);
+        btc_p2p_deser_msghdr(&hdr, &hdr_buf);
+        if (evbuffer_get_length(input) < BTC_P2P_HDRSZ + hdr.data_len)
+            break;
+        evbuffer_drain(input, BTC_P2P_HDRSZ);
+        uint8_t* payload = btc_malloc(hdr.data_len + 1);
+        evbuffer_remove(input, payload, hdr.data_len);
+        struct const_buffer buf = {payload, hdr.data_len};
+
+        if (strcmp(hdr.command, BTC_MSG_GETHEADERS) == 0) {
+            peer->locator_requests++;
+            /* serve up to MAX_HEADERS_RESULTS headers after the locator */
+            unsigned int start = blockdl_test_locator_start(&buf);
+            unsigned int count = blockdl_test_chain_len - start;
+            if (count > MAX_HEADERS_RESULTS)
+                count = MAX_HEADERS_RESULTS;
+            cstring* headers = cstr_new_sz(count * 81 + 5);
+            ser_varlen(headers, count);
+            for (unsigned int i = start; i < start + count; i++) {
+                cstr_append_buf(headers, blockdl_test_blocks[i]->str, 80);
+                ser_varlen(headers, 0);
+            }
+            blockdl_test_send(bev, BTC_MSG_HEADERS, headers->str, headers->len, peer->headers_delay_ms);
+            cstr_free(headers, true);
+        } else if (strcmp(hdr.command, BTC_MSG_GETBLOCKS) == 0) {
+            /* announce the blocks after the locator */
+            peer->locator_requests++;
+            unsigned int start = blockdl_test_locator_start(&buf);
+            cstring* inv = cstr_new_sz((blockdl_test_chain_len - start) * 36 + 5);
+            ser_varlen(inv, blockdl_test_chain_len - start);
+            for (unsigned int i = start; i < blockdl_test_chain_len; i++) {
+                ser_u32(inv, BTC_INV_TYPE_BLOCK);
+                ser_u256(inv, blockdl_test_hashes[i]);
+            }
+            blockdl_test_send(bev, BTC_MSG_INV, inv->str, inv->len, 0);
+            cstr_free(inv, true);
+        } else if (strcmp(hdr.command, BTC_MSG_GETCFHEADERS) == 0 || strcmp(hdr.command, BTC_MSG_GETCFILTERS) == 0) {
+            /* serve the precomputed filters (heights are block positions + 1) */
+            uint8_t filter_type;
+            uint32_t start_height;
+            btc_uint256 stop_hash;
+            deser_bytes(&filter_type, &buf, 1);
+            deser_u32(&start_height, &buf);
+            deser_u256(stop_hash, &buf);
+            unsigned int stop = 0;
+            for (unsigned int j = 0; j < blockdl_test_chain_len; j++) {
+                if (memcmp(stop_hash, blockdl_test_hashes[j], sizeof(btc_uint256)) == 0)
+                    stop = j;
+            }
+            cstring* reply = cstr_new_sz(1024);
+            if (strcmp(hdr.command, BTC_MSG_GETCFHEADERS) == 0) {
+                ser_bytes(reply, &filter_type, 1);
+                ser_u256(reply, stop_hash);
+                if (start_height >= 2) {
+                    btc_uint256 prev_header;
+                    blockdl_test_peer_filter_header(peer, start_height - 2, prev_header);
+                    ser_u256(reply, prev_header);
+                } else
+                    ser_u256(reply, NULLHASH);
+                ser_varlen(reply, stop - (start_height - 1) + 1);
+                for (unsigned int j = start_height - 1; j <= stop; j++) {
+                    btc_uint256 filter_hash;
+                    cstring* filter = blockdl_test_peer_filter(peer, j);
+                    btc_blockfilter_hash((const uint8_t*)filter->str, filter->len, filter_hash);
+                    ser_u256(reply, filter_hash);
+                }
+                blockdl_test_send(bev, BTC_MSG_CFHEADERS, reply->str, reply->len, 0);
+            } else {
+                for (unsigned int j = start_height - 1; j <= stop; j++) {
+                    cstr_resize(reply, 0);
+                    ser_bytes(reply, &filter_type, 1);
+                    ser_u256(reply, blockdl_test_hashes[j]);
+                    ser_varstr(reply, blockdl_test_peer_filter(peer, j));
+                    blockdl_test_send(bev, BTC_MSG_CFILTER, reply->str, reply->len, 0);
+                }
+            }
+            cstr_free(reply, true);
+        } else if (strcmp(hdr.command, BTC_MSG_GETDATA) == 0) {
+            uint32_t count = 0;
+            deser_varlen(&count, &buf);
+            cstring* tx_msgs = NULL;
+            for (unsigned int i = 0; i < count; i++) {
+                uint32_t type;
+                btc_uint256 hash;
+                deser_u32(&type, &buf);
+                deser_u256(hash, &buf);
+                if (type == BTC_INV_TYPE_TX) {
+                    /* relayed txs of the compact block test */
+                    for (unsigned int j = 0; j < CMPCT_TEST_TXS && cmpct_test_block; j++) {
+                        if (memcmp(hash, cmpct_test_txids[j], sizeof(btc_uint256)) != 0)
+                            continue;
+                        cstring* tx_msg = btc_p2p_message_new(btc_chainparams_regtest.netmagic, BTC_MSG_TX, cmpct_test_txs[j]->str, cmpct_test_txs[j]->len);
+                        if (!tx_msgs)
+                            tx_msgs = cstr_new_sz(256);
+                        cstr_append_cstr(tx_msgs, tx_msg);
+                        cstr_free(tx_msg, true);
+                    }
+                    continue;
+                }
+                peer->requested++;
+                if (peer->behavior == BLOCKDL_TEST_STALL)
+                    continue;
+                for (unsigned int j = 0; j < blockdl_test_chain_len; j++) {
+                    if (memcmp(hash, blockdl_test_hashes[j], sizeof(btc_uint256)) == 0) {
+                        peer->served++;
+                        if (type == BTC_INV_TYPE_FILTERED_BLOCK)
+                            blockdl_test_send_merkle_block(peer, j);
+                        else
+                            blockdl_test_send(bev, BTC_MSG_BLOCK, blockdl_test_blocks[j]->str, blockdl_test_blocks[j]->len, (peer->behavior == BLOCKDL_TEST_SLOW ? 50 : 0));
+                    }
+                }
+            }
+            if (tx_msgs) {
+                /* announce the new block right after its relayed txs */
+                cstring* cmpctblock = cstr_new_sz(256);
+                btc_cmpctblock_build((const uint8_t*)cmpct_test_block->str, cmpct_test_block->len, 42, cmpctblock);
+                cstring* msg = btc_p2p_message_new(btc_chainparams_regtest.netmagic, BTC_MSG_CMPCTBLOCK, cmpctblock->str, cmpctblock->len);
+                cstr_append_cstr(tx_msgs, msg);
+                cstr_free(msg, true);
+                cstr_free(cmpctblock, true);
+                blockdl_test_write(bev, tx_msgs);
+            }
+        } else if (strcmp(hdr.command, BTC_MSG_SENDCMPCT) == 0) {
+            uint8_t announce = 0;
+            deser_bytes(&announce, &buf, 1);
+            peer->sendcmpct = (announce == 1);
+        } else if (strcmp(hdr.command, BTC_MSG_SENDHEADERS) == 0) {
+            peer->sendheaders = true;
+        } else if (strcmp(hdr.command, BTC_MSG_GETBLOCKTXN) == 0) {
+            btc_uint256 hash;
+            uint32_t count = 0;
+            deser_u256(hash, &buf);
+            deser_varlen(&count, &buf);
+            cstring* blocktxn = cstr_new_sz(512);
+            ser_u256(blocktxn, hash);
+            ser_varlen(blocktxn, count);
+            int last = -1;
+            for (unsigned int i = 0; i < count; i++) {
+                uint32_t diff = 0;
+                deser_varlen(&diff, &buf);
+                last = last + 1 + diff;
+                if (last < CMPCT_TEST_TXS)
+                    cstr_append_cstr(blocktxn, cmpct_test_txs[last]);
+                peer->blocktxn_requested++;
+            }
+            blockdl_test_send(bev, BTC_MSG_BLOCKTXN, blocktxn->str, blocktxn->len, 0);
+            cstr_free(blocktxn, true);
+        } else if (strcmp(hdr.command, BTC_MSG_FILTERLOAD) == 0) {
+            uint32_t size = 0;
+            deser_varlen(&size, &buf);
+            btc_bloom_filter_free(peer->bloom);
+            peer->bloom = btc_calloc(1, sizeof(*peer->bloom));
+            peer->bloom->size = size;
+            peer->bloom->data = btc_malloc(size);
+            deser_bytes(peer->bloom->data, &buf, size);
+            deser_u32(&peer->bloom->n_hash_funcs, &buf);
+            deser_u32(&peer->bloom->tweak, &buf);
+            deser_bytes(&peer->bloom->flags, &buf, 1);
+        } else if (strcmp(hdr.command, BTC_MSG_PING) == 0) {
+            blockdl_test_send(bev, BTC_MSG_PONG, payload, hdr.data_len, 0);
+        }
+        btc_free(payload);
+    }
+}
+
+static void blockdl_test_accept_cb(struct evconnlistener* listener, evutil_socket_t fd, struct sockaddr* addr, int socklen, void* ctx)
+{
+    (void)(addr);
+    (void)(socklen);
+    blockdl_test_peer* peer = ctx;
+    peer->bev = bufferevent_socket_new(evconnlistener_get_base(listener), fd, BEV_OPT_CLOSE_ON_FREE);
+    bufferevent_setcb(peer->bev, blockdl_test_peer_read_cb, NULL, NULL, peer);
+    bufferevent_enable(peer->bev, EV_READ | EV_WRITE);
+
+    /* version handshake from the peer side */
+    btc_p2p_version_msg version_msg;
+    btc_p2p_address addr_local;
+    btc_p2p_address_init(&addr_local);
+    btc_p2p_msg_version_init(&version_msg, &addr_local, &addr_local, "/blockdl-test/", false);
+    version_msg.services = BTC_NODE_NETWORK | peer->services;
+    version_msg.start_height = blockdl_test_chain_len;
+    cstring* version = cstr_new_sz(256);
+    btc_p2p_msg_version_ser(&version_msg, version);
+    blockdl_test_send(peer->bev, BTC_MSG_VERSION, version->str, version->len, 0);
+    blockdl_test_send(peer->bev, BTC_MSG_VERACK, NULL, 0, 0);
+    cstr_free(version, true);
+}
+
+static void blockdl_test_sync_transaction(void* ctx, btc_tx* tx, unsigned int pos, btc_blockindex* pindex)
+{
+    (void)(ctx);
+    (void)(tx);
+    (void)(pos);
+    if (pindex->height != blockdl_test_next_height)
+        blockdl_test_in_order = false;
+    blockdl_test_next_height++;
+}
+
+static void blockdl_test_sync_completed(btc_spv_client* client)
+{
+    blockdl_test_completed = true;
+    event_base_loopexit(client->nodegroup->event_base, NULL);
+}
+
+static void blockdl_test_free_blocks()
+{
+    for (unsigned int i = 0; i < blockdl_test_chain_len; i++) {
+        cstr_free(blockdl_test_blocks[i], true);
+        cstr_free(blockdl_test_scripts[i], true);
+        cstr_free(blockdl_test_filters[i], true);
+    }
+    btc_free(blockdl_test_blocks);
+    btc_free(blockdl_test_hashes);
+    btc_free(blockdl_test_scripts);
+    btc_free(blockdl_test_filters);
+    btc_free(blockdl_test_filter_headers);
+    blockdl_test_chain_len = 0;
+}
+
+static struct evconnlistener* blockdl_test_listen(btc_spv_client* client, blockdl_test_peer* peer, char* ips)
+{
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sin.sin_port = 0;
+    struct evconnlistener* listener = evconnlistener_new_bind(client->nodegroup->event_base, blockdl_test_accept_cb, peer, LEV_OPT_REUSEABLE | LEV_OPT_CLOSE_ON_FREE, -1, (struct sockaddr*)&sin, sizeof(sin));
+    socklen_t sinlen = sizeof(sin);
+    getsockname(evconnlistener_get_fd(listener), (struct sockaddr*)&sin, &sinlen);
+    sprintf(ips + strlen(ips), "%s127.0.0.1:%d", (strlen(ips) > 0 ? "," : ""), ntohs(sin.sin_port));
+    return listener;
+}
+
+void test_netspv_block_download()
+{
+    blockdl_test_create_blocks(BLOCKDL_TEST_BLOCKS);
+
+    btc_spv_client* client = btc_spv_client_new(&btc_chainparams_regtest, false, true);
+    client->use_checkpoints = false;
+    /* start downloading blocks after the header at height BLOCKDL_TEST_SCAN_FROM (the scan starts ~5 blocks before the birthday) */
+    client->oldest_item_of_interest = 1296688602 + BLOCKDL_TEST_SCAN_FROM * 600 + 2700;
+    client->block_download_timeout_ms = 300;
+    client->sync_transaction = blockdl_test_sync_transaction;
+    client->sync_completed = blockdl_test_sync_completed;
+
+    char ips[128] = {0};
+    struct evconnlistener* listeners[BLOCKDL_TEST_PEERS];
+    for (unsigned int i = 0; i < BLOCKDL_TEST_PEERS; i++) {
+        memset(&blockdl_test_peers[i], 0, sizeof(blockdl_test_peers[i]));
+        blockdl_test_peers[i].behavior = (enum blockdl_test_behavior)i;
+        listeners[i] = blockdl_test_listen(client, &blockdl_test_peers[i], ips);
+    }
+    btc_spv_client_discover_peers(client, ips);
+
+    struct timeval tv = {10, 0};
+    event_base_loopexit(client->nodegroup->event_base, &tv);
+    btc_spv_client_runloop(client);
+
+    u_assert_int_eq(blockdl_test_completed, true);
+    u_assert_int_eq(blockdl_test_in_order, true);
+    u_assert_int_eq(blockdl_test_next_height, BLOCKDL_TEST_BLOCKS + 1);
+    u_assert_int_eq(client->headers_db->getchaintip(client->headers_db_ctx)->height, BLOCKDL_TEST_BLOCKS);
+    u_assert_int_eq(client->block_queue->len, 0);
+
+    /* the stalled requests have been served by the other peers */
+    u_assert_int_eq(blockdl_test_peers[BLOCKDL_TEST_STALL].requested > 0, true);
+    u_assert_int_eq(blockdl_test_peers[BLOCKDL_TEST_SLOW].served > 0, true);
+    u_assert_int_eq(blockdl_test_peers[BLOCKDL_TEST_FAST].served > 0, true);
+    u_assert_int_eq(blockdl_test_peers[BLOCKDL_TEST_FAST].served > blockdl_test_peers[BLOCKDL_TEST_SLOW].served, true);
+
+    btc_node_group_shutdown(client->nodegroup);
+    for (unsigned int i = 0; i < BLOCKDL_TEST_PEERS; i++) {
+        if (blockdl_test_peers[i].bev)
+            bufferevent_free(blockdl_test_peers[i].bev);
+        evconnlistener_free(listeners[i]);
+    }
+    btc_spv_client_free(client);
+    blockdl_test_free_blocks();
+}
+
+void test_netspv_block_pipeline()
+{
+    blockdl_test_create_blocks(BLOCKDL_TEST_BLOCKS);
+    blockdl_test_next_height = BLOCKDL_TEST_SCAN_FROM + 1;
+    blockdl_test_in_order = true;
+    blockdl_test_completed = false;
+
+    btc_spv_client* client = btc_spv_client_new(&btc_chainparams_regtest, false, true);
+    client->use_checkpoints = false;
+    client->oldest_item_of_interest = 1296688602 + BLOCKDL_TEST_SCAN_FROM * 600 + 2700;
+    client->sync_transaction = blockdl_test_sync_transaction;
+    client->sync_completed = blockdl_test_sync_completed;
+    /* a small pipeline holds back the block requests */
+    u_assert_int_eq(btc_spv_client_set_block_workers(client, 3, 2), true);
+
+    char ips[32] = {0};
+    memset(&blockdl_test_peers[0], 0, sizeof(blockdl_test_peers[0]));
+    blockdl_test_peers[0].behavior = BLOCKDL_TEST_FAST;
+    struct evconnlistener* listener = blockdl_test_listen(client, &blockdl_test_peers[0], ips);
+    btc_spv_client_discover_peers(client, ips);
+
+    struct timeval tv = {10, 0};
+    event_base_loopexit(client->nodegroup->event_base, &tv);
+    btc_spv_client_runloop(client);
+
+    /* parsed on the workers, passed to the callback in chain order */
+    u_assert_int_eq(blockdl_test_completed, true);
+    u_assert_int_eq(blockdl_test_in_order, true);
+    u_assert_int_eq(blockdl_test_next_height, BLOCKDL_TEST_BLOCKS + 1);
+
+    btc_spv_pipeline_stats stats;
+    btc_spv_client_get_pipeline_stats(client, &stats);
+    u_assert_int_eq(stats.blocks, BLOCKDL_TEST_BLOCKS - BLOCKDL_TEST_SCAN_FROM);
+    u_assert_int_eq(stats.txs, BLOCKDL_TEST_BLOCKS - BLOCKDL_TEST_SCAN_FROM);
+    u_assert_int_eq(stats.parse.count, stats.blocks);
+    u_assert_int_eq(stats.callback.count, stats.blocks);
+    u_assert_int_eq(stats.pending, 0);
+    u_assert_int_eq(stats.pending_max <= 2, true);
+    u_assert_int_eq(stats.backpressure > 0, true);
+
+    btc_node_group_shutdown(client->nodegroup);
+    if (blockdl_test_peers[0].bev)
+        bufferevent_free(blockdl_test_peers[0].bev);
+    evconnlistener_free(listener);
+    btc_spv_client_free(client);
+    blockdl_test_free_blocks();
+}
+
+/* heights of the blocks matched for a watcher */
+typedef struct watcher_test_ctx_ {
+    unsigned int heights[4];
+    unsigned int count;
+} watcher_test_ctx;
+
+static void watcher_test_sync_transaction(void* ctx, btc_tx* tx, unsigned int pos, btc_blockindex* pindex)
+{
+    (void)(tx);
+    (void)(pos);
+    watcher_test_ctx* wctx = (watcher_test_ctx*)ctx;
+    if (wctx->count < 4)
+        wctx->heights[wctx->count] = pindex->height;
+    wctx->count++;
+}
+
+static void watcher_test_watch(btc_spv_client* client, btc_spv_watcher* watcher, unsigned int height)
+{
+    cstring* script = blockdl_test_scripts[height - 1];
+    btc_spv_watcher_watch_script(client, watcher, (const uint8_t*)script->str, script->len);
+}
+
+void test_netspv_watchers()
+{
+    blockdl_test_create_blocks(BLOCKDL_TEST_BLOCKS);
+    blockdl_test_next_height = BLOCKDL_TEST_SCAN_FROM + 1;
+    blockdl_test_in_order = true;
+    blockdl_test_completed = false;
+
+    btc_spv_client* client = btc_spv_client_new(&btc_chainparams_regtest, false, true);
+    client->use_checkpoints = false;
+    client->oldest_item_of_interest = 1296688602 + BLOCKDL_TEST_SCAN_FROM * 600 + 2700;
+    client->sync_transaction = blockdl_test_sync_transaction;
+    client->sync_completed = blockdl_test_sync_completed;
+
+    /* two wallets share a script, the third one is removed before the scan */
+    watcher_test_ctx ctx_a, ctx_b, ctx_c;
+    memset(&ctx_a, 0, sizeof(ctx_a));
+    memset(&ctx_b, 0, sizeof(ctx_b));
+    memset(&ctx_c, 0, sizeof(ctx_c));
+    btc_spv_watcher* watcher_a = btc_spv_client_add_watcher(client, watcher_test_sync_transaction, &ctx_a);
+    btc_spv_watcher* watcher_b = btc_spv_client_add_watcher(client, watcher_test_sync_transaction, &ctx_b);
+    btc_spv_watcher* watcher_c = btc_spv_client_add_watcher(client, watcher_test_sync_transaction, &ctx_c);
+    watcher_test_watch(client, watcher_a, 15);
+    watcher_test_watch(client, watcher_a, 40);
+    watcher_test_watch(client, watcher_b, 20);
+    watcher_test_watch(client, watcher_b, 40);
+    watcher_test_watch(client, watcher_c, 30);
+    watcher_test_watch(client, watcher_c, 40);
+    cstring* script = blockdl_test_scripts[14];
+    u_assert_int_eq(btc_spv_watcher_watch_script(client, watcher_a, (const uint8_t*)script->str, script->len), false);
+    u_assert_int_eq(client->watch_index->count, 6);
+    btc_spv_client_remove_watcher(client, watcher_c);
+    u_assert_int_eq(client->watchers->len, 2);
+    u_assert_int_eq(client->watch_index->count, 4);
+
+    char ips[32] = {0};
+    memset(&blockdl_test_peers[0], 0, sizeof(blockdl_test_peers[0]));
+    blockdl_test_peers[0].behavior = BLOCKDL_TEST_FAST;
+    struct evconnlistener* listener = blockdl_test_listen(client, &blockdl_test_peers[0], ips);
+    btc_spv_client_discover_peers(client, ips);
+
+    struct timeval tv = {10, 0};
+    event_base_loopexit(client->nodegroup->event_base, &tv);
+    btc_spv_client_runloop(client);
+
+    /* each block was parsed once, the matches went to the owning watchers */
+    u_assert_int_eq(blockdl_test_completed, true);
+    u_assert_int_eq(blockdl_test_next_height, BLOCKDL_TEST_BLOCKS + 1);
+    u_assert_int_eq(ctx_a.count, 2);
+    u_assert_int_eq(ctx_a.heights[0], 15);
+    u_assert_int_eq(ctx_a.heights[1], 40);
+    u_assert_int_eq(ctx_b.count, 2);
+    u_assert_int_eq(ctx_b.heights[0], 20);
+    u_assert_int_eq(ctx_b.heights[1], 40);
+    u_assert_int_eq(ctx_c.count, 0);
+
+    btc_node_group_shutdown(client->nodegroup);
+    if (blockdl_test_peers[0].bev)
+        bufferevent_free(blockdl_test_peers[0].bev);
+    evconnlistener_free(listener);
+    btc_spv_client_free(client);
+    blockdl_test_free_blocks();
+}
+
+static btc_bool rescan_test_completed = false;
+
+static void rescan_test_rescan_completed(btc_spv_client* client)
+{
+    rescan_test_completed = true;
+    event_base_loopexit(client->nodegroup->event_base, NULL);
+}
+
+static void rescan_test_run(btc_spv_client* client, uint32_t from_height)
+{
+    blockdl_test_next_height = from_height;
+    blockdl_test_in_order = true;
+    rescan_test_completed = false;
+    struct timeval tv = {10, 0};
+    event_base_loopexit(client->nodegroup->event_base, &tv);
+    btc_spv_client_rescan(client, from_height);
+    if (!rescan_test_completed)
+        btc_node_group_event_loop(client->nodegroup);
+}
+
+void test_netspv_block_store()
+{
+    const char* dir = "/tmp/libbtc_netspv_blockstore_test";
+    char path[64];
+    for (unsigned int i = 0; i < 16; i++) {
+        snprintf(path, sizeof(path), "%s/blk%05u.dat", dir, i);
+        unlink(path);
+    }
+
+    blockdl_test_create_blocks(BLOCKDL_TEST_BLOCKS);
+    blockdl_test_next_height = BLOCKDL_TEST_SCAN_FROM + 1;
+    blockdl_test_in_order = true;
+    blockdl_test_completed = false;
+
+    btc_spv_client* client = btc_spv_client_new(&btc_chainparams_regtest, false, true);
+    client->use_checkpoints = false;
+    client->oldest_item_of_interest = 1296688602 + BLOCKDL_TEST_SCAN_FROM * 600 + 2700;
+    client->sync_transaction = blockdl_test_sync_transaction;
+    client->sync_completed = blockdl_test_sync_completed;
+    client->rescan_completed = rescan_test_rescan_completed;
+    u_assert_int_eq(btc_spv_client_rescan(client, 1), false);
+    u_assert_int_eq(btc_spv_client_open_block_store(client, dir), true);
+    /* about ten blocks per file */
+    client->block_store->max_file_size = 2000;
+
+    char ips[32] = {0};
+    memset(&blockdl_test_peers[0], 0, sizeof(blockdl_test_peers[0]));
+    blockdl_test_peers[0].behavior = BLOCKDL_TEST_FAST;
+    struct evconnlistener* listener = blockdl_test_listen(client, &blockdl_test_peers[0], ips);
+    btc_spv_client_discover_peers(client, ips);
+
+    struct timeval tv = {10, 0};
+    event_base_loopexit(client->nodegroup->event_base, &tv);
+    btc_spv_client_runloop(client);
+
+    /* the downloaded blocks have been stored */
+    u_assert_int_eq(blockdl_test_completed, true);
+    u_assert_int_eq(client->block_store->entries->len, BLOCKDL_TEST_BLOCKS - BLOCKDL_TEST_SCAN_FROM);
+    u_assert_int_eq(client->block_store->current_file > 2, true);
+    unsigned int requested = blockdl_test_peers[0].requested;
+
+    /* a rescan is served from the store */
+    rescan_test_run(client, 30);
+    u_assert_int_eq(rescan_test_completed, true);
+    u_assert_int_eq(blockdl_test_in_order, true);
+    u_assert_int_eq(blockdl_test_next_height, BLOCKDL_TEST_BLOCKS + 1);
+    u_assert_int_eq(blockdl_test_peers[0].requested, requested);
+
+    /* the blocks no longer in the store are downloaded again */
+    btc_blockstore_set_retention(client->block_store, 35, 0);
+    u_assert_int_eq(btc_blockstore_find(client->block_store, blockdl_test_hashes[24]) == NULL, true);
+    rescan_test_run(client, 25);
+    u_assert_int_eq(rescan_test_completed, true);
+    u_assert_int_eq(blockdl_test_in_order, true);
+    u_assert_int_eq(blockdl_test_next_height, BLOCKDL_TEST_BLOCKS + 1);
+    u_assert_int_eq(blockdl_test_peers[0].requested > requested, true);
+    u_assert_int_eq(client->block_queue->len, 0);
+
+    btc_node_group_shutdown(client->nodegroup);
+    if (blockdl_test_peers[0].bev)
+        bufferevent_free(blockdl_test_peers[0].bev);
+    evconnlistener_free(listener);
+    btc_spv_client_free(client);
+    blockdl_test_free_blocks();
+
+    for (unsigned int i = 0; i < 16; i++) {
+        snprintf(path, sizeof(path), "%s/blk%05u.dat", dir, i);
+        unlink(path);
+    }
+    rmdir(dir);
+}
+
+/* rescan below the in-memory window of the file based headers db */
+void test_netspv_block_store_window()
+{
+    const char* dir = "/tmp/libbtc_netspv_blockstore_window_test";
+    const char* headersfile = "/tmp/libbtc_netspv_blockstore_window_headers";
+    char path[64];
+    for (unsigned int i = 0; i < 16; i++) {
+        snprintf(path, sizeof(path), "%s/blk%05u.dat", dir, i);
+        unlink(path);
+    }
+    unlink(headersfile);
+
+    blockdl_test_create_blocks(BLOCKDL_TEST_BLOCKS);
+    blockdl_test_next_height = BLOCKDL_TEST_SCAN_FROM + 1;
+    blockdl_test_in_order = true;
+    blockdl_test_completed = false;
+
+    btc_spv_client* client = btc_spv_client_new(&btc_chainparams_regtest, false, false);
+    client->use_checkpoints = false;
+    client->oldest_item_of_interest = 1296688602 + BLOCKDL_TEST_SCAN_FROM * 600 + 2700;
+    client->sync_transaction = blockdl_test_sync_transaction;
+    client->sync_completed = blockdl_test_sync_completed;
+    client->rescan_completed = rescan_test_rescan_completed;
+    u_assert_int_eq(btc_spv_client_load(client, headersfile), true);
+    btc_headers_db* headers_db = (btc_headers_db*)client->headers_db_ctx;
+    btc_headers_db_set_mem_budget(headers_db, 2 * 1024);
+    u_assert_int_eq(btc_spv_client_open_block_store(client, dir), true);
+
+    char ips[32] = {0};
+    memset(&blockdl_test_peers[0], 0, sizeof(blockdl_test_peers[0]));
+    blockdl_test_peers[0].behavior = BLOCKDL_TEST_FAST;
+    struct evconnlistener* listener = blockdl_test_listen(client, &blockdl_test_peers[0], ips);
+    btc_spv_client_discover_peers(client, ips);
+
+    struct timeval tv = {10, 0};
+    event_base_loopexit(client->nodegroup->event_base, &tv);
+    btc_spv_client_runloop(client);
+    u_assert_int_eq(blockdl_test_completed, true);
+    unsigned int requested = blockdl_test_peers[0].requested;
+
+    /* the blocks below the headers window are taken from the store by height */
+    u_assert_int_eq(headers_db->chainbottom->height > 30, true);
+    rescan_test_run(client, 30);
+    u_assert_int_eq(rescan_test_completed, true);
+    u_assert_int_eq(blockdl_test_in_order, true);
+    u_assert_int_eq(blockdl_test_next_height, BLOCKDL_TEST_BLOCKS + 1);
+    u_assert_int_eq(blockdl_test_peers[0].requested, requested);
+
+    /* blocks neither stored nor in the headers window are skipped */
+    rescan_test_run(client, 1);
+    u_assert_int_eq(rescan_test_completed, true);
+    u_assert_int_eq(blockdl_test_next_height, 1 + BLOCKDL_TEST_BLOCKS - BLOCKDL_TEST_SCAN_FROM);
+    u_assert_int_eq(blockdl_test_peers[0].requested, requested);
+
+    btc_node_group_shutdown(client->nodegroup);
+    if (blockdl_test_peers[0].bev)
+        bufferevent_free(blockdl_test_peers[0].bev);
+    evconnlistener_free(listener);
+    btc_spv_client_free(client);
+    blockdl_test_free_blocks();
+
+    for (unsigned int i = 0; i < 16; i++) {
+        snprintf(path, sizeof(path), "%s/blk%05u.dat", dir, i);
+        unlink(path);
+    }
+    rmdir(dir);
+    unlink(headersfile);
+}
+
+static unsigned int headers_test_batches = 0;
+static uint64_t headers_test_requests[4];
+static int headers_test_on_wire[4]; /* bytes the peer can read from its socket */
+
+static uint64_t headers_test_getheaders_sent(btc_node* node)
+{
+    for (unsigned int i = 0; i < node->stats.commands_count; i++) {
+        if (strcmp(node->stats.commands[i].command, BTC_MSG_GETHEADERS) == 0)
+            return node->stats.commands[i].msgs_out;
+    }
+    return 0;
+}
+
+static btc_bool headers_test_message_processed(struct btc_spv_client_* client, btc_node* node, btc_blockindex* newtip)
+{
+    /* amount of getheaders sent when a batch has been connected */
+    if (headers_test_batches < sizeof(headers_test_requests) / sizeof(headers_test_requests[0])) {
+        headers_test_requests[headers_test_batches] = headers_test_getheaders_sent(node);
+        /* the peer runs on the same loop, it hasn't read anything since the batch arrived */
+        headers_test_on_wire[headers_test_batches] = 0;
+        if (blockdl_test_peers[0].bev)
+            ioctl(bufferevent_getfd(blockdl_test_peers[0].bev), FIONREAD, &headers_test_on_wire[headers_test_batches]);
+    }
+    headers_test_batches++;
+    if (newtip->height == HEADERS_TEST_BLOCKS)
+        event_base_loopexit(client->nodegroup->event_base, NULL);
+    return true;
+}
+
+void test_netspv_headers_pipelining()
+{
+    blockdl_test_create_blocks(HEADERS_TEST_BLOCKS);
+
+    btc_spv_client* client = btc_spv_client_new(&btc_chainparams_regtest, false, true);
+    client->use_checkpoints = false;
+    client->header_message_processed = headers_test_message_processed;
+
+    char ips[32] = {0};
+    memset(&blockdl_test_peers[0], 0, sizeof(blockdl_test_peers[0]));
+    blockdl_test_peers[0].behavior = BLOCKDL_TEST_FAST;
+    blockdl_test_peers[0].headers_delay_ms = 20;
+    struct evconnlistener* listener = blockdl_test_listen(client, &blockdl_test_peers[0], ips);
+    btc_spv_client_discover_peers(client, ips);
+
+    struct timeval tv = {10, 0};
+    event_base_loopexit(client->nodegroup->event_base, &tv);
+    btc_spv_client_runloop(client);
+
+    u_assert_int_eq(client->headers_db->getchaintip(client->headers_db_ctx)->height, HEADERS_TEST_BLOCKS);
+    u_assert_int_eq(headers_test_batches, 3);
+    /* the next getheaders was sent before the full batches were connected */
+    u_assert_int_eq(headers_test_requests[0], 2);
+    u_assert_int_eq(headers_test_requests[1], 3);
+    u_assert_int_eq(headers_test_requests[2], 3);
+    /* and it has been written to the socket before connecting them, not at the end of the loop iteration */
+    u_assert_int_eq(headers_test_on_wire[0] >= (int)BTC_P2P_HDRSZ, true);
+    u_assert_int_eq(headers_test_on_wire[1] >= (int)BTC_P2P_HDRSZ, true);
+
+    btc_node_group_shutdown(client->nodegroup);
+    if (blockdl_test_peers[0].bev)
+        bufferevent_free(blockdl_test_peers[0].bev);
+    evconnlistener_free(listener);
+    btc_spv_client_free(client);
+    blockdl_test_free_blocks();
+}
+
+#define FILTER_TEST_BLOCKS 2500
+
+/* heights of the blocks with a watched script */
+static const unsigned int* filter_test_matches = NULL;
+static unsigned int filter_test_synced = 0;
+
+static void filter_test_sync_transaction(void* ctx, btc_tx* tx, unsigned int pos, btc_blockindex* pindex)
+{
+    (void)(ctx);
+    (void)(tx);
+    (void)(pos);
+    if (filter_test_synced >= 3 || filter_test_matches[filter_test_synced] != pindex->height)
+        blockdl_test_in_order = false;
+    filter_test_synced++;
+}
+
+void test_netspv_compact_filters()
+{
+    static const unsigned int matches[3] = {15, 1500, 2400};
+    filter_test_matches = matches;
+    filter_test_synced = 0;
+    blockdl_test_create_blocks(FILTER_TEST_BLOCKS);
+    blockdl_test_in_order = true;
+    blockdl_test_completed = false;
+
+    btc_spv_client* client = btc_spv_client_new(&btc_chainparams_regtest, false, true);
+    client->use_checkpoints = false;
+    client->use_compact_filters = true;
+    client->oldest_item_of_interest = 1296688602 + BLOCKDL_TEST_SCAN_FROM * 600 + 2700;
+    client->sync_transaction = filter_test_sync_transaction;
+    client->sync_completed = blockdl_test_sync_completed;
+    for (unsigned int i = 0; i < 3; i++) {
+        cstring* script = blockdl_test_scripts[filter_test_matches[i] - 1];
+        btc_spv_client_watch_script(client, (const uint8_t*)script->str, script->len);
+    }
+
+    char ips[32] = {0};
+    memset(&blockdl_test_peers[0], 0, sizeof(blockdl_test_peers[0]));
+    blockdl_test_peers[0].behavior = BLOCKDL_TEST_FAST;
+    blockdl_test_peers[0].services = BTC_NODE_COMPACT_FILTERS;
+    struct evconnlistener* listener = blockdl_test_listen(client, &blockdl_test_peers[0], ips);
+    btc_spv_client_discover_peers(client, ips);
+
+    struct timeval tv = {10, 0};
+    event_base_loopexit(client->nodegroup->event_base, &tv);
+    btc_spv_client_runloop(client);
+
+    /* all headers were loaded, only the matching blocks were downloaded */
+    u_assert_int_eq(blockdl_test_completed, true);
+    u_assert_int_eq(client->headers_db->getchaintip(client->headers_db_ctx)->height, FILTER_TEST_BLOCKS);
+    u_assert_int_eq(filter_test_synced, 3);
+    u_assert_int_eq(blockdl_test_in_order, true);
+    u_assert_int_eq(blockdl_test_peers[0].requested, 3);
+
+    btc_node_group_shutdown(client->nodegroup);
+    if (blockdl_test_peers[0].bev)
+        bufferevent_free(blockdl_test_peers[0].bev);
+    evconnlistener_free(listener);
+    btc_spv_client_free(client);
+    blockdl_test_free_blocks();
+}
+
+static unsigned int filter_cross_test_height = 0; /* of the last synced block */
+static btc_bool filter_cross_test_hidden_synced = false;
+
+static void filter_cross_test_sync_transaction(void* ctx, btc_tx* tx, unsigned int pos, btc_blockindex* pindex)
+{
+    (void)(ctx);
+    (void)(tx);
+    (void)(pos);
+    if (pindex->height <= filter_cross_test_height)
+        blockdl_test_in_order = false;
+    filter_cross_test_height = pindex->height;
+    if (pindex->height == 1500)
+        filter_cross_test_hidden_synced = true;
+}
+
+/* the peer liar serves filters leaving out a match, the test doesn't control which peer gets to serve the filters */
+static void filter_cross_test_run(unsigned int liar)
+{
+    static const unsigned int matches[3] = {15, 1500, 2400};
+    filter_cross_test_height = 0;
+    filter_cross_test_hidden_synced = false;
+    blockdl_test_create_blocks(FILTER_TEST_BLOCKS);
+    blockdl_test_in_order = true;
+    blockdl_test_completed = false;
+
+    btc_spv_client* client = btc_spv_client_new(&btc_chainparams_regtest, false, true);
+    client->use_checkpoints = false;
+    client->use_compact_filters = true;
+    client->oldest_item_of_interest = 1296688602 + BLOCKDL_TEST_SCAN_FROM * 600 + 2700;
+    client->sync_transaction = filter_cross_test_sync_transaction;
+    client->sync_completed = blockdl_test_sync_completed;
+    for (unsigned int i = 0; i < 3; i++) {
+        cstring* script = blockdl_test_scripts[matches[i] - 1];
+        btc_spv_client_watch_script(client, (const uint8_t*)script->str, script->len);
+    }
+
+    char ips[64] = {0};
+    struct evconnlistener* listeners[2];
+    for (unsigned int i = 0; i < 2; i++) {
+        memset(&blockdl_test_peers[i], 0, sizeof(blockdl_test_peers[i]));
+        blockdl_test_peers[i].behavior = BLOCKDL_TEST_FAST;
+        blockdl_test_peers[i].services = BTC_NODE_COMPACT_FILTERS;
+        listeners[i] = blockdl_test_listen(client, &blockdl_test_peers[i], ips);
+    }
+    /* consistent filters and filter headers, without the match at height 1500 */
+    vector* elements = vector_new(1, NULL);
+    blockdl_test_peers[liar].hide_pos = matches[1] - 1;
+    blockdl_test_peers[liar].hidden_filter = cstr_new_sz(16);
+    btc_blockfilter_build(blockdl_test_hashes[matches[1] - 1], elements, blockdl_test_peers[liar].hidden_filter);
+    vector_free(elements, true);
+    btc_spv_client_discover_peers(client, ips);
+
+    struct timeval tv = {10, 0};
+    event_base_loopexit(client->nodegroup->event_base, &tv);
+    btc_spv_client_runloop(client);
+
+    /* the filter headers of the batch with the hidden match disagree, all its blocks were downloaded */
+    u_assert_int_eq(blockdl_test_completed, true);
+    u_assert_int_eq(client->headers_db->getchaintip(client->headers_db_ctx)->height, FILTER_TEST_BLOCKS);
+    u_assert_int_eq(filter_cross_test_hidden_synced, true);
+    u_assert_int_eq(filter_cross_test_height, matches[2]);
+    u_assert_int_eq(blockdl_test_in_order, true);
+    unsigned int served = blockdl_test_peers[0].served + blockdl_test_peers[1].served;
+    u_assert_int_eq(served >= MAX_GETCFILTERS_SIZE + 2, true);
+    /* the filters of the other batches were trusted */
+    u_assert_int_eq(served < 2 * MAX_GETCFILTERS_SIZE, true);
+
+    /* without knowing which one lies, none of them is blamed */
+    u_assert_int_eq(client->nodegroup->nodes->len, 2);
+    for (size_t i = 0; i < client->nodegroup->nodes->len; i++) {
+        btc_node* node = vector_idx(client->nodegroup->nodes, i);
+        u_assert_int_eq(node->state & NODE_MISSBEHAVED, 0);
+    }
+
+    btc_node_group_shutdown(client->nodegroup);
+    for (unsigned int i = 0; i < 2; i++) {
+        if (blockdl_test_peers[i].bev)
+            bufferevent_free(blockdl_test_peers[i].bev);
+        evconnlistener_free(listeners[i]);
+    }
+    cstr_free(blockdl_test_peers[liar].hidden_filter, true);
+    btc_spv_client_free(client);
+    blockdl_test_free_blocks();
+}
+
+void test_netspv_compact_filters_cross_check()
+{
+    filter_cross_test_run(0);
+    filter_cross_test_run(1);
+}
+
+void test_netspv_bloom_filter()
+{
+    static const unsigned int matches[3] = {15, 30, 50};
+    filter_test_matches = matches;
+    filter_test_synced = 0;
+    blockdl_test_create_blocks(BLOCKDL_TEST_BLOCKS);
+    blockdl_test_in_order = true;
+    blockdl_test_completed = false;
+
+    btc_spv_client* client = btc_spv_client_new(&btc_chainparams_regtest, false, true);
+    client->use_checkpoints = false;
+    client->use_bloom_filter = true;
+    client->bloom_fp_rate = 0.000001;
+    client->oldest_item_of_interest = 1296688602 + BLOCKDL_TEST_SCAN_FROM * 600 + 2700;
+    client->sync_transaction = filter_test_sync_transaction;
+    client->sync_completed = blockdl_test_sync_completed;
+    for (unsigned int i = 0; i < 3; i++) {
+        cstring* script = blockdl_test_scripts[matches[i] - 1];
+        btc_spv_client_watch_script(client, (const uint8_t*)script->str, script->len);
+    }
+
+    char ips[32] = {0};
+    memset(&blockdl_test_peers[0], 0, sizeof(blockdl_test_peers[0]));
+    blockdl_test_peers[0].behavior = BLOCKDL_TEST_FAST;
+    blockdl_test_peers[0].services = BTC_NODE_BLOOM;
+    struct evconnlistener* listener = blockdl_test_listen(client, &blockdl_test_peers[0], ips);
+    btc_spv_client_discover_peers(client, ips);
+
+    struct timeval tv = {10, 0};
+    event_base_loopexit(client->nodegroup->event_base, &tv);
+    btc_spv_client_runloop(client);
+
+    /* all blocks were requested as merkle blocks, only the matched txs were transferred */
+    u_assert_int_eq(blockdl_test_completed, true);
+    u_assert_int_eq(client->headers_db->getchaintip(client->headers_db_ctx)->height, BLOCKDL_TEST_BLOCKS);
+    u_assert_int_eq(client->block_queue->len, 0);
+    u_assert_int_eq(blockdl_test_peers[0].served, BLOCKDL_TEST_BLOCKS - BLOCKDL_TEST_SCAN_FROM);
+    u_assert_int_eq(blockdl_test_peers[0].txs_served, 3);
+    u_assert_int_eq(filter_test_synced, 3);
+    u_assert_int_eq(blockdl_test_in_order, true);
+
+    btc_node_group_shutdown(client->nodegroup);
+    if (blockdl_test_peers[0].bev)
+        bufferevent_free(blockdl_test_peers[0].bev);
+    btc_bloom_filter_free(blockdl_test_peers[0].bloom);
+    evconnlistener_free(listener);
+    btc_spv_client_free(client);
+    blockdl_test_free_blocks();
+}
+
+static unsigned int cmpct_test_synced = 0;
+
+/* relay the first txs of the new block once the headers are synced */
+static btc_bool cmpct_test_header_message_processed(struct btc_spv_client_* client, btc_node* node, btc_blockindex* newtip)
+{
+    (void)(client);
+    (void)(node);
+    if (!newtip || newtip->height != BLOCKDL_TEST_BLOCKS)
+        return true;
+    cstring* inv = cstr_new_sz(128);
+    ser_varlen(inv, 2);
+    for (unsigned int i = 1; i < 3; i++) {
+        ser_u32(inv, BTC_INV_TYPE_TX);
+        ser_u256(inv, cmpct_test_txids[i]);
+    }
+    blockdl_test_send(blockdl_test_peers[0].bev, BTC_MSG_INV, inv->str, inv->len, 0);
+    cstr_free(inv, true);
+    return true;
+}
+
+static void cmpct_test_sync_transaction(void* ctx, btc_tx* tx, unsigned int pos, btc_blockindex* pindex)
+{
+    btc_spv_client* client = ctx;
+    (void)(tx);
+    if (pindex->height != BLOCKDL_TEST_BLOCKS + 1 || pos != cmpct_test_synced)
+        blockdl_test_in_order = false;
+    if (++cmpct_test_synced == CMPCT_TEST_TXS)
+        event_base_loopexit(client->nodegroup->event_base, NULL);
+}
+
+void test_netspv_compact_blocks()
+{
+    blockdl_test_create_blocks(BLOCKDL_TEST_BLOCKS);
+    blockdl_test_in_order = true;
+
+    /* the new block: a coinbase, two relayed txs and one that has to be requested */
+    btc_block_header header;
+    memset(&header, 0, sizeof(header));
+    header.version = 1;
+    memcpy(header.prev_block, blockdl_test_hashes[BLOCKDL_TEST_BLOCKS - 1], sizeof(btc_uint256));
+    header.timestamp = 1296688602 + (BLOCKDL_TEST_BLOCKS + 1) * 600;
+    header.bits = 0x207fffff;
+    uint8_t txids[CMPCT_TEST_TXS * 32];
+    for (unsigned int i = 0; i < CMPCT_TEST_TXS; i++) {
+        btc_tx* tx = btc_tx_new();
+        btc_tx_in* tx_in = btc_tx_in_new();
+        tx_in->script_sig = cstr_new_sz(0);
+        vector_add(tx->vin, tx_in);
+        unsigned int value = 1000 + i;
+        btc_tx_add_data_out(tx, 0, (const uint8_t*)&value, sizeof(value));
+        cmpct_test_txs[i] = cstr_new_sz(64);
+        btc_tx_serialize(cmpct_test_txs[i], tx, true);
+        btc_tx_hash(tx, cmpct_test_txids[i]);
+        memcpy(txids + i * 32, cmpct_test_txids[i], 32);
+        btc_tx_free(tx);
+    }
+    btc_block_merkle_root(txids, CMPCT_TEST_TXS, header.merkle_root);
+    cmpct_test_block = cstr_new_sz(512);
+    btc_block_header_serialize(cmpct_test_block, &header);
+    ser_varlen(cmpct_test_block, CMPCT_TEST_TXS);
+    for (unsigned int i = 0; i < CMPCT_TEST_TXS; i++)
+        cstr_append_cstr(cmpct_test_block, cmpct_test_txs[i]);
+
+    btc_spv_client* client = btc_spv_client_new(&btc_chainparams_regtest, false, true);
+    client->use_checkpoints = false;
+    client->use_compact_blocks = true;
+    client->sync_transaction = cmpct_test_sync_transaction;
+    client->sync_transaction_ctx = client;
+    client->header_message_processed = cmpct_test_header_message_processed;
+
+    char ips[32] = {0};
+    memset(&blockdl_test_peers[0], 0, sizeof(blockdl_test_peers[0]));
+    blockdl_test_peers[0].behavior = BLOCKDL_TEST_FAST;
+    struct evconnlistener* listener = blockdl_test_listen(client, &blockdl_test_peers[0], ips);
+    btc_spv_client_discover_peers(client, ips);
+
+    struct timeval tv = {10, 0};
+    event_base_loopexit(client->nodegroup->event_base, &tv);
+    btc_spv_client_runloop(client);
+
+    /* the block was reconstructed from the pool and the single requested tx */
+    u_assert_int_eq(blockdl_test_peers[0].sendcmpct, true);
+    u_assert_int_eq(cmpct_test_synced, CMPCT_TEST_TXS);
+    u_assert_int_eq(blockdl_test_in_order, true);
+    u_assert_int_eq(client->headers_db->getchaintip(client->headers_db_ctx)->height, BLOCKDL_TEST_BLOCKS + 1);
+    u_assert_int_eq(blockdl_test_peers[0].blocktxn_requested, 1);
+    u_assert_int_eq(blockdl_test_peers[0].requested, 0);
+    u_assert_int_eq(client->cmpct_blocks->len, 0);
+
+    btc_node_group_shutdown(client->nodegroup);
+    if (blockdl_test_peers[0].bev)
+        bufferevent_free(blockdl_test_peers[0].bev);
+    evconnlistener_free(listener);
+    btc_spv_client_free(client);
+    for (unsigned int i = 0; i < CMPCT_TEST_TXS; i++)
+        cstr_free(cmpct_test_txs[i], true);
+    cstr_free(cmpct_test_block, true);
+    cmpct_test_block = NULL;
+    blockdl_test_free_blocks();
+}
+
+static unsigned int sendheaders_test_locator_requests = 0;
+static uint64_t sendheaders_test_announced_us = 0;
+static uint64_t sendheaders_test_connected_us = 0;
+
+static uint64_t sendheaders_test_now_us()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/* announce a new block on top of the synced chain with a single header */
+static void sendheaders_test_sync_completed(btc_spv_client* client)
+{
+    (void)(client);
+    blockdl_test_completed = true;
+    sendheaders_test_locator_requests = blockdl_test_peers[0].locator_requests;
+
+    /* the test chain is deterministic, extending it keeps the synced blocks */
+    blockdl_test_free_blocks();
+    blockdl_test_create_blocks(BLOCKDL_TEST_BLOCKS + 1);
+    cstring* headers = cstr_new_sz(90);
+    ser_varlen(headers, 1);
+    cstr_append_buf(headers, blockdl_test_blocks[BLOCKDL_TEST_BLOCKS]->str, 80);
+    ser_varlen(headers, 0);
+    sendheaders_test_announced_us = sendheaders_test_now_us();
+    blockdl_test_send(blockdl_test_peers[0].bev, BTC_MSG_HEADERS, headers->str, headers->len, 0);
+    cstr_free(headers, true);
+}
+
+static void sendheaders_test_header_connected(btc_spv_client* client)
+{
+    if (sendheaders_test_announced_us > 0 && client->headers_db->getchaintip(client->headers_db_ctx)->height == BLOCKDL_TEST_BLOCKS + 1)
+        sendheaders_test_connected_us = sendheaders_test_now_us();
+}
+
+static void sendheaders_test_sync_transaction(void* ctx, btc_tx* tx, unsigned int pos, btc_blockindex* pindex)
+{
+    btc_spv_client* client = ctx;
+    blockdl_test_sync_transaction(ctx, tx, pos, pindex);
+    if (pindex->height == BLOCKDL_TEST_BLOCKS + 1)
+        event_base_loopexit(client->nodegroup->event_base, NULL);
+}
+
+void test_netspv_sendheaders()
+{
+    blockdl_test_create_blocks(BLOCKDL_TEST_BLOCKS);
+    blockdl_test_next_height = BLOCKDL_TEST_SCAN_FROM + 1;
+    blockdl_test_in_order = true;
+    blockdl_test_completed = false;
+
+    btc_spv_client* client = btc_spv_client_new(&btc_chainparams_regtest, false, true);
+    client->use_checkpoints = false;
+    client->oldest_item_of_interest = 1296688602 + BLOCKDL_TEST_SCAN_FROM * 600 + 2700;
+    client->sync_transaction = sendheaders_test_sync_transaction;
+    client->sync_transaction_ctx = client;
+    client->sync_completed = sendheaders_test_sync_completed;
+    client->header_connected = sendheaders_test_header_connected;
+
+    char ips[32] = {0};
+    memset(&blockdl_test_peers[0], 0, sizeof(blockdl_test_peers[0]));
+    blockdl_test_peers[0].behavior = BLOCKDL_TEST_FAST;
+    struct evconnlistener* listener = blockdl_test_listen(client, &blockdl_test_peers[0], ips);
+    btc_spv_client_discover_peers(client, ips);
+
+    struct timeval tv = {10, 0};
+    event_base_loopexit(client->nodegroup->event_base, &tv);
+    btc_spv_client_runloop(client);
+
+    /* the announced block was fetched right away, without a getheaders/getblocks round trip */
+    u_assert_int_eq(blockdl_test_peers[0].sendheaders, true);
+    u_assert_int_eq(blockdl_test_completed, true);
+    u_assert_int_eq(blockdl_test_in_order, true);
+    u_assert_int_eq(blockdl_test_next_height, BLOCKDL_TEST_BLOCKS + 2);
+    u_assert_int_eq(client->headers_db->getchaintip(client->headers_db_ctx)->height, BLOCKDL_TEST_BLOCKS + 1);
+    u_assert_int_eq(blockdl_test_peers[0].locator_requests, sendheaders_test_locator_requests);
+    u_assert_int_eq(sendheaders_test_connected_us > 0, true);
+    printf("header announcement connected after %llu us\n", (unsigned long long)(sendheaders_test_connected_us - sendheaders_test_announced_us));
+
+    btc_node_group_shutdown(client->nodegroup);
+    if (blockdl_test_peers[0].bev)
+        bufferevent_free(blockdl_test_peers[0].bev);
+    evconnlistener_free(listener);
+    btc_spv_client_free(client);
+    blockdl_test_free_blocks();
+}
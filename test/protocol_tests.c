@@ -85,6 +85,7 @@ void test_protocol()
 
     u_assert_mem_eq(hdr.netmagic, &btc_chainparams_main.netmagic, 4);
     u_assert_str_eq(hdr.command, BTC_MSG_VERSION);
+    u_assert_int_eq(hdr.type, BTC_MSG_TYPE_VERSION);
     u_assert_int_eq(hdr.data_len, version_msg_cstr->len);
     u_assert_int_eq(buf.len, hdr.data_len);
     u_assert_int_eq(buf.len, hdr.data_len);
@@ -113,6 +114,7 @@ void test_protocol()
     buf.len = p2p_msg->len;
     btc_p2p_deser_msghdr(&hdr, &buf);
     u_assert_str_eq(hdr.command, BTC_MSG_GETHEADERS);
+    u_assert_int_eq(hdr.type, BTC_MSG_TYPE_GETHEADERS);
     u_assert_int_eq(hdr.data_len, getheader_msg->len);
 
 
@@ -129,5 +131,30 @@ void test_protocol()
     vector_free(blocklocators, true);
     vector_free(blocklocators_check, true);
     cstr_free(p2p_msg, true);
-}
 
+    /* every known command has its own message type */
+    for (int type = BTC_MSG_TYPE_UNKNOWN + 1; type < BTC_MSG_TYPE_COUNT; type++) {
+        const char* command = btc_p2p_msg_type_command((enum btc_p2p_msg_type)type);
+        u_assert_int_eq(command != NULL, true);
+        u_assert_int_eq(btc_p2p_msg_type_from_command(command), type);
+    }
+    u_assert_int_eq(btc_p2p_msg_type_from_command(BTC_MSG_SENDHEADERS), BTC_MSG_TYPE_SENDHEADERS);
+    u_assert_int_eq(btc_p2p_msg_type_from_command(""), BTC_MSG_TYPE_UNKNOWN);
+    u_assert_int_eq(btc_p2p_msg_type_from_command("versio"), BTC_MSG_TYPE_UNKNOWN);
+    u_assert_int_eq(btc_p2p_msg_type_from_command("versionx"), BTC_MSG_TYPE_UNKNOWN);
+    u_assert_int_eq(btc_p2p_msg_type_from_command("alert"), BTC_MSG_TYPE_UNKNOWN);
+    u_assert_int_eq(btc_p2p_msg_type_command(BTC_MSG_TYPE_UNKNOWN) == NULL, true);
+
+    /* a header framed from payload parts equals the one of the flat message */
+    const char* payload_str = "0123456789abcdef";
+    struct const_buffer parts[3] = {{payload_str, 3}, {payload_str + 3, 0}, {payload_str + 3, 13}};
+    unsigned char msg_hdr[24];
+    btc_p2p_message_header(btc_chainparams_main.netmagic, BTC_MSG_TX, parts, 3, NULL, msg_hdr);
+    p2p_msg = btc_p2p_message_new(btc_chainparams_main.netmagic, BTC_MSG_TX, payload_str, 16);
+    u_assert_mem_eq(msg_hdr, p2p_msg->str, BTC_P2P_HDRSZ);
+    const unsigned char checksum[4] = {0x01, 0x02, 0x03, 0x04};
+    btc_p2p_message_header(btc_chainparams_main.netmagic, BTC_MSG_TX, parts, 3, checksum, msg_hdr);
+    u_assert_mem_eq(msg_hdr, p2p_msg->str, 20);
+    u_assert_mem_eq(msg_hdr + 20, checksum, 4);
+    cstr_free(p2p_msg, true);
+}
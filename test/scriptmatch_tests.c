@@ -0,0 +1,169 @@
+/**********************************************************************
+ * Copyright (c) 2016 libbtc developers                               *
+ * Distributed under the MIT software license, see the accompanying   *
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.*
+ **********************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+
+#include <btc/hash.h>
+#include <btc/ripemd160.h>
+#include <btc/script.h>
+#include <btc/scriptmatch.h>
+#include <btc/tx.h>
+
+#include "utest.h"
+
+static void scriptmatch_test_hash160(uint32_t n, btc_uint160 hash160)
+{
+    btc_uint256 hash;
+    btc_hash_sngl_sha256((const uint8_t*)&n, sizeof(n), hash);
+    memcpy(hash160, hash, sizeof(btc_uint160));
+}
+
+static btc_bool scriptmatch_test_match(const btc_script_matcher* matcher, const cstring* script)
+{
+    return btc_script_matcher_match_script(matcher, (const uint8_t*)script->str, script->len);
+}
+
+void test_scriptmatch()
+{
+    btc_script_matcher* matcher = btc_script_matcher_new(0);
+    btc_uint160 hash160;
+    scriptmatch_test_hash160(1, hash160);
+    cstring* script = cstr_new_sz(64);
+
+    /* a key hash matches the P2PKH and the P2WPKH output, but not a P2SH with the same hash */
+    u_assert_int_eq(btc_script_matcher_add_keyhash(matcher, hash160), true);
+    u_assert_int_eq(btc_script_matcher_add_keyhash(matcher, hash160), false);
+    btc_script_build_p2pkh(script, hash160);
+    u_assert_int_eq(scriptmatch_test_match(matcher, script), true);
+    u_assert_int_eq(btc_script_matcher_add_script(matcher, (const uint8_t*)script->str, script->len), false);
+    cstr_resize(script, 0);
+    btc_script_build_p2wpkh(script, hash160);
+    u_assert_int_eq(scriptmatch_test_match(matcher, script), true);
+    cstr_resize(script, 0);
+    btc_script_build_p2sh(script, hash160);
+    u_assert_int_eq(scriptmatch_test_match(matcher, script), false);
+
+    /* P2PK is matched by the hash of the pubkey */
+    uint8_t pubkey[33];
+    memset(pubkey, 0x42, sizeof(pubkey));
+    pubkey[0] = 0x02;
+    cstr_resize(script, 0);
+    btc_script_append_pushdata(script, pubkey, sizeof(pubkey));
+    btc_script_append_op(script, OP_CHECKSIG);
+    u_assert_int_eq(scriptmatch_test_match(matcher, script), false);
+    btc_uint256 pubkey_hash;
+    btc_hash_sngl_sha256(pubkey, sizeof(pubkey), pubkey_hash);
+    btc_ripemd160(pubkey_hash, sizeof(pubkey_hash), hash160);
+    u_assert_int_eq(btc_script_matcher_add_keyhash(matcher, hash160), true);
+    u_assert_int_eq(scriptmatch_test_match(matcher, script), true);
+
+    /* witness programs are matched by version and program */
+    uint8_t program[32];
+    memset(program, 0x17, sizeof(program));
+    cstring* p2wsh = cstr_new_sz(34);
+    btc_script_append_op(p2wsh, OP_0);
+    btc_script_append_pushdata(p2wsh, program, sizeof(program));
+    cstring* p2tr = cstr_new_sz(34);
+    btc_script_append_op(p2tr, OP_1);
+    btc_script_append_pushdata(p2tr, program, sizeof(program));
+    u_assert_int_eq(btc_script_matcher_add_script(matcher, (const uint8_t*)p2wsh->str, p2wsh->len), true);
+    u_assert_int_eq(scriptmatch_test_match(matcher, p2wsh), true);
+    u_assert_int_eq(scriptmatch_test_match(matcher, p2tr), false);
+    u_assert_int_eq(btc_script_matcher_add_script(matcher, (const uint8_t*)p2tr->str, p2tr->len), true);
+    u_assert_int_eq(scriptmatch_test_match(matcher, p2tr), true);
+
+    /* other scripts are matched as a whole */
+    cstr_resize(script, 0);
+    btc_script_append_op(script, OP_RETURN);
+    btc_script_append_pushdata(script, program, 20);
+    u_assert_int_eq(scriptmatch_test_match(matcher, script), false);
+    u_assert_int_eq(btc_script_matcher_add_script(matcher, (const uint8_t*)script->str, script->len), true);
+    u_assert_int_eq(scriptmatch_test_match(matcher, script), true);
+    cstr_resize(script, script->len - 1);
+    u_assert_int_eq(scriptmatch_test_match(matcher, script), false);
+    u_assert_int_eq(matcher->count, 5);
+
+    /* the matcher grows, all watched keys are still found */
+    for (uint32_t i = 100; i < 20100; i++) {
+        scriptmatch_test_hash160(i, hash160);
+        u_assert_int_eq(btc_script_matcher_add_keyhash(matcher, hash160), true);
+    }
+    u_assert_int_eq(matcher->count, 20005);
+    u_assert_int_eq(matcher->capacity >= 2 * matcher->count, true);
+    u_assert_int_eq(scriptmatch_test_match(matcher, p2wsh), true);
+
+    /* a tx matches if any of its outputs does */
+    btc_tx* tx = btc_tx_new();
+    for (uint32_t i = 30000; i < 30100; i++) {
+        scriptmatch_test_hash160(i, hash160);
+        btc_tx_add_p2pkh_hash160_out(tx, 1000, hash160);
+    }
+    u_assert_int_eq(btc_script_matcher_match_tx(matcher, tx), false);
+    scriptmatch_test_hash160(12345, hash160);
+    btc_tx_add_p2pkh_hash160_out(tx, 1000, hash160);
+    u_assert_int_eq(btc_script_matcher_match_tx(matcher, tx), true);
+    btc_tx_free(tx);
+
+    cstr_free(p2wsh, true);
+    cstr_free(p2tr, true);
+    cstr_free(script, true);
+    btc_script_matcher_free(matcher);
+}
+
+void test_scriptmatch_owners()
+{
+    btc_script_matcher* matcher = btc_script_matcher_new(0);
+    int owner_a = 0, owner_b = 0;
+    btc_uint160 hash160;
+    btc_script_match_key key;
+    cstring* script = cstr_new_sz(25);
+    vector* owners = vector_new(4, NULL);
+
+    /* a key watched by two owners */
+    scriptmatch_test_hash160(1, hash160);
+    btc_script_match_key_from_keyhash(hash160, &key);
+    u_assert_int_eq(btc_script_matcher_add_key(matcher, &key, &owner_a), true);
+    u_assert_int_eq(btc_script_matcher_add_key(matcher, &key, &owner_a), false);
+    u_assert_int_eq(btc_script_matcher_add_key(matcher, &key, &owner_b), true);
+    btc_script_build_p2pkh(script, hash160);
+    u_assert_int_eq(btc_script_matcher_find_owners(matcher, (const uint8_t*)script->str, script->len, owners), 2);
+    u_assert_int_eq(vector_find(owners, &owner_a) >= 0, true);
+    u_assert_int_eq(vector_find(owners, &owner_b) >= 0, true);
+
+    u_assert_int_eq(btc_script_matcher_remove_key(matcher, &key, &owner_a), true);
+    u_assert_int_eq(btc_script_matcher_remove_key(matcher, &key, &owner_a), false);
+    vector_resize(owners, 0);
+    u_assert_int_eq(btc_script_matcher_find_owners(matcher, (const uint8_t*)script->str, script->len, owners), 1);
+    u_assert_int_eq(vector_idx(owners, 0) == &owner_b, true);
+    u_assert_int_eq(btc_script_matcher_remove_key(matcher, &key, &owner_b), true);
+    u_assert_int_eq(scriptmatch_test_match(matcher, script), false);
+    u_assert_int_eq(matcher->count, 0);
+
+    /* removing keys keeps the probe sequences of the remaining ones intact */
+    for (uint32_t i = 0; i < 5000; i++) {
+        scriptmatch_test_hash160(i, hash160);
+        btc_script_match_key_from_keyhash(hash160, &key);
+        u_assert_int_eq(btc_script_matcher_add_key(matcher, &key, (i % 2 == 0 ? &owner_a : &owner_b)), true);
+    }
+    for (uint32_t i = 0; i < 5000; i += 2) {
+        scriptmatch_test_hash160(i, hash160);
+        btc_script_match_key_from_keyhash(hash160, &key);
+        u_assert_int_eq(btc_script_matcher_remove_key(matcher, &key, &owner_a), true);
+    }
+    u_assert_int_eq(matcher->count, 2500);
+    for (uint32_t i = 0; i < 5000; i++) {
+        scriptmatch_test_hash160(i, hash160);
+        cstr_resize(script, 0);
+        btc_script_build_p2wpkh(script, hash160);
+        vector_resize(owners, 0);
+        u_assert_int_eq(btc_script_matcher_find_owners(matcher, (const uint8_t*)script->str, script->len, owners), (i % 2 == 0 ? 0 : 1));
+    }
+
+    vector_free(owners, true);
+    cstr_free(script, true);
+    btc_script_matcher_free(matcher);
+}
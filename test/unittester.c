@@ -43,9 +43,14 @@ extern void test_utils();
 extern void test_serialize();
 extern void test_memory();
 extern void test_random();
+extern void test_scriptmatch();
+extern void test_scriptmatch_owners();
 extern void test_bitcoin_hash();
 extern void test_base58check();
 extern void test_block_header();
+extern void test_blockfilter();
+extern void test_bloom();
+extern void test_cmpctblock();
 extern void test_bip32();
 extern void test_ecc();
 extern void test_vector();
@@ -70,9 +75,31 @@ extern void test_tool();
 #endif
 
 #ifdef WITH_NET
+extern void test_addrman();
+extern void test_blockstore();
+extern void test_headersdb();
 extern void test_net_basics_plus_download_block();
+extern void test_net_recv_framing();
+extern void test_net_shards();
+extern void test_net_send_queue();
+extern void test_net_stats();
+extern void test_net_peer_scoring();
+extern void test_net_addrman();
+extern void test_net_dns_seeds();
+extern void test_net_dns_reseed();
 extern void test_protocol();
 extern void test_netspv();
+extern void test_netspv_block_download();
+extern void test_netspv_block_pipeline();
+extern void test_netspv_watchers();
+extern void test_netspv_block_store();
+extern void test_netspv_block_store_window();
+extern void test_netspv_headers_pipelining();
+extern void test_netspv_compact_filters();
+extern void test_netspv_compact_filters_cross_check();
+extern void test_netspv_bloom_filter();
+extern void test_netspv_compact_blocks();
+extern void test_netspv_sendheaders();
 #endif
 
 extern void btc_ecc_start();
@@ -95,6 +122,8 @@ int main()
 
     u_run_test(test_memory);
     u_run_test(test_random);
+    u_run_test(test_scriptmatch);
+    u_run_test(test_scriptmatch_owners);
     u_run_test(test_bitcoin_hash);
     u_run_test(test_base58check);
     u_run_test(test_aes);
@@ -110,6 +139,9 @@ int main()
     u_run_test(test_tx_negative_version);
     u_run_test(test_scripts);
     u_run_test(test_block_header);
+    u_run_test(test_blockfilter);
+    u_run_test(test_bloom);
+    u_run_test(test_cmpctblock);
     u_run_test(test_script_parse);
     u_run_test(test_script_op_codeseperator);
 
@@ -124,9 +156,31 @@ int main()
 #endif
 
 #ifdef WITH_NET
+    u_run_test(test_addrman);
+    u_run_test(test_blockstore);
+    u_run_test(test_headersdb);
     u_run_test(test_netspv);
+    u_run_test(test_netspv_block_download);
+    u_run_test(test_netspv_block_pipeline);
+    u_run_test(test_netspv_watchers);
+    u_run_test(test_netspv_block_store);
+    u_run_test(test_netspv_block_store_window);
+    u_run_test(test_netspv_headers_pipelining);
+    u_run_test(test_netspv_compact_filters);
+    u_run_test(test_netspv_compact_filters_cross_check);
+    u_run_test(test_netspv_bloom_filter);
+    u_run_test(test_netspv_compact_blocks);
+    u_run_test(test_netspv_sendheaders);
 
     u_run_test(test_protocol);
+    u_run_test(test_net_recv_framing);
+    u_run_test(test_net_shards);
+    u_run_test(test_net_send_queue);
+    u_run_test(test_net_stats);
+    u_run_test(test_net_peer_scoring);
+    u_run_test(test_net_addrman);
+    u_run_test(test_net_dns_seeds);
+    u_run_test(test_net_dns_reseed);
     u_run_test(test_net_basics_plus_download_block);
 #endif
 